@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+
+"""
+Honeybee Project Disassembly Mode Report
+
+Compares hives generated with the default linear sweep against those generated with the hybrid recursive-descent mode
+(honey_hive_generator -r). Reports the block count and direct map size of each hive along with how many of the unit
+test traces fail to decode with it, broken down by the decoder's error.
+
+---
+Author: Allison Husain <$first.$last@berkeley.edu>
+Date: January 30th, 2021
+"""
+import re
+import subprocess
+
+TESTS_ROOT = "../honeybee_unittest_data/"
+HONEY_HIVE_GENERATOR_PATH = "cmake-build-debug/honey_hive_generator"
+HONEY_TESTER_PATH = "cmake-build-debug/honey_tester"
+HIVE_TEMP_PATH = "/tmp/report_hive.hive"
+MODES = [
+	("linear", []),
+	("hybrid", ["-r"]),
+]
+
+# honey_tester exits with the decoder's status, see ha_pt_decoder_status
+ABORT_KINDS = {
+	4: "desync",
+	6: "no_map",
+}
+
+MAP_STATS_PATTERN = re.compile(r"blocks = (\d+), code bytes = (\d+), map bytes = (\d+)")
+
+targets = [
+	("contrived_small", TESTS_ROOT + "contrived_small/small", [
+		(TESTS_ROOT + "contrived_small/trace_1.pt", "0x401000", "0x1000"),
+		(TESTS_ROOT + "contrived_small/trace_2_1.pt", "0x401000", "0x1000"),
+		(TESTS_ROOT + "contrived_small/trace_2_2.pt", "0x401000", "0x1000"),
+		(TESTS_ROOT + "contrived_small/trace_2_3.pt", "0x401000", "0x1000"),
+	]),
+	("contrived_medium", TESTS_ROOT + "contrived_medium/medium", [
+		(TESTS_ROOT + "contrived_medium/trace_1.pt", "0x401000", "0x1000"),
+		(TESTS_ROOT + "contrived_medium/trace_2_1.pt", "0x401000", "0x1000"),
+		(TESTS_ROOT + "contrived_medium/trace_2_2.pt", "0x401000", "0x1000"),
+		(TESTS_ROOT + "contrived_medium/trace_2_3.pt", "0x401000", "0x1000"),
+		(TESTS_ROOT + "contrived_medium/trace_2_4.pt", "0x401000", "0x1000"),
+	]),
+	("tar", TESTS_ROOT + "tar/tar", [
+		(TESTS_ROOT + "tar/decompress_clion.pt", "0x55555555d000", "0x9000"),
+		(TESTS_ROOT + "tar/help_page.pt", "0x55555555d000", "0x9000"),
+	]),
+	("html_fast_parse", TESTS_ROOT + "html_fast_parse/fuzz_target", [
+		(TESTS_ROOT + "html_fast_parse/6_txt.pt", "0x555555558000", "0x4000"),
+	]),
+]
+
+
+def get_map_stats(display_name):
+	"""
+	Reads the block count and direct map size of the temporary hive.
+	Returns (blocks, map bytes) or None on failure.
+	"""
+	task = subprocess.Popen([HONEY_TESTER_PATH, "-m", "-h", HIVE_TEMP_PATH], stdout=subprocess.PIPE,
+							universal_newlines=True)
+	output, _ = task.communicate() #wait
+	match = MAP_STATS_PATTERN.search(output)
+	if task.returncode != 0 or not match:
+		print(f"[!!!] Could not read map stats for {display_name}")
+		return None
+	return int(match.group(1)), int(match.group(3))
+
+
+def count_aborts(traces):
+	"""
+	Decodes every trace with the temporary hive.
+	Returns a dictionary of abort kinds to the number of traces which aborted with them.
+	"""
+	aborts = {}
+	for trace_path, sideband_load_address, sideband_offset in traces:
+		task = subprocess.Popen([HONEY_TESTER_PATH, "-p", "-h", HIVE_TEMP_PATH, "-s", sideband_load_address,
+								 "-o", sideband_offset, "-t", trace_path], stdout=subprocess.DEVNULL)
+		task.communicate() #wait
+		if task.returncode != 0:
+			kind = ABORT_KINDS.get(task.returncode, "other")
+			aborts[kind] = aborts.get(kind, 0) + 1
+	return aborts
+
+
+def report_target(display_name, binary_path, traces):
+	"""
+	Generates a hive for the binary in every mode and reports its size and aborted decodes.
+	Returns true on success.
+	"""
+	for mode, generator_options in MODES:
+		task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH] + generator_options + [binary_path, HIVE_TEMP_PATH],
+								stdout=subprocess.DEVNULL)
+		task.communicate() #wait
+		if task.returncode != 0:
+			print(f"[!!!] Hive generator for {display_name} failed in {mode} mode with code {str(task.returncode)}")
+			return False
+
+		stats = get_map_stats(display_name)
+		if stats is None:
+			return False
+
+		aborts = count_aborts(traces)
+		abort_description = ", ".join(f"{kind} = {str(count)}" for kind, count in sorted(aborts.items())) or "none"
+		print(f"[***] {display_name} ({mode}): blocks = {str(stats[0])}, map bytes = {str(stats[1])}, "
+			  f"aborted decodes = {str(sum(aborts.values()))}/{str(len(traces))} ({abort_description})")
+	return True
+
+
+failure_count = 0
+for display_name, binary_path, traces in targets:
+	if not report_target(display_name, binary_path, traces):
+		failure_count += 1
+
+print("-" * 60)
+print(f"Summary: {str(failure_count)} report(s) failed")
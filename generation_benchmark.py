@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+
+"""
+Honeybee Project Hive Generation Benchmark
+
+Reports how hive generation time scales with the number of disassembly threads (honey_hive_generator -j).
+
+---
+Author: Allison Husain <$first.$last@berkeley.edu>
+Date: January 30th, 2021
+"""
+import filecmp
+import subprocess
+import time
+
+TESTS_ROOT = "../honeybee_unittest_data/"
+HONEY_HIVE_GENERATOR_PATH = "cmake-build-debug/honey_hive_generator"
+HIVE_TEMP_PATH = "/tmp/benchmark_hive.hive"
+REFERENCE_HIVE_TEMP_PATH = "/tmp/benchmark_hive_reference.hive"
+THREAD_COUNTS = [1, 2, 4, 8, 16, 32]
+
+targets = [
+	("tar", TESTS_ROOT + "tar/tar"),
+	("clang", TESTS_ROOT + "clang/clang"),
+]
+
+
+def generate(binary_path, thread_count, hive_path):
+	"""
+	Generates a hive with the given number of threads.
+	Returns the wall time in seconds or None on failure.
+	"""
+	start = time.monotonic()
+	task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH, "-j", str(thread_count), binary_path, hive_path],
+							stdout=subprocess.DEVNULL)
+	task.communicate() #wait
+	if task.returncode != 0:
+		return None
+	return time.monotonic() - start
+
+
+def benchmark_target(display_name, binary_path):
+	"""
+	Benchmarks generation of a binary's hive across THREAD_COUNTS. Every hive must match the single threaded one.
+	Returns true on success.
+	"""
+	print(f"[***] Benchmarking hive generation for {display_name}")
+	baseline = None
+	for thread_count in THREAD_COUNTS:
+		hive_path = REFERENCE_HIVE_TEMP_PATH if thread_count == 1 else HIVE_TEMP_PATH
+		duration = generate(binary_path, thread_count, hive_path)
+		if duration is None:
+			print(f"[!!!] Hive generator for {display_name} failed with {str(thread_count)} threads")
+			return False
+
+		if baseline is None:
+			baseline = duration
+		elif not filecmp.cmp(REFERENCE_HIVE_TEMP_PATH, HIVE_TEMP_PATH, shallow=False):
+			print(f"[!!!] {display_name} hive differs with {str(thread_count)} threads")
+			return False
+
+		print(f"[***] {display_name}: {str(thread_count)} threads = {duration:.3f} s ({baseline / duration:.2f}x)")
+	return True
+
+
+failure_count = 0
+for display_name, binary_path in targets:
+	if not benchmark_target(display_name, binary_path):
+		failure_count += 1
+
+print("-" * 60)
+print(f"Summary: {str(failure_count)} benchmark(s) failed")
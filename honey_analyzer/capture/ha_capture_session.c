@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -35,6 +36,11 @@ struct ha_capture_session_internal {
      * The size of our mmap'd region
      */
     uint64_t mmap_size;
+
+    /**
+     * Is our mmap'd region writable? It is only mapped writable for callers which need a stop codon.
+     */
+    bool is_mmap_writable;
 };
 
 int ha_capture_session_alloc(ha_capture_session_t *session_out, uint16_t cpu_id) {
@@ -130,18 +136,21 @@ static int get_trace_buffer_lengths(ha_capture_session_t session, uint64_t *pack
     return ioctl(session->fd, HB_DRIVER_PACKET_IOC_GET_TRACE_LENGTHS, &get_trace_lengths);
 }
 
-int ha_capture_get_trace(ha_capture_session_t session, uint8_t **trace_buffer, uint64_t *trace_length) {
-    int result;
-
-    uint64_t packet_byte_count;
-    uint64_t buffer_length;
-    if ((result = get_trace_buffer_lengths(session, &packet_byte_count, &buffer_length)) < 0) {
-        return result;
+/**
+ * Maps the trace buffer, reusing the existing mapping if it allows the access we need
+ * @return A status code. Non-zero on error.
+ */
+static int map_trace_buffer(ha_capture_session_t session, uint64_t buffer_length, bool writable) {
+    if (session->mmap_handle && session->mmap_handle != MAP_FAILED && writable && !session->is_mmap_writable) {
+        munmap(session->mmap_handle, session->mmap_size);
+        session->mmap_handle = NULL;
+        session->mmap_size = 0;
     }
 
     //We can abuse the fact that we re-use buffers by reusing the buffer
     if (!session->mmap_handle || session->mmap_handle == MAP_FAILED) {
-        session->mmap_handle = mmap(NULL, buffer_length, PROT_READ | PROT_WRITE, MAP_SHARED, session->fd,
+        session->mmap_handle = mmap(NULL, buffer_length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                                    session->fd,
                 /* offsets are passed in PAGE_SIZE multiples as non-aligned offsets are invalid */
                                     getpagesize() * session->cpu_id);
 
@@ -149,6 +158,23 @@ int ha_capture_get_trace(ha_capture_session_t session, uint8_t **trace_buffer, u
             return errno;
         }
         session->mmap_size = buffer_length;
+        session->is_mmap_writable = writable;
+    }
+
+    return 0;
+}
+
+int ha_capture_get_trace(ha_capture_session_t session, uint8_t **trace_buffer, uint64_t *trace_length) {
+    int result;
+
+    uint64_t packet_byte_count;
+    uint64_t buffer_length;
+    if ((result = get_trace_buffer_lengths(session, &packet_byte_count, &buffer_length)) < 0) {
+        return result;
+    }
+
+    if ((result = map_trace_buffer(session, buffer_length, true))) {
+        return result;
     }
 
     /* Terminate the buffer using our stop codon */
@@ -163,5 +189,30 @@ int ha_capture_get_trace(ha_capture_session_t session, uint8_t **trace_buffer, u
     *trace_buffer = session->mmap_handle;
     *trace_length = packet_byte_count;
 
+    return result;
+}
+
+int ha_capture_get_trace_read_only(ha_capture_session_t session, const uint8_t **trace_buffer,
+                                   uint64_t *trace_length) {
+    int result;
+
+    uint64_t packet_byte_count;
+    uint64_t buffer_length;
+    if ((result = get_trace_buffer_lengths(session, &packet_byte_count, &buffer_length)) < 0) {
+        return result;
+    }
+
+    if ((result = map_trace_buffer(session, buffer_length, false))) {
+        return result;
+    }
+
+    if (packet_byte_count > buffer_length) {
+        //This should really just not happen
+        packet_byte_count = buffer_length;
+    }
+
+    *trace_buffer = session->mmap_handle;
+    *trace_length = packet_byte_count;
+
     return result;
 }
\ No newline at end of file
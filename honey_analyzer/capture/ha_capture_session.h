@@ -75,7 +75,8 @@ int ha_capture_session_configure_tracing(ha_capture_session_t session, uint32_t
                                          ha_capture_session_range_filter filters[4]);
 
 /**
- * Gets the trace buffer. This trace buffer has a stop codon (PT_TRACE_END) at the end of it.
+ * Gets the trace buffer. This trace buffer has a stop codon (PT_TRACE_END) at the end of it, so the buffer is mapped
+ * writable. The decoder no longer needs the stop codon, so prefer ha_capture_get_trace_read_only.
  * Note: you do not own this buffer and it will be destroyed when this session is freed or a new trace is launched on
  * this core.
  * @param trace_buffer The location to place a pointer to the trace buffer. Nothing is written on error.
@@ -84,4 +85,17 @@ int ha_capture_session_configure_tracing(ha_capture_session_t session, uint32_t
  */
 int ha_capture_get_trace(ha_capture_session_t session, uint8_t **trace_buffer, uint64_t *trace_length);
 
+/**
+ * Gets the trace buffer as a read-only view of the driver's buffer which can be decoded in place with
+ * ha_session_reconfigure_with_trace_buffer. Unlike ha_capture_get_trace, nothing is written to the buffer and the
+ * trace is never truncated.
+ * Note: you do not own this buffer and it will be destroyed when this session is freed or a new trace is launched on
+ * this core.
+ * @param trace_buffer The location to place a pointer to the trace buffer. Nothing is written on error.
+ * @param trace_length The location to place the length of the trace. Nothing is written on error.
+ * @return A status code. Negative on error.
+ */
+int ha_capture_get_trace_read_only(ha_capture_session_t session, const uint8_t **trace_buffer,
+                                   uint64_t *trace_length);
+
 #endif //HA_CAPTURE_SESSION_H
@@ -6,8 +6,10 @@
 #define HONEY_ANALYZER_H
 
 #include "trace_analysis/ha_session.h"
+#include "trace_analysis/ha_parallel_decode.h"
 #include "capture/ha_capture_session.h"
 #include "processor_trace/ha_pt_decoder.h"
 #include "../honeybee_shared/hb_hive.h"
+#include "../honeybee_shared/hb_hive_bundle.h"
 
 #endif //HONEY_ANALYZER_H
@@ -32,8 +32,12 @@ SOFTWARE.
 
 #include "ha_pt_decoder.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 #include "../ha_debug_switch.h"
 #include "ha_pt_decoder_constants.h"
 #if HA_ENABLE_DECODER_LOGS
@@ -65,29 +69,464 @@ void ha_pt_decoder_free(ha_pt_decoder_t decoder) {
     free(decoder);
 }
 
-void ha_pt_decoder_reconfigure_with_trace(ha_pt_decoder_t decoder, uint8_t *trace_buffer, uint64_t trace_length) {
-    /* clear all state (including our embedded cache) */
-    bzero(decoder, sizeof(ha_pt_decoder));
+/**
+ * Starts decoding a segment in place
+ * @param wrapped Is this the second segment?
+ * @param position Where to start decoding
+ * @param end The end of the segment
+ */
+static void enter_segment(ha_pt_decoder_t decoder, bool wrapped, const uint8_t *position, const uint8_t *end) {
+    decoder->is_in_wrapped_segment = wrapped;
+    decoder->is_in_tail = false;
+    decoder->i_pt_buffer = position;
+    decoder->segment_end = end;
+    //If we start inside the guard, the first dispatch moves us straight into the tail
+    decoder->guard = end - position > HA_PT_DECODER_GUARD_LENGTH ? end - HA_PT_DECODER_GUARD_LENGTH : position;
+}
+
+/** Is there a segment after the one being decoded? */
+static bool has_next_segment(ha_pt_decoder_t decoder) {
+    return !decoder->is_in_wrapped_segment && decoder->pt_buffer_wrapped;
+}
+
+/**
+ * Moves decoding from the guard of a segment into the tail buffer. The tail holds the rest of the segment followed by
+ * either the start of the next segment or, if that was all of the trace, a stop codon.
+ */
+static void enter_tail(ha_pt_decoder_t decoder) {
+    const uint8_t *position = decoder->i_pt_buffer;
+    uint64_t rest = position < decoder->segment_end ? decoder->segment_end - position : 0;
+
+    //The padding after the copied bytes must be zero so that handlers which read past their packet see PADs
+    bzero(decoder->tail, sizeof(decoder->tail));
+    memcpy(decoder->tail, position, rest);
+    uint64_t length = rest;
+    bool is_complete = true;
+    if (has_next_segment(decoder)) {
+        uint64_t next_length = decoder->pt_buffer_wrapped_length;
+        uint64_t copy_length = next_length < HA_PT_DECODER_GUARD_LENGTH ? next_length : HA_PT_DECODER_GUARD_LENGTH;
+        memcpy(decoder->tail + rest, decoder->pt_buffer_wrapped, copy_length);
+        length += copy_length;
+        is_complete = copy_length == next_length;
+    }
 
+    decoder->is_in_tail = true;
+    decoder->tail_join = rest;
+    decoder->i_pt_buffer = decoder->tail;
+    if (is_complete) {
+        //The stop codon ends decoding before we could ever reach this guard
+        decoder->tail[length] = PT_TRACE_END;
+        decoder->guard = decoder->tail + sizeof(decoder->tail);
+    } else {
+        //Once we're decoding the copy of the next segment, we can go back to decoding it in place
+        decoder->guard = decoder->tail + rest;
+    }
+}
+
+/**
+ * Handles the decoder reaching the guard of the buffer it is decoding
+ * @return False if this is as far as we can decode until more of a streamed trace is pushed
+ */
+__attribute__((noinline))
+static bool cross_guard(ha_pt_decoder_t decoder) {
+    //Segments shorter than the guard may need several steps
+    while (decoder->i_pt_buffer >= decoder->guard) {
+        if (decoder->is_in_tail) {
+            uint64_t offset = decoder->i_pt_buffer - (decoder->tail + decoder->tail_join);
+            enter_segment(decoder, true, decoder->pt_buffer_wrapped + offset,
+                          decoder->pt_buffer_wrapped + decoder->pt_buffer_wrapped_length);
+        } else if (decoder->is_stream_open && !(has_next_segment(decoder)
+                                                && decoder->pt_buffer_wrapped_length > HA_PT_DECODER_GUARD_LENGTH)) {
+            //Everything we have left may be the start of packets which continue in the next chunk
+            return false;
+        } else {
+            enter_tail(decoder);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Moves the decoder out of the tail buffer back to the same position in the trace itself
+ */
+static void leave_tail(ha_pt_decoder_t decoder) {
+    if (!decoder->is_in_tail) {
+        return;
+    }
+
+    uint64_t offset = decoder->i_pt_buffer - decoder->tail;
+    if (offset < decoder->tail_join) {
+        enter_segment(decoder, decoder->is_in_wrapped_segment,
+                      decoder->segment_end - (decoder->tail_join - offset), decoder->segment_end);
+    } else if (has_next_segment(decoder)) {
+        const uint8_t *end = decoder->pt_buffer_wrapped + decoder->pt_buffer_wrapped_length;
+        const uint8_t *position = decoder->pt_buffer_wrapped + (offset - decoder->tail_join);
+        enter_segment(decoder, true, position < end ? position : end, end);
+    } else {
+        //We're at the stop codon
+        enter_segment(decoder, decoder->is_in_wrapped_segment, decoder->segment_end, decoder->segment_end);
+    }
+}
+
+/**
+ * Installs the segments of the trace and starts decoding from the start of the first. No other state is changed.
+ */
+static void set_segments(ha_pt_decoder_t decoder, const uint8_t *trace_buffer, uint64_t trace_length,
+                         const uint8_t *wrapped_buffer, uint64_t wrapped_length) {
     decoder->pt_buffer = trace_buffer;
-    decoder->i_pt_buffer = trace_buffer;
     decoder->pt_buffer_length = trace_length;
+    if (wrapped_buffer && wrapped_length) {
+        decoder->pt_buffer_wrapped = wrapped_buffer;
+        decoder->pt_buffer_wrapped_length = wrapped_length;
+    } else {
+        decoder->pt_buffer_wrapped = NULL;
+        decoder->pt_buffer_wrapped_length = 0;
+    }
+
+    enter_segment(decoder, false, trace_buffer, trace_buffer + trace_length);
+}
+
+void ha_pt_decoder_reconfigure_with_trace(ha_pt_decoder_t decoder, const uint8_t *trace_buffer,
+                                          uint64_t trace_length) {
+    ha_pt_decoder_reconfigure_with_wrapped_trace(decoder, trace_buffer, trace_length, NULL, 0);
+}
+
+void ha_pt_decoder_reconfigure_with_wrapped_trace(ha_pt_decoder_t decoder, const uint8_t *trace_buffer,
+                                                  uint64_t trace_length, const uint8_t *wrapped_buffer,
+                                                  uint64_t wrapped_length) {
+    /* clear all state (including our embedded cache) */
+    bzero(decoder, sizeof(ha_pt_decoder));
+
+    set_segments(decoder, trace_buffer, trace_length, wrapped_buffer, wrapped_length);
+}
+
+void ha_pt_decoder_reconfigure_with_stream(ha_pt_decoder_t decoder) {
+    bzero(decoder, sizeof(ha_pt_decoder));
+
+    decoder->is_stream_open = true;
+    set_segments(decoder, decoder->stream_carry, 0, NULL, 0);
+}
+
+/**
+ * Moves the trace which has not been decoded yet into the stream carry, keeping at most the last limit bytes of it
+ */
+static void carry_stream(ha_pt_decoder_t decoder, uint64_t limit) {
+    leave_tail(decoder);
+
+    //The carry may be the segment we're copying from, so we gather everything first
+    uint8_t carry[sizeof(decoder->stream_carry)];
+    uint64_t rest = decoder->segment_end - decoder->i_pt_buffer;
+    uint64_t next = has_next_segment(decoder) ? decoder->pt_buffer_wrapped_length : 0;
+    if (limit > sizeof(carry)) {
+        //We only stop decoding within a guard of the end of each of the last two chunks, so this shouldn't happen
+        limit = sizeof(carry);
+    }
+
+    uint64_t skip = rest + next > limit ? rest + next - limit : 0;
+    uint64_t length = 0;
+    if (skip < rest) {
+        length = rest - skip;
+        memcpy(carry, decoder->i_pt_buffer + skip, length);
+    }
+
+    if (next) {
+        uint64_t next_skip = skip > rest ? skip - rest : 0;
+        memcpy(carry + length, decoder->pt_buffer_wrapped + next_skip, next - next_skip);
+        length += next - next_skip;
+    }
+
+    memcpy(decoder->stream_carry, carry, length);
+    decoder->stream_carry_length = length;
+    set_segments(decoder, decoder->stream_carry, length, NULL, 0);
 }
 
+/**
+ * Installs the stream carry followed by a new chunk as the trace. The carry is always decoded first so that packets
+ * which straddle chunks are joined up.
+ */
+static void set_stream_segments(ha_pt_decoder_t decoder, const uint8_t *chunk, uint64_t chunk_length) {
+    if (decoder->stream_carry_length) {
+        set_segments(decoder, decoder->stream_carry, decoder->stream_carry_length, chunk, chunk_length);
+    } else {
+        set_segments(decoder, chunk, chunk_length, NULL, 0);
+    }
+}
+
+int ha_pt_decoder_push_stream_chunk(ha_pt_decoder_t decoder, const uint8_t *chunk, uint64_t chunk_length) {
+    if (!decoder->is_stream_open) {
+        return -HA_PT_DECODER_END_OF_STREAM;
+    }
+
+    if (!chunk) {
+        //The trace has ended, so whatever is left can be decoded up to a stop codon
+        decoder->is_stream_open = false;
+        chunk_length = 0;
+    }
+
+    set_stream_segments(decoder, chunk, chunk_length);
+    if (!decoder->is_stream_synced) {
+        int result = ha_pt_decoder_sync_forward(decoder);
+        if (result) {
+            if (!decoder->is_stream_open) {
+                return result;
+            }
+
+            //A PSB may start in the last few bytes, so we keep them (even if they're in the carry) for the next chunk
+            set_stream_segments(decoder, chunk, chunk_length);
+            carry_stream(decoder, PT_PKT_PSB_LEN - 1);
+            return -HA_PT_DECODER_NEED_MORE_TRACE;
+        }
+
+        decoder->is_stream_synced = true;
+    }
+
+    return -HA_PT_DECODER_NO_ERROR;
+}
+
+void ha_pt_decoder_retain_stream_chunk(ha_pt_decoder_t decoder) {
+    carry_stream(decoder, UINT64_MAX);
+}
+
+
+/**
+ * Finds the first PSB which lies entirely within [start, end)
+ * @return The PSB or NULL if there is none
+ */
+static const uint8_t *find_psb(const uint8_t *start, const uint8_t *end) {
+    const uint8_t *ptr = start;
+#if __SSE2__
+    //Every PSB starts with the first two bytes of the pattern, so we look for those sixteen positions at a time and
+    //only compare the full pattern at candidates. Real packets almost never produce false candidates.
+    const __m128i byte_0 = _mm_set1_epi8((char) PT_PKT_PSB_BYTE0);
+    const __m128i byte_1 = _mm_set1_epi8((char) PT_PKT_PSB_BYTE1);
+    while ((uint64_t) (end - ptr) > sizeof(__m128i)) {
+        __m128i first = _mm_loadu_si128((const __m128i *) ptr);
+        __m128i second = _mm_loadu_si128((const __m128i *) (ptr + 1));
+        uint32_t candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, byte_0),
+                                                              _mm_cmpeq_epi8(second, byte_1)));
+        while (candidates) {
+            const uint8_t *candidate = ptr + __builtin_ctz(candidates);
+            if (end - candidate >= PT_PKT_PSB_LEN && memcmp(candidate, psb, PT_PKT_PSB_LEN) == 0) {
+                return candidate;
+            }
+
+            candidates &= candidates - 1;
+        }
+
+        ptr += sizeof(__m128i);
+    }
+#endif
+
+    for (; end - ptr >= PT_PKT_PSB_LEN; ptr++) {
+        if (memcmp(ptr, psb, PT_PKT_PSB_LEN) == 0) {
+            return ptr;
+        }
+    }
+
+    return NULL;
+}
 
 int ha_pt_decoder_sync_forward(ha_pt_decoder_t decoder) {
-    uint8_t *pt_end_ptr = decoder->pt_buffer + decoder->pt_buffer_length - 1;
-    for (uint8_t *ptr_i = decoder->i_pt_buffer; ptr_i < pt_end_ptr - PT_PKT_PSB_LEN; ptr_i++) {
-        if (memcmp(ptr_i, psb, PT_PKT_PSB_LEN) == 0) {
-            decoder->i_pt_buffer = ptr_i;
-            return -HA_PT_DECODER_NO_ERROR;
+    leave_tail(decoder);
+    const uint8_t *found = find_psb(decoder->i_pt_buffer, decoder->segment_end);
+    if (!found && has_next_segment(decoder)) {
+        //A PSB may straddle the two segments, so we look across the join
+        uint8_t join[2 * (PT_PKT_PSB_LEN - 1)];
+        uint64_t rest = decoder->segment_end - decoder->i_pt_buffer;
+        uint64_t before = rest < PT_PKT_PSB_LEN - 1 ? rest : PT_PKT_PSB_LEN - 1;
+        uint64_t after = decoder->pt_buffer_wrapped_length < PT_PKT_PSB_LEN - 1
+                         ? decoder->pt_buffer_wrapped_length : PT_PKT_PSB_LEN - 1;
+        memcpy(join, decoder->segment_end - before, before);
+        memcpy(join + before, decoder->pt_buffer_wrapped, after);
+        const uint8_t *found_join = find_psb(join, join + before + after);
+        if (found_join) {
+            //A PSB can't fit in the bytes after the join, so it starts in this segment
+            found = decoder->segment_end - before + (found_join - join);
+        } else {
+            enter_segment(decoder, true, decoder->pt_buffer_wrapped,
+                          decoder->pt_buffer_wrapped + decoder->pt_buffer_wrapped_length);
+            found = find_psb(decoder->i_pt_buffer, decoder->segment_end);
         }
     }
 
-    return -HA_PT_DECODER_COULD_NOT_SYNC;
+    if (!found) {
+        return -HA_PT_DECODER_COULD_NOT_SYNC;
+    }
+
+    enter_segment(decoder, decoder->is_in_wrapped_segment, found, decoder->segment_end);
+    return -HA_PT_DECODER_NO_ERROR;
 }
 
-void ha_pt_decoder_internal_get_trace_buffer(ha_pt_decoder_t decoder, uint8_t **trace, uint64_t *trace_length) {
+/**
+ * Reads the IP of a TIP family packet
+ * @param last_ip The IP which the packet is compressed against. On success, this is updated to the packet's IP.
+ * @return The length of the packet or zero if it is truncated or malformed
+ */
+static uint64_t read_ip_packet(const uint8_t *packet, const uint8_t *end, uint64_t *last_ip) {
+    uint8_t ip_bytes = packet[0] >> PT_PKT_TIP_SHIFT;
+    static const uint8_t payload_lengths[8] = {0, 2, 4, 6, 6, 0, 8, 0};
+    uint8_t payload_length = payload_lengths[ip_bytes];
+    if ((ip_bytes && !payload_length) || end - packet < 1 + payload_length) {
+        return 0;
+    }
+
+    uint64_t payload = 0;
+    for (uint8_t i = 0; i < payload_length; i++) {
+        payload |= (uint64_t) packet[1 + i] << (8 * i);
+    }
+
+    if (ip_bytes == 3) {
+        //Sign extended from bit 47
+        *last_ip = (uint64_t) ((int64_t) (payload << 16) >> 16);
+    } else if (ip_bytes == 6) {
+        *last_ip = payload;
+    } else if (payload_length) {
+        uint64_t mask = UINT64_MAX >> (64 - 8 * payload_length);
+        *last_ip = (*last_ip & ~mask) | payload;
+    }
+
+    return 1 + payload_length;
+}
+
+/**
+ * Reads a PSB+ header, filling the state of the PSB
+ * @param header The first byte after the PSB
+ * @return True if the header was understood
+ */
+static bool read_psb_header(const uint8_t *trace_buffer, const uint8_t *header, const uint8_t *end,
+                            ha_pt_decoder_psb *psb_out) {
+    //IP compression restarts at each PSB
+    uint64_t last_ip = 0;
+    uint64_t ip = 0;
+    const uint8_t *ptr = header;
+    while (ptr < end) {
+        uint64_t length;
+        if (!ptr[0]) {
+            length = 1; /* PAD */
+        } else if (ptr[0] == PT_PKT_MODE_BYTE0) {
+            length = PT_PKT_MODE_LEN;
+        } else if (ptr[0] == PT_PKT_TSC_BYTE0) {
+            length = PT_PKT_TSC_LEN;
+        } else if ((ptr[0] & PT_PKT_TIP_MASK) == PT_PKT_TIP_FUP_BYTE0) {
+            if (!(length = read_ip_packet(ptr, end, &last_ip))) {
+                return false;
+            }
+            ip = last_ip;
+        } else if (ptr[0] == PT_PKT_GENERIC_BYTE0 && end - ptr >= PT_PKT_GENERIC_LEN) {
+            switch (ptr[1]) {
+                case PT_PKT_PSBEND_BYTE1:
+                    psb_out->resume_offset = ptr + PT_PKT_PSBEND_LEN - trace_buffer;
+                    psb_out->ip = ip;
+                    return true;
+                case PT_PKT_CBR_BYTE1:
+                    length = PT_PKT_CBR_LEN;
+                    break;
+                case PT_PKT_TMA_BYTE1:
+                    length = PT_PKT_TMA_LEN;
+                    break;
+                case PT_PKT_PIP_BYTE1:
+                    length = PT_PKT_PIP_LEN;
+                    break;
+                case PT_PKT_VMCS_BYTE1:
+                    length = PT_PKT_VMCS_LEN;
+                    break;
+                case PT_PKT_MNT_BYTE1:
+                    length = PT_PKT_MNT_LEN;
+                    break;
+                default:
+                    return false;
+            }
+        } else {
+            return false;
+        }
+
+        ptr += length;
+    }
+
+    //The header was cut off
+    return false;
+}
+
+int ha_pt_decoder_psb_index_alloc(ha_pt_decoder_psb_index **index_out, const uint8_t *trace_buffer,
+                                  uint64_t trace_length) {
+    int result = 0;
+    uint64_t capacity = 0;
+    ha_pt_decoder_psb_index *index = NULL;
+
+    if (!(index_out && trace_buffer)) {
+        result = -1;
+        goto CLEANUP;
+    }
+
+    index = calloc(1, sizeof(ha_pt_decoder_psb_index));
+    if (!index) {
+        result = -2;
+        goto CLEANUP;
+    }
+
+    index->trace_length = trace_length;
+
+    const uint8_t *end = trace_buffer + trace_length;
+    const uint8_t *found = trace_buffer;
+    while ((found = find_psb(found, end))) {
+        if (index->psb_count >= capacity) {
+            uint64_t new_capacity = capacity ? capacity * 2 : 64;
+            ha_pt_decoder_psb *new_psbs = realloc(index->psbs, new_capacity * sizeof(ha_pt_decoder_psb));
+            if (!new_psbs) {
+                printf(TAG "Out of memory\n");
+                result = -2;
+                goto CLEANUP;
+            }
+
+            index->psbs = new_psbs;
+            capacity = new_capacity;
+        }
+
+        ha_pt_decoder_psb *entry = &index->psbs[index->psb_count];
+        entry->offset = found - trace_buffer;
+        found += PT_PKT_PSB_LEN;
+        if (read_psb_header(trace_buffer, found, end, entry)) {
+            index->psb_count++;
+        }
+    }
+
+    CLEANUP:
+    if (result) {
+        ha_pt_decoder_psb_index_free(index);
+    } else {
+        *index_out = index;
+    }
+
+    return result;
+}
+
+void ha_pt_decoder_psb_index_free(ha_pt_decoder_psb_index *index) {
+    if (!index) {
+        return;
+    }
+
+    free(index->psbs);
+    free(index);
+}
+
+void ha_pt_decoder_seek_to_psb(ha_pt_decoder_t decoder, const ha_pt_decoder_psb *psb, uint64_t end_offset) {
+    const uint8_t *trace_buffer = decoder->pt_buffer;
+    uint64_t trace_length = decoder->pt_buffer_length;
+    ha_pt_decoder_reconfigure_with_trace(decoder, trace_buffer, trace_length);
+
+    if (end_offset > trace_length) {
+        end_offset = trace_length;
+    }
+
+    enter_segment(decoder, false, trace_buffer + psb->resume_offset, trace_buffer + end_offset);
+    decoder->is_window_cut = end_offset < trace_length;
+    decoder->last_tip = psb->ip;
+    decoder->cache.override_target = psb->ip;
+}
+
+void ha_pt_decoder_internal_get_trace_buffer(ha_pt_decoder_t decoder, const uint8_t **trace,
+                                             uint64_t *trace_length) {
     *trace = decoder->pt_buffer;
     *trace_length = decoder->pt_buffer_length;
 }
@@ -97,12 +536,13 @@ void ha_pt_decoder_internal_get_trace_buffer(ha_pt_decoder_t decoder, uint8_t **
 /** Returns true if the TNT cache can accept more TNT packets safely. */
 __attribute__((always_inline))
 static inline bool is_tnt_cache_near_full(ha_pt_decoder_t decoder) {
-    //If we have fewer than 47 slots (aka the largest LTNT) we consider ourselves full so that we don't drop anything
-    return HA_PT_DECODER_CACHE_TNT_COUNT - ha_pt_decoder_cache_tnt_count(&decoder->cache) < 47;
+    //If we don't have room for the largest LTNT (47 TNTs) plus the word a push may clobber after it, we consider
+    //ourselves full so that we don't drop anything
+    return HA_PT_DECODER_CACHE_TNT_COUNT - ha_pt_decoder_cache_tnt_count(&decoder->cache) < 47 + 64;
 }
 
 __attribute__((always_inline))
-static inline uint64_t get_ip_val(uint8_t **pp, uint64_t *last_ip){
+static inline uint64_t get_ip_val(const uint8_t **pp, uint64_t *last_ip){
     register uint8_t len = (*(*pp)++ >> PT_PKT_TIP_SHIFT);
     if(unlikely(!len))
         return 0;
@@ -182,25 +622,32 @@ static inline uint8_t asm_bsr(uint64_t x) {
 #endif
 }
 
-static inline bool append_tnt_cache(ha_pt_decoder_t decoder, uint8_t data) {
-    uint8_t bits = asm_bsr(data)-SHORT_TNT_OFFSET;
-    for (int16_t i = bits + SHORT_TNT_OFFSET - 1; i >= SHORT_TNT_OFFSET; i--) {
-        uint8_t b = (data >> i) & 0b1;
-        ha_pt_decoder_cache_tnt_push_back(&decoder->cache, b);
+/**
+ * Pushes the TNTs of a TNT packet's payload. The TNTs are the bits below the payload's highest set bit (the stop bit),
+ * the first TNT being the most significant.
+ */
+__attribute__((always_inline))
+static inline bool append_tnt_payload(ha_pt_decoder_t decoder, uint64_t payload) {
+    //A payload without a stop bit is malformed, so we treat it as empty
+    uint8_t count = payload ? asm_bsr(payload) : 0;
+    if (likely(count)) {
+        //The push shifts out the stop bit for us
+        ha_pt_decoder_cache_tnt_push_bits(&decoder->cache, payload, count);
     }
 
     return !is_tnt_cache_near_full(decoder);
 }
 
-__attribute__((always_inline))
-static inline bool append_tnt_cache_ltnt(ha_pt_decoder_t decoder, uint64_t data) {
-    uint8_t bits = asm_bsr(data)-LONG_TNT_MAX_BITS;
-    for (int16_t i = bits + LONG_TNT_MAX_BITS - 1; i >= LONG_TNT_MAX_BITS; i--) {
-        uint8_t b = (data >> i) & 0b1;
-        ha_pt_decoder_cache_tnt_push_back(&decoder->cache, b);
-    }
+static inline bool append_tnt_cache(ha_pt_decoder_t decoder, uint8_t data) {
+    return append_tnt_payload(decoder, data >> SHORT_TNT_OFFSET);
+}
 
-    return !is_tnt_cache_near_full(decoder);
+__attribute__((always_inline))
+static inline bool append_tnt_cache_ltnt(ha_pt_decoder_t decoder, const uint8_t *packet) {
+    //The payload is the six bytes after the two byte header
+    uint64_t data;
+    memcpy(&data, packet, sizeof(uint64_t));
+    return append_tnt_payload(decoder, data >> LONG_TNT_OFFSET);
 }
 
 
@@ -465,7 +912,16 @@ int ha_pt_decoder_decode_until_caches_filled(ha_pt_decoder_t decoder) {
             __extension__ &&handle_pt_error,        // 11111111
     };
 
-#define DISPATCH_L1 goto *dispatch_table_level_1[decoder->i_pt_buffer[0]];
+    //Until we reach the guard, every packet lies entirely in the buffer, so this is our only bounds check
+    const uint8_t *guard = decoder->guard;
+#define DISPATCH_L1 \
+    if (unlikely(decoder->i_pt_buffer >= guard)) { \
+        if (unlikely(!cross_guard(decoder))) { \
+            return -HA_PT_DECODER_NEED_MORE_TRACE; \
+        } \
+        guard = decoder->guard; \
+    } \
+    goto *dispatch_table_level_1[decoder->i_pt_buffer[0]];
     DISPATCH_L1;
     handle_pt_mode:
         decoder->i_pt_buffer += PT_PKT_MODE_LEN;
@@ -492,7 +948,7 @@ int ha_pt_decoder_decode_until_caches_filled(ha_pt_decoder_t decoder) {
         }
         DISPATCH_L1;
     handle_pt_pad:
-        while(unlikely(!(*(++decoder->i_pt_buffer)))){}
+        while(++decoder->i_pt_buffer < guard && unlikely(!*decoder->i_pt_buffer)){}
         DISPATCH_L1;
     handle_pt_tnt8:
         LOGGER("TNT 0x%x\n", *decoder->i_pt_buffer);
@@ -515,12 +971,14 @@ int ha_pt_decoder_decode_until_caches_filled(ha_pt_decoder_t decoder) {
 
         case __extension__ 0b10000010:    /* PSB */
             decoder->i_pt_buffer += PT_PKT_PSB_LEN;
+            //IP compression restarts at each PSB
+            decoder->last_tip = 0;
             LOGGER("PSB\n");
             DISPATCH_L1;
 
         case __extension__ 0b10100011:    /* LTNT */
             LOGGER("LTNT\n");
-            bool cont = append_tnt_cache_ltnt(decoder, (uint64_t)*decoder->i_pt_buffer);
+            bool cont = append_tnt_cache_ltnt(decoder, decoder->i_pt_buffer);
             decoder->i_pt_buffer += PT_PKT_LTNT_LEN;
             if (unlikely(!cont)) {
                 return HA_PT_DECODER_NO_ERROR;
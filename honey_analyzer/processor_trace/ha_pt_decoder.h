@@ -30,11 +30,29 @@ typedef enum {
     HA_PT_UNSUPPORTED_TRACE_PACKET = 5,
     /** The target address was not found in the binary map. */
     HA_PT_DECODER_NO_MAP = 6,
+    /**
+     * A streamed trace has been decoded as far as it can be until the next chunk is pushed. This is not an error but
+     * rather an indication to push more.
+     */
+    HA_PT_DECODER_NEED_MORE_TRACE = 7,
 } ha_pt_decoder_status;
 
-/** The number of elements our cache struct holds. This is a power of two so we can mask instead of modulo */
+/** The number of TNTs our cache struct holds. This is a power of two so we can mask instead of modulo */
 #define HA_PT_DECODER_CACHE_TNT_COUNT (1LLU<<16U)
-#define HA_PT_DECODER_CACHE_TNT_COUNT_MASK (HA_PT_DECODER_CACHE_TNT_COUNT - 1)
+/** TNTs are packed 64 to a word */
+#define HA_PT_DECODER_CACHE_TNT_WORD_COUNT (HA_PT_DECODER_CACHE_TNT_COUNT / 64)
+#define HA_PT_DECODER_CACHE_TNT_WORD_MASK (HA_PT_DECODER_CACHE_TNT_WORD_COUNT - 1)
+
+/**
+ * How close to the end of a trace segment the decoder may get before it stops decoding in place. This must be more
+ * than the number of bytes any packet handler reads (the longest packet is a 16 byte PSB).
+ */
+#define HA_PT_DECODER_GUARD_LENGTH 32
+/**
+ * The size of the tail buffer. This holds the rest of a segment and the start of the next one, a stop codon, and
+ * padding for the handlers which read past the end of their packet.
+ */
+#define HA_PT_DECODER_TAIL_LENGTH (4 * HA_PT_DECODER_GUARD_LENGTH)
 typedef struct {
     /** If an indirect branch target is available, this field is non-zero.*/
     uint64_t next_indirect_branch_target;
@@ -48,29 +66,92 @@ typedef struct {
      * index arithmetic.
      */
 
-    /** The next index for the TNT */
+    /** The bit index of the next TNT */
     uint64_t tnt_cache_read;
-    /** The index to place the next TNT (i.e. there is no valid TNT here) */
+    /** The bit index to place the next TNT (i.e. there is no valid TNT here) */
     uint64_t tnt_cache_write;
 
     /**
-     * The actual TNT cache. TNT items are in a FIFO ringbuffer.
+     * The actual TNT cache. TNT items are in a FIFO ringbuffer of bits, one bit per TNT (set if taken). Within a word,
+     * earlier TNTs are more significant so that runs of TNTs can be read with shifts. Bits at and after the write
+     * index are undefined.
      */
-    int8_t tnt_cache[HA_PT_DECODER_CACHE_TNT_COUNT];
+    uint64_t tnt_cache[HA_PT_DECODER_CACHE_TNT_WORD_COUNT];
 } ha_pt_decoder_cache;
 
 typedef struct internal_ha_pt_decoder {
     /**
-     * The PT buffer. This needs to be mmaped into a larger map in which the stop codon is placed just after the last
-     * byte of this buffer
+     * The PT buffer. The decoder never writes to it, so it may be read-only. A trace may be split in two segments (such
+     * as a ring buffer which has wrapped), in which case this is the first segment.
      */
-    uint8_t *pt_buffer;
+    const uint8_t *pt_buffer;
 
-    /** This size of the PT buffer. This does not include the stop codon. */
+    /** This size of the PT buffer. */
     uint64_t pt_buffer_length;
 
-    /** The iterator pointer. This is used to "walk" the trace without destroying our handle. */
-    uint8_t *i_pt_buffer;
+    /** The second segment of the trace, which continues where pt_buffer ends. NULL if the trace is in one piece. */
+    const uint8_t *pt_buffer_wrapped;
+
+    /** The size of the second segment */
+    uint64_t pt_buffer_wrapped_length;
+
+    /**
+     * The iterator pointer. This is used to "walk" the trace without destroying our handle. It points either into the
+     * segment being decoded or into the tail buffer.
+     */
+    const uint8_t *i_pt_buffer;
+
+    /**
+     * Every packet which starts before the guard lies entirely in the buffer being decoded, so the decoder only needs
+     * to look at where it is once it reaches the guard.
+     */
+    const uint8_t *guard;
+
+    /** The end of the segment being decoded. This may be before the end of the segment's buffer, see seek_to_psb. */
+    const uint8_t *segment_end;
+
+    /** Are we decoding (or have we copied the tail of) the second segment? */
+    uint64_t is_in_wrapped_segment;
+
+    /** Are we decoding from the tail buffer? */
+    uint64_t is_in_tail;
+
+    /**
+     * The number of bytes at the start of the tail buffer which are the rest of the segment. Anything after these is
+     * the start of the next segment or a stop codon.
+     */
+    uint64_t tail_join;
+
+    /**
+     * Once the decoder reaches the guard, the rest of the segment is copied here and decoded instead so that the
+     * packets near the end which may run off it (or into the next segment) are decoded from one buffer with a stop
+     * codon where the trace ends.
+     */
+    uint8_t tail[HA_PT_DECODER_TAIL_LENGTH];
+
+    /**
+     * Set while more of a streamed trace may be pushed. Packets near the end of what we have may continue in the next
+     * chunk, so rather than decode them, the decoder asks for more.
+     */
+    uint64_t is_stream_open;
+
+    /** Has a streamed trace been synced to its first PSB yet? */
+    uint64_t is_stream_synced;
+
+    /**
+     * Set when the decoder was seeked to a window which ends before the trace does. Execution carries on past the end
+     * of such a window, so running out of trace at a branch is not a desync.
+     */
+    uint64_t is_window_cut;
+
+    /** The length of the part of a streamed trace which was pushed but not yet decoded */
+    uint64_t stream_carry_length;
+
+    /**
+     * The part of a streamed trace which was pushed but not yet decoded. This is kept here so that a chunk's buffer is
+     * not needed once it has been decoded. This is never more than a guard of each of the last two chunks.
+     */
+    uint8_t stream_carry[2 * HA_PT_DECODER_GUARD_LENGTH];
 
     /** The last TIP. This is used for understanding future TIPs since they are masks on this value. */
     uint64_t last_tip;
@@ -85,23 +166,45 @@ typedef struct internal_ha_pt_decoder {
 } ha_pt_decoder;
 
 /**
- * Creates a new decoder from a raw Intel Processor Trace dump
- * @param trace_path The path to the trace file
- * @return The tracer session or NULL
+ * A PSB in a trace along with the decoder state reconstructed from its PSB+ header
  */
+typedef struct {
+    /** The offset of the PSB from the start of the trace */
+    uint64_t offset;
+
+    /** The offset of the first packet after the PSB+ header. Decoding from this PSB resumes here. */
+    uint64_t resume_offset;
+
+    /**
+     * The IP given by the header's FUP, which is where execution was when the PSB was emitted. This is also the last
+     * IP which later packets are compressed against. Zero if tracing was disabled at the PSB.
+     */
+    uint64_t ip;
+} ha_pt_decoder_psb;
 
 /**
- * Creates a new trace session from a R/W buffer which contains the trace data. The trace buffer must have AT LEAST
- * one extra byte of space after the end of the trace. This is a performance hack borrowed from libxdc.
- * @param session_out The location to place a pointer to the created session. On error, left unchanged.
- * @param hive_path The path to the Honeybee hive to use for decoding this trace.
- * at least one byte more than this value.
- * @param trace_slide The ASLR shifted base address of the binary for this trace
- * @return Error code. On success, zero is returned
+ * Every PSB of a trace, in order. Each PSB starts a window of the trace which can be decoded without the rest of it.
  */
+typedef struct {
+    /** The PSBs */
+    ha_pt_decoder_psb *psbs;
+
+    /** The number of PSBs */
+    uint64_t psb_count;
+
+    /** The length of the trace which this index was built for */
+    uint64_t trace_length;
+} ha_pt_decoder_psb_index;
 
 /**
- * Allocates a new decoder. The decoder does not initially have a trace installed.
+ * Creates a new decoder from a raw Intel Processor Trace dump
+ * @param trace_path The path to the trace file
+ * @return The tracer session or NULL
+ */
+
+/**
+ * Allocates a new decoder. The decoder does not initially have a trace installed. Traces are only ever read, so they
+ * may be mapped read-only and need neither a stop codon nor any extra space after them.
  */
 ha_pt_decoder_t ha_pt_decoder_alloc(void);
 
@@ -111,14 +214,80 @@ void ha_pt_decoder_free(ha_pt_decoder_t decoder);
 /**
  * (Re)configures the decoder with a new trace buffer. This operation clears all internal state.
  * @param trace_buffer The pointer to the start of the buffer containing the trace data. NOTE: This buffer is NOT
- * owned by the decoder--you are still responsible for freeing it (and any buffer replaced by this operation).
+ * owned by the decoder--you are still responsible for freeing it (and any buffer replaced by this operation). The
+ * buffer is never written to and does not need to be terminated.
  * @param trace_length The length of the trace
  */
-void ha_pt_decoder_reconfigure_with_trace(ha_pt_decoder_t decoder, uint8_t *trace_buffer, uint64_t trace_length);
+void ha_pt_decoder_reconfigure_with_trace(ha_pt_decoder_t decoder, const uint8_t *trace_buffer,
+                                          uint64_t trace_length);
+
+/**
+ * (Re)configures the decoder with a trace which is split in two segments, such as the contents of a ring buffer which
+ * has wrapped around. Packets may straddle the two segments. This operation clears all internal state.
+ * @param trace_buffer The first (older) segment of the trace. For a wrapped ring buffer, this runs from the write
+ * position to the end of the buffer.
+ * @param trace_length The length of the first segment
+ * @param wrapped_buffer The second (newer) segment of the trace, which continues from the end of the first. For a
+ * wrapped ring buffer, this runs from the start of the buffer to the write position.
+ * @param wrapped_length The length of the second segment
+ */
+void ha_pt_decoder_reconfigure_with_wrapped_trace(ha_pt_decoder_t decoder, const uint8_t *trace_buffer,
+                                                  uint64_t trace_length, const uint8_t *wrapped_buffer,
+                                                  uint64_t wrapped_length);
+
+/**
+ * (Re)configures the decoder to decode a trace which is pushed to it in chunks as it arrives, see
+ * ha_pt_decoder_push_stream_chunk. This operation clears all internal state.
+ */
+void ha_pt_decoder_reconfigure_with_stream(ha_pt_decoder_t decoder);
+
+/**
+ * Gives a streaming decoder the next chunk of its trace. Packets which straddle chunks are decoded once the chunk
+ * which completes them is pushed. Decode the chunk until the decoder returns -HA_PT_DECODER_NEED_MORE_TRACE and then
+ * call ha_pt_decoder_retain_stream_chunk before pushing the next.
+ * @param chunk The chunk. Pass NULL once the trace has ended so that the rest of it is decoded.
+ * @param chunk_length The length of the chunk
+ * @return Zero if the chunk is ready to decode. -HA_PT_DECODER_NEED_MORE_TRACE if the decoder has not yet found the
+ * first PSB of the trace and so the chunk should be retained without decoding. Other negative codes are errors.
+ */
+int ha_pt_decoder_push_stream_chunk(ha_pt_decoder_t decoder, const uint8_t *chunk, uint64_t chunk_length);
+
+/**
+ * Copies the part of the last chunk pushed which the decoder has not decoded yet into the decoder so that the chunk's
+ * buffer is no longer needed
+ */
+void ha_pt_decoder_retain_stream_chunk(ha_pt_decoder_t decoder);
 
 /** Sync the decoder forwards towards the first PSB. Returns -ha_pt_decoder_status on error. */
 int ha_pt_decoder_sync_forward(ha_pt_decoder_t decoder);
 
+/**
+ * Builds an index of every PSB in a trace. Only traces which are in one piece can be indexed. The trace is scanned
+ * once and the PSB+ header of each PSB is read to recover the state needed to start decoding there. PSBs whose
+ * headers are truncated or hold packets we don't understand are left out, which only merges their window into the one
+ * before it.
+ * @param index_out The location to place the index. On error, left unchanged. Free it with
+ * ha_pt_decoder_psb_index_free.
+ * @param trace_buffer The trace
+ * @param trace_length The length of the trace
+ * @return Zero on success
+ */
+int ha_pt_decoder_psb_index_alloc(ha_pt_decoder_psb_index **index_out, const uint8_t *trace_buffer,
+                                  uint64_t trace_length);
+
+/** Frees a PSB index */
+void ha_pt_decoder_psb_index_free(ha_pt_decoder_psb_index *index);
+
+/**
+ * Positions the decoder just after a PSB+ header with the state the header describes. This clears all other internal
+ * state, so the decoder only sees the trace from this PSB onwards. If the header reported an IP, it is delivered as
+ * an override so that decoding picks up where execution was when the PSB was emitted.
+ * @param psb A PSB from the index of the decoder's trace
+ * @param end_offset Where the decoder should consider the trace to end, such as at the offset of a later PSB. Pass
+ * the trace length to decode through the end of the trace.
+ */
+void ha_pt_decoder_seek_to_psb(ha_pt_decoder_t decoder, const ha_pt_decoder_psb *psb, uint64_t end_offset);
+
 /** Runs the decode process until one of the two caches fills */
 int ha_pt_decoder_decode_until_caches_filled(ha_pt_decoder_t decoder);
 
@@ -134,16 +303,57 @@ static inline int ha_pt_decoder_cache_tnt_is_empty(ha_pt_decoder_cache *cache) {
     return cache->tnt_cache_read == cache->tnt_cache_write;
 }
 
-/** Pushes a new TNT item to the end of the ringbuffer. Does not check for capacity. */
+/**
+ * Pushes several TNT items to the end of the ringbuffer. Does not check for capacity, and since the rest of the last
+ * word written is clobbered, there must be room for a further word past the pushed TNTs.
+ * @param bits The TNTs in the low count bits, the first item being the most significant. Higher bits are ignored.
+ * @param count The number of TNTs, 1 through 64
+ */
 __attribute__((always_inline))
-static inline void ha_pt_decoder_cache_tnt_push_back(ha_pt_decoder_cache *cache, uint8_t tnt) {
-    cache->tnt_cache[(cache->tnt_cache_write++) & HA_PT_DECODER_CACHE_TNT_COUNT_MASK] = tnt;
+static inline void ha_pt_decoder_cache_tnt_push_bits(ha_pt_decoder_cache *cache, uint64_t bits, uint32_t count) {
+    uint64_t write = cache->tnt_cache_write;
+    uint32_t offset = write & 63;
+    uint64_t *word = &cache->tnt_cache[(write >> 6) & HA_PT_DECODER_CACHE_TNT_WORD_MASK];
+    uint64_t aligned = bits << (64 - count);
+    if (offset) {
+        //Keep the TNTs already in the word
+        *word = (*word & (UINT64_MAX << (64 - offset))) | (aligned >> offset);
+        if (offset + count > 64) {
+            cache->tnt_cache[((write >> 6) + 1) & HA_PT_DECODER_CACHE_TNT_WORD_MASK] = aligned << (64 - offset);
+        }
+    } else {
+        *word = aligned;
+    }
+
+    cache->tnt_cache_write = write + count;
 }
 
 /** Pops the first TNT item from front of the ringbuffer. Does not check for availability. */
 __attribute__((always_inline))
 static inline uint8_t ha_pt_decoder_cache_tnt_pop(ha_pt_decoder_cache *cache) {
-    return cache->tnt_cache[(cache->tnt_cache_read++) & HA_PT_DECODER_CACHE_TNT_COUNT_MASK];
+    uint64_t read = cache->tnt_cache_read++;
+    return (cache->tnt_cache[(read >> 6) & HA_PT_DECODER_CACHE_TNT_WORD_MASK] >> (63 - (read & 63))) & 1;
+}
+
+/**
+ * Reads several TNT items from the front of the ringbuffer as an integer, the first item being the most significant
+ * bit, without popping them. Does not check for availability.
+ * @param count The number of TNTs, 1 through 64
+ */
+__attribute__((always_inline))
+static inline uint64_t ha_pt_decoder_cache_tnt_peek_bits(ha_pt_decoder_cache *cache, uint32_t count) {
+    uint64_t read = cache->tnt_cache_read;
+    uint32_t offset = read & 63;
+    uint64_t first = cache->tnt_cache[(read >> 6) & HA_PT_DECODER_CACHE_TNT_WORD_MASK];
+    uint64_t second = cache->tnt_cache[((read >> 6) + 1) & HA_PT_DECODER_CACHE_TNT_WORD_MASK];
+    //The second word is shifted in two steps so that an offset of zero shifts it out entirely
+    return ((first << offset) | (second >> 1 >> (63 - offset))) >> (64 - count);
+}
+
+/** Discards TNT items from the front of the ringbuffer. Does not check for availability. */
+__attribute__((always_inline))
+static inline void ha_pt_decoder_cache_tnt_drop(ha_pt_decoder_cache *cache, uint32_t count) {
+    cache->tnt_cache_read += count;
 }
 
 /** Returns the number of valid items in the ringbuffer. */
@@ -155,6 +365,37 @@ static inline uint64_t ha_pt_decoder_cache_tnt_count(ha_pt_decoder_cache *cache)
 
 /* ha_pt_decoder functions -- these are defined here for inline-ability */
 
+/**
+ * Finishes a TNT query which had to refill the cache. This is split out of ha_pt_decoder_cache_query_tnt so that a
+ * query which ran out of streamed trace can be picked up again once the refill has been completed.
+ * @param refill_result The result of the refill
+ */
+__attribute__((always_inline))
+static inline int ha_pt_decoder_cache_query_tnt_after_refill(ha_pt_decoder_t decoder, int refill_result,
+                                                             uint64_t *override) {
+    ha_pt_decoder_cache *cache = &decoder->cache;
+    if (unlikely(refill_result < 0 && refill_result != -HA_PT_DECODER_END_OF_STREAM)) {
+        return refill_result;
+    }
+
+    //We tried to refill the cache but no TNTs were returned.
+    //This indicates that the consumer consumed data from us in the wrong order.
+    if (unlikely(ha_pt_decoder_cache_tnt_is_empty(cache))) {
+        if (cache->override_target) {
+            *override = cache->override_target;
+            cache->override_target = 0;
+            return 2;
+        } else if (refill_result == -HA_PT_DECODER_END_OF_STREAM && decoder->is_window_cut) {
+            //The window simply ended before this branch
+            return refill_result;
+        } else {
+            return -HA_PT_DECODER_TRACE_DESYNC;
+        }
+    }
+
+    return ha_pt_decoder_cache_tnt_pop(cache);
+}
+
 /**
  * Query the decoder for the next TNT. This function will trigger additional analysis if necessary.
  * @param override If there was an FUP which must be taken instead of the expected TNT, fup_override will hold
@@ -166,36 +407,19 @@ static inline uint64_t ha_pt_decoder_cache_tnt_count(ha_pt_decoder_cache *cache)
 static inline int ha_pt_decoder_cache_query_tnt(ha_pt_decoder_t decoder, uint64_t *override) {
     ha_pt_decoder_cache *cache = &decoder->cache;
     if (unlikely(ha_pt_decoder_cache_tnt_is_empty(cache))) {
-        int refill_result = ha_pt_decoder_decode_until_caches_filled(decoder);
-        if (unlikely(refill_result < 0 && refill_result != -HA_PT_DECODER_END_OF_STREAM)) {
-            return refill_result;
-        }
-
-        //We tried to refill the cache but no TNTs were returned.
-        //This indicates that the consumer consumed data from us in the wrong order.
-        if (unlikely(ha_pt_decoder_cache_tnt_is_empty(cache))) {
-            if (cache->override_target) {
-                *override = cache->override_target;
-                cache->override_target = 0;
-                return 2;
-            } else {
-                return -HA_PT_DECODER_TRACE_DESYNC;
-            }
-        }
+        return ha_pt_decoder_cache_query_tnt_after_refill(decoder, ha_pt_decoder_decode_until_caches_filled(decoder),
+                                                          override);
     }
 
     return ha_pt_decoder_cache_tnt_pop(cache);
 }
 
 /**
- * Query the decoder for where to go for an indirect jump.
- * @param ip A pointer to where the new IP should be placed.
- * @return Negative on error. 0 if an indirect branch was placed. 1 if there was an override.
+ * Takes the pending override or, failing that, the pending indirect branch target
+ * @return 1 if there was an override. 0 if an indirect branch was placed. -1 if there was neither.
  */
 __attribute__((always_inline))
-static inline int ha_pt_decoder_cache_query_indirect(ha_pt_decoder_t decoder, uint64_t *ip) {
-    ha_pt_decoder_cache *cache = &decoder->cache;
-    REROUTE:
+static inline int ha_pt_decoder_cache_take_indirect(ha_pt_decoder_cache *cache, uint64_t *ip) {
     if (cache->override_target) {
         *ip = cache->override_target;
         cache->override_target = 0;
@@ -204,21 +428,48 @@ static inline int ha_pt_decoder_cache_query_indirect(ha_pt_decoder_t decoder, ui
         *ip = cache->next_indirect_branch_target;
         cache->next_indirect_branch_target = 0;
         return 0;
-    } else {
-        //No answer, we need to hit the decoder
-        int result = ha_pt_decoder_decode_until_caches_filled(decoder);
-        if (unlikely(result < 0)) {
-            return result;
-        }
+    }
 
-        if (unlikely(!cache->next_indirect_branch_target && !cache->override_target)) {
-            return -HA_PT_DECODER_TRACE_DESYNC;
-        }
+    return -1;
+}
 
-        goto REROUTE;
+/**
+ * Finishes an indirect query which had to hit the decoder. This is split out of ha_pt_decoder_cache_query_indirect
+ * for the same reason as ha_pt_decoder_cache_query_tnt_after_refill.
+ * @param refill_result The result of the refill
+ */
+__attribute__((always_inline))
+static inline int ha_pt_decoder_cache_query_indirect_after_refill(ha_pt_decoder_t decoder, int refill_result,
+                                                                  uint64_t *ip) {
+    if (unlikely(refill_result < 0)) {
+        return refill_result;
+    }
+
+    int result = ha_pt_decoder_cache_take_indirect(&decoder->cache, ip);
+    if (unlikely(result < 0)) {
+        return -HA_PT_DECODER_TRACE_DESYNC;
+    }
+
+    return result;
+}
+
+/**
+ * Query the decoder for where to go for an indirect jump.
+ * @param ip A pointer to where the new IP should be placed.
+ * @return Negative on error. 0 if an indirect branch was placed. 1 if there was an override.
+ */
+__attribute__((always_inline))
+static inline int ha_pt_decoder_cache_query_indirect(ha_pt_decoder_t decoder, uint64_t *ip) {
+    int result = ha_pt_decoder_cache_take_indirect(&decoder->cache, ip);
+    if (result >= 0) {
+        return result;
     }
+
+    //No answer, we need to hit the decoder
+    return ha_pt_decoder_cache_query_indirect_after_refill(decoder, ha_pt_decoder_decode_until_caches_filled(decoder),
+                                                           ip);
 }
 
 #undef unlikely
-#undef HA_PT_DECODER_CACHE_TNT_COUNT_MASK
+#undef HA_PT_DECODER_CACHE_TNT_WORD_MASK
 #endif //HONEY_ANALYZER_HA_PT_DECODER_H
@@ -63,6 +63,9 @@
 #define PT_PKT_MODE_LEN            2
 #define PT_PKT_MODE_BYTE0        __extension__ 0b10011001
 
+#define PT_PKT_TSC_LEN            8
+#define PT_PKT_TSC_BYTE0        __extension__ 0b00011001
+
 #define PT_PKT_TIP_LEN            8
 #define PT_PKT_TIP_SHIFT        5
 #define PT_PKT_TIP_MASK            __extension__ 0b00011111
@@ -0,0 +1,413 @@
+//
+// Created by Allison Husain on 4/2/21.
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "ha_parallel_decode.h"
+#include "ha_session_internal.h"
+
+#define TAG "[" __FILE__ "] "
+
+/**
+ * A point in a segment's reports where decoding moved to another image
+ */
+typedef struct {
+    /** The index of the first report in the new image */
+    uint64_t report_index;
+
+    /** The position of the new image in the session's (sorted) images */
+    uint64_t image_position;
+} image_switch;
+
+/**
+ * A run of PSB windows which are decoded together along with the blocks they reported
+ */
+typedef struct {
+    /** The index of the PSB which starts the segment */
+    uint64_t start_psb;
+
+    /** The index of the PSB which ends the segment, or the PSB count for the last segment */
+    uint64_t end_psb;
+
+    /**
+     * Where decoding the segment starts in the trace. Blocks reported before the decoder reads past this point were
+     * reached without the segment's trace, which means that the previous segment reported them too.
+     */
+    const uint8_t *start;
+
+    /** The unslid IP of each block reported, in order */
+    uint64_t *reports;
+    uint64_t report_count;
+    uint64_t report_capacity;
+
+    /** Every image change among the reports. The first report always starts a switch. */
+    image_switch *switches;
+    uint64_t switch_count;
+    uint64_t switch_capacity;
+
+    /** The image of the last report */
+    ha_session_image *last_image;
+
+    /** The number of reports at the start of the segment which the previous segment also reported */
+    uint64_t overlap_count;
+
+    /** The result of decoding the segment */
+    int status;
+
+    /** Set if some reports could not be recorded */
+    bool out_of_memory;
+
+    /** Set once the segment has been decoded */
+    bool done;
+} parallel_segment;
+
+typedef struct {
+    /** The PSB index of the trace */
+    ha_pt_decoder_psb_index *index;
+
+    parallel_segment *segments;
+    uint64_t segment_count;
+
+    /** The next segment which has not yet been claimed by a thread */
+    uint64_t next_segment;
+
+    /** The number of segments which have been delivered */
+    uint64_t delivered_count;
+
+    /** How many segments past the last delivered segment may be decoded */
+    uint64_t in_flight_limit;
+
+    /** Held while waiting on progress */
+    pthread_mutex_t lock;
+
+    /** Broadcast whenever a segment is decoded or delivered, or when decoding stops */
+    pthread_cond_t progress;
+} parallel_context;
+
+typedef struct {
+    parallel_context *context;
+
+    /** The worker's own copy of the session being decoded */
+    ha_session_t session;
+} parallel_worker;
+
+/**
+ * Makes sure that a buffer has room for one more element
+ * @return false if the buffer could not be grown
+ */
+static bool reserve(void **buffer, uint64_t count, uint64_t *capacity, size_t element_size) {
+    if (count < *capacity) {
+        return true;
+    }
+
+    uint64_t new_capacity = *capacity ? *capacity * 2 : 1024;
+    void *new_buffer = realloc(*buffer, new_capacity * element_size);
+    if (!new_buffer) {
+        return false;
+    }
+
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return true;
+}
+
+/**
+ * Records a block reported while decoding a segment
+ */
+static void record_block(ha_session_t session, void *context, uint64_t unslid_ip) {
+    parallel_segment *segment = context;
+    if (segment->out_of_memory) {
+        return;
+    }
+
+    if (session->current_image != segment->last_image) {
+        if (!reserve((void **) &segment->switches, segment->switch_count, &segment->switch_capacity,
+                     sizeof(image_switch))) {
+            segment->out_of_memory = true;
+            return;
+        }
+
+        image_switch *change = &segment->switches[segment->switch_count++];
+        change->report_index = segment->report_count;
+        change->image_position = session->current_image - session->images;
+        segment->last_image = session->current_image;
+    }
+
+    if (!reserve((void **) &segment->reports, segment->report_count, &segment->report_capacity, sizeof(uint64_t))) {
+        segment->out_of_memory = true;
+        return;
+    }
+
+    if (session->decoder->i_pt_buffer == segment->start) {
+        segment->overlap_count++;
+    }
+
+    segment->reports[segment->report_count++] = unslid_ip;
+}
+
+/**
+ * Wakes every thread waiting on progress. The progress itself is published before this is called.
+ */
+static void notify_progress(parallel_context *context) {
+    pthread_mutex_lock(&context->lock);
+    pthread_cond_broadcast(&context->progress);
+    pthread_mutex_unlock(&context->lock);
+}
+
+/**
+ * Is there a segment which has not been claimed and is not too far ahead of delivery?
+ */
+static bool can_claim_segment(parallel_context *context) {
+    uint64_t i = __atomic_load_n(&context->next_segment, __ATOMIC_RELAXED);
+    return i < context->segment_count
+           && i < __atomic_load_n(&context->delivered_count, __ATOMIC_ACQUIRE) + context->in_flight_limit;
+}
+
+/**
+ * Claims and decodes the next segment which has not yet been claimed, so long as it is not too far ahead of delivery
+ * @return false if there was no segment which could be claimed
+ */
+static bool decode_next_segment(parallel_worker *worker) {
+    parallel_context *context = worker->context;
+    uint64_t i = __atomic_load_n(&context->next_segment, __ATOMIC_RELAXED);
+    do {
+        if (i >= context->segment_count
+            || i >= __atomic_load_n(&context->delivered_count, __ATOMIC_ACQUIRE) + context->in_flight_limit) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&context->next_segment, &i, i + 1, true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    parallel_segment *segment = context->segments + i;
+    segment->status = ha_session_decode_window(worker->session, context->index, segment->start_psb, segment->end_psb,
+                                               record_block, segment);
+    __atomic_store_n(&segment->done, true, __ATOMIC_RELEASE);
+    notify_progress(context);
+    return true;
+}
+
+static void *parallel_worker_main(void *worker_) {
+    parallel_worker *worker = worker_;
+    parallel_context *context = worker->context;
+    while (__atomic_load_n(&context->next_segment, __ATOMIC_RELAXED) < context->segment_count) {
+        if (decode_next_segment(worker)) {
+            continue;
+        }
+
+        //We're too far ahead of delivery, so we sleep until a segment is delivered or decoding stops
+        pthread_mutex_lock(&context->lock);
+        while (!can_claim_segment(context)
+               && __atomic_load_n(&context->next_segment, __ATOMIC_RELAXED) < context->segment_count) {
+            pthread_cond_wait(&context->progress, &context->lock);
+        }
+        pthread_mutex_unlock(&context->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Passes a decoded segment's reports, other than those which the previous segment already delivered, on to the
+ * caller
+ */
+static void deliver_segment(ha_session_t session, parallel_segment *segment, uint64_t first_report,
+                            ha_hive_on_block_function *on_block_function, void *context) {
+    uint64_t switch_index = 0;
+    for (uint64_t i = 0; i < segment->report_count; i++) {
+        if (switch_index < segment->switch_count && segment->switches[switch_index].report_index == i) {
+            ha_session_image *image = &session->images[segment->switches[switch_index++].image_position];
+            session->current_image = image;
+            session->hive = image->hive;
+            session->trace_slide = image->trace_slide;
+        }
+
+        if (i >= first_report) {
+            on_block_function(session, context, segment->reports[i]);
+        }
+    }
+}
+
+/**
+ * Splits the trace into segments of at least segment_size bytes
+ * @return false if the segments could not be allocated
+ */
+static bool split_segments(parallel_context *context, const uint8_t *trace_buffer, uint64_t segment_size) {
+    ha_pt_decoder_psb_index *index = context->index;
+
+    //We walk the PSBs twice: once to count and once to fill
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t segment_count = 0;
+        uint64_t start_psb = 0;
+        for (uint64_t i = 1; i <= index->psb_count; i++) {
+            if (i < index->psb_count
+                && index->psbs[i].offset - index->psbs[start_psb].offset < segment_size) {
+                continue;
+            }
+
+            if (pass == 1) {
+                parallel_segment *segment = context->segments + segment_count;
+                segment->start_psb = start_psb;
+                segment->end_psb = i;
+                segment->start = trace_buffer + index->psbs[start_psb].resume_offset;
+            }
+
+            segment_count++;
+            start_psb = i;
+        }
+
+        if (pass == 0) {
+            context->segment_count = segment_count;
+            if (!(context->segments = calloc(segment_count, sizeof(parallel_segment)))) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+int ha_parallel_decode(ha_session_t session, uint32_t thread_count, ha_hive_on_block_function *on_block_function,
+                       void *context) {
+    return ha_parallel_decode_with_segment_size(session, thread_count, HA_PARALLEL_DECODE_SEGMENT_SIZE,
+                                                on_block_function, context);
+}
+
+int ha_parallel_decode_with_segment_size(ha_session_t session, uint32_t thread_count, uint64_t segment_size,
+                                         ha_hive_on_block_function *on_block_function, void *context_) {
+    int result = -HA_PT_DECODER_INTERNAL;
+    parallel_context context = {0};
+    parallel_worker *workers = NULL;
+    uint32_t worker_count = 0;
+    pthread_t *threads = NULL;
+    uint32_t threads_started = 0;
+
+    pthread_mutex_init(&context.lock, NULL);
+    pthread_cond_init(&context.progress, NULL);
+
+    if (!(session && on_block_function && session->decoder->pt_buffer)) {
+        goto CLEANUP;
+    }
+
+    if (session->decoder->pt_buffer_wrapped) {
+        //Wrapped traces can't be indexed, so they are decoded on this thread
+        result = ha_session_decode(session, on_block_function, context_);
+        goto CLEANUP;
+    }
+
+    const uint8_t *trace_buffer = session->decoder->pt_buffer;
+    if (ha_pt_decoder_psb_index_alloc(&context.index, trace_buffer, session->decoder->pt_buffer_length)) {
+        printf(TAG "Could not index the trace\n");
+        goto CLEANUP;
+    }
+
+    if (!context.index->psb_count) {
+        result = -HA_PT_DECODER_COULD_NOT_SYNC;
+        goto CLEANUP;
+    }
+
+    if (!split_segments(&context, trace_buffer, segment_size)) {
+        printf(TAG "Out of memory\n");
+        goto CLEANUP;
+    }
+
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    if (thread_count > context.segment_count) {
+        thread_count = context.segment_count;
+    }
+
+    context.in_flight_limit = (uint64_t) thread_count * HA_PARALLEL_DECODE_SEGMENTS_IN_FLIGHT;
+
+    if (!(workers = calloc(thread_count, sizeof(parallel_worker)))) {
+        printf(TAG "Out of memory\n");
+        goto CLEANUP;
+    }
+
+    for (; worker_count < thread_count; worker_count++) {
+        workers[worker_count].context = &context;
+        if (ha_session_alloc_copy(&workers[worker_count].session, session)) {
+            printf(TAG "Could not copy the session\n");
+            goto CLEANUP;
+        }
+    }
+
+    //This thread delivers segments in order as they are finished, helping with decoding while it waits, alongside
+    //however many extra workers we manage to start.
+    if (thread_count > 1 && (threads = calloc(thread_count - 1, sizeof(pthread_t)))) {
+        for (; threads_started < thread_count - 1; threads_started++) {
+            if (pthread_create(threads + threads_started, NULL, parallel_worker_main, workers + threads_started + 1)) {
+                break;
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i < context.segment_count; i++) {
+        parallel_segment *segment = context.segments + i;
+        while (!__atomic_load_n(&segment->done, __ATOMIC_ACQUIRE)) {
+            if (decode_next_segment(workers)) {
+                continue;
+            }
+
+            //Another thread is decoding the segment, so we sleep until it (or any segment we could help with) is done
+            pthread_mutex_lock(&context.lock);
+            while (!__atomic_load_n(&segment->done, __ATOMIC_ACQUIRE) && !can_claim_segment(&context)) {
+                pthread_cond_wait(&context.progress, &context.lock);
+            }
+            pthread_mutex_unlock(&context.lock);
+        }
+
+        if (segment->out_of_memory) {
+            printf(TAG "Out of memory\n");
+            result = -HA_PT_DECODER_INTERNAL;
+            goto CLEANUP;
+        }
+
+        //The first segment has nothing before it to overlap with
+        deliver_segment(session, segment, i ? segment->overlap_count : 0, on_block_function, context_);
+
+        free(segment->reports);
+        free(segment->switches);
+        segment->reports = NULL;
+        segment->switches = NULL;
+        __atomic_store_n(&context.delivered_count, i + 1, __ATOMIC_RELEASE);
+        notify_progress(&context);
+
+        //Every segment but the last ends early, so only errors stop us
+        result = segment->status;
+        if (result < 0 && result != -HA_PT_DECODER_END_OF_STREAM) {
+            goto CLEANUP;
+        }
+    }
+
+    CLEANUP:
+    //Workers may still be decoding if we bailed out early, so stop handing out segments and wait for them
+    __atomic_store_n(&context.next_segment, context.segment_count, __ATOMIC_RELAXED);
+    notify_progress(&context);
+
+    for (uint32_t i = 0; i < threads_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (uint64_t i = 0; i < context.segment_count; i++) {
+        free(context.segments[i].reports);
+        free(context.segments[i].switches);
+    }
+
+    for (uint32_t i = 0; i < worker_count; i++) {
+        ha_session_free(workers[i].session);
+    }
+
+    free(threads);
+    free(workers);
+    free(context.segments);
+    ha_pt_decoder_psb_index_free(context.index);
+    pthread_cond_destroy(&context.progress);
+    pthread_mutex_destroy(&context.lock);
+    return result;
+}
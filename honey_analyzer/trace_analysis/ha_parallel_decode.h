@@ -0,0 +1,51 @@
+//
+// Created by Allison Husain on 4/2/21.
+//
+
+#ifndef HONEY_ANALYZER_HA_PARALLEL_DECODE_H
+#define HONEY_ANALYZER_HA_PARALLEL_DECODE_H
+
+#include <stdint.h>
+#include "ha_session.h"
+
+/**
+ * The number of trace bytes which are decoded as a unit. Segments are split at the first PSB past this many bytes, so
+ * traces with sparse PSBs have larger segments.
+ */
+#define HA_PARALLEL_DECODE_SEGMENT_SIZE (256LLU * 1024)
+
+/**
+ * The number of segments, per thread, which may be decoded ahead of the segment being delivered. Decoded segments are
+ * buffered until they are delivered so this bounds memory use.
+ */
+#define HA_PARALLEL_DECODE_SEGMENTS_IN_FLIGHT 4
+
+/**
+ * Decodes a session's trace on several threads and calls a function on each block, in trace order, on the calling
+ * thread. The trace is split into segments at PSBs (see ha_session_decode_window) and each segment is decoded by its
+ * own copy of the session (see ha_session_alloc_copy). Blocks which neighbouring segments both report are reported
+ * once, so the blocks reported are the same as those reported by ha_session_decode. The one exception is a trace
+ * which was already enabled at its first PSB: decoding starts at the IP the PSB+ header gives instead of at the first
+ * TIP. Traces which are split in two segments can't be split at PSBs and are decoded on the calling thread.
+ *
+ * The session passed to on_block_function is the given session. ha_session_get_current_image reports the image of
+ * each block as usual, but no other state of the session is meaningful during the callback.
+ * @param session A session which has been configured with a trace
+ * @param thread_count The number of threads to decode with, including the calling thread
+ * @param on_block_function A callback function which will be invoked for each block
+ * @param context An arbitrary pointer which will be passed to the on_block_function
+ * @return A negative code on error. An end-of-stream error is the expected exit code.
+ */
+int ha_parallel_decode(ha_session_t session, uint32_t thread_count, ha_hive_on_block_function *on_block_function,
+                       void *context);
+
+/**
+ * Decodes a session's trace on several threads like ha_parallel_decode, but with segments of at least segment_size
+ * bytes instead of HA_PARALLEL_DECODE_SEGMENT_SIZE. Small segments are mostly useful for testing, since every PSB
+ * then starts a segment.
+ * @param segment_size The smallest number of trace bytes to decode as a unit
+ */
+int ha_parallel_decode_with_segment_size(ha_session_t session, uint32_t thread_count, uint64_t segment_size,
+                                         ha_hive_on_block_function *on_block_function, void *context);
+
+#endif //HONEY_ANALYZER_HA_PARALLEL_DECODE_H
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <stdbool.h>
 
 #include "ha_session.h"
 #include "ha_session_internal.h"
@@ -24,22 +25,97 @@
  */
 #define LO32(x) ((uint32_t)(x))
 
-int ha_session_alloc(ha_session_t *session_out, hb_hive *hive) {
+/**
+ * Makes an image the session's current image
+ */
+static inline void set_current_image(ha_session *session, ha_session_image *image) {
+    session->current_image = image;
+    session->hive = image->hive;
+    session->trace_slide = image->trace_slide;
+}
+
+/**
+ * Sorts the session's images by start address so that they can be binary searched and resets the current image to
+ * the primary image.
+ * @return Zero on success, negative if any images overlap
+ */
+static int sort_images(ha_session *session) {
+    //Sessions only ever hold a handful of images, so a simple insertion sort will do
+    for (uint64_t i = 1; i < session->image_count; i++) {
+        ha_session_image image = session->images[i];
+        uint64_t j = i;
+        while (j > 0 && session->images[j - 1].start > image.start) {
+            session->images[j] = session->images[j - 1];
+            j--;
+        }
+        session->images[j] = image;
+    }
+
+    for (uint64_t i = 0; i < session->image_count; i++) {
+        ha_session_image *image = &session->images[i];
+        if (i + 1 < session->image_count && image->start + image->size > session->images[i + 1].start) {
+            return -4;
+        }
+
+        if (image->bundle_index == 0) {
+            set_current_image(session, image);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Finds the session image with a given bundle index
+ */
+static ha_session_image *get_image_by_bundle_index(ha_session *session, uint64_t bundle_index) {
+    for (uint64_t i = 0; i < session->image_count; i++) {
+        if (session->images[i].bundle_index == bundle_index) {
+            return &session->images[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Creates a session which decodes through a set of images
+ */
+static int alloc_with_images(ha_session_t *session_out, hb_hive_bundle_image *images, uint64_t image_count) {
     int result = 0;
+    ha_session *session = NULL;
 
-    if (!(session_out)) {
+    if (!(session_out && images && image_count)) {
         //Invalid argument
         result = -1;
         goto CLEANUP;
     }
 
-    ha_session *session = calloc(1, sizeof(ha_session));
+    session = calloc(1, sizeof(ha_session));
     if (!session) {
         result = -2;
         goto CLEANUP;
     }
 
-    session->hive = hive;
+    session->images = calloc(image_count, sizeof(ha_session_image));
+    if (!session->images) {
+        result = -2;
+        goto CLEANUP;
+    }
+
+    session->image_count = image_count;
+    for (uint64_t i = 0; i < image_count; i++) {
+        ha_session_image *image = &session->images[i];
+        image->hive = images[i].hive;
+        image->trace_slide = images[i].trace_slide;
+        image->start = image->trace_slide + image->hive->uvip_slide;
+        image->size = image->hive->direct_map_count;
+        image->bundle_index = i;
+    }
+
+    if ((result = sort_images(session))) {
+        goto CLEANUP;
+    }
 
     session->decoder = ha_pt_decoder_alloc();
     if (!session->decoder) {
@@ -63,18 +139,123 @@ int ha_session_alloc(ha_session_t *session_out, hb_hive *hive) {
     return result;
 }
 
-int ha_session_reconfigure_with_terminated_trace_buffer(ha_session_t session, uint8_t *trace_buffer,
-                                                        uint64_t trace_length, uint64_t trace_slide) {
+int ha_session_alloc(ha_session_t *session_out, hb_hive *hive) {
+    if (!hive) {
+        return -1;
+    }
+
+    //The slide is provided when the session is configured with a trace
+    hb_hive_bundle_image image = {
+            .hive = hive,
+            .trace_slide = 0,
+    };
+
+    return alloc_with_images(session_out, &image, 1);
+}
+
+int ha_session_alloc_with_bundle(ha_session_t *session_out, hb_hive_bundle *bundle) {
+    if (!bundle) {
+        return -1;
+    }
+
+    return alloc_with_images(session_out, bundle->images, bundle->image_count);
+}
+
+int ha_session_alloc_copy(ha_session_t *session_out, ha_session_t session) {
+    int result;
+    hb_hive_bundle_image *images = NULL;
+    ha_session *copy = NULL;
+
+    if (!(session_out && session)) {
+        return -1;
+    }
+
+    //Our images are sorted by address, but alloc_with_images expects them in bundle order
+    if (!(images = calloc(session->image_count, sizeof(hb_hive_bundle_image)))) {
+        return -2;
+    }
+
+    for (uint64_t i = 0; i < session->image_count; i++) {
+        ha_session_image *image = &session->images[i];
+        images[image->bundle_index].hive = image->hive;
+        images[image->bundle_index].trace_slide = image->trace_slide;
+    }
+
+    if ((result = alloc_with_images(&copy, images, session->image_count))) {
+        goto CLEANUP;
+    }
+
+    copy->skip_chains = session->skip_chains;
+    //A stream's buffer is the original's own carry, so a copy of a streaming session starts unconfigured
+    if (session->decoder->pt_buffer && !session->decoder->is_stream_open) {
+        ha_pt_decoder_reconfigure_with_wrapped_trace(copy->decoder, session->decoder->pt_buffer,
+                                                     session->decoder->pt_buffer_length,
+                                                     session->decoder->pt_buffer_wrapped,
+                                                     session->decoder->pt_buffer_wrapped_length);
+        //If this fails, the original failed to sync too and decodes with either will fail the same way
+        ha_pt_decoder_sync_forward(copy->decoder);
+    }
+
+    *session_out = copy;
+
+    CLEANUP:
+    free(images);
+    return result;
+}
+
+int ha_session_set_image_slide(ha_session_t session, uint64_t bundle_index, uint64_t trace_slide) {
+    ha_session_image *image;
+    if (!session || !(image = get_image_by_bundle_index(session, bundle_index))) {
+        return -1;
+    }
+
+    image->trace_slide = trace_slide;
+    image->start = trace_slide + image->hive->uvip_slide;
+    return sort_images(session);
+}
+
+int ha_session_set_chain_skipping(ha_session_t session, bool enabled) {
+    if (!session) {
+        return -1;
+    }
+
+    session->skip_chains = enabled;
+    return 0;
+}
+
+uint64_t ha_session_get_current_image(ha_session_t session) {
+    return session->current_image->bundle_index;
+}
+
+int ha_session_reconfigure_with_trace_buffer(ha_session_t session, const uint8_t *trace_buffer, uint64_t trace_length,
+                                             uint64_t trace_slide) {
+    return ha_session_reconfigure_with_wrapped_trace_buffer(session, trace_buffer, trace_length, NULL, 0,
+                                                            trace_slide);
+}
+
+int ha_session_reconfigure_with_wrapped_trace_buffer(ha_session_t session, const uint8_t *trace_buffer,
+                                                     uint64_t trace_length, const uint8_t *wrapped_buffer,
+                                                     uint64_t wrapped_length, uint64_t trace_slide) {
+    int result;
     if (!(session && trace_buffer)) {
         return -1;
     }
 
-    session->trace_slide = trace_slide;
-    ha_pt_decoder_reconfigure_with_trace(session->decoder, trace_buffer, trace_length);
+    if ((result = ha_session_set_image_slide(session, 0, trace_slide))) {
+        return result;
+    }
+
+    ha_pt_decoder_reconfigure_with_wrapped_trace(session->decoder, trace_buffer, trace_length, wrapped_buffer,
+                                                 wrapped_length);
 
     return ha_pt_decoder_sync_forward(session->decoder);
 }
 
+int ha_session_reconfigure_with_terminated_trace_buffer(ha_session_t session, uint8_t *trace_buffer,
+                                                        uint64_t trace_length, uint64_t trace_slide) {
+    return ha_session_reconfigure_with_trace_buffer(session, trace_buffer, trace_length, trace_slide);
+}
+
 
 void ha_session_free(ha_session_t session) {
     if (!session) {
@@ -86,85 +267,469 @@ void ha_session_free(ha_session_t session) {
         session->decoder = NULL;
     }
 
+    if (session->images) {
+        free(session->images);
+        session->images = NULL;
+    }
+
     free(session);
 }
 
 /**
- * Initiates a block level trace decode using the session's on_block_function and extra_context
+ * Finds the image which contains a traced virtual address and makes it the current image. This is the slow path of
+ * resolve_target, taken only when a branch leaves the current image.
+ * @return The image or NULL if no image contains the address
+ */
+__attribute__((noinline))
+static ha_session_image *switch_image(ha_session *session, uint64_t address) {
+    uint64_t left = 0, right = session->image_count;
+    while (left < right) {
+        uint64_t search = (left + right) / 2;
+        ha_session_image *image = &session->images[search];
+        if (address < image->start) {
+            right = search;
+        } else if (address - image->start >= image->size) {
+            left = search + 1;
+        } else {
+            set_current_image(session, image);
+            ANALYSIS_LOGGER("\tSwitched to image %"PRIu64"\n", image->bundle_index);
+            return image;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Resolves a traced virtual address to a block index, switching images if the address is not in the current image
+ * @param vip The traced virtual address. On return, this is the slid VIP of the block within its image.
+ * @return The block index or -1 if no image maps the address
+ */
+__attribute__((always_inline))
+static inline int64_t resolve_target(ha_session *session, uint64_t *vip) {
+    ha_session_image *image = session->current_image;
+    if (__builtin_expect(*vip - image->start >= image->size, 0)) {
+        if (!(image = switch_image(session, *vip))) {
+            ANALYSIS_LOGGER("\tNo image maps %p\n", (void *) *vip);
+            return -1;
+        }
+    }
+
+    *vip -= image->trace_slide;
+    int64_t index = hb_hive_virtual_address_to_block_index(image->hive, *vip);
+    *vip -= image->hive->uvip_slide;
+    return index;
+}
+
+/**
+ * Returned by a decode loop when the trace enters an image whose blocks use a different layout. The loop's state is
+ * saved in the session so that the loop for the other layout can pick up where it left off.
+ */
+#define LAYOUT_HANDOFF (INT64_MIN)
+
+/*
+ * The decode loop is written once and specialized for each block layout. These helpers are the only parts which
+ * differ between layouts. layout is always a constant so each one reduces to the code for a single layout.
+ */
+
+/**
+ * Get the part of a block's slid VIP which is significant for a block layout
+ */
+__attribute__((always_inline))
+static inline uint64_t layout_vip(const uint64_t layout, uint64_t vip) {
+    return layout == HB_HIVE_BLOCK_LAYOUT_WIDE ? vip : LO32(vip);
+}
+
+/**
+ * Is a block index outside of a hive?
+ */
+__attribute__((always_inline))
+static inline bool layout_index_is_unmapped(const uint64_t layout, hb_hive *hive, uint64_t index) {
+    //Packed indices still carry the not-taken index in their upper bits when we check them
+    return (layout == HB_HIVE_BLOCK_LAYOUT_PACKED ? LO32(index) : index) >= hive->block_count;
+}
+
+/**
+ * Is a block index the indirect jump marker?
+ */
+__attribute__((always_inline))
+static inline bool layout_index_is_indirect(const uint64_t layout, uint64_t index) {
+    if (layout == HB_HIVE_BLOCK_LAYOUT_PACKED) {
+        return LO32(index) == HB_HIVE_FLAG_INDIRECT_JUMP_INDEX_VALUE;
+    } else if (layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+        return index == HB_HIVE_NARROW_FLAG_INDIRECT_JUMP_INDEX_VALUE;
+    } else {
+        return index == HB_HIVE_WIDE_FLAG_INDIRECT_JUMP_INDEX_VALUE;
+    }
+}
+
+/**
+ * Reads a block. On return, index and vip hold the block's taken successor in whatever form take_taken and
+ * take_not_taken expect.
+ * @return True if the block ends in a conditional branch
+ */
+__attribute__((always_inline))
+static inline bool layout_read_block(const uint64_t layout, uint64_t *blocks, uint64_t *index, uint64_t *vip) {
+    if (layout == HB_HIVE_BLOCK_LAYOUT_PACKED) {
+        /* if we inline both take_conditional and take_indirect and have them both pre-fetched, we can do a branchless increment on the value we consume */
+        *vip = blocks[2 * LO32(*index) + 1];
+        *index = blocks[2 * LO32(*index)];
+        return *index & HB_HIVE_FLAG_IS_CONDITIONAL;
+    } else if (layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+        hm_narrow_block *block = ((hm_narrow_block *) blocks) + *index;
+        *index = block->taken_index;
+        return block->packed_not_taken_delta & HB_HIVE_FLAG_IS_CONDITIONAL;
+    } else {
+        hm_wide_block *block = ((hm_wide_block *) blocks) + *index;
+        *vip = block->taken_uvip;
+        *index = block->packed_taken_index;
+        return *index & HB_HIVE_FLAG_IS_CONDITIONAL;
+    }
+}
+
+/**
+ * Moves to the taken successor of the block read by layout_read_block
+ */
+__attribute__((always_inline))
+static inline void layout_take_taken(const uint64_t layout, uint64_t *blocks, uint64_t *index, uint64_t *vip) {
+    if (layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+        //The hive is validated such that every taken index other than the indirect marker is a block
+        if (*index != HB_HIVE_NARROW_FLAG_INDIRECT_JUMP_INDEX_VALUE) {
+            *vip = ((hm_narrow_block *) blocks)[*index].uvip;
+        }
+    } else {
+        /* cuts off the conditional flag or the zero bit if NT */
+        *index >>= 1;
+    }
+}
+
+/**
+ * Does the unconditional block block_index, read by layout_read_block, hold the end of its chain?
+ */
+__attribute__((always_inline))
+static inline bool layout_skips_chain(const uint64_t layout, uint64_t *blocks, uint64_t block_index, uint64_t index) {
+    //Unconditional blocks which don't skip a chain have a zero not-taken index
+    if (layout == HB_HIVE_BLOCK_LAYOUT_PACKED) {
+        return index >> 33;
+    } else if (layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+        //Narrow blocks have no room for chain ends
+        return false;
+    } else {
+        return ((hm_wide_block *) blocks)[block_index].not_taken_index;
+    }
+}
+
+/**
+ * Moves to the end of the chain of the unconditional block block_index, read by layout_read_block
+ */
+__attribute__((always_inline))
+static inline void layout_take_chain_end(const uint64_t layout, uint64_t *blocks, uint64_t block_index, uint64_t *index,
+                                         uint64_t *vip) {
+    if (layout == HB_HIVE_BLOCK_LAYOUT_PACKED) {
+        //The chain end is stored in place of the not-taken successor
+        *index >>= 33;
+        *vip >>= 32;
+    } else if (layout == HB_HIVE_BLOCK_LAYOUT_WIDE) {
+        hm_wide_block *block = ((hm_wide_block *) blocks) + block_index;
+        *index = block->not_taken_index;
+        *vip = block->not_taken_uvip;
+    }
+}
+
+/**
+ * Moves to the not-taken successor of the conditional block block_index, read by layout_read_block
+ */
+__attribute__((always_inline))
+static inline void layout_take_not_taken(const uint64_t layout, uint64_t *blocks, uint64_t block_index, uint64_t *index,
+                                         uint64_t *vip) {
+    if (layout == HB_HIVE_BLOCK_LAYOUT_PACKED) {
+        *index >>= 33;
+        *vip >>= 32;
+    } else if (layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+        hm_narrow_block *block = ((hm_narrow_block *) blocks) + block_index;
+        *index = block_index + 1;
+        *vip = block->uvip + (block->packed_not_taken_delta >> 1);
+    } else {
+        hm_wide_block *block = ((hm_wide_block *) blocks) + block_index;
+        *index = block->not_taken_index;
+        *vip = block->not_taken_uvip;
+    }
+}
+
+/**
+ * Reports a block to the session's on_block_function
+ * @param last_report The previously reported block, for edge transitions
+ */
+__attribute__((always_inline))
+static inline void report_block(ha_session_t session, const uint64_t layout, uint64_t vip, uint64_t *last_report) {
+#if HA_BLOCK_REPORTS_ARE_EDGE_TRANSITIONS
+    //This is the AFL edge transition function
+    session->on_block_function(session, session->extra_context, (*last_report << 1) ^ layout_vip(layout, vip));
+    *last_report = layout_vip(layout, vip);
+#else
+    (void) last_report;
+    session->on_block_function(session, session->extra_context,
+                               layout_vip(layout, vip) + session->hive->uvip_slide);
+#endif
+}
+
+/**
+ * Initiates a block level trace decode using the session's on_block_function and extra_context. This is specialized
+ * for each block layout so that each hive only pays for its own layout.
  * @param session
- * @return A negative code on error. An end-of-stream error is the expected exit code.
+ * @param layout The block layout this loop handles. This must be a constant.
+ * @return A negative code on error. An end-of-stream error is the expected exit code. LAYOUT_HANDOFF if the trace
+ * entered an image with a different block layout.
  */
-__attribute__ ((hot))
-int64_t block_decode(ha_session_t session) {
+__attribute__((always_inline))
+static inline int64_t block_decode(ha_session_t session, const uint64_t layout) {
     uint64_t index;
     uint64_t vip;
     uint64_t *blocks = session->hive->blocks;
+    uint32_t *transition_rows = session->hive->tnt_transition_rows;
+    hm_tnt_transition *transitions = session->hive->tnt_transitions;
+    ha_pt_decoder_cache *cache = &session->decoder->cache;
+    const bool skip_chains = session->skip_chains;
     int64_t status;
-#if HA_BLOCK_REPORTS_ARE_EDGE_TRANSITIONS
-    uint64_t last_report = 0;
-#endif
+    uint64_t block_index;
+    int64_t result;
+    uint64_t last_report = session->handoff_last_report;
+
+    if (session->handoff_pending) {
+        //Another layout's loop decoded up to (and resolved) a jump into this image
+        session->handoff_pending = false;
+        index = session->handoff_index;
+        vip = session->handoff_vip;
+        status = session->handoff_status;
+        goto RESUME;
+    }
+
+    if (__builtin_expect(session->suspend_point != HA_SESSION_SUSPEND_NONE, 0)) {
+        //A streamed trace ran out in the middle of the decoder's refill for a query, so we finish the refill with the
+        //new chunk and then the query, just as if the trace had never been split
+        ha_session_suspend_point suspend_point = session->suspend_point;
+        session->suspend_point = HA_SESSION_SUSPEND_NONE;
+        int refill_result = ha_pt_decoder_decode_until_caches_filled(session->decoder);
+        if (suspend_point == HA_SESSION_SUSPEND_AT_BRANCH) {
+            //We were inside the loop, so the last indirect query succeeded
+            status = 0;
+            block_index = index = session->suspended_index;
+            layout_read_block(layout, blocks, &index, &vip);
+            result = ha_pt_decoder_cache_query_tnt_after_refill(session->decoder, refill_result, &vip);
+            goto BRANCH_RESULT;
+        }
+
+        status = ha_pt_decoder_cache_query_indirect_after_refill(session->decoder, refill_result, &vip);
+        goto INDIRECT_RESULT;
+    }
 
     //We need to take an indirect jump since we currently don't have a starting state
     goto TRACE_INIT;
     while (status >= 0) {
-#if HA_BLOCK_REPORTS_ARE_EDGE_TRANSITIONS
-        //This is the AFL edge transition function
-        uint64_t report = (last_report << 1) ^LO32(vip);
-        session->on_block_function(session, session->extra_context, report);
-        last_report = LO32(vip);
-#else
-        session->on_block_function(session, session->extra_context, LO32(vip) + session->hive->uvip_slide);
-#endif
+        RESUME:
+        report_block(session, layout, vip, &last_report);
 
-        if (LO32(index) >= session->hive->block_count) {
-            ANALYSIS_LOGGER("\tNo map error, index = %"PRIu32", block count = %"PRIu64"\n", LO32(index),
+        if (layout_index_is_unmapped(layout, session->hive, index)) {
+            ANALYSIS_LOGGER("\tNo map error, index = %"PRIu64", block count = %"PRIu64"\n", index,
                             session->hive->block_count);
             return -HA_PT_DECODER_NO_MAP;
         }
 
-        /* if we inline both take_conditional and take_indirect and have them both pre-fetched, we can do a branchless increment on the value we consume */
-        vip = blocks[2 * LO32(index) + 1];
-        index = blocks[2 * LO32(index)];
+        uint32_t row;
+        if (layout != HB_HIVE_BLOCK_LAYOUT_WIDE && transition_rows
+            && (row = transition_rows[LO32(index)]) != HB_HIVE_TNT_TRANSITION_NO_ROW
+            && ha_pt_decoder_cache_tnt_count(cache) >= HB_HIVE_TNT_TRANSITION_BITS) {
+            //Every TNT we might need is already cached (and so can't be overridden), so follow them all at once
+            uint32_t tnts = ha_pt_decoder_cache_tnt_peek_bits(cache, HB_HIVE_TNT_TRANSITION_BITS);
+            hm_tnt_transition *transition = transitions + ((uint64_t) row << HB_HIVE_TNT_TRANSITION_BITS) + tnts;
+            uint32_t last = transition->tnt_count - 1;
+            ha_pt_decoder_cache_tnt_drop(cache, transition->tnt_count);
+            for (uint32_t i = 0; i < last; i++) {
+                report_block(session, layout, transition->uvips[i], &last_report);
+            }
 
-        if (index & HB_HIVE_FLAG_IS_CONDITIONAL) {
-            uint64_t result = ha_pt_decoder_cache_query_tnt(session->decoder, &vip);
+            index = transition->end_index;
+            vip = transition->uvips[last];
+            ANALYSIS_LOGGER("\tTNT transition %x consumed %u\n", tnts, transition->tnt_count);
+            continue;
+        }
+
+        block_index = index;
+        if (layout_read_block(layout, blocks, &index, &vip)) {
+            result = ha_pt_decoder_cache_query_tnt(session->decoder, &vip);
+            BRANCH_RESULT:
             if (result == 2 /* override */) {
                 ANALYSIS_LOGGER("\tTNT result = 2: override destination to %p\n", (void *) vip);
-                vip -= session->trace_slide;
-                index = hb_hive_virtual_address_to_block_index(session->hive, vip);
+                index = resolve_target(session, &vip);
+                blocks = session->hive->blocks;
+                transition_rows = session->hive->tnt_transition_rows;
+                transitions = session->hive->tnt_transitions;
+                if (__builtin_expect(session->hive->block_layout != layout, 0)) {
+                    goto HANDOFF;
+                }
+                continue;
             } else if (result == 1 /* taken */) {
-                index >>= 1;
-                ANALYSIS_LOGGER("\tTNT result = 1: vip = %p\n",
-                                (void *) (uint64_t) (LO32(vip)) + session->hive->uvip_slide);
+                layout_take_taken(layout, blocks, &index, &vip);
             } else if (result == 0 /* not taken */) {
-                index >>= 33;
-                vip >>= 32;
-                ANALYSIS_LOGGER("\tTNT result = 0: vip = %p\n",
-                                (void *) (uint64_t) (LO32(vip)) + session->hive->uvip_slide);
+                layout_take_not_taken(layout, blocks, block_index, &index, &vip);
+            } else {
+                ANALYSIS_LOGGER("\tTNT error = %"PRId64"\n", result);
+                if (result == -HA_PT_DECODER_NEED_MORE_TRACE) {
+                    session->suspend_point = HA_SESSION_SUSPEND_AT_BRANCH;
+                    session->suspended_index = block_index;
+#if HA_BLOCK_REPORTS_ARE_EDGE_TRANSITIONS
+                    session->handoff_last_report = last_report;
+#endif
+                }
+                return result;
             }
+            ANALYSIS_LOGGER("\tTNT result = %"PRId64"\n", result);
+        } else if (skip_chains && layout_skips_chain(layout, blocks, block_index, index)) {
+            /* direct, and so are the blocks which follow until the chain end */
+            layout_take_chain_end(layout, blocks, block_index, &index, &vip);
         } else {
-            /* taken or direct -- cuts off the conditional flag or the zero bit if NT */
-            index >>= 1;
+            /* taken or direct */
+            layout_take_taken(layout, blocks, &index, &vip);
+        }
+
+        if (!layout_index_is_indirect(layout, index)) {
+            continue;
+        }
+
+        TRACE_INIT:
+        status = ha_pt_decoder_cache_query_indirect(session->decoder, &vip);
+        INDIRECT_RESULT:
+        if (__builtin_expect(status < 0, 0)) {
+            //There's no target, so we mustn't switch images trying to resolve one
+            break;
         }
 
-        if (LO32(index) == HB_HIVE_FLAG_INDIRECT_JUMP_INDEX_VALUE) {
-            TRACE_INIT:
-            status = ha_pt_decoder_cache_query_indirect(session->decoder, &vip);
-            vip -= session->trace_slide;
-            index = hb_hive_virtual_address_to_block_index(session->hive, vip);
-            vip -= session->hive->uvip_slide;
-            ANALYSIS_LOGGER("\tIndirect: vip = %p\n", (void *) (uint64_t) (LO32(vip)));
+        //Other than overrides, indirect branches are the only way to leave an image
+        index = resolve_target(session, &vip);
+        blocks = session->hive->blocks;
+        transition_rows = session->hive->tnt_transition_rows;
+        transitions = session->hive->tnt_transitions;
+        ANALYSIS_LOGGER("\tIndirect: vip = %p\n", (void *) layout_vip(layout, vip));
+        if (__builtin_expect(session->hive->block_layout != layout, 0)) {
+            goto HANDOFF;
         }
     }
 
+    if (status == -HA_PT_DECODER_NEED_MORE_TRACE) {
+        session->suspend_point = HA_SESSION_SUSPEND_AT_INDIRECT;
+#if HA_BLOCK_REPORTS_ARE_EDGE_TRANSITIONS
+        session->handoff_last_report = last_report;
+#endif
+    }
+
     return status;
+
+    HANDOFF:
+    //We just jumped into an image which this loop can't walk
+    session->handoff_pending = true;
+    session->handoff_index = index;
+    session->handoff_vip = vip;
+    session->handoff_status = status;
+#if HA_BLOCK_REPORTS_ARE_EDGE_TRANSITIONS
+    session->handoff_last_report = last_report;
+#endif
+    return LAYOUT_HANDOFF;
+}
+
+__attribute__ ((hot))
+static int64_t block_decode_packed(ha_session_t session) {
+    return block_decode(session, HB_HIVE_BLOCK_LAYOUT_PACKED);
+}
+
+__attribute__ ((hot))
+static int64_t block_decode_narrow(ha_session_t session) {
+    return block_decode(session, HB_HIVE_BLOCK_LAYOUT_NARROW);
+}
+
+__attribute__ ((hot))
+static int64_t block_decode_wide(ha_session_t session) {
+    return block_decode(session, HB_HIVE_BLOCK_LAYOUT_WIDE);
+}
+
+/**
+ * Runs the decode loops, picking up from wherever the session's state says the last one stopped
+ */
+static int run_decode_loops(ha_session_t session) {
+    int64_t result;
+    do {
+        //Bundles can mix layouts, so we bounce between the loops whenever the trace crosses between them
+        if (session->hive->block_layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+            result = block_decode_narrow(session);
+        } else if (session->hive->block_layout == HB_HIVE_BLOCK_LAYOUT_WIDE) {
+            result = block_decode_wide(session);
+        } else {
+            result = block_decode_packed(session);
+        }
+    } while (result == LAYOUT_HANDOFF);
+
+    return (int) result;
 }
 
 int ha_session_decode(ha_session_t session, ha_hive_on_block_function *on_block_function, void *context) {
     session->on_block_function = on_block_function;
     session->extra_context = context;
+    session->handoff_pending = false;
+    session->suspend_point = HA_SESSION_SUSPEND_NONE;
+#if HA_BLOCK_REPORTS_ARE_EDGE_TRANSITIONS
+    session->handoff_last_report = 0;
+#endif
+
+    return run_decode_loops(session);
+}
+
+int ha_session_reconfigure_with_stream(ha_session_t session, uint64_t trace_slide) {
+    int result;
+    if (!session) {
+        return -1;
+    }
+
+    if ((result = ha_session_set_image_slide(session, 0, trace_slide))) {
+        return result;
+    }
+
+    ha_pt_decoder_reconfigure_with_stream(session->decoder);
+    session->handoff_pending = false;
+    session->suspend_point = HA_SESSION_SUSPEND_NONE;
+#if HA_BLOCK_REPORTS_ARE_EDGE_TRANSITIONS
+    session->handoff_last_report = 0;
+#endif
+
+    return 0;
+}
+
+int ha_session_decode_stream(ha_session_t session, const uint8_t *chunk, uint64_t chunk_length,
+                             ha_hive_on_block_function *on_block_function, void *context) {
+    session->on_block_function = on_block_function;
+    session->extra_context = context;
+
+    int result = ha_pt_decoder_push_stream_chunk(session->decoder, chunk, chunk_length);
+    if (!result) {
+        result = run_decode_loops(session);
+    }
+
+    if (result == -HA_PT_DECODER_NEED_MORE_TRACE) {
+        //We're done with the chunk, so we hold on to whatever is left of it ourselves
+        ha_pt_decoder_retain_stream_chunk(session->decoder);
+    }
+
+    return result;
+}
+
+int ha_session_decode_window(ha_session_t session, const ha_pt_decoder_psb_index *index, uint64_t start_psb,
+                             uint64_t end_psb, ha_hive_on_block_function *on_block_function, void *context) {
+    if (!(session && index) || index->trace_length != session->decoder->pt_buffer_length
+        || session->decoder->pt_buffer_wrapped || start_psb >= end_psb || end_psb > index->psb_count) {
+        return -HA_PT_DECODER_COULD_NOT_SYNC;
+    }
 
-    return block_decode(session);
+    uint64_t end_offset = end_psb < index->psb_count ? index->psbs[end_psb].offset : index->trace_length;
+    ha_pt_decoder_seek_to_psb(session->decoder, &index->psbs[start_psb], end_offset);
+    return ha_session_decode(session, on_block_function, context);
 }
 
 //int c = 0;
@@ -7,7 +7,10 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include "../../honeybee_shared/hb_hive.h"
+#include "../../honeybee_shared/hb_hive_bundle.h"
+#include "../processor_trace/ha_pt_decoder.h"
 
 typedef struct internal_ha_session *ha_session_t;
 
@@ -24,15 +27,85 @@ typedef void (ha_hive_on_block_function)(ha_session_t session, void *context, ui
  */
 int ha_session_alloc(ha_session_t *session_out, hb_hive *hive);
 
+/**
+ * Create a new trace session which decodes through every image in a bundle. Indirect branches into any image of the
+ * bundle continue decoding in that image.
+ * @param session_out The location to place a pointer to the created session. On error, left unchanged.
+ * @param bundle The bundle to use for decoding. The bundle is NOT owned by the session and must outlive it. Images
+ * added to the bundle after the session is created are not visible to the session.
+ * @return Error code. On success, zero is returned
+ */
+int ha_session_alloc_with_bundle(ha_session_t *session_out, hb_hive_bundle *bundle);
+
+/**
+ * Create a new trace session which decodes through the same images, with the same slides and settings, as another.
+ * If the other session has a trace, the new session is configured with the same trace buffer, synced to its first PSB.
+ * A session which is in the middle of decoding a stream is copied without a trace.
+ * Since sessions only read their hives, this is how several threads can decode with the same hives at once.
+ * @param session_out The location to place a pointer to the created session. On error, left unchanged.
+ * @param session The session to copy. It must outlive the copy if it does not own its hives.
+ * @return Error code. On success, zero is returned
+ */
+int ha_session_alloc_copy(ha_session_t *session_out, ha_session_t session);
+
+/**
+ * Changes the base address of an image for future traces. This is useful when the traced process is re-launched
+ * with a different ASLR layout.
+ * @param bundle_index The index of the image in the session's bundle. Single hive sessions have one image, zero.
+ * @param trace_slide The base address of the image in the traced process
+ * @return Error code. On success, zero is returned. Images may not overlap.
+ */
+int ha_session_set_image_slide(ha_session_t session, uint64_t bundle_index, uint64_t trace_slide);
+
+/**
+ * Enables or disables skipping chains of direct unconditional blocks. Hives generated with chain skips (see
+ * honey_hive_generator -s) mark where each chain ends so that the decoder can jump straight to the next block which
+ * needs the trace. Only the first block of each chain is reported, so consumers which need every block (such as
+ * coverage) should leave this disabled, which is the default. Hives without chain skips are unaffected.
+ * @return Error code. On success, zero is returned
+ */
+int ha_session_set_chain_skipping(ha_session_t session, bool enabled);
+
+/**
+ * Gets the image which the most recently reported block belongs to. Block callbacks for bundle sessions use this to
+ * tell which image an unslid IP refers to.
+ * @return The index of the image in the session's bundle. Single hive sessions always return zero.
+ */
+uint64_t ha_session_get_current_image(ha_session_t session);
+
 
 /**
  * (Re)configures the session with a new trace. This is a zero allocation operation.
  * @param trace_buffer The pointer to the start of the buffer containing the trace data. NOTE: This pointer is NOT
- * owned by the session, you are responsible for destroying it.
- * @param trace_length The length of the trace (read: NOT THE BUFFER ITSELF). The actual length of the buffer must be
- * @param trace_slide The base address of the binary for this trace in memory
+ * owned by the session, you are responsible for destroying it. The buffer is only ever read, so it may be a read-only
+ * mapping of a trace file.
+ * @param trace_length The length of the trace
+ * @param trace_slide The base address of the binary for this trace in memory. For bundle sessions, this is the base
+ * address of the primary image (the first image in the bundle).
+ * @return Error code. On success, zero is returned
+ */
+int ha_session_reconfigure_with_trace_buffer(ha_session_t session, const uint8_t *trace_buffer, uint64_t trace_length,
+                                             uint64_t trace_slide);
+
+/**
+ * (Re)configures the session with a trace which is split in two segments, such as a ring buffer which has wrapped
+ * around. See ha_pt_decoder_reconfigure_with_wrapped_trace. This is a zero allocation operation.
+ * @param trace_buffer The first (older) segment of the trace
+ * @param trace_length The length of the first segment
+ * @param wrapped_buffer The second (newer) segment of the trace
+ * @param wrapped_length The length of the second segment
+ * @param trace_slide The base address of the binary for this trace in memory. For bundle sessions, this is the base
+ * address of the primary image (the first image in the bundle).
  * @return Error code. On success, zero is returned
  */
+int ha_session_reconfigure_with_wrapped_trace_buffer(ha_session_t session, const uint8_t *trace_buffer,
+                                                     uint64_t trace_length, const uint8_t *wrapped_buffer,
+                                                     uint64_t wrapped_length, uint64_t trace_slide);
+
+/**
+ * (Re)configures the session with a new trace. Traces no longer need a stop codon after them, so this is the same as
+ * ha_session_reconfigure_with_trace_buffer and is kept for existing callers.
+ */
 int ha_session_reconfigure_with_terminated_trace_buffer(ha_session_t session, uint8_t *trace_buffer,
                                                         uint64_t trace_length, uint64_t trace_slide);
 
@@ -50,6 +123,49 @@ void ha_session_free(ha_session_t session);
  */
 int ha_session_decode(ha_session_t, ha_hive_on_block_function *on_block_function, void *context);
 
+/**
+ * (Re)configures the session to decode a trace which arrives in chunks, such as from a pipe, a file read loop, or a
+ * capture buffer which is drained while tracing. Decode it by passing each chunk to ha_session_decode_stream as it
+ * arrives. This is a zero allocation operation.
+ * @param trace_slide The base address of the binary for this trace in memory. For bundle sessions, this is the base
+ * address of the primary image (the first image in the bundle).
+ * @return Error code. On success, zero is returned
+ */
+int ha_session_reconfigure_with_stream(ha_session_t session, uint64_t trace_slide);
+
+/**
+ * Decodes the next chunk of a streamed trace and calls a function on each block. Packets and branches which straddle
+ * chunks are picked up where the last chunk left off, so the blocks reported are the same as if the whole trace had
+ * been decoded by ha_session_decode. The chunk's buffer is not needed once this returns, and the session's memory use
+ * does not grow with the trace.
+ * @param chunk The next chunk of the trace. Pass NULL once the trace has ended to decode the rest of it.
+ * @param chunk_length The length of the chunk
+ * @param on_block_function A callback function which will be invoked for each block
+ * @param context An arbitrary pointer which will be passed to the on_block_function
+ * @return -HA_PT_DECODER_NEED_MORE_TRACE once everything which can be decoded has been. Once the trace has ended, an
+ * end-of-stream error is the expected exit code. Other negative codes are errors, after which the stream can't be
+ * decoded any further.
+ */
+int ha_session_decode_stream(ha_session_t session, const uint8_t *chunk, uint64_t chunk_length,
+                             ha_hive_on_block_function *on_block_function, void *context);
+
+/**
+ * Decodes only the part of the session's trace between two of its PSBs and calls a function on each block. Decoding
+ * starts from the state recorded for the first PSB rather than by replaying the trace before it, so windows can be
+ * decoded in any order (or skipped entirely). Decoding starts at the IP where the first PSB was emitted, so the blocks
+ * from there up to the first branch which needs the trace are also reported by the end of the window before it.
+ * The session's decoder is left at the end of the window. Only traces which are in one piece can be windowed.
+ * @param index The PSB index of the session's trace, see ha_pt_decoder_psb_index_alloc
+ * @param start_psb The index of the PSB which starts the window
+ * @param end_psb The index of the PSB which ends the window. This PSB is not decoded. Pass the index's psb_count to
+ * decode through the end of the trace.
+ * @param on_block_function A callback function which will be invoked for each block
+ * @param context An arbitrary pointer which will be passed to the on_block_function
+ * @return A negative code on error. An end-of-stream error is the expected exit code.
+ */
+int ha_session_decode_window(ha_session_t session, const ha_pt_decoder_psb_index *index, uint64_t start_psb,
+                             uint64_t end_psb, ha_hive_on_block_function *on_block_function, void *context);
+
 /**
  * Debug function. Walks the trace and dumps to the console.
  * @return A negative code on error. An end-of-stream error is the expected exit code.
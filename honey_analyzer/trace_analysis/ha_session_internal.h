@@ -5,8 +5,53 @@
 #ifndef HONEY_ANALYZER_HA_SESSION_INTERNAL_H
 #define HONEY_ANALYZER_HA_SESSION_INTERNAL_H
 
+#include <stdbool.h>
+
 #include "../processor_trace/ha_pt_decoder.h"
 #include "../../honeybee_shared/hb_hive.h"
+#include "../../honeybee_shared/hb_hive_bundle.h"
+
+/**
+ * A binary image which a session can decode through
+ */
+typedef struct {
+    /**
+     * The hive for this image
+     */
+    hb_hive *hive;
+
+    /**
+     * The base address of this image in the traced process
+     */
+    uint64_t trace_slide;
+
+    /**
+     * The first traced virtual address covered by the image's hive (trace_slide + uvip_slide)
+     */
+    uint64_t start;
+
+    /**
+     * The number of bytes covered by the image's hive, starting at start
+     */
+    uint64_t size;
+
+    /**
+     * The index of this image in the bundle (or zero for single hive sessions)
+     */
+    uint64_t bundle_index;
+} ha_session_image;
+
+/**
+ * Where a decode loop stopped when a streamed trace ran out
+ */
+typedef enum {
+    /** The loop was not stopped. It starts by taking an indirect jump to find its first block. */
+    HA_SESSION_SUSPEND_NONE = 0,
+    /** The loop stopped querying the conditional branch of the block suspended_index */
+    HA_SESSION_SUSPEND_AT_BRANCH = 1,
+    /** The loop stopped querying an indirect jump */
+    HA_SESSION_SUSPEND_AT_INDIRECT = 2,
+} ha_session_suspend_point;
 
 /**
  * This is the internal representation of an ha_session. This is exposed in a separate header for custom loggers. If
@@ -19,15 +64,30 @@ typedef struct internal_ha_session {
     ha_pt_decoder_t decoder;
 
     /**
-     * The hive to use for decoding traces
+     * The hive of the image currently being decoded
      */
     hb_hive *hive;
 
     /**
-     * The (for now) global slide. This is the base address of the traced binary during the current trace
+     * The base address of the image currently being decoded
      */
     uint64_t trace_slide;
 
+    /**
+     * The images which this session can decode through, sorted by start address
+     */
+    ha_session_image *images;
+
+    /**
+     * The number of images
+     */
+    uint64_t image_count;
+
+    /**
+     * The image currently being decoded. hive and trace_slide mirror this image.
+     */
+    ha_session_image *current_image;
+
     /**
      * The function called by this session when a block is decoded
     */
@@ -37,6 +97,29 @@ typedef struct internal_ha_session {
      * An addition field which custom decoders can use
      */
     void *extra_context;
+
+    /**
+     * Jump straight to the end of chains of direct unconditional blocks in hives which mark them. The blocks within a
+     * chain are not reported.
+     */
+    bool skip_chains;
+
+    /**
+     * Set when a decode loop stopped at a jump into an image with a different block layout. The handoff fields hold
+     * the loop's state so that the loop for the other layout can resume from the jump's target.
+     */
+    bool handoff_pending;
+    uint64_t handoff_index;
+    uint64_t handoff_vip;
+    int64_t handoff_status;
+    uint64_t handoff_last_report;
+
+    /**
+     * Set when a decode loop ran out of a streamed trace in the middle of a query. Once the next chunk arrives, the
+     * loop finishes the query and carries on walking from there. The last report is kept in handoff_last_report.
+     */
+    ha_session_suspend_point suspend_point;
+    uint64_t suspended_index;
 } ha_session;
 
 #endif //HONEY_ANALYZER_HA_SESSION_INTERNAL_H
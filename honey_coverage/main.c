@@ -16,6 +16,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <sched.h>
 #include <sys/ptrace.h>
 #include <sys/personality.h>
@@ -148,6 +149,20 @@ int main(int argc, const char * argv[]) {
     pin_process_to_cpu(pid, 0);
 //    printf(TAGI "Spawned process %d\n", pid);
 
+    //Virtually addressed hives know where the binary wants to be loaded, so we can find the slide ourselves
+    uint64_t trace_slide = filter_start_address;
+    if (hive->address_kind == HB_HIVE_ADDRESS_KIND_VIRTUAL) {
+        char maps_path[64];
+        char binary_path[PATH_MAX];
+        snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", pid);
+        if (!realpath(target_binary, binary_path)
+            || hb_hive_get_trace_slide_from_maps(hive, maps_path, binary_path, &trace_slide)) {
+            printf(TAGE "Could not find the trace slide of %s\n", target_binary);
+            result = 1;
+            goto CLEANUP;
+        }
+    }
+
     ha_capture_session_range_filter filters[4];
     bzero(&filters, sizeof(ha_capture_session_range_filter) * 4);
     filters[0].enabled = 1;
@@ -175,17 +190,17 @@ int main(int argc, const char * argv[]) {
         goto CLEANUP;
     }
 
-    uint8_t *terminated_buffer = NULL;
+    const uint8_t *trace_buffer = NULL;
     uint64_t buffer_length = 0;
-    if ((result = ha_capture_get_trace(capture_session, &terminated_buffer, &buffer_length)) < 0) {
+    if ((result = ha_capture_get_trace_read_only(capture_session, &trace_buffer, &buffer_length)) < 0) {
         printf(TAGE "Failed to get trace buffer, error = %d\n", result);
         goto CLEANUP;
     }
 
-    if ((result = ha_session_reconfigure_with_terminated_trace_buffer(session,
-                                                                      terminated_buffer,
-                                                                      buffer_length,
-                                                                      filter_start_address)) < 0) {
+    if ((result = ha_session_reconfigure_with_trace_buffer(session,
+                                                           trace_buffer,
+                                                           buffer_length,
+                                                           trace_slide)) < 0) {
         printf(TAGE "Failed to reconfigure session, error = %d\n", result);
         goto CLEANUP;
     }
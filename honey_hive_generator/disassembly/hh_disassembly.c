@@ -13,6 +13,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "xed-interface.h"
 
@@ -21,15 +23,6 @@
 
 #define TAG "[" __FILE__ "] "
 
-/**
- * Init Intel XED
- */
-__attribute__((constructor))
-static void intel_xed_init() {
-    xed_tables_init();
-}
-
-
 /**
  * Is this instruction a Processor Trace qualifying change-of-flow-instruction?
  * @param category The category of the instruction
@@ -52,169 +45,1882 @@ bool is_qualifying_cofi(xed_category_enum_t category) {
     }
 }
 
+/**
+ * The number of XED opcode maps which contain COFIs (legacy, 0x0F, and 0x0F38)
+ */
+#define COFI_CANDIDATE_MAP_COUNT 3
 
-bool hh_disassembly_get_blocks_from_elf(const char *path, hh_disassembly_block **blocks, int64_t *blocks_count) {
-    int fd = 0;
-    void *map_handle = NULL;
-    hh_disassembly_block *_blocks = NULL;
-    bool success = false;
+/**
+ * A modrm.reg mask for each opcode of each map. An instruction is a COFI candidate if the bit for its modrm.reg is set.
+ * Instructions without a modrm have a modrm.reg of zero.
+ */
+static uint8_t cofi_candidate_reg_masks[COFI_CANDIDATE_MAP_COUNT][256];
+
+/**
+ * Marks a range of opcodes as COFI candidates
+ */
+static void mark_cofi_candidates(uint32_t map, uint32_t first_opcode, uint32_t last_opcode, uint8_t reg_mask) {
+    for (uint32_t opcode = first_opcode; opcode <= last_opcode; opcode++) {
+        cofi_candidate_reg_masks[map][opcode] = reg_mask;
+    }
+}
+
+/**
+ * Marks every instruction which XED categorizes as a COFI as a candidate. Each opcode of each map is decoded with no
+ * prefix and with each of the 66, F2 and F3 prefixes, and with each modrm.reg in both a register form (for every
+ * modrm.rm) and a memory form. Candidates are recorded under the map, opcode and modrm.reg which XED reports, which are
+ * exactly what is_cofi_candidate looks up.
+ */
+static void mark_xed_cofi_candidates(void) {
+    static const uint8_t prefixes[] = {0x66, 0xF2, 0xF3};
+    static const uint8_t escapes[COFI_CANDIDATE_MAP_COUNT][2] = {{0}, {0x0F}, {0x0F, 0x38}};
+
+    xed_state_t dstate = {0};
+    dstate.mmode = XED_MACHINE_MODE_LONG_64;
+
+    for (uint32_t prefix_index = 0; prefix_index <= sizeof(prefixes); prefix_index++) {
+        for (uint32_t escape_length = 0; escape_length < COFI_CANDIDATE_MAP_COUNT; escape_length++) {
+            for (uint32_t opcode = 0; opcode < 256; opcode++) {
+                //Eight register forms and one memory form for each modrm.reg
+                for (uint32_t form = 0; form < 8 * 9; form++) {
+                    uint32_t reg = form / 9;
+                    uint32_t rm = form % 9;
+                    uint8_t modrm = rm < 8 ? 0xC0 | reg << 3 | rm : reg << 3;
+
+                    uint8_t itext[XED_MAX_INSTRUCTION_BYTES] = {0};
+                    uint32_t length = 0;
+                    if (prefix_index < sizeof(prefixes)) {
+                        itext[length++] = prefixes[prefix_index];
+                    }
+                    memcpy(itext + length, escapes[escape_length], escape_length);
+                    length += escape_length;
+                    itext[length++] = opcode;
+                    itext[length] = modrm;
+
+                    xed_decoded_inst_t xedd;
+                    xed_decoded_inst_zero_set_mode(&xedd, &dstate);
+                    if (xed_decode(&xedd, itext, sizeof(itext)) != XED_ERROR_NONE
+                        || !is_qualifying_cofi(xed_decoded_inst_get_category(&xedd))) {
+                        continue;
+                    }
+
+                    uint32_t map = xed3_operand_get_map(&xedd);
+                    if (map < COFI_CANDIDATE_MAP_COUNT) {
+                        cofi_candidate_reg_masks[map][xed3_operand_get_nominal_opcode(&xedd)]
+                                |= 1 << xed3_operand_get_reg(&xedd);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Init Intel XED and the COFI candidate table
+ */
+__attribute__((constructor))
+static void intel_xed_init() {
+    xed_tables_init();
+
+    /*
+     * The candidate table only needs to never miss a COFI since every candidate is fully decoded to learn its real
+     * category. System instructions are rare in practice, so rather than pin down exactly which of them XED considers
+     * to be XED_CATEGORY_SYSTEM we just take all of them.
+     */
+
+    /* Legacy map */
+    mark_cofi_candidates(0, 0x6C, 0x6F, 0xFF); //ins, outs
+    mark_cofi_candidates(0, 0x70, 0x7F, 0xFF); //jcc rel8
+    mark_cofi_candidates(0, 0x8E, 0x8E, 0xFF); //mov sreg
+    mark_cofi_candidates(0, 0x9A, 0x9A, 0xFF); //far call
+    mark_cofi_candidates(0, 0xC2, 0xC3, 0xFF); //ret
+    mark_cofi_candidates(0, 0xC6, 0xC7, 0x80); //xabort, xbegin (/7)
+    mark_cofi_candidates(0, 0xCA, 0xCF, 0xFF); //far ret, int3, int, into, iret
+    mark_cofi_candidates(0, 0xE0, 0xEF, 0xFF); //loop, jrcxz, in, out, call, jmp, far jmp
+    mark_cofi_candidates(0, 0xF1, 0xF1, 0xFF); //int1
+    mark_cofi_candidates(0, 0xF4, 0xF4, 0xFF); //hlt
+    mark_cofi_candidates(0, 0xFA, 0xFB, 0xFF); //cli, sti
+    mark_cofi_candidates(0, 0xFF, 0xFF, 0x3C); //indirect call and jmp (/2 through /5)
+
+    /* 0x0F map */
+    mark_cofi_candidates(1, 0x00, 0x0F, 0xFF); //descriptor tables, syscall, sysret, vm*, ud2...
+    mark_cofi_candidates(1, 0x20, 0x27, 0xFF); //control and debug registers
+    mark_cofi_candidates(1, 0x30, 0x37, 0xFF); //msrs, sysenter, sysexit, getsec
+    mark_cofi_candidates(1, 0x80, 0x8F, 0xFF); //jcc rel32
+    mark_cofi_candidates(1, 0xA2, 0xA2, 0xFF); //cpuid
+    mark_cofi_candidates(1, 0xAA, 0xAA, 0xFF); //rsm
+    mark_cofi_candidates(1, 0xAE, 0xAE, 0xFF); //fences, xsave, fsgsbase...
+    mark_cofi_candidates(1, 0xC7, 0xC7, 0xFF); //rdrand, vmptrld...
+
+    /* 0x0F38 map */
+    mark_cofi_candidates(2, 0x80, 0x82, 0xFF); //invept, invvpid, invpcid
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
+    /*
+     * The list above is what we expect, but XED has the final say on what is a COFI, so anything XED categorizes as one
+     * which the list missed is added as well.
+     */
+    mark_xed_cofi_candidates();
+}
+
+
+
+/**
+ * Maps and validates an x86_64 ELF binary
+ * @param path The path to the ELF binary
+ * @param fd The location to place the open file descriptor. This is left open on failure and must be closed if > 0.
+ * @param map_handle The location to place the read-only mapping of the binary. This must be unmapped if not NULL.
+ * @param sb The location to place the file's stat
+ * @return The ELF header or NULL if the file could not be mapped or is not a valid ELF
+ */
+static Elf64_Ehdr *map_elf(const char *path, int *fd, void **map_handle, struct stat *sb) {
+    *map_handle = NULL;
+    *fd = open(path, O_RDONLY);
+    if (*fd < 0) {
         printf(TAG "Could not open file '%s'!\n", path);
-        goto CLEANUP;
+        return NULL;
     }
-    struct stat sb;
-    int stat_result = fstat(fd, &sb);
+
+    int stat_result = fstat(*fd, sb);
     if (stat_result < 0) {
         printf(TAG "Could not stat file '%s'!\n", path);
-        goto CLEANUP;
+        return NULL;
     }
 
-    map_handle = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (!map_handle) {
+    void *mapping = mmap(NULL, sb->st_size, PROT_READ, MAP_SHARED, *fd, 0);
+    if (mapping == MAP_FAILED) {
         printf(TAG "Could not mmap file '%s'!\n", path);
-        goto CLEANUP;
+        return NULL;
     }
+    *map_handle = mapping;
 
-    Elf64_Ehdr *header = map_handle;
-    if (sb.st_size < sizeof(Elf64_Ehdr)) {
+    Elf64_Ehdr *header = mapping;
+    uint64_t file_size = sb->st_size;
+    if (file_size < sizeof(Elf64_Ehdr)) {
         printf(TAG "Too small!\n");
-        goto CLEANUP;
+        return NULL;
     }
 
     if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0) {
         printf(TAG "Bad magic!\n");
-        goto CLEANUP;
+        return NULL;
     }
 
     if (header->e_ident[EI_CLASS] != ELFCLASS64) {
         printf(TAG "Not 64-bit!\n");
-        goto CLEANUP;
+        return NULL;
     }
 
     if (header->e_ident[EI_DATA] != ELFDATA2LSB) {
         printf(TAG "x86_64 must be LSB");
-        goto CLEANUP;
+        return NULL;
     }
 
     if (header->e_ident[EI_VERSION] != EV_CURRENT) {
         printf(TAG "Unsupported ELF type?\n");
-        goto CLEANUP;
+        return NULL;
     }
 
-    if (header->e_shoff > sb.st_size || header->e_shoff + sizeof(Elf64_Shdr) * header->e_shnum > sb.st_size) {
+    if (header->e_shoff > file_size || header->e_shoff + sizeof(Elf64_Shdr) * header->e_shnum > file_size) {
         printf(TAG "Bad section header!\n");
-        goto CLEANUP;
+        return NULL;
     }
 
+    return header;
+}
 
-    xed_decoded_inst_t xedd;
-    xed_state_t dstate;
-    dstate.mmode = XED_MACHINE_MODE_LONG_64;
+/**
+ * Gets the program header table of a binary
+ * @return The table or NULL if it lies outside the binary
+ */
+static const Elf64_Phdr *get_program_headers(const Elf64_Ehdr *header, uint64_t image_size) {
+    if (header->e_phoff > image_size || header->e_phnum * sizeof(Elf64_Phdr) > image_size - header->e_phoff) {
+        printf(TAG "Bad program header!\n");
+        return NULL;
+    }
 
-    size_t blocks_capacity = 16;
-    int64_t blocks_write_index = 0;
-    _blocks = malloc(sizeof(hh_disassembly_block) * blocks_capacity);
-    if (!_blocks) {
-        printf(TAG "Out of memory!\n");
-        success = false;
+    return (const Elf64_Phdr *) ((const uint8_t *) header + header->e_phoff);
+}
+
+/**
+ * Finds the GNU build-id among a run of ELF notes. Names and descriptors are padded to four bytes.
+ * @return 1 if the build-id was found, 0 if it was not, or -1 if it does not fit in build_id
+ */
+static int find_build_id_in_notes(const uint8_t *notes, uint64_t notes_size, uint8_t *build_id,
+                                  uint32_t build_id_capacity, uint32_t *build_id_size) {
+    uint64_t note_offset = 0;
+    while (note_offset + sizeof(Elf64_Nhdr) <= notes_size) {
+        const Elf64_Nhdr *note = (const Elf64_Nhdr *) (notes + note_offset);
+        uint64_t name_offset = note_offset + sizeof(Elf64_Nhdr);
+        uint64_t desc_offset = name_offset + ((note->n_namesz + 3ULL) & ~3ULL);
+        uint64_t next_offset = desc_offset + ((note->n_descsz + 3ULL) & ~3ULL);
+        if (next_offset > notes_size) {
+            break;
+        }
+
+        if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == sizeof(ELF_NOTE_GNU)
+            && memcmp(notes + name_offset, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)) == 0) {
+            if (note->n_descsz > build_id_capacity) {
+                printf(TAG "Build-id is too large!\n");
+                return -1;
+            }
+
+            memcpy(build_id, notes + desc_offset, note->n_descsz);
+            *build_id_size = note->n_descsz;
+            return 1;
+        }
+
+        note_offset = next_offset;
+    }
+
+    return 0;
+}
+
+bool hh_disassembly_get_build_id_from_elf(const char *path, uint8_t *build_id, uint32_t build_id_capacity,
+                                          uint32_t *build_id_size) {
+    int fd = 0;
+    void *map_handle = NULL;
+    bool success = false;
+    struct stat sb;
+    int found = 0;
+    *build_id_size = 0;
+
+    Elf64_Ehdr *header = map_elf(path, &fd, &map_handle, &sb);
+    if (!header) {
         goto CLEANUP;
     }
 
-    //Walk each section
-    for (int i = 0; i < header->e_shnum; i++) {
+    for (int i = 0; !found && i < header->e_shnum; i++) {
         Elf64_Shdr *sh_header = (map_handle + header->e_shoff + sizeof(Elf64_Shdr) * i);
-        if (sh_header->sh_offset > sb.st_size || sh_header->sh_offset + sh_header->sh_size > sb.st_size) {
-            printf(TAG "Bad region defined by section header. Skipping...\n");
+        if (sh_header->sh_type != SHT_NOTE || sh_header->sh_offset > (uint64_t) sb.st_size
+            || sh_header->sh_offset + sh_header->sh_size > (uint64_t) sb.st_size) {
             continue;
         }
 
-        //Skip non-executable sections (poor man's __TEXT filter)
-        if (!(sh_header->sh_flags & SHF_EXECINSTR)) {
+        found = find_build_id_in_notes(map_handle + sh_header->sh_offset, sh_header->sh_size, build_id,
+                                       build_id_capacity, build_id_size);
+    }
+
+    //Binaries stripped of their section headers still have their notes in PT_NOTE segments, and so the same build-id
+    const Elf64_Phdr *ph_headers = found ? NULL : get_program_headers(header, sb.st_size);
+    for (int i = 0; ph_headers && !found && i < header->e_phnum; i++) {
+        const Elf64_Phdr *ph_header = ph_headers + i;
+        if (ph_header->p_type != PT_NOTE || ph_header->p_offset > (uint64_t) sb.st_size
+            || ph_header->p_filesz > sb.st_size - ph_header->p_offset) {
             continue;
         }
 
-        //Relative pointer into this text segment
-        uint8_t *text_segment = map_handle + sh_header->sh_offset;
-        off_t text_segment_offset = 0;
-        //A running count of where our last block started. Updated after committing each block
-        uint64_t block_start = sh_header->sh_offset + text_segment_offset;
+        found = find_build_id_in_notes(map_handle + ph_header->p_offset, ph_header->p_filesz, build_id,
+                                       build_id_capacity, build_id_size);
+    }
 
-        while (text_segment_offset < sh_header->sh_size) {
-            uint64_t insn_va = sh_header->sh_offset + text_segment_offset;
+    //No build-id is not an error
+    success = found >= 0;
 
-            //Decode the instruction
-            xed_error_enum_t result;
-            xed_decoded_inst_zero_set_mode(&xedd, &dstate);
-            result = xed_decode(&xedd, text_segment + text_segment_offset, sb.st_size - text_segment_offset);
-            if (result != XED_ERROR_NONE) {
-                //Try and just length decode it. Complicated weird instructions can't be decoded by xed but ild can
-                // handle them.
-                xed_decoded_inst_zero_set_mode(&xedd, &dstate);
-                result = xed_ild_decode(&xedd,text_segment + text_segment_offset, sb.st_size - text_segment_offset);
-                if (result != XED_ERROR_NONE) {
-                    printf(TAG "XED total decode error! %s -> %p\n", xed_error_enum_t2str(result), (void *) insn_va);
-                    break;
-                }
-                text_segment_offset += xed_decoded_inst_get_length(&xedd);
-                continue;
-            }
+    CLEANUP:
+    if (map_handle) {
+        munmap(map_handle, sb.st_size);
+    }
 
+    if (fd > 0) {
+        close(fd);
+    }
 
-            uint32_t insn_length = xed_decoded_inst_get_length(&xedd);
-            xed_category_enum_t category = xed_decoded_inst_get_category(&xedd);
-            if (is_qualifying_cofi(category)) {
-                int32_t branch_displacement = xed_decoded_inst_get_branch_displacement(&xedd);
-                uint64_t cofi_destination = UINT64_MAX;
-                if (xed_operand_values_has_branch_displacement(xed_decoded_inst_operands_const(&xedd))) {
-                    cofi_destination = insn_va + insn_length + branch_displacement;
-                }
+    return success;
+}
 
-                if (blocks_write_index >= blocks_capacity) {
-                    blocks_capacity *= 2;
-                    hh_disassembly_block *new_blocks = realloc(_blocks, sizeof(hh_disassembly_block) * blocks_capacity);
-                    if (!new_blocks) {
-                        printf(TAG "Out of memory!\n");
-                        success = false;
-                        goto CLEANUP;
-                    }
+/**
+ * The number of bytes of an executable section which are swept as one unit of work
+ */
+#define SWEEP_CHUNK_SIZE (256 * 1024)
 
-                    _blocks = new_blocks;
-                }
+/**
+ * The granularity at which a binary is compared against its previous build when sweeping incrementally
+ */
+#define INCREMENTAL_PAGE_SIZE (4096)
+
+/**
+ * A decoded instruction. Instructions which were only length decoded, either because they cannot be COFIs or because
+ * XED could not fully decode them, have a category of XED_CATEGORY_INVALID.
+ */
+typedef struct {
+    uint64_t cofi_destination;
+    uint32_t length;
+    xed_category_enum_t category;
+} decoded_instruction;
+
+/**
+ * A qualifying change-of-flow instruction found by a sweep
+ */
+typedef struct {
+    uint64_t offset;
+    uint64_t cofi_destination;
+    uint32_t length;
+    uint16_t category;
+} cofi_record;
+
+/**
+ * A slice of an executable section which a worker sweeps speculatively. A chunk may begin in the middle of an
+ * instruction, so its results are only trusted from the first instruction boundary which the true sweep of the
+ * section shares with it (see merge_chunk). x86 decoding resynchronizes quickly, so this is almost always the first
+ * few instructions of the chunk.
+ */
+typedef struct {
+    /** The file offsets [start, end) which this chunk covers */
+    uint64_t start;
+    uint64_t end;
+
+    /** The file offset of the start of the section this chunk belongs to */
+    uint64_t section_start;
+
+    /** The difference between the address the section's blocks are recorded at and their file offset */
+    uint64_t address_delta;
 
-                hh_disassembly_block *block = &_blocks[blocks_write_index++];
-                block->instruction_category = category;
-                block->start_offset = block_start;
-                block->length = (uint32_t) (insn_va - block_start);
-                block->last_instruction_size = insn_length;
-                block->cofi_destination = cofi_destination;
+    /** A bit for each byte of the chunk, set if the speculative sweep decoded an instruction starting there */
+    uint64_t *boundaries;
 
-                block_start = insn_va + insn_length;
+    /** The COFIs found by the speculative sweep, in order */
+    cofi_record *cofis;
+    uint64_t cofi_count;
+    uint64_t cofi_capacity;
+
+    /** The offset of the first instruction the speculative sweep decoded at or after end */
+    uint64_t exit_offset;
+
+    /** The offset of the instruction the speculative sweep could not decode, UINT64_MAX if there was none */
+    uint64_t error_offset;
+
+    /** XED's error for the instruction at error_offset */
+    xed_error_enum_t error;
+
+    /** Set if the sweep ran out of memory. The chunk's results are unusable. */
+    bool out_of_memory;
+
+    /** Set (with release semantics) once the chunk has been swept or skipped */
+    bool done;
+} sweep_chunk;
+
+/**
+ * Work shared between sweep workers
+ */
+typedef struct {
+    const uint8_t *image;
+    uint64_t image_size;
+    bool full_decode;
+    sweep_chunk *chunks;
+    uint64_t chunk_count;
+
+    /** The index of the next chunk to be claimed by a worker. Accessed atomically. */
+    uint64_t next_chunk;
+
+    /**
+     * The start of the section which the merge last found a decode error in, or UINT64_MAX. The sequential sweep
+     * stops at the first error in a section, so there is no point sweeping the rest of it. Accessed atomically.
+     */
+    uint64_t ended_section_start;
+} sweep_context;
+
+/**
+ * Checks if a length decoded instruction might be a COFI
+ */
+__attribute((always_inline))
+static inline bool is_cofi_candidate(const xed_decoded_inst_t *xedd) {
+    uint32_t map = xed3_operand_get_map(xedd);
+    if (map >= COFI_CANDIDATE_MAP_COUNT) {
+        return false;
+    }
+
+    uint8_t reg_mask = cofi_candidate_reg_masks[map][xed3_operand_get_nominal_opcode(xedd)];
+    return (reg_mask >> xed3_operand_get_reg(xedd)) & 1;
+}
+
+/**
+ * Decodes the instruction at an offset into the image
+ * @param full_decode If set, every instruction is fully decoded. Otherwise, only COFI candidates are fully decoded and
+ * everything else is just length decoded, which is far cheaper. Both give identical results.
+ * @return XED_ERROR_NONE if the instruction could at least be length decoded
+ */
+__attribute((always_inline))
+static inline xed_error_enum_t decode_instruction(const uint8_t *image, uint64_t image_size, uint64_t offset,
+                                                  bool full_decode, decoded_instruction *decoded) {
+    xed_decoded_inst_t xedd;
+    xed_state_t dstate = {0};
+    dstate.mmode = XED_MACHINE_MODE_LONG_64;
+
+    xed_error_enum_t result;
+    if (!full_decode) {
+        xed_decoded_inst_zero_set_mode(&xedd, &dstate);
+        result = xed_ild_decode(&xedd, image + offset, image_size - offset);
+        if (result != XED_ERROR_NONE) {
+            //xed_decode length decodes first, so the full decode would have failed the same way
+            return result;
+        }
+
+        if (!is_cofi_candidate(&xedd)) {
+            decoded->length = xed_decoded_inst_get_length(&xedd);
+            decoded->category = XED_CATEGORY_INVALID;
+            decoded->cofi_destination = UINT64_MAX;
+            return XED_ERROR_NONE;
+        }
+    }
+
+    xed_decoded_inst_zero_set_mode(&xedd, &dstate);
+    result = xed_decode(&xedd, image + offset, image_size - offset);
+    if (result != XED_ERROR_NONE) {
+        //Try and just length decode it. Complicated weird instructions can't be decoded by xed but ild can
+        // handle them.
+        xed_decoded_inst_zero_set_mode(&xedd, &dstate);
+        result = xed_ild_decode(&xedd, image + offset, image_size - offset);
+        if (result != XED_ERROR_NONE) {
+            return result;
+        }
+
+        decoded->length = xed_decoded_inst_get_length(&xedd);
+        decoded->category = XED_CATEGORY_INVALID;
+        decoded->cofi_destination = UINT64_MAX;
+        return XED_ERROR_NONE;
+    }
+
+    decoded->length = xed_decoded_inst_get_length(&xedd);
+    decoded->category = xed_decoded_inst_get_category(&xedd);
+    decoded->cofi_destination = UINT64_MAX;
+    if (is_qualifying_cofi(decoded->category)
+        && xed_operand_values_has_branch_displacement(xed_decoded_inst_operands_const(&xedd))) {
+        int32_t branch_displacement = xed_decoded_inst_get_branch_displacement(&xedd);
+        decoded->cofi_destination = offset + decoded->length + branch_displacement;
+    }
+
+    return XED_ERROR_NONE;
+}
+
+/**
+ * Appends a COFI to a chunk
+ * @return false if out of memory
+ */
+static bool append_cofi(sweep_chunk *chunk, uint64_t offset, const decoded_instruction *decoded) {
+    if (chunk->cofi_count >= chunk->cofi_capacity) {
+        uint64_t new_capacity = chunk->cofi_capacity ? chunk->cofi_capacity * 2 : 64;
+        cofi_record *new_cofis = realloc(chunk->cofis, sizeof(cofi_record) * new_capacity);
+        if (!new_cofis) {
+            return false;
+        }
+
+        chunk->cofis = new_cofis;
+        chunk->cofi_capacity = new_capacity;
+    }
+
+    cofi_record *cofi = &chunk->cofis[chunk->cofi_count++];
+    cofi->offset = offset;
+    cofi->cofi_destination = decoded->cofi_destination;
+    cofi->length = decoded->length;
+    cofi->category = decoded->category;
+    return true;
+}
+
+/**
+ * Linearly sweeps a chunk starting from its first byte, recording every instruction boundary and COFI
+ */
+static void sweep_chunk_speculatively(const uint8_t *image, uint64_t image_size, bool full_decode,
+                                      sweep_chunk *chunk) {
+    uint64_t offset = chunk->start;
+    chunk->error_offset = UINT64_MAX;
+
+    uint64_t bitmap_size = sizeof(uint64_t) * ((chunk->end - chunk->start + 63) / 64);
+    if (!(chunk->boundaries = calloc(1, bitmap_size))) {
+        chunk->out_of_memory = true;
+        return;
+    }
+
+    while (offset < chunk->end) {
+        uint64_t bit = offset - chunk->start;
+        chunk->boundaries[bit / 64] |= 1LLU << (bit % 64);
+
+        decoded_instruction decoded;
+        if ((chunk->error = decode_instruction(image, image_size, offset, full_decode, &decoded)) != XED_ERROR_NONE) {
+            chunk->error_offset = offset;
+            break;
+        }
+
+        if (is_qualifying_cofi(decoded.category) && !append_cofi(chunk, offset, &decoded)) {
+            chunk->out_of_memory = true;
+            return;
+        }
+
+        offset += decoded.length;
+    }
+
+    chunk->exit_offset = offset;
+}
+
+/**
+ * Claims and sweeps the next chunk which has not yet been claimed
+ * @return false if every chunk has already been claimed
+ */
+static bool sweep_next_chunk(sweep_context *context) {
+    uint64_t i = __atomic_fetch_add(&context->next_chunk, 1, __ATOMIC_RELAXED);
+    if (i >= context->chunk_count) {
+        return false;
+    }
+
+    sweep_chunk *chunk = context->chunks + i;
+    if (chunk->section_start != __atomic_load_n(&context->ended_section_start, __ATOMIC_RELAXED)) {
+        sweep_chunk_speculatively(context->image, context->image_size, context->full_decode, chunk);
+    }
+
+    __atomic_store_n(&chunk->done, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void *sweep_worker(void *context_) {
+    sweep_context *context = context_;
+    while (sweep_next_chunk(context));
+    return NULL;
+}
+
+/**
+ * A growable buffer of blocks along with the start of the block currently being swept
+ */
+typedef struct {
+    hh_disassembly_block *blocks;
+    int64_t count;
+    int64_t capacity;
+    uint64_t block_start;
+} block_list;
+
+/**
+ * Ends the current block with a COFI
+ * @return false if out of memory
+ */
+static bool commit_cofi(block_list *list, const cofi_record *cofi) {
+    if (list->count >= list->capacity) {
+        list->capacity *= 2;
+        hh_disassembly_block *new_blocks = realloc(list->blocks, sizeof(hh_disassembly_block) * list->capacity);
+        if (!new_blocks) {
+            printf(TAG "Out of memory!\n");
+            return false;
+        }
+
+        list->blocks = new_blocks;
+    }
+
+    hh_disassembly_block *block = &list->blocks[list->count++];
+    block->instruction_category = cofi->category;
+    block->start_offset = list->block_start;
+    block->length = (uint32_t) (cofi->offset - list->block_start);
+    block->last_instruction_size = cofi->length;
+    block->cofi_destination = cofi->cofi_destination;
+
+    list->block_start = cofi->offset + cofi->length;
+    return true;
+}
+
+/**
+ * Commits the blocks of a chunk as a sequential sweep of its section would have found them. Starting from the offset
+ * at which the sequential sweep enters the chunk, instructions are decoded one by one until we reach an instruction
+ * boundary which the speculative sweep also decoded. From there on, both sweeps are identical and so the speculative
+ * results are used as-is.
+ * @param full_decode See decode_instruction
+ * @param offset The offset at which the sequential sweep enters the chunk. Updated to where it leaves the chunk.
+ * @param section_ended Set if the sequential sweep hits an instruction which cannot be decoded. The rest of the
+ * section is not swept.
+ * @return false if out of memory
+ */
+static bool merge_chunk(const uint8_t *image, uint64_t image_size, bool full_decode, const sweep_chunk *chunk,
+                        block_list *list, uint64_t *offset, bool *section_ended) {
+    uint64_t insn_offset = *offset;
+    while (insn_offset < chunk->end) {
+        uint64_t bit = insn_offset - chunk->start;
+        if (chunk->boundaries[bit / 64] & (1LLU << (bit % 64))) {
+            for (uint64_t i = 0; i < chunk->cofi_count; i++) {
+                if (chunk->cofis[i].offset >= insn_offset && !commit_cofi(list, chunk->cofis + i)) {
+                    return false;
+                }
+            }
+
+            if (chunk->error_offset != UINT64_MAX) {
+                printf(TAG "XED total decode error! %s -> %p\n", xed_error_enum_t2str(chunk->error),
+                       (void *) chunk->error_offset);
+                *section_ended = true;
             }
 
-            text_segment_offset += insn_length;
+            *offset = chunk->exit_offset;
+            return true;
+        }
+
+        decoded_instruction decoded;
+        xed_error_enum_t result = decode_instruction(image, image_size, insn_offset, full_decode, &decoded);
+        if (result != XED_ERROR_NONE) {
+            printf(TAG "XED total decode error! %s -> %p\n", xed_error_enum_t2str(result), (void *) insn_offset);
+            *section_ended = true;
+            return true;
         }
+
+        if (is_qualifying_cofi(decoded.category)) {
+            cofi_record cofi = {
+                    .offset = insn_offset,
+                    .cofi_destination = decoded.cofi_destination,
+                    .length = decoded.length,
+                    .category = decoded.category
+            };
+            if (!commit_cofi(list, &cofi)) {
+                return false;
+            }
+        }
+
+        insn_offset += decoded.length;
     }
 
-    success = true;
-    *blocks = _blocks;
-    *blocks_count = blocks_write_index; //the next write index IS the count!
+    *offset = insn_offset;
+    return true;
+}
 
-    CLEANUP:
-    if (map_handle) {
-        munmap(map_handle, sb.st_size);
+/**
+ * Lazily compares the pages of a binary against those at the same offsets in its previous build
+ */
+typedef struct {
+    const uint8_t *image;
+    uint64_t image_size;
+    const uint8_t *previous_image;
+    uint64_t previous_image_size;
+
+    /** The state of each page of image: zero if not yet compared, one if unchanged, and two if changed */
+    uint8_t *page_states;
+} page_diff;
+
+/**
+ * Checks that the bytes [start, end) are the same in both builds
+ */
+static bool is_range_unchanged(page_diff *diff, uint64_t start, uint64_t end) {
+    if (end > diff->image_size || end > diff->previous_image_size) {
+        return false;
     }
 
-    if (fd) {
-        close(fd);
+    for (uint64_t page = start / INCREMENTAL_PAGE_SIZE; page * INCREMENTAL_PAGE_SIZE < end; page++) {
+        if (!diff->page_states[page]) {
+            uint64_t page_start = page * INCREMENTAL_PAGE_SIZE;
+            uint64_t page_size = INCREMENTAL_PAGE_SIZE;
+            if (page_size > diff->image_size - page_start) {
+                page_size = diff->image_size - page_start;
+            }
+
+            if (page_size > diff->previous_image_size - page_start) {
+                //The previous build ends within this page, so only the range itself can be compared
+                return memcmp(diff->image + start, diff->previous_image + start, end - start) == 0;
+            }
+
+            diff->page_states[page] = memcmp(diff->image + page_start, diff->previous_image + page_start,
+                                             page_size) == 0 ? 1 : 2;
+        }
+
+        if (diff->page_states[page] != 1) {
+            return false;
+        }
     }
 
-    if (!success) {
-        if (_blocks) {
-            free(_blocks);
+    return true;
+}
+
+/**
+ * Finds the executable section of a binary which starts at a given offset
+ * @return The end offset of the section, or zero if there is no such section
+ */
+static uint64_t get_executable_section_end(const Elf64_Ehdr *header, const uint8_t *image, uint64_t image_size,
+                                           uint64_t section_offset) {
+    for (int i = 0; i < header->e_shnum; i++) {
+        const Elf64_Shdr *sh_header = (const Elf64_Shdr *) (image + header->e_shoff + sizeof(Elf64_Shdr) * i);
+        if ((sh_header->sh_flags & SHF_EXECINSTR) && sh_header->sh_offset == section_offset
+            && sh_header->sh_offset <= image_size && sh_header->sh_offset + sh_header->sh_size <= image_size) {
+            return sh_header->sh_offset + sh_header->sh_size;
         }
     }
 
-    return success;
-}
\ No newline at end of file
+    return 0;
+}
+
+static int compare_blocks_by_start(const void *a, const void *b) {
+    const hh_disassembly_block *block_a = a;
+    const hh_disassembly_block *block_b = b;
+    return (block_a->start_offset > block_b->start_offset) - (block_a->start_offset < block_b->start_offset);
+}
+
+bool hh_disassembly_get_blocks_from_elf_incrementally(const char *path, const char *previous_path,
+                                                      const hh_disassembly_block *previous_blocks,
+                                                      int64_t previous_block_count, hh_disassembly_block **blocks,
+                                                      int64_t *blocks_count, int64_t *reused_count, uint32_t flags) {
+    int fd = 0;
+    void *map_handle = NULL;
+    int previous_fd = 0;
+    void *previous_map_handle = NULL;
+    hh_disassembly_block *sorted_previous_blocks = NULL;
+    page_diff diff = {0};
+    block_list list = {0};
+    bool success = false;
+    bool full_decode = flags & HH_DISASSEMBLY_FLAG_FULL_DECODE;
+    struct stat sb;
+    struct stat previous_sb;
+    *reused_count = 0;
+
+    if (flags & HH_DISASSEMBLY_FLAG_SEGMENTS) {
+        printf(TAG "Incremental disassembly can't sweep segments!\n");
+        return false;
+    }
+
+    Elf64_Ehdr *header = map_elf(path, &fd, &map_handle, &sb);
+    Elf64_Ehdr *previous_header = header ? map_elf(previous_path, &previous_fd, &previous_map_handle, &previous_sb)
+                                         : NULL;
+    if (!previous_header) {
+        goto CLEANUP;
+    }
+
+    //Blocks come out of the sweep in section header order, which is almost but not always address order
+    if (!(sorted_previous_blocks = malloc(sizeof(hh_disassembly_block) * (previous_block_count + 1)))) {
+        printf(TAG "Out of memory!\n");
+        goto CLEANUP;
+    }
+    memcpy(sorted_previous_blocks, previous_blocks, sizeof(hh_disassembly_block) * previous_block_count);
+    for (int64_t i = 1; i < previous_block_count; i++) {
+        if (sorted_previous_blocks[i].start_offset < sorted_previous_blocks[i - 1].start_offset) {
+            qsort(sorted_previous_blocks, previous_block_count, sizeof(hh_disassembly_block), compare_blocks_by_start);
+            break;
+        }
+    }
+
+    diff.image = map_handle;
+    diff.image_size = sb.st_size;
+    diff.previous_image = previous_map_handle;
+    diff.previous_image_size = previous_sb.st_size;
+    if (!(diff.page_states = calloc(sb.st_size / INCREMENTAL_PAGE_SIZE + 1, sizeof(uint8_t)))) {
+        printf(TAG "Out of memory!\n");
+        goto CLEANUP;
+    }
+
+    list.capacity = previous_block_count > 16 ? previous_block_count : 16;
+    if (!(list.blocks = malloc(sizeof(hh_disassembly_block) * list.capacity))) {
+        printf(TAG "Out of memory!\n");
+        goto CLEANUP;
+    }
+
+    for (int i = 0; i < header->e_shnum; i++) {
+        Elf64_Shdr *sh_header = (map_handle + header->e_shoff + sizeof(Elf64_Shdr) * i);
+        if (sh_header->sh_offset > (uint64_t) sb.st_size
+            || sh_header->sh_offset + sh_header->sh_size > (uint64_t) sb.st_size) {
+            printf(TAG "Bad region defined by section header. Skipping...\n");
+            continue;
+        }
+
+        if (!(sh_header->sh_flags & SHF_EXECINSTR)) {
+            continue;
+        }
+
+        uint64_t section_end = sh_header->sh_offset + sh_header->sh_size;
+
+        //Previous blocks are only trustworthy if the previous sweep of this code started from the same place
+        uint64_t reuse_end = get_executable_section_end(previous_header, previous_map_handle, previous_sb.st_size,
+                                                        sh_header->sh_offset);
+        if (reuse_end > section_end) {
+            reuse_end = section_end;
+        }
+
+        int64_t cursor = 0;
+        int64_t cursor_end = previous_block_count;
+        while (cursor < cursor_end) {
+            int64_t middle = cursor + (cursor_end - cursor) / 2;
+            if (sorted_previous_blocks[middle].start_offset < sh_header->sh_offset) {
+                cursor = middle + 1;
+            } else {
+                cursor_end = middle;
+            }
+        }
+
+        uint64_t offset = sh_header->sh_offset;
+        list.block_start = offset;
+        while (offset < section_end) {
+            /*
+             * Once the sweep lands on an instruction boundary which the previous sweep also had (the start of one of
+             * its blocks) and the code from there on is unchanged, both sweeps are identical until the code changes.
+             */
+            while (cursor < previous_block_count && sorted_previous_blocks[cursor].start_offset < offset) {
+                cursor++;
+            }
+
+            bool reused = false;
+            while (cursor < previous_block_count && sorted_previous_blocks[cursor].start_offset == offset) {
+                const hh_disassembly_block *previous_block = sorted_previous_blocks + cursor;
+                cofi_record cofi = {
+                        .offset = previous_block->start_offset + previous_block->length,
+                        .cofi_destination = previous_block->cofi_destination,
+                        .length = previous_block->last_instruction_size,
+                        .category = previous_block->instruction_category
+                };
+                if (cofi.offset >= reuse_end || !is_range_unchanged(&diff, offset, cofi.offset + cofi.length)) {
+                    break;
+                }
+
+                if (!commit_cofi(&list, &cofi)) {
+                    goto CLEANUP;
+                }
+
+                offset = cofi.offset + cofi.length;
+                cursor++;
+                (*reused_count)++;
+                reused = true;
+            }
+
+            if (reused) {
+                continue;
+            }
+
+            decoded_instruction decoded;
+            xed_error_enum_t result = decode_instruction(map_handle, sb.st_size, offset, full_decode, &decoded);
+            if (result != XED_ERROR_NONE) {
+                printf(TAG "XED total decode error! %s -> %p\n", xed_error_enum_t2str(result), (void *) offset);
+                break;
+            }
+
+            if (is_qualifying_cofi(decoded.category)) {
+                cofi_record cofi = {
+                        .offset = offset,
+                        .cofi_destination = decoded.cofi_destination,
+                        .length = decoded.length,
+                        .category = decoded.category
+                };
+                if (!commit_cofi(&list, &cofi)) {
+                    goto CLEANUP;
+                }
+            }
+
+            offset += decoded.length;
+        }
+    }
+
+    success = true;
+    *blocks = list.blocks;
+    *blocks_count = list.count;
+
+    CLEANUP:
+    if (map_handle) {
+        munmap(map_handle, sb.st_size);
+    }
+
+    if (fd > 0) {
+        close(fd);
+    }
+
+    if (previous_map_handle) {
+        munmap(previous_map_handle, previous_sb.st_size);
+    }
+
+    if (previous_fd > 0) {
+        close(previous_fd);
+    }
+
+    free(sorted_previous_blocks);
+    free(diff.page_states);
+
+    if (!success) {
+        free(list.blocks);
+    }
+
+    return success;
+}
+
+/**
+ * A range of file offsets [start, end) which holds code. Seeds, which are code of unknown extent, have end == start.
+ */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} code_region;
+
+/**
+ * A growable buffer of code regions
+ */
+typedef struct {
+    code_region *regions;
+    uint64_t count;
+    uint64_t capacity;
+} region_list;
+
+/**
+ * Appends a region to a list
+ * @return false if out of memory
+ */
+static bool append_region(region_list *list, uint64_t start, uint64_t end) {
+    if (list->count >= list->capacity) {
+        uint64_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+        code_region *new_regions = realloc(list->regions, sizeof(code_region) * new_capacity);
+        if (!new_regions) {
+            printf(TAG "Out of memory!\n");
+            return false;
+        }
+
+        list->regions = new_regions;
+        list->capacity = new_capacity;
+    }
+
+    list->regions[list->count].start = start;
+    list->regions[list->count].end = end;
+    list->count++;
+    return true;
+}
+
+static int compare_regions_by_start(const void *a, const void *b) {
+    const code_region *region_a = a;
+    const code_region *region_b = b;
+    return (region_a->start > region_b->start) - (region_a->start < region_b->start);
+}
+
+/**
+ * Finds the executable section which holds a virtual address or file offset
+ * @return The section or NULL if no executable section holds the position
+ */
+static const Elf64_Shdr *find_executable_section(const Elf64_Ehdr *header, const uint8_t *image, uint64_t image_size,
+                                                 uint64_t position, bool position_is_address) {
+    for (int i = 0; i < header->e_shnum; i++) {
+        const Elf64_Shdr *sh_header = (const Elf64_Shdr *) (image + header->e_shoff + sizeof(Elf64_Shdr) * i);
+        if (!(sh_header->sh_flags & SHF_EXECINSTR) || sh_header->sh_type == SHT_NOBITS
+            || sh_header->sh_offset > image_size || sh_header->sh_offset + sh_header->sh_size > image_size) {
+            continue;
+        }
+
+        uint64_t section_start = position_is_address ? sh_header->sh_addr : sh_header->sh_offset;
+        if (position >= section_start && position - section_start < sh_header->sh_size) {
+            return sh_header;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Adds a function which starts at a virtual address to either the extents (if its size is known) or the seeds
+ * @return false if out of memory
+ */
+static bool add_function(const Elf64_Ehdr *header, const uint8_t *image, uint64_t image_size, uint64_t address,
+                         uint64_t size, region_list *extents, region_list *seeds) {
+    const Elf64_Shdr *section = find_executable_section(header, image, image_size, address, true);
+    if (!section) {
+        return true;
+    }
+
+    uint64_t offset = address - section->sh_addr + section->sh_offset;
+    if (!size) {
+        return append_region(seeds, offset, offset);
+    }
+
+    uint64_t section_end = section->sh_offset + section->sh_size;
+    return append_region(extents, offset, size < section_end - offset ? offset + size : section_end);
+}
+
+/**
+ * Collects the functions described by the binary's symbol tables
+ * @return false if out of memory
+ */
+static bool collect_symbol_functions(const Elf64_Ehdr *header, const uint8_t *image, uint64_t image_size,
+                                     region_list *extents, region_list *seeds) {
+    for (int i = 0; i < header->e_shnum; i++) {
+        const Elf64_Shdr *sh_header = (const Elf64_Shdr *) (image + header->e_shoff + sizeof(Elf64_Shdr) * i);
+        if ((sh_header->sh_type != SHT_SYMTAB && sh_header->sh_type != SHT_DYNSYM)
+            || sh_header->sh_entsize != sizeof(Elf64_Sym)
+            || sh_header->sh_offset > image_size || sh_header->sh_offset + sh_header->sh_size > image_size) {
+            continue;
+        }
+
+        const Elf64_Sym *symbols = (const Elf64_Sym *) (image + sh_header->sh_offset);
+        for (uint64_t j = 0; j < sh_header->sh_size / sizeof(Elf64_Sym); j++) {
+            const Elf64_Sym *symbol = symbols + j;
+            uint8_t type = ELF64_ST_TYPE(symbol->st_info);
+            if ((type == STT_FUNC || type == STT_GNU_IFUNC) && symbol->st_shndx != SHN_UNDEF
+                && !add_function(header, image, image_size, symbol->st_value, symbol->st_size, extents, seeds)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * DWARF exception header pointer encodings (see the LSB's description of .eh_frame)
+ */
+#define DW_EH_PE_absptr (0x00)
+#define DW_EH_PE_uleb128 (0x01)
+#define DW_EH_PE_udata2 (0x02)
+#define DW_EH_PE_udata4 (0x03)
+#define DW_EH_PE_udata8 (0x04)
+#define DW_EH_PE_sleb128 (0x09)
+#define DW_EH_PE_sdata2 (0x0A)
+#define DW_EH_PE_sdata4 (0x0B)
+#define DW_EH_PE_sdata8 (0x0C)
+#define DW_EH_PE_pcrel (0x10)
+#define DW_EH_PE_omit (0xFF)
+
+static bool read_uleb128(const uint8_t **cursor, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (uint32_t shift = 0; *cursor < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*cursor)++;
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool read_sleb128(const uint8_t **cursor, const uint8_t *end, int64_t *value) {
+    uint64_t result = 0;
+    for (uint32_t shift = 0; *cursor < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*cursor)++;
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            if (shift + 7 < 64 && (byte & 0x40)) {
+                result |= ~0LLU << (shift + 7);
+            }
+            *value = (int64_t) result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Reads a pointer encoded using a DW_EH_PE_* encoding
+ * @param field_address The virtual address of the pointer, used for pc relative pointers
+ * @return false if the pointer is truncated or uses an encoding we don't support
+ */
+static bool read_encoded_pointer(const uint8_t **cursor, const uint8_t *end, uint8_t encoding,
+                                 uint64_t field_address, uint64_t *value) {
+    uint64_t remaining = end - *cursor;
+    uint64_t size = 0;
+    switch (encoding & 0x0F) {
+        case DW_EH_PE_absptr:
+        case DW_EH_PE_udata8:
+        case DW_EH_PE_sdata8:
+            size = 8;
+            break;
+        case DW_EH_PE_udata4:
+        case DW_EH_PE_sdata4:
+            size = 4;
+            break;
+        case DW_EH_PE_udata2:
+        case DW_EH_PE_sdata2:
+            size = 2;
+            break;
+        case DW_EH_PE_uleb128:
+            if (!read_uleb128(cursor, end, value)) {
+                return false;
+            }
+            break;
+        case DW_EH_PE_sleb128:
+            if (!read_sleb128(cursor, end, (int64_t *) value)) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+    }
+
+    if (size) {
+        if (remaining < size) {
+            return false;
+        }
+
+        const uint8_t *bytes = *cursor;
+        switch (encoding & 0x0F) {
+            case DW_EH_PE_udata2:
+                *value = (uint16_t) (bytes[0] | bytes[1] << 8);
+                break;
+            case DW_EH_PE_sdata2:
+                *value = (int64_t) (int16_t) (bytes[0] | bytes[1] << 8);
+                break;
+            case DW_EH_PE_udata4:
+                *value = *(const uint32_t *) bytes;
+                break;
+            case DW_EH_PE_sdata4:
+                *value = (int64_t) *(const int32_t *) bytes;
+                break;
+            default:
+                *value = *(const uint64_t *) bytes;
+                break;
+        }
+        *cursor += size;
+    }
+
+    switch (encoding & 0x70) {
+        case 0:
+            return true;
+        case DW_EH_PE_pcrel:
+            *value += field_address;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Reads the FDE pointer encoding from a CIE
+ * @param cie The start of the CIE, at its length field
+ * @return false if the CIE is malformed or uses features we don't support
+ */
+static bool read_cie_pointer_encoding(const uint8_t *cie, const uint8_t *end, uint64_t cie_address,
+                                      uint8_t *encoding) {
+    const uint8_t *cursor = cie;
+    if (end - cursor < 8 || *(const uint32_t *) cursor == 0xFFFFFFFF) {
+        return false;
+    }
+
+    uint32_t length = *(const uint32_t *) cursor;
+    if (length < 4 || length > end - cursor - 4 || *(const uint32_t *) (cursor + 4) != 0) {
+        return false;
+    }
+    end = cursor + 4 + length;
+    cursor += 8;
+
+    uint8_t version = *cursor++;
+    const char *augmentation = (const char *) cursor;
+    while (cursor < end && *cursor) {
+        cursor++;
+    }
+    if (cursor++ >= end) {
+        return false;
+    }
+
+    uint64_t unused;
+    int64_t unused_signed;
+    if (!read_uleb128(&cursor, end, &unused) || !read_sleb128(&cursor, end, &unused_signed)) {
+        return false;
+    }
+
+    if (version == 1) {
+        cursor++;
+    } else if (!read_uleb128(&cursor, end, &unused)) {
+        return false;
+    }
+
+    *encoding = DW_EH_PE_absptr;
+    if (augmentation[0] != 'z') {
+        //Without augmentation data, FDEs use absolute pointers
+        return augmentation[0] == '\0';
+    }
+
+    if (!read_uleb128(&cursor, end, &unused)) {
+        return false;
+    }
+
+    for (const char *c = augmentation + 1; *c && cursor < end; c++) {
+        switch (*c) {
+            case 'R':
+                *encoding = *cursor;
+                return true;
+            case 'P': {
+                uint8_t personality_encoding = *cursor++;
+                if (!read_encoded_pointer(&cursor, end, personality_encoding & 0x7F,
+                                          cie_address + (cursor - cie), &unused)) {
+                    return false;
+                }
+                break;
+            }
+            case 'L':
+                cursor++;
+                break;
+            case 'S':
+            case 'B':
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Collects the functions described by the FDEs of the binary's .eh_frame section. Nearly every function of a modern
+ * x86_64 binary has one, even when the binary is stripped.
+ * @return false if out of memory
+ */
+static bool collect_eh_frame_functions(const Elf64_Ehdr *header, const uint8_t *image, uint64_t image_size,
+                                       region_list *extents, region_list *seeds) {
+    if (header->e_shstrndx >= header->e_shnum) {
+        return true;
+    }
+
+    const Elf64_Shdr *names = (const Elf64_Shdr *) (image + header->e_shoff
+                                                    + sizeof(Elf64_Shdr) * header->e_shstrndx);
+    if (names->sh_offset > image_size || names->sh_offset + names->sh_size > image_size) {
+        return true;
+    }
+
+    for (int i = 0; i < header->e_shnum; i++) {
+        const Elf64_Shdr *sh_header = (const Elf64_Shdr *) (image + header->e_shoff + sizeof(Elf64_Shdr) * i);
+        if (sh_header->sh_name >= names->sh_size
+            || strncmp((const char *) image + names->sh_offset + sh_header->sh_name, ".eh_frame",
+                       names->sh_size - sh_header->sh_name) != 0
+            || sh_header->sh_type == SHT_NOBITS
+            || sh_header->sh_offset > image_size || sh_header->sh_offset + sh_header->sh_size > image_size) {
+            continue;
+        }
+
+        const uint8_t *start = image + sh_header->sh_offset;
+        const uint8_t *end = start + sh_header->sh_size;
+        const uint8_t *cursor = start;
+        while (end - cursor >= 8) {
+            uint32_t length = *(const uint32_t *) cursor;
+            if (length == 0 || length == 0xFFFFFFFF || length > end - cursor - 4) {
+                //A terminator, or a 64-bit length which nothing emits for x86_64
+                break;
+            }
+
+            const uint8_t *record = cursor;
+            const uint8_t *record_end = cursor + 4 + length;
+            cursor = record_end;
+
+            uint32_t cie_pointer = *(const uint32_t *) (record + 4);
+            if (cie_pointer == 0 || cie_pointer > record + 4 - start) {
+                //A CIE (or a broken FDE)
+                continue;
+            }
+
+            const uint8_t *cie = record + 4 - cie_pointer;
+            uint8_t encoding;
+            if (!read_cie_pointer_encoding(cie, end, sh_header->sh_addr + (cie - start), &encoding)
+                || encoding == DW_EH_PE_omit) {
+                continue;
+            }
+
+            const uint8_t *field = record + 8;
+            uint64_t function_address;
+            uint64_t function_size;
+            if (!read_encoded_pointer(&field, record_end, encoding, sh_header->sh_addr + (field - start),
+                                      &function_address)
+                || !read_encoded_pointer(&field, record_end, encoding & 0x0F, 0, &function_size)) {
+                continue;
+            }
+
+            if (function_size
+                && !add_function(header, image, image_size, function_address, function_size, extents, seeds)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * State shared by the sweeps of a hybrid disassembly
+ */
+typedef struct {
+    const Elf64_Ehdr *header;
+    const uint8_t *image;
+    uint64_t image_size;
+    bool full_decode;
+
+    /** A bit for each byte of the image, set once the byte is known to belong to a region */
+    uint64_t *coverage;
+
+    /** Direct branch targets which have not been disassembled yet */
+    region_list pending;
+
+    /** Code which falls through into another region without a COFI and so belongs to that region's first block */
+    region_list prefixes;
+
+    block_list list;
+} hybrid_context;
+
+static inline bool is_covered(const hybrid_context *context, uint64_t offset) {
+    return (context->coverage[offset / 64] >> (offset % 64)) & 1;
+}
+
+static void mark_covered(hybrid_context *context, uint64_t start, uint64_t end) {
+    for (uint64_t offset = start; offset < end; offset++) {
+        context->coverage[offset / 64] |= 1LLU << (offset % 64);
+    }
+}
+
+/**
+ * Sweeps a region of code, committing its blocks and queueing any direct branch targets we haven't seen yet
+ * @param descend If set, the region's extent is unknown. The sweep stops after the first unconditional branch or
+ * return, or when it runs into code belonging to another region, and marks what it decoded as covered.
+ * @return false if out of memory
+ */
+static bool sweep_region(hybrid_context *context, uint64_t start, uint64_t end, bool descend) {
+    uint64_t offset = start;
+    context->list.block_start = start;
+    while (offset < end) {
+        decoded_instruction decoded;
+        xed_error_enum_t result = decode_instruction(context->image, context->image_size, offset,
+                                                     context->full_decode, &decoded);
+        if (result != XED_ERROR_NONE || decoded.length > end - offset) {
+            //Whatever follows is not code we understand, and an instruction may not spill into the next region
+            break;
+        }
+
+        uint64_t next_offset = offset + decoded.length;
+        if (descend) {
+            if (is_covered(context, offset)) {
+                return offset == context->list.block_start
+                       || append_region(&context->prefixes, context->list.block_start, offset);
+            }
+
+            for (uint64_t i = offset + 1; i < next_offset; i++) {
+                if (is_covered(context, i)) {
+                    //We've desynchronized from the other region's instructions
+                    return true;
+                }
+            }
+            mark_covered(context, offset, next_offset);
+        }
+
+        if (is_qualifying_cofi(decoded.category)) {
+            cofi_record cofi = {
+                    .offset = offset,
+                    .cofi_destination = decoded.cofi_destination,
+                    .length = decoded.length,
+                    .category = decoded.category
+            };
+            if (!commit_cofi(&context->list, &cofi)) {
+                return false;
+            }
+
+            if (decoded.cofi_destination < context->image_size && !is_covered(context, decoded.cofi_destination)
+                && !append_region(&context->pending, decoded.cofi_destination, decoded.cofi_destination)) {
+                return false;
+            }
+
+            if (descend && (decoded.category == XED_CATEGORY_UNCOND_BR || decoded.category == XED_CATEGORY_RET)) {
+                break;
+            }
+        }
+
+        offset = next_offset;
+    }
+
+    if (offset == end && offset != context->list.block_start) {
+        return append_region(&context->prefixes, context->list.block_start, offset);
+    }
+
+    return true;
+}
+
+/**
+ * Extends blocks which are fallen into by a prefix so that they start at the prefix
+ * @param blocks The blocks, sorted by their start
+ */
+static void apply_prefixes(region_list *prefixes, hh_disassembly_block *blocks, int64_t block_count) {
+    //Prefixes can chain, so handle later prefixes first to let earlier ones find the block they were merged into
+    qsort(prefixes->regions, prefixes->count, sizeof(code_region), compare_regions_by_start);
+    for (uint64_t i = prefixes->count; i > 0; i--) {
+        code_region *prefix = prefixes->regions + i - 1;
+        int64_t low = 0;
+        int64_t high = block_count - 1;
+        while (low <= high) {
+            int64_t middle = low + (high - low) / 2;
+            if (blocks[middle].start_offset < prefix->end) {
+                low = middle + 1;
+            } else if (blocks[middle].start_offset > prefix->end) {
+                high = middle - 1;
+            } else {
+                blocks[middle].length += (uint32_t) (prefix->end - prefix->start);
+                blocks[middle].start_offset = prefix->start;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Disassembles only the code we can find rather than everything in executable sections. Functions with a known extent
+ * (from the symbol tables and .eh_frame) are swept from their true start to their end, which keeps the sweep aligned
+ * and skips the padding and data between functions. Code outside of those functions is found by recursive descent
+ * from the entry point, functions without a size, and direct branch targets.
+ */
+static bool get_blocks_from_elf_hybrid(const char *path, hh_disassembly_block **blocks, int64_t *blocks_count,
+                                       uint32_t flags) {
+    int fd = 0;
+    void *map_handle = NULL;
+    region_list extents = {0};
+    hybrid_context context = {0};
+    bool success = false;
+    struct stat sb;
+
+    Elf64_Ehdr *header = map_elf(path, &fd, &map_handle, &sb);
+    if (!header) {
+        goto CLEANUP;
+    }
+
+    context.header = header;
+    context.image = map_handle;
+    context.image_size = sb.st_size;
+    context.full_decode = flags & HH_DISASSEMBLY_FLAG_FULL_DECODE;
+    context.list.capacity = 16;
+    if (!(context.coverage = calloc(sb.st_size / 64 + 1, sizeof(uint64_t)))
+        || !(context.list.blocks = malloc(sizeof(hh_disassembly_block) * context.list.capacity))) {
+        printf(TAG "Out of memory!\n");
+        goto CLEANUP;
+    }
+
+    if (!add_function(header, map_handle, sb.st_size, header->e_entry, 0, &extents, &context.pending)
+        || !collect_symbol_functions(header, map_handle, sb.st_size, &extents, &context.pending)
+        || !collect_eh_frame_functions(header, map_handle, sb.st_size, &extents, &context.pending)) {
+        goto CLEANUP;
+    }
+
+    //Symbols and FDEs describe many functions twice, so merge the extents which overlap
+    uint64_t merged_count = 0;
+    if (extents.count) {
+        qsort(extents.regions, extents.count, sizeof(code_region), compare_regions_by_start);
+        merged_count = 1;
+        for (uint64_t i = 1; i < extents.count; i++) {
+            code_region *merged = extents.regions + merged_count - 1;
+            if (extents.regions[i].start < merged->end) {
+                if (extents.regions[i].end > merged->end) {
+                    merged->end = extents.regions[i].end;
+                }
+            } else {
+                extents.regions[merged_count++] = extents.regions[i];
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i < merged_count; i++) {
+        mark_covered(&context, extents.regions[i].start, extents.regions[i].end);
+    }
+
+    for (uint64_t i = 0; i < merged_count; i++) {
+        if (!sweep_region(&context, extents.regions[i].start, extents.regions[i].end, false)) {
+            goto CLEANUP;
+        }
+    }
+
+    while (context.pending.count) {
+        uint64_t seed = context.pending.regions[--context.pending.count].start;
+        const Elf64_Shdr *section = find_executable_section(header, map_handle, sb.st_size, seed, false);
+        if (!section || is_covered(&context, seed)) {
+            continue;
+        }
+
+        if (!sweep_region(&context, seed, section->sh_offset + section->sh_size, true)) {
+            goto CLEANUP;
+        }
+    }
+
+    //Regions are found out of order, but the blocks of different regions never overlap
+    qsort(context.list.blocks, context.list.count, sizeof(hh_disassembly_block), compare_blocks_by_start);
+    apply_prefixes(&context.prefixes, context.list.blocks, (int64_t) context.list.count);
+
+    success = true;
+    *blocks = context.list.blocks;
+    *blocks_count = context.list.count;
+
+    CLEANUP:
+    if (map_handle) {
+        munmap(map_handle, sb.st_size);
+    }
+
+    if (fd > 0) {
+        close(fd);
+    }
+
+    free(extents.regions);
+    free(context.pending.regions);
+    free(context.prefixes.regions);
+    free(context.coverage);
+
+    if (!success) {
+        free(context.list.blocks);
+    }
+
+    return success;
+}
+
+/**
+ * Gets an executable region of a binary. Regions are either the executable sections, whose blocks are recorded at
+ * their file offsets, or with HH_DISASSEMBLY_FLAG_SEGMENTS the executable PT_LOAD segments, whose blocks are recorded
+ * at their virtual addresses.
+ * @param i The index of the section or program header
+ * @param offset The location to place the file offset of the region
+ * @param size The location to place the size of the region in the file
+ * @param address The location to place the address the first byte of the region is recorded at
+ * @return false if the header does not describe an executable region
+ */
+static bool get_executable_region(const Elf64_Ehdr *header, const uint8_t *image, bool segments, int i,
+                                  uint64_t *offset, uint64_t *size, uint64_t *address) {
+    if (segments) {
+        const Elf64_Phdr *ph_header = (const Elf64_Phdr *) (image + header->e_phoff) + i;
+        *offset = ph_header->p_offset;
+        *size = ph_header->p_filesz;
+        *address = ph_header->p_vaddr;
+        return ph_header->p_type == PT_LOAD && (ph_header->p_flags & PF_X);
+    }
+
+    //Skip non-executable sections (poor man's __TEXT filter)
+    const Elf64_Shdr *sh_header = (const Elf64_Shdr *) (image + header->e_shoff) + i;
+    *offset = sh_header->sh_offset;
+    *size = sh_header->sh_size;
+    *address = sh_header->sh_offset;
+    return sh_header->sh_flags & SHF_EXECINSTR;
+}
+
+/**
+ * Moves blocks (and their branch destinations, which are relative to them) by a delta
+ */
+static void relocate_blocks(hh_disassembly_block *blocks, int64_t block_count, uint64_t delta) {
+    for (int64_t i = 0; delta && i < block_count; i++) {
+        blocks[i].start_offset += delta;
+        if (blocks[i].cofi_destination != UINT64_MAX) {
+            blocks[i].cofi_destination += delta;
+        }
+    }
+}
+
+bool hh_disassembly_get_preferred_load_base_from_elf(const char *path, uint64_t *load_base) {
+    int fd = 0;
+    void *map_handle = NULL;
+    bool success = false;
+    struct stat sb;
+
+    Elf64_Ehdr *header = map_elf(path, &fd, &map_handle, &sb);
+    const Elf64_Phdr *ph_headers = header ? get_program_headers(header, sb.st_size) : NULL;
+    if (!ph_headers) {
+        goto CLEANUP;
+    }
+
+    //The kernel places the lowest segment and lays the rest out relative to it
+    for (int i = 0; i < header->e_phnum; i++) {
+        if (ph_headers[i].p_type == PT_LOAD
+            && (!success || ph_headers[i].p_vaddr - ph_headers[i].p_offset < *load_base)) {
+            *load_base = ph_headers[i].p_vaddr - ph_headers[i].p_offset;
+            success = true;
+        }
+    }
+
+    if (!success) {
+        printf(TAG "'%s' has no loadable segments!\n", path);
+    }
+
+    CLEANUP:
+    if (map_handle) {
+        munmap(map_handle, sb.st_size);
+    }
+
+    if (fd > 0) {
+        close(fd);
+    }
+
+    return success;
+}
+
+/**
+ * Finds the file offset of a virtual address using the binary's PT_LOAD segments
+ * @return false if no segment loads the address from the file
+ */
+static bool address_to_offset(const Elf64_Ehdr *header, const Elf64_Phdr *ph_headers, uint64_t address,
+                              uint64_t *offset) {
+    for (int i = 0; i < header->e_phnum; i++) {
+        if (ph_headers[i].p_type == PT_LOAD && address >= ph_headers[i].p_vaddr
+            && address - ph_headers[i].p_vaddr < ph_headers[i].p_filesz) {
+            *offset = address - ph_headers[i].p_vaddr + ph_headers[i].p_offset;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool hh_disassembly_get_dependencies_from_elf(const char *path, char ***needed, uint64_t *needed_count, char **rpath,
+                                              char **runpath) {
+    int fd = 0;
+    void *map_handle = NULL;
+    bool success = false;
+    struct stat sb;
+    *needed = NULL;
+    *needed_count = 0;
+    *rpath = NULL;
+    *runpath = NULL;
+
+    Elf64_Ehdr *header = map_elf(path, &fd, &map_handle, &sb);
+    const Elf64_Phdr *ph_headers = header ? get_program_headers(header, sb.st_size) : NULL;
+    if (!ph_headers) {
+        goto CLEANUP;
+    }
+
+    const Elf64_Phdr *dynamic = NULL;
+    for (int i = 0; i < header->e_phnum; i++) {
+        if (ph_headers[i].p_type == PT_DYNAMIC) {
+            dynamic = ph_headers + i;
+        }
+    }
+
+    //Statically linked binaries don't depend on anything
+    if (!dynamic) {
+        success = true;
+        goto CLEANUP;
+    }
+
+    if (dynamic->p_offset > (uint64_t) sb.st_size || dynamic->p_filesz > sb.st_size - dynamic->p_offset) {
+        printf(TAG "Bad dynamic segment!\n");
+        goto CLEANUP;
+    }
+
+    const Elf64_Dyn *entries = map_handle + dynamic->p_offset;
+    uint64_t entry_count = dynamic->p_filesz / sizeof(Elf64_Dyn);
+    uint64_t string_table_address = 0;
+    uint64_t string_table_size = 0;
+    for (uint64_t i = 0; i < entry_count && entries[i].d_tag != DT_NULL; i++) {
+        if (entries[i].d_tag == DT_STRTAB) {
+            string_table_address = entries[i].d_un.d_ptr;
+        } else if (entries[i].d_tag == DT_STRSZ) {
+            string_table_size = entries[i].d_un.d_val;
+        }
+    }
+
+    uint64_t string_table_offset;
+    if (!address_to_offset(header, ph_headers, string_table_address, &string_table_offset)
+        || string_table_size > sb.st_size - string_table_offset) {
+        printf(TAG "Bad dynamic string table!\n");
+        goto CLEANUP;
+    }
+
+    const char *strings = map_handle + string_table_offset;
+    for (uint64_t i = 0; i < entry_count && entries[i].d_tag != DT_NULL; i++) {
+        if (entries[i].d_tag != DT_NEEDED && entries[i].d_tag != DT_RPATH && entries[i].d_tag != DT_RUNPATH) {
+            continue;
+        }
+
+        //Strings must be terminated inside of the table
+        uint64_t string_offset = entries[i].d_un.d_val;
+        if (string_offset >= string_table_size
+            || !memchr(strings + string_offset, '\0', string_table_size - string_offset)) {
+            printf(TAG "Bad dynamic string!\n");
+            goto CLEANUP;
+        }
+
+        char *string = strdup(strings + string_offset);
+        if (!string) {
+            printf(TAG "Out of memory!\n");
+            goto CLEANUP;
+        }
+
+        if (entries[i].d_tag == DT_RPATH) {
+            free(*rpath);
+            *rpath = string;
+        } else if (entries[i].d_tag == DT_RUNPATH) {
+            free(*runpath);
+            *runpath = string;
+        } else {
+            char **new_needed = realloc(*needed, sizeof(char *) * (*needed_count + 1));
+            if (!new_needed) {
+                printf(TAG "Out of memory!\n");
+                free(string);
+                goto CLEANUP;
+            }
+
+            *needed = new_needed;
+            (*needed)[(*needed_count)++] = string;
+        }
+    }
+
+    success = true;
+
+    CLEANUP:
+    if (map_handle) {
+        munmap(map_handle, sb.st_size);
+    }
+
+    if (fd > 0) {
+        close(fd);
+    }
+
+    if (!success) {
+        for (uint64_t i = 0; i < *needed_count; i++) {
+            free((*needed)[i]);
+        }
+        free(*needed);
+        free(*rpath);
+        free(*runpath);
+        *needed = NULL;
+        *needed_count = 0;
+        *rpath = NULL;
+        *runpath = NULL;
+    }
+
+    return success;
+}
+
+bool hh_disassembly_get_blocks_from_elf(const char *path, hh_disassembly_block **blocks, int64_t *blocks_count) {
+    return hh_disassembly_get_blocks_from_elf_with_threads(path, blocks, blocks_count, 1, 0);
+}
+
+bool hh_disassembly_get_blocks_from_elf_with_threads(const char *path, hh_disassembly_block **blocks,
+                                                     int64_t *blocks_count, uint32_t thread_count, uint32_t flags) {
+    if (flags & HH_DISASSEMBLY_FLAG_HYBRID) {
+        if (flags & HH_DISASSEMBLY_FLAG_SEGMENTS) {
+            printf(TAG "Hybrid disassembly can't sweep segments!\n");
+            return false;
+        }
+
+        return get_blocks_from_elf_hybrid(path, blocks, blocks_count, flags);
+    }
+
+    int fd = 0;
+    void *map_handle = NULL;
+    sweep_chunk *chunks = NULL;
+    uint64_t chunk_count = 0;
+    pthread_t *threads = NULL;
+    uint32_t threads_started = 0;
+    sweep_context context = {0};
+    block_list list = {0};
+    bool success = false;
+    struct stat sb;
+
+    Elf64_Ehdr *header = map_elf(path, &fd, &map_handle, &sb);
+    if (!header) {
+        goto CLEANUP;
+    }
+
+    bool segments = flags & HH_DISASSEMBLY_FLAG_SEGMENTS;
+    if (segments && !get_program_headers(header, sb.st_size)) {
+        goto CLEANUP;
+    }
+
+    list.capacity = 16;
+    if (!(list.blocks = malloc(sizeof(hh_disassembly_block) * list.capacity))) {
+        printf(TAG "Out of memory!\n");
+        goto CLEANUP;
+    }
+
+    //Split each executable region into chunks. We walk the regions twice: once to count and once to fill.
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t chunk_index = 0;
+        for (int i = 0; i < (segments ? header->e_phnum : header->e_shnum); i++) {
+            uint64_t region_offset, region_size, region_address;
+            if (!get_executable_region(header, map_handle, segments, i, &region_offset, &region_size,
+                                       &region_address)) {
+                continue;
+            }
+
+            if (region_offset > (uint64_t) sb.st_size || region_offset + region_size > (uint64_t) sb.st_size) {
+                if (pass == 0) {
+                    printf(TAG "Bad region defined by %s header. Skipping...\n", segments ? "program" : "section");
+                }
+                continue;
+            }
+
+            for (uint64_t start = 0; start < region_size; start += SWEEP_CHUNK_SIZE) {
+                if (pass == 1) {
+                    sweep_chunk *chunk = chunks + chunk_index;
+                    chunk->section_start = region_offset;
+                    chunk->address_delta = region_address - region_offset;
+                    chunk->start = region_offset + start;
+                    chunk->end = region_offset
+                                 + (region_size - start > SWEEP_CHUNK_SIZE ? start + SWEEP_CHUNK_SIZE : region_size);
+                }
+                chunk_index++;
+            }
+        }
+
+        if (pass == 0) {
+            chunk_count = chunk_index;
+            if (chunk_count && !(chunks = calloc(chunk_count, sizeof(sweep_chunk)))) {
+                printf(TAG "Out of memory!\n");
+                goto CLEANUP;
+            }
+        }
+    }
+
+    //Sweep every chunk. This thread merges chunks in order as they are finished, helping with the sweep while it
+    // waits, alongside however many extra workers we manage to start.
+    context.image = map_handle;
+    context.image_size = sb.st_size;
+    context.full_decode = flags & HH_DISASSEMBLY_FLAG_FULL_DECODE;
+    context.chunks = chunks;
+    context.chunk_count = chunk_count;
+    context.ended_section_start = UINT64_MAX;
+
+    if (thread_count > chunk_count) {
+        thread_count = chunk_count;
+    }
+
+    if (thread_count > 1 && (threads = calloc(thread_count - 1, sizeof(pthread_t)))) {
+        for (; threads_started < thread_count - 1; threads_started++) {
+            if (pthread_create(threads + threads_started, NULL, sweep_worker, &context)) {
+                break;
+            }
+        }
+    }
+
+    uint64_t offset = 0;
+    bool section_ended = false;
+    for (uint64_t i = 0; i < chunk_count; i++) {
+        sweep_chunk *chunk = chunks + i;
+        while (!__atomic_load_n(&chunk->done, __ATOMIC_ACQUIRE)) {
+            if (!sweep_next_chunk(&context)) {
+                sched_yield();
+            }
+        }
+
+        if (chunk->start == chunk->section_start) {
+            offset = chunk->start;
+            list.block_start = chunk->start;
+            section_ended = false;
+        }
+
+        if (!section_ended) {
+            if (chunk->out_of_memory) {
+                printf(TAG "Out of memory!\n");
+                goto CLEANUP;
+            }
+
+            //Every block committed while merging a chunk belongs to the chunk's section
+            int64_t first_new_block = list.count;
+            if (!merge_chunk(map_handle, sb.st_size, context.full_decode, chunk, &list, &offset, &section_ended)) {
+                goto CLEANUP;
+            }
+            relocate_blocks(list.blocks + first_new_block, list.count - first_new_block, chunk->address_delta);
+
+            if (section_ended) {
+                __atomic_store_n(&context.ended_section_start, chunk->section_start, __ATOMIC_RELAXED);
+            }
+        }
+
+        free(chunk->boundaries);
+        free(chunk->cofis);
+        chunk->boundaries = NULL;
+        chunk->cofis = NULL;
+    }
+
+    success = true;
+    *blocks = list.blocks;
+    *blocks_count = list.count;
+
+    CLEANUP:
+    //Workers may still be sweeping if we bailed out early, so stop handing out chunks and wait for them
+    __atomic_store_n(&context.next_chunk, chunk_count, __ATOMIC_RELAXED);
+
+    for (uint32_t i = 0; i < threads_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (map_handle) {
+        munmap(map_handle, sb.st_size);
+    }
+
+    if (fd > 0) {
+        close(fd);
+    }
+
+    for (uint64_t i = 0; chunks && i < chunk_count; i++) {
+        free(chunks[i].boundaries);
+        free(chunks[i].cofis);
+    }
+    free(chunks);
+    free(threads);
+
+    if (!success) {
+        free(list.blocks);
+    }
+
+    return success;
+}
@@ -19,6 +19,28 @@ typedef struct {
     uint16_t instruction_category;
 } hh_disassembly_block;
 
+/**
+ * Fully decode every instruction rather than only those which might be COFIs. This is much slower and only exists to
+ * check the fast path since the result is identical.
+ */
+#define HH_DISASSEMBLY_FLAG_FULL_DECODE (1U << 0)
+
+/**
+ * Only disassemble code which we can find rather than sweeping entire executable sections. Functions described by the
+ * symbol tables and .eh_frame are swept individually and any other code is found by recursive descent from the entry
+ * point and direct branch targets. This avoids the spurious blocks which sweeping through padding and embedded data
+ * creates, but may miss code which is only reached indirectly. This is always single threaded.
+ */
+#define HH_DISASSEMBLY_FLAG_HYBRID (1U << 1)
+
+/**
+ * Sweep the executable PT_LOAD segments described by the program headers rather than the executable sections and
+ * record blocks at their virtual addresses rather than their file offsets. This works for binaries which have been
+ * stripped of their section headers. Hives of these blocks are HB_HIVE_ADDRESS_KIND_VIRTUAL. Cannot be combined with
+ * HH_DISASSEMBLY_FLAG_HYBRID or incremental disassembly, which both work from the section headers.
+ */
+#define HH_DISASSEMBLY_FLAG_SEGMENTS (1U << 2)
+
 /**
  * Iterates the basic blocks inside of an ELF binary
  * @param path The path to the ELF binary
@@ -28,5 +50,71 @@ typedef struct {
  */
 bool hh_disassembly_get_blocks_from_elf(const char *path, hh_disassembly_block **blocks, int64_t *blocks_count);
 
+/**
+ * Iterates the basic blocks inside of an ELF binary using several threads. The result is identical to
+ * hh_disassembly_get_blocks_from_elf.
+ * @param path The path to the ELF binary
+ * @param blocks The location to place a pointer to a buffer of blocks. You are responsible for freeing this buffer.
+ * @param blocks_count The location to place the number of blocks in the blocks buffer
+ * @param thread_count The number of threads to sweep with, including the calling thread
+ * @param flags A bitwise OR of HH_DISASSEMBLY_FLAG_* values
+ * @return true on success
+ */
+bool hh_disassembly_get_blocks_from_elf_with_threads(const char *path, hh_disassembly_block **blocks,
+                                                     int64_t *blocks_count, uint32_t thread_count, uint32_t flags);
+
+/**
+ * Iterates the basic blocks inside of an ELF binary, reusing the blocks of a previous build of it wherever the code
+ * has not changed. Only the changed code and the few instructions around it are disassembled again. The result is
+ * identical to hh_disassembly_get_blocks_from_elf.
+ * @param path The path to the ELF binary
+ * @param previous_path The path to the previous build of the binary
+ * @param previous_blocks The blocks of the previous build, as found by the other hh_disassembly_get_blocks_* functions
+ * @param previous_block_count The number of blocks in previous_blocks
+ * @param blocks The location to place a pointer to a buffer of blocks. You are responsible for freeing this buffer.
+ * @param blocks_count The location to place the number of blocks in the blocks buffer
+ * @param reused_count The location to place the number of blocks which were reused from the previous build
+ * @param flags A bitwise OR of HH_DISASSEMBLY_FLAG_* values
+ * @return true on success
+ */
+bool hh_disassembly_get_blocks_from_elf_incrementally(const char *path, const char *previous_path,
+                                                      const hh_disassembly_block *previous_blocks,
+                                                      int64_t previous_block_count, hh_disassembly_block **blocks,
+                                                      int64_t *blocks_count, int64_t *reused_count, uint32_t flags);
+
+/**
+ * Reads the GNU build-id note of an ELF binary
+ * @param path The path to the ELF binary
+ * @param build_id The buffer to place the build-id in
+ * @param build_id_capacity The size of the build_id buffer
+ * @param build_id_size The location to place the size of the build-id. This is zero if the binary has no build-id.
+ * @return true on success, even if the binary has no build-id
+ */
+bool hh_disassembly_get_build_id_from_elf(const char *path, uint8_t *build_id, uint32_t build_id_capacity,
+                                          uint32_t *build_id_size);
+
+/**
+ * Gets the virtual address at which an ELF binary expects the start of its file to be loaded. This is the lowest
+ * PT_LOAD segment's address less its file offset, and so is zero for most position independent binaries.
+ * @param path The path to the ELF binary
+ * @param load_base The location to place the load base
+ * @return true on success
+ */
+bool hh_disassembly_get_preferred_load_base_from_elf(const char *path, uint64_t *load_base);
+
+/**
+ * Reads the libraries which an ELF binary directly depends on along with where it asks for them to be searched for
+ * @param path The path to the ELF binary
+ * @param needed The location to place a buffer of the DT_NEEDED library names. You are responsible for freeing each
+ * name and the buffer.
+ * @param needed_count The location to place the number of names in needed
+ * @param rpath The location to place the binary's DT_RPATH or NULL if it has none. You are responsible for freeing it.
+ * @param runpath The location to place the binary's DT_RUNPATH or NULL if it has none. You are responsible for freeing
+ * it.
+ * @return true on success, even if the binary is statically linked
+ */
+bool hh_disassembly_get_dependencies_from_elf(const char *path, char ***needed, uint64_t *needed_count, char **rpath,
+                                              char **runpath);
+
 
 #endif //HONEY_MIRROR_HH_DISASSEMBLY_H
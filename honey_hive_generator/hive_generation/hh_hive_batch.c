@@ -0,0 +1,462 @@
+//
+// Created by Allison Husain on 3/29/21.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "hh_hive_batch.h"
+#include "hh_hive_cache.h"
+#include "../disassembly/hh_disassembly.h"
+#include "../disassembly/elf.h"
+
+#define TAG "[" __FILE__ "] "
+
+/**
+ * The directories which the dynamic loader searches once it has exhausted every path it was given
+ */
+static const char *const default_library_directories[] = {
+        "/lib/x86_64-linux-gnu",
+        "/usr/lib/x86_64-linux-gnu",
+        "/lib64",
+        "/usr/lib64",
+        "/lib",
+        "/usr/lib",
+};
+
+/**
+ * A growable buffer of owned paths
+ */
+typedef struct {
+    char **paths;
+    uint64_t count;
+    uint64_t capacity;
+} path_list;
+
+static bool path_list_contains(const path_list *list, const char *path) {
+    for (uint64_t i = 0; i < list->count; i++) {
+        if (!strcmp(list->paths[i], path)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Appends a copy of a path to a list
+ * @return false if out of memory
+ */
+static bool append_path(path_list *list, const char *path) {
+    if (list->count >= list->capacity) {
+        uint64_t new_capacity = list->capacity ? list->capacity * 2 : 16;
+        char **new_paths = realloc(list->paths, sizeof(char *) * new_capacity);
+        if (!new_paths) {
+            printf(TAG "Out of memory!\n");
+            return false;
+        }
+
+        list->paths = new_paths;
+        list->capacity = new_capacity;
+    }
+
+    if (!(list->paths[list->count] = strdup(path))) {
+        printf(TAG "Out of memory!\n");
+        return false;
+    }
+
+    list->count++;
+    return true;
+}
+
+/**
+ * Checks that a file is an x86_64 ELF. Library directories may also hold libraries for other architectures, which the
+ * dynamic loader skips over.
+ */
+static bool is_x86_64_elf(const char *path) {
+    Elf64_Ehdr header;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool result = read(fd, &header, sizeof(header)) == sizeof(header)
+                  && memcmp(header.e_ident, ELFMAG, SELFMAG) == 0
+                  && header.e_ident[EI_CLASS] == ELFCLASS64
+                  && header.e_machine == EM_X86_64;
+    close(fd);
+    return result;
+}
+
+/**
+ * Copies a search directory, replacing $ORIGIN and ${ORIGIN} with the directory of the binary which asked for it
+ * @param directory The directory, which does not need to be terminated
+ * @param directory_length The length of directory
+ * @return false if the expanded directory does not fit in out
+ */
+static bool expand_origin(const char *directory, size_t directory_length, const char *origin, char *out,
+                          size_t out_size) {
+    size_t out_length = 0;
+    for (size_t i = 0; i < directory_length;) {
+        const char *append;
+        size_t append_length;
+        if (directory_length - i >= 7 && !strncmp(directory + i, "$ORIGIN", 7)) {
+            append = origin;
+            append_length = strlen(origin);
+            i += 7;
+        } else if (directory_length - i >= 9 && !strncmp(directory + i, "${ORIGIN}", 9)) {
+            append = origin;
+            append_length = strlen(origin);
+            i += 9;
+        } else {
+            append = directory + i;
+            append_length = 1;
+            i++;
+        }
+
+        if (append_length >= out_size - out_length) {
+            return false;
+        }
+
+        memcpy(out + out_length, append, append_length);
+        out_length += append_length;
+    }
+
+    out[out_length] = '\0';
+    return true;
+}
+
+/**
+ * Searches a colon separated list of directories for a library
+ * @param path_out The buffer to place the real path of the library in. Must be PATH_MAX bytes.
+ * @return true if the library was found
+ */
+static bool search_directories(const char *directories, const char *name, const char *origin, char *path_out) {
+    while (directories) {
+        const char *separator = strchr(directories, ':');
+        size_t length = separator ? (size_t) (separator - directories) : strlen(directories);
+
+        //Empty entries mean the current directory
+        char directory[PATH_MAX];
+        char candidate[PATH_MAX];
+        if (expand_origin(directories, length, origin, directory, sizeof(directory))
+            && (size_t) snprintf(candidate, sizeof(candidate), "%s/%s", length ? directory : ".", name)
+               < sizeof(candidate)
+            && is_x86_64_elf(candidate) && realpath(candidate, path_out)) {
+            return true;
+        }
+
+        directories = separator ? separator + 1 : NULL;
+    }
+
+    return false;
+}
+
+/**
+ * Finds a library the way the dynamic loader would for a binary
+ * @param origin The directory holding the binary which needs the library
+ * @param rpath The binary's DT_RPATH or NULL
+ * @param runpath The binary's DT_RUNPATH or NULL
+ * @param path_out The buffer to place the real path of the library in. Must be PATH_MAX bytes.
+ * @return true if the library was found
+ */
+static bool find_library(const char *name, const char *origin, const char *rpath, const char *runpath,
+                         char *path_out) {
+    if (strchr(name, '/')) {
+        return is_x86_64_elf(name) && realpath(name, path_out);
+    }
+
+    //DT_RPATH is ignored when a binary has a DT_RUNPATH
+    if (rpath && !runpath && search_directories(rpath, name, origin, path_out)) {
+        return true;
+    }
+
+    const char *library_path = getenv("LD_LIBRARY_PATH");
+    if (library_path && *library_path && search_directories(library_path, name, origin, path_out)) {
+        return true;
+    }
+
+    if (runpath && search_directories(runpath, name, origin, path_out)) {
+        return true;
+    }
+
+    for (size_t i = 0; i < sizeof(default_library_directories) / sizeof(*default_library_directories); i++) {
+        if (search_directories(default_library_directories[i], name, origin, path_out)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Appends the direct dependencies of a binary to a list if they are not already in it
+ * @return Zero on success
+ */
+static int add_dependencies(path_list *list, const char *path) {
+    char **needed = NULL;
+    uint64_t needed_count = 0;
+    char *rpath = NULL;
+    char *runpath = NULL;
+    int result = 0;
+
+    if (!hh_disassembly_get_dependencies_from_elf(path, &needed, &needed_count, &rpath, &runpath)) {
+        printf(TAG "Could not read the dependencies of '%s'!\n", path);
+        return -1;
+    }
+
+    char origin[PATH_MAX];
+    snprintf(origin, sizeof(origin), "%s", path);
+    char *last_slash = strrchr(origin, '/');
+    if (last_slash) {
+        *last_slash = '\0';
+    }
+
+    for (uint64_t i = 0; i < needed_count; i++) {
+        char library_path[PATH_MAX];
+        if (!find_library(needed[i], origin, rpath, runpath, library_path)) {
+            printf(TAG "Could not find '%s' (needed by '%s'), skipping it\n", needed[i], path);
+            continue;
+        }
+
+        if (!path_list_contains(list, library_path) && !append_path(list, library_path)) {
+            result = -2;
+            break;
+        }
+    }
+
+    for (uint64_t i = 0; i < needed_count; i++) {
+        free(needed[i]);
+    }
+    free(needed);
+    free(rpath);
+    free(runpath);
+
+    return result;
+}
+
+int hh_hive_batch_resolve_dependencies(const char *const *elf_paths, uint64_t elf_count, char ***paths_out,
+                                       uint64_t *path_count_out) {
+    path_list list = {0};
+    int result = 0;
+
+    for (uint64_t i = 0; i < elf_count; i++) {
+        char path[PATH_MAX];
+        if (!realpath(elf_paths[i], path)) {
+            printf(TAG "Could not find '%s'!\n", elf_paths[i]);
+            result = -1;
+            goto CLEANUP;
+        }
+
+        if (!path_list_contains(&list, path) && !append_path(&list, path)) {
+            result = -2;
+            goto CLEANUP;
+        }
+    }
+
+    //The list grows as we go, so this visits every library in the closure exactly once
+    for (uint64_t i = 0; i < list.count; i++) {
+        if (add_dependencies(&list, list.paths[i])) {
+            result = -3;
+            goto CLEANUP;
+        }
+    }
+
+    *paths_out = list.paths;
+    *path_count_out = list.count;
+
+    CLEANUP:
+    if (result) {
+        hh_hive_batch_free_paths(list.paths, list.count);
+    }
+
+    return result;
+}
+
+int hh_hive_batch_read_list(const char *list_path, char ***paths_out, uint64_t *path_count_out) {
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    path_list list = {0};
+    int result = 0;
+
+    if (!(fp = fopen(list_path, "r"))) {
+        printf(TAG "Could not open list '%s'!\n", list_path);
+        return -1;
+    }
+
+    while (getline(&line, &line_capacity, fp) != -1) {
+        size_t length = strlen(line);
+        while (length && isspace((unsigned char) line[length - 1])) {
+            line[--length] = '\0';
+        }
+
+        char *cursor = line;
+        while (isspace((unsigned char) *cursor)) {
+            cursor++;
+        }
+
+        if (*cursor == '\0' || *cursor == '#') {
+            continue;
+        }
+
+        if (!append_path(&list, cursor)) {
+            result = -2;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (result) {
+        hh_hive_batch_free_paths(list.paths, list.count);
+        return result;
+    }
+
+    *paths_out = list.paths;
+    *path_count_out = list.count;
+    return 0;
+}
+
+void hh_hive_batch_free_paths(char **paths, uint64_t path_count) {
+    for (uint64_t i = 0; paths && i < path_count; i++) {
+        free(paths[i]);
+    }
+
+    free(paths);
+}
+
+/**
+ * Work shared between batch workers
+ */
+typedef struct {
+    const char *const *elf_paths;
+    uint64_t elf_count;
+    const char *cache_directory;
+
+    /** The number of threads each worker disassembles with */
+    uint32_t disassembly_thread_count;
+
+    /** The index of the next binary to be claimed by a worker. Accessed atomically. */
+    uint64_t next_elf;
+
+    /** The number of hives which had to be generated. Accessed atomically. */
+    uint64_t generated_count;
+
+    /** The number of binaries whose hive could not be found or generated. Accessed atomically. */
+    uint64_t failed_count;
+} batch_context;
+
+static void *batch_worker(void *context_) {
+    batch_context *context = context_;
+    uint64_t i;
+    while ((i = __atomic_fetch_add(&context->next_elf, 1, __ATOMIC_RELAXED)) < context->elf_count) {
+        bool generated = false;
+        hb_hive *hive = hh_hive_cache_open_for_elf_with_threads(context->elf_paths[i], context->cache_directory,
+                                                                HB_HIVE_LOAD_FLAG_ZERO_COPY,
+                                                                context->disassembly_thread_count, &generated);
+        if (!hive) {
+            printf(TAG "Could not get a hive for '%s'!\n", context->elf_paths[i]);
+            __atomic_fetch_add(&context->failed_count, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        hb_hive_free(hive);
+        if (generated) {
+            __atomic_fetch_add(&context->generated_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Writes a manifest listing the cached hive of each binary
+ * @return Zero on success
+ */
+static int write_manifest(const char *const *elf_paths, uint64_t elf_count, const char *cache_directory,
+                          const char *manifest_path) {
+    char absolute_cache_directory[PATH_MAX];
+    FILE *fp = NULL;
+    int result = 0;
+
+    //Hives are listed by absolute path so that the manifest can be moved around
+    if (!realpath(cache_directory, absolute_cache_directory)) {
+        printf(TAG "Could not find cache directory '%s'!\n", cache_directory);
+        return -1;
+    }
+
+    if (!(fp = fopen(manifest_path, "w"))) {
+        printf(TAG "Could not open manifest '%s'!\n", manifest_path);
+        return -2;
+    }
+
+    fprintf(fp, "# Generated by honey_hive_generator. Replace each slide with where its image was loaded.\n");
+    for (uint64_t i = 0; i < elf_count; i++) {
+        char hive_path[PATH_MAX];
+        if (hh_hive_cache_get_path(elf_paths[i], absolute_cache_directory, hive_path, sizeof(hive_path))) {
+            printf(TAG "Could not get the cache entry for '%s'!\n", elf_paths[i]);
+            result = -3;
+            break;
+        }
+
+        fprintf(fp, "# %s\n0 %s\n", elf_paths[i], hive_path);
+    }
+
+    if (fclose(fp) && !result) {
+        printf(TAG "Could not write manifest '%s'!\n", manifest_path);
+        result = -4;
+    }
+
+    return result;
+}
+
+int hh_hive_batch_generate(const char *const *elf_paths, uint64_t elf_count, const char *cache_directory,
+                           uint32_t thread_count, const char *manifest_path, uint64_t *generated_count) {
+    pthread_t *threads = NULL;
+    uint32_t threads_started = 0;
+
+    if (!elf_count || !thread_count) {
+        return -1;
+    }
+
+    //Spread the threads over the binaries, and once there are more threads than binaries, within each binary
+    uint32_t worker_count = thread_count < elf_count ? thread_count : (uint32_t) elf_count;
+    batch_context context = {
+            .elf_paths = elf_paths,
+            .elf_count = elf_count,
+            .cache_directory = cache_directory,
+            .disassembly_thread_count = thread_count / worker_count,
+    };
+
+    if (worker_count > 1 && (threads = calloc(worker_count - 1, sizeof(pthread_t)))) {
+        for (; threads_started < worker_count - 1; threads_started++) {
+            if (pthread_create(threads + threads_started, NULL, batch_worker, &context)) {
+                break;
+            }
+        }
+    }
+
+    batch_worker(&context);
+    for (uint32_t i = 0; i < threads_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    *generated_count = context.generated_count;
+    if (context.failed_count) {
+        printf(TAG "Could not get hives for %" PRIu64 " of %" PRIu64 " binaries\n", context.failed_count, elf_count);
+        return -2;
+    }
+
+    return write_manifest(elf_paths, elf_count, cache_directory, manifest_path) ? -3 : 0;
+}
@@ -0,0 +1,61 @@
+//
+// Created by Allison Husain on 3/29/21.
+//
+
+#ifndef HH_HIVE_BATCH_H
+#define HH_HIVE_BATCH_H
+
+#include <stdint.h>
+
+/**
+ * Batch generation provisions a hive cache (see hh_hive_cache.h) for every image which may appear in a trace of a
+ * program: the program itself along with every shared library it loads. Hives are generated in parallel within a
+ * single process and a hive bundle manifest (see hb_hive_bundle.h) describing them is written out.
+ */
+
+/**
+ * Finds the closure of shared libraries which a set of ELF binaries load. Dependencies are found by following
+ * DT_NEEDED entries and are searched for the way the dynamic loader does: the DT_RPATH of the binary which needs them
+ * (if it has no DT_RUNPATH), LD_LIBRARY_PATH, its DT_RUNPATH, and then the default library directories. $ORIGIN is
+ * expanded. /etc/ld.so.cache is not consulted, so libraries which are only found through it are reported and skipped.
+ * @param elf_paths The binaries
+ * @param elf_count The number of binaries in elf_paths
+ * @param paths_out The location to place a buffer of the real paths of the binaries followed by each library, without
+ * duplicates. Free it with hh_hive_batch_free_paths.
+ * @param path_count_out The location to place the number of paths in paths_out
+ * @return Zero on success
+ */
+int hh_hive_batch_resolve_dependencies(const char *const *elf_paths, uint64_t elf_count, char ***paths_out,
+                                       uint64_t *path_count_out);
+
+/**
+ * Reads a list of binaries, one path per line. Blank lines and lines starting with # are ignored.
+ * @param list_path The list to read
+ * @param paths_out The location to place a buffer of the paths. Free it with hh_hive_batch_free_paths.
+ * @param path_count_out The location to place the number of paths in paths_out
+ * @return Zero on success
+ */
+int hh_hive_batch_read_list(const char *list_path, char ***paths_out, uint64_t *path_count_out);
+
+/**
+ * Frees a buffer of paths returned by hh_hive_batch_resolve_dependencies or hh_hive_batch_read_list
+ */
+void hh_hive_batch_free_paths(char **paths, uint64_t path_count);
+
+/**
+ * Makes sure that a cache holds a hive for each of a set of ELF binaries and writes a bundle manifest listing them.
+ * Binaries which are already cached are skipped and the rest are generated in parallel. Since slides are only known
+ * once the traced program has loaded its images, every image in the manifest has a slide of zero and must be given
+ * its real slide before decoding. Each entry is preceded by a comment naming its binary to make this easier.
+ * @param elf_paths The binaries. The first is the bundle's primary image.
+ * @param elf_count The number of binaries in elf_paths
+ * @param cache_directory The cache directory. It is created if it does not exist.
+ * @param thread_count The number of threads to generate hives with
+ * @param manifest_path The path to write the manifest to
+ * @param generated_count The location to place the number of hives which had to be generated
+ * @return Zero on success
+ */
+int hh_hive_batch_generate(const char *const *elf_paths, uint64_t elf_count, const char *cache_directory,
+                           uint32_t thread_count, const char *manifest_path, uint64_t *generated_count);
+
+#endif //HH_HIVE_BATCH_H
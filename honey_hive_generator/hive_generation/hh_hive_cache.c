@@ -0,0 +1,193 @@
+//
+// Created by Allison Husain on 3/22/21.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hh_hive_cache.h"
+#include "hh_hive_generator.h"
+#include "../disassembly/hh_disassembly.h"
+#include "../../honeybee_shared/hb_hash.h"
+
+#define TAG "[" __FILE__ "] "
+
+/**
+ * Computes the XXH64 of a file's contents
+ * @return true on success
+ */
+static bool hash_file(const char *path, uint64_t *hash) {
+    int fd = -1;
+    void *map_handle = MAP_FAILED;
+    bool success = false;
+    struct stat sb;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        printf(TAG "Could not open file '%s'!\n", path);
+        goto CLEANUP;
+    }
+
+    map_handle = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map_handle == MAP_FAILED) {
+        printf(TAG "Could not mmap file '%s'!\n", path);
+        goto CLEANUP;
+    }
+
+    *hash = hb_hash_xxh64(map_handle, sb.st_size, 0);
+    success = true;
+
+    CLEANUP:
+    if (map_handle != MAP_FAILED) {
+        munmap(map_handle, sb.st_size);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return success;
+}
+
+/**
+ * Reads a binary's build-id into the generator options and builds the path its hive is cached at
+ * @return Zero on success
+ */
+static int get_cache_entry(const char *elf_path, const char *cache_directory, hh_hive_generator_options *options,
+                           char *path_out, size_t path_size) {
+    char key[2 * HB_HIVE_BUILD_ID_MAX_SIZE + 1];
+
+    if (!hh_disassembly_get_build_id_from_elf(elf_path, options->build_id, sizeof(options->build_id),
+                                              &options->build_id_size)) {
+        return -1;
+    }
+
+    if (options->build_id_size) {
+        for (uint32_t i = 0; i < options->build_id_size; i++) {
+            snprintf(key + 2 * i, sizeof(key) - 2 * i, "%02x", options->build_id[i]);
+        }
+    } else {
+        //Without a build-id, the only way to tell builds apart is by their contents
+        uint64_t hash;
+        if (!hash_file(elf_path, &hash)) {
+            return -2;
+        }
+
+        snprintf(key, sizeof(key), "xxh64-%016" PRIx64, hash);
+    }
+
+    if ((size_t) snprintf(path_out, path_size, "%s/%s.hive", cache_directory, key) >= path_size) {
+        return -3;
+    }
+
+    return 0;
+}
+
+int hh_hive_cache_get_path(const char *elf_path, const char *cache_directory, char *path_out, size_t path_size) {
+    hh_hive_generator_options options;
+    bzero(&options, sizeof(options));
+    return get_cache_entry(elf_path, cache_directory, &options, path_out, path_size);
+}
+
+hb_hive *hh_hive_cache_open_for_elf(const char *elf_path, const char *cache_directory, uint32_t load_flags) {
+    //Callers are waiting on us to start, so use every CPU we have
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    return hh_hive_cache_open_for_elf_with_threads(elf_path, cache_directory, load_flags,
+                                                   cpu_count > 0 ? (uint32_t) cpu_count : 1, NULL);
+}
+
+hb_hive *hh_hive_cache_open_for_elf_with_threads(const char *elf_path, const char *cache_directory,
+                                                 uint32_t load_flags, uint32_t thread_count, bool *generated) {
+    char hive_path[PATH_MAX];
+    char temporary_path[PATH_MAX];
+    bool temporary_exists = false;
+    hh_disassembly_block *blocks = NULL;
+    hb_hive *hive = NULL;
+    int fd = -1;
+
+    hh_hive_generator_options options;
+    bzero(&options, sizeof(options));
+
+    if (generated) {
+        *generated = false;
+    }
+
+    if (get_cache_entry(elf_path, cache_directory, &options, hive_path, sizeof(hive_path))) {
+        printf(TAG "Could not get the cache entry for '%s'!\n", elf_path);
+        goto CLEANUP;
+    }
+
+    if (access(hive_path, F_OK) == 0) {
+        hive = hb_hive_alloc_with_flags(hive_path, load_flags);
+        if (hive && hive->build_id_size == options.build_id_size
+            && memcmp(hive->build_id, options.build_id, options.build_id_size) == 0) {
+            goto CLEANUP;
+        }
+
+        //A crash between renaming and flushing a hive can leave a truncated entry behind, so just replace it
+        printf(TAG "Cached hive '%s' is unusable, regenerating it\n", hive_path);
+        hb_hive_free(hive);
+        hive = NULL;
+    }
+
+    if (mkdir(cache_directory, 0755) < 0 && errno != EEXIST) {
+        printf(TAG "Could not create cache directory '%s'!\n", cache_directory);
+        goto CLEANUP;
+    }
+
+    //The temporary file must be in the cache directory so that renaming it into place is atomic
+    if ((size_t) snprintf(temporary_path, sizeof(temporary_path), "%s.XXXXXX", hive_path) >= sizeof(temporary_path)
+        || (fd = mkstemp(temporary_path)) < 0) {
+        printf(TAG "Could not create a temporary hive in '%s'!\n", cache_directory);
+        goto CLEANUP;
+    }
+    temporary_exists = true;
+
+    //mkstemp creates the file as private, but other users of the cache should be able to read it
+    fchmod(fd, 0644);
+    close(fd);
+    fd = -1;
+
+    int64_t block_count = 0;
+    if (!hh_disassembly_get_blocks_from_elf_with_threads(elf_path, &blocks, &block_count, thread_count, 0)) {
+        printf(TAG "Failed to get blocks of '%s'!\n", elf_path);
+        goto CLEANUP;
+    }
+
+    if (hh_hive_generator_generate(blocks, block_count, &options, temporary_path)) {
+        printf(TAG "Failed to write hive for '%s'!\n", elf_path);
+        goto CLEANUP;
+    }
+
+    if (rename(temporary_path, hive_path) < 0) {
+        printf(TAG "Could not move hive into place at '%s'!\n", hive_path);
+        goto CLEANUP;
+    }
+    temporary_exists = false;
+
+    hive = hb_hive_alloc_with_flags(hive_path, load_flags);
+    if (generated) {
+        *generated = hive != NULL;
+    }
+
+    CLEANUP:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (temporary_exists) {
+        unlink(temporary_path);
+    }
+
+    free(blocks);
+    return hive;
+}
@@ -0,0 +1,53 @@
+//
+// Created by Allison Husain on 3/22/21.
+//
+
+#ifndef HH_HIVE_CACHE_H
+#define HH_HIVE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../../honeybee_shared/hb_hive.h"
+
+/**
+ * A hive cache is a directory of hives named after the binary they were generated from. Binaries with a GNU build-id
+ * are keyed on it, others on the XXH64 of their contents, so a rebuilt binary never picks up a stale hive. Cached
+ * hives use the default generator options.
+ */
+
+/**
+ * Gets the path a binary's hive is cached at
+ * @param elf_path The ELF binary
+ * @param cache_directory The cache directory
+ * @param path_out The buffer to place the path in
+ * @param path_size The size of path_out
+ * @return Zero on success
+ */
+int hh_hive_cache_get_path(const char *elf_path, const char *cache_directory, char *path_out, size_t path_size);
+
+/**
+ * Gets the hive for a binary from a cache, generating and storing it first if the cache does not have it yet. Hives
+ * are generated using every online CPU and are written to a temporary file which is renamed into place, so concurrent
+ * callers never see a partial hive.
+ * @param elf_path The ELF binary
+ * @param cache_directory The cache directory. It is created if it does not exist.
+ * @param load_flags A bitwise OR of HB_HIVE_LOAD_FLAG_* values to load the hive with
+ * @return The hive or NULL on failure
+ */
+hb_hive *hh_hive_cache_open_for_elf(const char *elf_path, const char *cache_directory, uint32_t load_flags);
+
+/**
+ * Gets the hive for a binary from a cache like hh_hive_cache_open_for_elf, but generates it with a given number of
+ * threads. This is useful when several hives are generated at once.
+ * @param elf_path The ELF binary
+ * @param cache_directory The cache directory. It is created if it does not exist.
+ * @param load_flags A bitwise OR of HB_HIVE_LOAD_FLAG_* values to load the hive with
+ * @param thread_count The number of threads to disassemble the binary with if its hive must be generated
+ * @param generated If not NULL, the location to place whether the hive had to be generated
+ * @return The hive or NULL on failure
+ */
+hb_hive *hh_hive_cache_open_for_elf_with_threads(const char *elf_path, const char *cache_directory,
+                                                 uint32_t load_flags, uint32_t thread_count, bool *generated);
+
+#endif //HH_HIVE_CACHE_H
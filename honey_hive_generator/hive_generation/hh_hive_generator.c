@@ -4,11 +4,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "xed-interface.h"
 
 #include "hh_hive_generator.h"
 #include "../../honeybee_shared/hb_hive.h"
+#include "../../honeybee_shared/hb_hash.h"
+
+/** The most sections a generated hive may contain */
+#define MAX_SECTION_COUNT (16)
+
+/**
+ * Writes the sections of a v2 hive. Every section is laid out before anything is written, each starting at the next
+ * multiple of the section alignment, so that the file can be sized once and every table filled in place through a
+ * shared mapping of it. The header and directory are written last, once every section's hash is known.
+ */
+typedef struct {
+    int fd;
+    uint8_t *image;
+    uint64_t image_size;
+    hb_hive_section sections[MAX_SECTION_COUNT];
+    uint64_t section_count;
+} section_writer;
 
 static int64_t lookup_block_sorted(const hh_disassembly_block *sorted_blocks, int64_t block_count, uint64_t
 target_offset) {
@@ -47,106 +69,974 @@ static inline uint64_t packed_uvip(uint64_t not_taken, uint64_t taken) {
 }
 
 /**
- * Write a uint32_t a certain number of times to a file.
+ * Fill a run of a uint32_t table with a value
+ * @return The end of the run
  */
-static inline void write_uint32t_times(FILE *fp, uint32_t value, uint64_t times) {
+static inline uint32_t *fill_uint32t(uint32_t *destination, uint32_t value, uint64_t times) {
     for (uint64_t i = 0; i < times; i++) {
-        fwrite(&value, sizeof(value), 1, fp);
+        destination[i] = value;
+    }
+
+    return destination + times;
+}
+
+/**
+ * Counts the entries of the flat direct map. Unlike the header's direct_map_count, this covers the final instruction
+ * of the last block.
+ */
+static uint64_t count_flat_direct_map(const hh_disassembly_block *sorted_blocks, int64_t block_count) {
+    const hh_disassembly_block *last_block = sorted_blocks + block_count - 1;
+    return last_block->start_offset + last_block->length + last_block->last_instruction_size
+           - sorted_blocks[0].start_offset;
+}
+
+/**
+ * Fill the flat direct map. See hb_hive_file_header.
+ * @param map count_flat_direct_map entries
+ * @param new_indices The index of each block in the block table
+ */
+static void fill_flat_direct_map(uint32_t *map, const hh_disassembly_block *sorted_blocks, int64_t block_count,
+                                 const uint64_t *new_indices) {
+    uint64_t last_block_ip = sorted_blocks[0].start_offset;
+    for (int64_t i = 0; i < block_count; i++) {
+        const hh_disassembly_block *block = sorted_blocks + i;
+
+        uint64_t invalid_count = block->start_offset - last_block_ip;
+        uint64_t this_block_count = block->length + block->last_instruction_size;
+        //invalid, these resolve to the first block of the binary
+        map = fill_uint32t(map, (uint32_t)new_indices[0], invalid_count);
+        //valid
+        map = fill_uint32t(map, (uint32_t)new_indices[i], this_block_count);
+
+        last_block_ip = block->start_offset + this_block_count;
+    }
+}
+
+/** The largest not-taken uVIP delta a narrow block can hold */
+#define NARROW_MAX_NOT_TAKEN_DELTA (UINT16_MAX >> 1)
+
+/**
+ * Can the binary be represented with narrow blocks? Narrow blocks hold 16-bit indices, 32-bit uVIPs, and 15-bit
+ * not-taken uVIP deltas.
+ */
+static bool can_use_narrow_blocks(const hh_disassembly_block *sorted_blocks, int64_t block_count,
+                                  uint64_t direct_map_count) {
+    if (block_count >= HB_HIVE_NARROW_FLAG_INDIRECT_JUMP_INDEX_VALUE || direct_map_count > UINT32_MAX) {
+        return false;
+    }
+
+    for (int64_t i = 0; i < block_count; i++) {
+        const hh_disassembly_block *block = sorted_blocks + i;
+        if (block->instruction_category == XED_CATEGORY_COND_BR
+            && (uint64_t)block->length + block->last_instruction_size > NARROW_MAX_NOT_TAKEN_DELTA) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Store an entry of a direct map table, either as is (wide) or truncated to a uint32_t
+ */
+static inline void store_table_entry(void *table, uint64_t i, uint64_t value, bool wide) {
+    if (wide) {
+        ((uint64_t *)table)[i] = value;
+    } else {
+        ((uint32_t *)table)[i] = (uint32_t)value;
+    }
+}
+
+/**
+ * Load an entry of a direct map table written by store_table_entry
+ */
+static inline uint64_t load_table_entry(const void *table, uint64_t i, bool wide) {
+    return wide ? ((const uint64_t *)table)[i] : ((const uint32_t *)table)[i];
+}
+
+/**
+ * Counts the runs of a sparse direct map. Every block starts a run, as does every gap before a block.
+ */
+static uint64_t count_sparse_runs(const hh_disassembly_block *sorted_blocks, int64_t block_count) {
+    uint64_t run_count = 0;
+    uint64_t last_block_ip = sorted_blocks[0].start_offset;
+    for (int64_t i = 0; i < block_count; i++) {
+        const hh_disassembly_block *block = sorted_blocks + i;
+        if (block->start_offset > last_block_ip) {
+            run_count++;
+        }
+
+        run_count++;
+        last_block_ip = block->start_offset + block->length + block->last_instruction_size;
     }
+
+    return run_count;
 }
 
-int hh_hive_generator_generate(const hh_disassembly_block *sorted_blocks, int64_t block_count, const char
-*hive_destination_path) {
+/**
+ * Fills a sparse direct map which resolves every address identically to the flat map. See hb_hive_sparse_file_header.
+ * Entries are stored at full width for wide hives and truncated to uint32_ts otherwise.
+ * @param new_indices The index of each block in the block table
+ * @param chunks chunk_count entries
+ * @param run_starts count_sparse_runs + 1 entries
+ * @param run_blocks count_sparse_runs entries
+ */
+static void fill_sparse_direct_map(const hh_disassembly_block *sorted_blocks, int64_t block_count,
+                                   const uint64_t *new_indices, uint64_t chunk_shift, uint64_t chunk_count,
+                                   void *chunks, void *run_starts, void *run_blocks, bool wide) {
+    /* emit runs */
+    uint64_t run_count = 0;
+    uint64_t uvip_slide = sorted_blocks[0].start_offset;
+    uint64_t last_block_ip = uvip_slide;
+    for (int64_t i = 0; i < block_count; i++) {
+        const hh_disassembly_block *block = sorted_blocks + i;
+
+        if (block->start_offset > last_block_ip) {
+            //Gaps resolve to the first block of the binary, just as they do in the flat map
+            store_table_entry(run_starts, run_count, last_block_ip - uvip_slide, wide);
+            store_table_entry(run_blocks, run_count, new_indices[0], wide);
+            run_count++;
+        }
+
+        store_table_entry(run_starts, run_count, block->start_offset - uvip_slide, wide);
+        store_table_entry(run_blocks, run_count, new_indices[i], wide);
+        run_count++;
+
+        last_block_ip = block->start_offset + block->length + block->last_instruction_size;
+    }
+    //The terminator is UINT32_MAX once narrowed
+    store_table_entry(run_starts, run_count, UINT64_MAX, wide);
+
+    /* emit chunks */
+    uint64_t run = 0;
+    for (uint64_t chunk = 0; chunk < chunk_count; chunk++) {
+        uint64_t chunk_start = chunk << chunk_shift;
+        while (load_table_entry(run_starts, run + 1, wide) <= chunk_start) {
+            run++;
+        }
+
+        store_table_entry(chunks, chunk, run, wide);
+    }
+}
+
+/**
+ * A direct map which has already been filled, used to resolve branch targets while filling the block table
+ */
+typedef struct {
+    uint64_t uvip_slide;
+
+    /** The number of addresses covered by the map, see count_flat_direct_map */
+    uint64_t count;
+
+    /** The flat map or NULL for sparse maps */
+    const uint32_t *flat;
+
+    uint64_t chunk_shift;
+    uint64_t chunk_count;
+    const void *chunks;
+    const void *run_starts;
+    const void *run_blocks;
+    bool wide;
+} filled_direct_map;
+
+/**
+ * Finds the block containing an offset in constant time using the direct map. This finds the same block as
+ * lookup_block_sorted: targets anywhere from the start of a block up to the start of its final instruction resolve
+ * to that block.
+ * @param table_order The address order index of each block in the block table
+ * @return The address order index of the block or -1 if no block contains the offset
+ */
+static int64_t resolve_block(const filled_direct_map *map, const hh_disassembly_block *sorted_blocks,
+                             const int64_t *table_order, uint64_t target_offset) {
+    uint64_t map_index = target_offset - map->uvip_slide;
+    if (map_index >= map->count) {
+        return -1;
+    }
+
+    uint64_t table_i;
+    if (map->flat) {
+        table_i = map->flat[map_index];
+    } else {
+        //The chunks only cover direct_map_count, which stops short of the last block's final instruction
+        uint64_t chunk = map_index >> map->chunk_shift;
+        uint64_t run = 0;
+        if (chunk < map->chunk_count) {
+            run = load_table_entry(map->chunks, chunk, map->wide);
+        } else if (map->chunk_count) {
+            run = load_table_entry(map->chunks, map->chunk_count - 1, map->wide);
+        }
+
+        while (load_table_entry(map->run_starts, run + 1, map->wide) <= map_index) {
+            run++;
+        }
+
+        table_i = load_table_entry(map->run_blocks, run, map->wide);
+    }
+
+    //Gaps between blocks resolve to the first block, so check that we actually landed inside the block
+    int64_t block_i = table_order[table_i];
+    const hh_disassembly_block *block = sorted_blocks + block_i;
+    if (target_offset < block->start_offset || target_offset > block->start_offset + block->length) {
+        return -1;
+    }
+
+    return block_i;
+}
+
+/**
+ * Finds the end of each unconditional block's chain of direct unconditional successors: the first block reached by
+ * following taken successors which ends in a conditional or indirect branch.
+ * @param table_order The address order index of each block in the block table
+ * @param successors The table index of each block's taken successor or -1 if it ends in an indirect branch
+ * @param chain_ends Receives the table index of each block's chain end, or -1 if the block ends in a conditional or
+ * indirect branch or its chain loops forever
+ */
+static void find_chain_ends(const hh_disassembly_block *sorted_blocks, const int64_t *table_order,
+                            const int64_t *successors, int64_t block_count, int64_t *chain_ends) {
+#define CHAIN_END_UNVISITED (-2)
+#define CHAIN_END_VISITING (-3)
+    for (int64_t i = 0; i < block_count; i++) {
+        bool is_conditional = sorted_blocks[table_order[i]].instruction_category == XED_CATEGORY_COND_BR;
+        chain_ends[i] = is_conditional || successors[i] == -1 ? -1 : CHAIN_END_UNVISITED;
+    }
+
+    for (int64_t i = 0; i < block_count; i++) {
+        if (chain_ends[i] != CHAIN_END_UNVISITED) {
+            continue;
+        }
+
+        //Walk the chain until we reach its end, a block whose end we already know, or ourselves
+        int64_t end;
+        int64_t current = i;
+        while (true) {
+            chain_ends[current] = CHAIN_END_VISITING;
+            int64_t next = successors[current];
+            if (sorted_blocks[table_order[next]].instruction_category == XED_CATEGORY_COND_BR
+                || successors[next] == -1) {
+                end = next;
+                break;
+            } else if (chain_ends[next] == CHAIN_END_VISITING) {
+                end = -1;
+                break;
+            } else if (chain_ends[next] != CHAIN_END_UNVISITED) {
+                end = chain_ends[next];
+                break;
+            }
+
+            current = next;
+        }
+
+        for (current = i; chain_ends[current] == CHAIN_END_VISITING; current = successors[current]) {
+            chain_ends[current] = end;
+        }
+    }
+#undef CHAIN_END_UNVISITED
+#undef CHAIN_END_VISITING
+}
+
+/**
+ * Follows a TNT from a conditional block the same way that the decoder does
+ * @param successors The table index of each block's taken successor
+ * @param uvip Receives the slid VIP of the block reached
+ * @return The table index of the block reached or -1 if it isn't in the hive
+ */
+static int64_t follow_tnt(const hh_disassembly_block *sorted_blocks, const int64_t *table_order,
+                          const uint64_t *new_indices, const int64_t *successors, int64_t block_count,
+                          uint64_t uvip_slide, int64_t table_i, bool taken, uint64_t *uvip) {
+    int64_t i = table_order[table_i];
+    if (taken) {
+        int64_t next_table_i = successors[table_i];
+        if (next_table_i != -1) {
+            *uvip = sorted_blocks[table_order[next_table_i]].start_offset - uvip_slide;
+        }
+        return next_table_i;
+    }
+
+    const hh_disassembly_block *block = sorted_blocks + i;
+    *uvip = block->start_offset + block->length + block->last_instruction_size - uvip_slide;
+    return i + 1 < block_count ? (int64_t)new_indices[i + 1] : -1;
+}
+
+/**
+ * Can a TNT be followed from a block?
+ * @return True if the block ends in a conditional branch whose successors are both in the hive
+ */
+static bool can_follow_tnt(const hh_disassembly_block *sorted_blocks, const int64_t *table_order,
+                           const int64_t *successors, int64_t block_count, int64_t table_i) {
+    return sorted_blocks[table_order[table_i]].instruction_category == XED_CATEGORY_COND_BR
+           && successors[table_i] != -1 && table_order[table_i] + 1 < block_count;
+}
+
+/**
+ * Picks the blocks which get a row of TNT transitions. These are the blocks from which every transition consumes at
+ * least two TNTs, since a transition which consumes a single TNT is no faster than the block table.
+ * @param successors The table index of each block's taken successor or -1 if it ends in an indirect branch
+ * @param rows Receives the TNT transition row of each block
+ * @return The number of rows
+ */
+static uint64_t assign_tnt_transition_rows(const hh_disassembly_block *sorted_blocks, const int64_t *table_order,
+                                           const uint64_t *new_indices, const int64_t *successors,
+                                           int64_t block_count, uint32_t *rows) {
+    uint64_t row_count = 0;
+    for (int64_t table_i = 0; table_i < block_count; table_i++) {
+        rows[table_i] = HB_HIVE_TNT_TRANSITION_NO_ROW;
+        if (!can_follow_tnt(sorted_blocks, table_order, successors, block_count, table_i)) {
+            continue;
+        }
+
+        int64_t taken_i = successors[table_i];
+        int64_t not_taken_i = (int64_t)new_indices[table_order[table_i] + 1];
+        if (can_follow_tnt(sorted_blocks, table_order, successors, block_count, taken_i)
+            && can_follow_tnt(sorted_blocks, table_order, successors, block_count, not_taken_i)) {
+            rows[table_i] = (uint32_t)row_count++;
+        }
+    }
+
+    return row_count;
+}
+
+/**
+ * Fills the TNT transitions of every block with a row
+ * @param rows The TNT transition row of each block, from assign_tnt_transition_rows
+ */
+static void fill_tnt_transitions(const hh_disassembly_block *sorted_blocks, const int64_t *table_order,
+                                 const uint64_t *new_indices, const int64_t *successors, int64_t block_count,
+                                 uint64_t uvip_slide, const uint32_t *rows, hm_tnt_transition *transitions) {
+    for (int64_t table_i = 0; table_i < block_count; table_i++) {
+        if (rows[table_i] == HB_HIVE_TNT_TRANSITION_NO_ROW) {
+            continue;
+        }
+
+        hm_tnt_transition *row = transitions + ((uint64_t)rows[table_i] << HB_HIVE_TNT_TRANSITION_BITS);
+        for (uint32_t tnts = 0; tnts < 1U << HB_HIVE_TNT_TRANSITION_BITS; tnts++) {
+            hm_tnt_transition *transition = row + tnts;
+            bzero(transition, sizeof(hm_tnt_transition));
+
+            //Stop early at any block the decoder has to handle itself, the remaining TNTs belong to it
+            int64_t current_i = table_i;
+            while (transition->tnt_count < HB_HIVE_TNT_TRANSITION_BITS
+                   && can_follow_tnt(sorted_blocks, table_order, successors, block_count, current_i)) {
+                bool taken = (tnts >> (HB_HIVE_TNT_TRANSITION_BITS - 1 - transition->tnt_count)) & 1;
+                uint64_t uvip = 0;
+                current_i = follow_tnt(sorted_blocks, table_order, new_indices, successors, block_count, uvip_slide,
+                                       current_i, taken, &uvip);
+                transition->uvips[transition->tnt_count++] = (uint32_t)uvip;
+            }
+            transition->end_index = (uint32_t)current_i;
+        }
+    }
+}
+
+/**
+ * A run of blocks which must stay together in the block table. Each block but the last ends in a conditional branch
+ * which falls through to the next.
+ */
+typedef struct {
+    uint64_t first_block;
+    uint64_t block_count;
+    /* The hit count of the chain's hottest block */
+    uint64_t heat;
+} block_chain;
+
+/**
+ * Orders chains from hottest to coldest, breaking ties by address so that unprofiled code keeps its original order
+ */
+static int compare_chains(const void *a, const void *b) {
+    const block_chain *chain_a = a, *chain_b = b;
+    if (chain_a->heat != chain_b->heat) {
+        return chain_a->heat > chain_b->heat ? -1 : 1;
+    }
+
+    return chain_a->first_block < chain_b->first_block ? -1 : chain_a->first_block > chain_b->first_block;
+}
+
+/**
+ * Picks the index of each block in the block table. Without a profile, blocks are indexed in address order. With a
+ * profile, fall-through chains are ordered by their hottest block so that hot code is packed into as few cache lines
+ * and pages as possible. Chains are never split since narrow blocks require the not-taken successor of a block to be
+ * the next entry (and it's good for locality anyway).
+ * @param new_indices Receives the index of each block in the block table
+ * @return Zero on success
+ */
+static int order_blocks(const hh_disassembly_block *sorted_blocks, int64_t block_count,
+                        const hh_hive_generator_options *options, uint64_t *new_indices) {
+    int result = 0;
+    uint64_t *hits = NULL;
+    block_chain *chains = NULL;
+    uint64_t chain_count = 0;
+
+    if (!options->profile_count) {
+        for (int64_t i = 0; i < block_count; i++) {
+            new_indices[i] = i;
+        }
+
+        goto CLEANUP;
+    }
+
+    if (!(hits = calloc(block_count, sizeof(uint64_t))) || !(chains = malloc(block_count * sizeof(block_chain)))) {
+        result = -2;
+        goto CLEANUP;
+    }
+
+    uint64_t unmatched_count = 0;
+    for (uint64_t i = 0; i < options->profile_count; i++) {
+        int64_t block_i = lookup_block_sorted(sorted_blocks, block_count, options->profile[i].address);
+        if (block_i < 0) {
+            unmatched_count++;
+            continue;
+        }
+
+        hits[block_i] += options->profile[i].count;
+    }
+
+    if (unmatched_count) {
+        printf("%" PRIu64 " profile entries don't belong to this binary\n", unmatched_count);
+    }
+
+    for (int64_t i = 0; i < block_count; i++) {
+        if (i == 0 || sorted_blocks[i - 1].instruction_category != XED_CATEGORY_COND_BR) {
+            block_chain *chain = &chains[chain_count++];
+            chain->first_block = i;
+            chain->block_count = 0;
+            chain->heat = 0;
+        }
+
+        block_chain *chain = &chains[chain_count - 1];
+        chain->block_count++;
+        if (hits[i] > chain->heat) {
+            chain->heat = hits[i];
+        }
+    }
+
+    /*
+     * A conditional final block falls through to the end of the block table (where decoding stops with a map error),
+     * so its chain must stay last. Since chains are built in address order, that's always the final chain.
+     */
+    uint64_t sortable_count = chain_count;
+    if (sorted_blocks[block_count - 1].instruction_category == XED_CATEGORY_COND_BR) {
+        sortable_count--;
+    }
+    qsort(chains, sortable_count, sizeof(block_chain), compare_chains);
+
+    uint64_t next_index = 0;
+    for (uint64_t i = 0; i < chain_count; i++) {
+        for (uint64_t j = 0; j < chains[i].block_count; j++) {
+            new_indices[chains[i].first_block + j] = next_index++;
+        }
+    }
+
+    CLEANUP:
+    free(hits);
+    free(chains);
+
+    return result;
+}
+
+int hh_hive_generator_read_profile(const char *path, hh_hive_generator_profile_entry **entries,
+                                   uint64_t *entry_count) {
     int result = 0;
     FILE *fp = NULL;
-    size_t cofi_destination_size_bytes = 0;
-    int64_t *cofi_destination_block_indexes = NULL;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    uint64_t line_number = 0;
 
-    fp = fopen(hive_destination_path, "w");
-    if (!fp) {
+    if (!(fp = fopen(path, "r"))) {
         result = -1;
         goto CLEANUP;
     }
 
-    //Write out our header
-    hb_hive_file_header header = {
-            .magic = HB_HIVE_FILE_HEADER_MAGIC,
-            .block_count = block_count,
-            .uvip_slide = sorted_blocks[0].start_offset,
-            .direct_map_count = sorted_blocks[block_count - 1].start_offset + sorted_blocks[block_count - 1].length - sorted_blocks[0].start_offset,
-    };
-    fwrite(&header, sizeof(hb_hive_file_header), 1, fp);
+    while (getline(&line, &line_capacity, fp) >= 0) {
+        hh_hive_generator_profile_entry entry;
+        char *cursor = line;
+        line_number++;
+
+        while (*cursor == ' ' || *cursor == '\t') {
+            cursor++;
+        }
+
+        if (*cursor == '#' || *cursor == '\n' || *cursor == '\0') {
+            continue;
+        }
+
+        if (sscanf(cursor, "%" SCNx64 " %" SCNu64, &entry.address, &entry.count) != 2) {
+            printf("%s:%" PRIu64 ": malformed profile entry\n", path, line_number);
+            result = -3;
+            goto CLEANUP;
+        }
+
+        hh_hive_generator_profile_entry *new_entries = realloc(*entries, (*entry_count + 1) * sizeof(entry));
+        if (!new_entries) {
+            result = -2;
+            goto CLEANUP;
+        }
+
+        *entries = new_entries;
+        (*entries)[(*entry_count)++] = entry;
+    }
+
+    CLEANUP:
+    free(line);
+
+    if (fp) {
+        fclose(fp);
+    }
+
+    return result;
+}
+
+/**
+ * Adds a section to the layout of the hive at the next aligned offset after the previous section. The header and
+ * directory live in front of the first section.
+ * @param size The size of the section's contents in bytes
+ * @return Zero on success
+ */
+static int add_section(section_writer *writer, uint32_t type, uint64_t count, uint64_t parameter, uint64_t size) {
+    if (writer->section_count >= MAX_SECTION_COUNT) {
+        return -1;
+    }
+
+    uint64_t position = 0;
+    if (writer->section_count) {
+        hb_hive_section *previous = &writer->sections[writer->section_count - 1];
+        position = previous->offset + previous->size;
+    }
+
+    uint64_t offset = (position + HB_HIVE_V2_SECTION_ALIGNMENT - 1) & ~(HB_HIVE_V2_SECTION_ALIGNMENT - 1);
+    if (offset == 0) {
+        offset = HB_HIVE_V2_SECTION_ALIGNMENT;
+    }
+
+    hb_hive_section *section = &writer->sections[writer->section_count++];
+    bzero(section, sizeof(hb_hive_section));
+    section->type = type;
+    section->offset = offset;
+    section->size = size;
+    section->count = count;
+    section->parameter = parameter;
+
+    //Empty sections still need to lie within the file
+    if (offset + size > writer->image_size) {
+        writer->image_size = offset + size;
+    }
+
+    return 0;
+}
+
+/**
+ * Sizes the file to fit every section and maps it. Storage is allocated for each section (but not the alignment
+ * padding between them) so that running out of space fails here rather than with a SIGBUS while filling sections.
+ * @return Zero on success
+ */
+static int map_sections(section_writer *writer) {
+    if (ftruncate(writer->fd, (off_t)writer->image_size) < 0) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < writer->section_count; i++) {
+        hb_hive_section *section = &writer->sections[i];
+        if (section->size
+            && posix_fallocate(writer->fd, (off_t)section->offset, (off_t)section->size) != 0) {
+            return -1;
+        }
+    }
+
+    void *map_handle = mmap(NULL, writer->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, writer->fd, 0);
+    if (map_handle == MAP_FAILED) {
+        return -1;
+    }
+
+    writer->image = map_handle;
+    return 0;
+}
+
+/**
+ * Adds a section to a hive which has already been mapped. This is for sections whose size depends on the contents of
+ * other sections. The image is remapped, so any pointers into it must be fetched again.
+ * @return Zero on success
+ */
+static int add_mapped_section(section_writer *writer, uint32_t type, uint64_t count, uint64_t parameter,
+                              uint64_t size) {
+    uint64_t mapped_size = writer->image_size;
+    if (add_section(writer, type, count, parameter, size)) {
+        return -1;
+    }
+
+    munmap(writer->image, mapped_size);
+    writer->image = NULL;
+    return map_sections(writer);
+}
+
+/**
+ * Gets the contents of a section of a mapped hive
+ */
+static inline void *section_data(section_writer *writer, uint64_t section_index) {
+    return writer->image + writer->sections[section_index].offset;
+}
+
+/**
+ * Hashes every section of a mapped hive
+ */
+static void hash_sections(section_writer *writer) {
+    for (uint64_t i = 0; i < writer->section_count; i++) {
+        hb_hive_section *section = &writer->sections[i];
+        section->hash = hb_hash_xxh64(section_data(writer, i), section->size, 0);
+        section->flags |= HB_HIVE_SECTION_FLAG_HASHED;
+    }
+}
+
+int hh_hive_generator_get_disassembly(hb_hive *hive, const hh_disassembly_block **blocks, int64_t *block_count) {
+    const hb_hive_section *section = hb_hive_get_section(hive, HB_HIVE_SECTION_DISASSEMBLY);
+    if (!section) {
+        return -1;
+    }
+
+    if (section->parameter != sizeof(hh_disassembly_block) || section->count > INT64_MAX
+        || section->size / sizeof(hh_disassembly_block) < section->count) {
+        return -2;
+    }
+
+    *blocks = hb_hive_get_section_data(hive, section);
+    *block_count = (int64_t) section->count;
+    return 0;
+}
+
+int hh_hive_generator_generate(const hh_disassembly_block *sorted_blocks, int64_t block_count,
+                               const hh_hive_generator_options *options, const char *hive_destination_path) {
+    int result = 0;
+    uint64_t *new_indices = NULL;
+    int64_t *table_order = NULL;
+    int64_t *successors = NULL;
+    int64_t *chain_ends = NULL;
+    hh_hive_generator_options default_options;
+    section_writer writer;
+    bzero(&writer, sizeof(writer));
+    writer.fd = -1;
+
+    if (!options) {
+        bzero(&default_options, sizeof(default_options));
+        options = &default_options;
+    }
+
+    if (options->build_id_size > HB_HIVE_BUILD_ID_MAX_SIZE) {
+        result = -4;
+        goto CLEANUP;
+    }
+
+    uint64_t uvip_slide = sorted_blocks[0].start_offset;
+    uint64_t direct_map_count = sorted_blocks[block_count - 1].start_offset + sorted_blocks[block_count - 1].length
+            - sorted_blocks[0].start_offset;
+
+    /*
+     * Packed blocks hold 31-bit indices (one of which is the indirect marker) and 31-bit taken uVIPs. Anything larger
+     * needs wide blocks, which in turn need a wide map since the flat map's entries are 32-bit. Small binaries get
+     * narrow blocks when possible since they halve the size of the block table.
+     */
+    bool packed_possible = (uint64_t)block_count < HB_HIVE_FLAG_INDIRECT_JUMP_INDEX_VALUE
+                           && direct_map_count < HB_HIVE_FLAG_INDIRECT_JUMP_INDEX_VALUE;
+    bool narrow_possible = can_use_narrow_blocks(sorted_blocks, block_count, direct_map_count);
+    int layout;
+    switch (options->block_layout) {
+        case HH_HIVE_GENERATOR_BLOCKS_PACKED:
+            layout = HB_HIVE_BLOCK_LAYOUT_PACKED;
+            break;
+        case HH_HIVE_GENERATOR_BLOCKS_NARROW:
+            layout = HB_HIVE_BLOCK_LAYOUT_NARROW;
+            break;
+        case HH_HIVE_GENERATOR_BLOCKS_WIDE:
+            layout = HB_HIVE_BLOCK_LAYOUT_WIDE;
+            break;
+        default:
+            layout = narrow_possible && !options->chain_skips ? HB_HIVE_BLOCK_LAYOUT_NARROW
+                                     : packed_possible ? HB_HIVE_BLOCK_LAYOUT_PACKED : HB_HIVE_BLOCK_LAYOUT_WIDE;
+            break;
+    }
+
+    if (layout == HB_HIVE_BLOCK_LAYOUT_NARROW && options->chain_skips) {
+        printf("Narrow blocks can't hold chain skips\n");
+        result = -5;
+        goto CLEANUP;
+    }
 
-    /* Generate our cofi destination table */
+    if (layout == HB_HIVE_BLOCK_LAYOUT_WIDE && options->tnt_transitions) {
+        printf("Wide blocks can't use TNT transitions\n");
+        result = -5;
+        goto CLEANUP;
+    }
+
+    if ((layout == HB_HIVE_BLOCK_LAYOUT_PACKED && !packed_possible)
+        || (layout == HB_HIVE_BLOCK_LAYOUT_NARROW && !narrow_possible)) {
+        printf("Binary can't be represented with the requested block layout\n");
+        result = -5;
+        goto CLEANUP;
+    }
+
+    bool wide = layout == HB_HIVE_BLOCK_LAYOUT_WIDE;
+    hh_hive_generator_map_kind map_kind = options->map_kind;
+    if (wide && map_kind != HH_HIVE_GENERATOR_MAP_SPARSE) {
+        printf("Wide blocks require a sparse direct map, using a wide sparse direct map\n");
+        map_kind = HH_HIVE_GENERATOR_MAP_SPARSE;
+    }
+
+    if (map_kind == HH_HIVE_GENERATOR_MAP_SPARSE && !wide
+        && (direct_map_count >= UINT32_MAX || block_count >= UINT32_MAX / 2)) {
+        //We can't represent this with 32-bit runs
+        result = -3;
+        goto CLEANUP;
+    }
 
-    if (__builtin_mul_overflow(block_count, sizeof(int64_t), &cofi_destination_size_bytes)
-        || !(cofi_destination_block_indexes = malloc(cofi_destination_size_bytes))) {
+    if (!(new_indices = malloc(block_count * sizeof(uint64_t)))
+        || !(table_order = malloc(block_count * sizeof(int64_t)))
+        || !(successors = malloc(block_count * sizeof(int64_t)))
+        || (options->chain_skips && !(chain_ends = malloc(block_count * sizeof(int64_t))))) {
         result = -2;
         goto CLEANUP;
     }
 
+    if ((result = order_blocks(sorted_blocks, block_count, options, new_indices))) {
+        goto CLEANUP;
+    }
+
+    /* Lay out the hive */
+
+    uint32_t blocks_section_type = HB_HIVE_SECTION_BLOCKS;
+    uint64_t block_size = sizeof(hm_block);
+    if (layout == HB_HIVE_BLOCK_LAYOUT_WIDE) {
+        blocks_section_type = HB_HIVE_SECTION_WIDE_BLOCKS;
+        block_size = sizeof(hm_wide_block);
+    } else if (layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+        blocks_section_type = HB_HIVE_SECTION_NARROW_BLOCKS;
+        block_size = sizeof(hm_narrow_block);
+    }
+
+    uint64_t blocks_section = writer.section_count;
+    if (add_section(&writer, blocks_section_type, block_count, 0, block_count * block_size)) {
+        result = -1;
+        goto CLEANUP;
+    }
+
+    uint64_t map_section = writer.section_count;
+    uint64_t chunk_shift = HB_HIVE_SPARSE_DEFAULT_CHUNK_SHIFT;
+    uint64_t chunk_count = (direct_map_count + (1LLU << chunk_shift) - 1) >> chunk_shift;
+    uint64_t run_count = 0;
+    if (map_kind == HH_HIVE_GENERATOR_MAP_SPARSE) {
+        uint64_t entry_size = wide ? sizeof(uint64_t) : sizeof(uint32_t);
+        run_count = count_sparse_runs(sorted_blocks, block_count);
+        if (add_section(&writer, wide ? HB_HIVE_SECTION_WIDE_SPARSE_CHUNKS : HB_HIVE_SECTION_SPARSE_CHUNKS,
+                        chunk_count, chunk_shift, chunk_count * entry_size)
+            || add_section(&writer, wide ? HB_HIVE_SECTION_WIDE_SPARSE_RUN_STARTS : HB_HIVE_SECTION_SPARSE_RUN_STARTS,
+                           run_count + 1, 0, (run_count + 1) * entry_size)
+            || add_section(&writer, wide ? HB_HIVE_SECTION_WIDE_SPARSE_RUN_BLOCKS : HB_HIVE_SECTION_SPARSE_RUN_BLOCKS,
+                           run_count, 0, run_count * entry_size)) {
+            result = -1;
+            goto CLEANUP;
+        }
+    } else {
+        uint64_t flat_map_count = count_flat_direct_map(sorted_blocks, block_count);
+        if (add_section(&writer, HB_HIVE_SECTION_FLAT_MAP, flat_map_count, 0, flat_map_count * sizeof(uint32_t))) {
+            result = -1;
+            goto CLEANUP;
+        }
+    }
+
+    uint64_t transition_rows_section = writer.section_count;
+    if (options->tnt_transitions
+        && add_section(&writer, HB_HIVE_SECTION_TNT_TRANSITION_ROWS, block_count, HB_HIVE_TNT_TRANSITION_BITS,
+                       block_count * sizeof(uint32_t))) {
+        result = -1;
+        goto CLEANUP;
+    }
+
+    uint64_t disassembly_section = writer.section_count;
+    if (options->store_disassembly
+        && add_section(&writer, HB_HIVE_SECTION_DISASSEMBLY, block_count, sizeof(hh_disassembly_block),
+                       block_count * sizeof(hh_disassembly_block))) {
+        result = -1;
+        goto CLEANUP;
+    }
+
+    writer.fd = open(hive_destination_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (writer.fd < 0 || map_sections(&writer)) {
+        result = -1;
+        goto CLEANUP;
+    }
+
+    /* Fill the direct map. This comes first since we use it to resolve branch targets. */
+
+    filled_direct_map filled_map;
+    bzero(&filled_map, sizeof(filled_map));
+    filled_map.uvip_slide = uvip_slide;
+    filled_map.count = count_flat_direct_map(sorted_blocks, block_count);
+    if (map_kind == HH_HIVE_GENERATOR_MAP_SPARSE) {
+        fill_sparse_direct_map(sorted_blocks, block_count, new_indices, chunk_shift, chunk_count,
+                               section_data(&writer, map_section), section_data(&writer, map_section + 1),
+                               section_data(&writer, map_section + 2), wide);
+        filled_map.chunk_shift = chunk_shift;
+        filled_map.chunk_count = chunk_count;
+        filled_map.chunks = section_data(&writer, map_section);
+        filled_map.run_starts = section_data(&writer, map_section + 1);
+        filled_map.run_blocks = section_data(&writer, map_section + 2);
+        filled_map.wide = wide;
+    } else {
+        fill_flat_direct_map(section_data(&writer, map_section), sorted_blocks, block_count, new_indices);
+        filled_map.flat = section_data(&writer, map_section);
+    }
+
+    /* Fill the block table */
+
+    //Blocks are stored in table order, which is only address order when there's no profile
     for (int64_t i = 0; i < block_count; i++) {
-        const hh_disassembly_block *block = sorted_blocks + i;
+        table_order[new_indices[i]] = i;
+    }
 
+    for (int64_t table_i = 0; table_i < block_count; table_i++) {
+        const hh_disassembly_block *block = sorted_blocks + table_order[table_i];
         int64_t next_block_i = -1;
-        if (block->cofi_destination == UINT64_MAX
-            || (next_block_i = lookup_block_sorted(sorted_blocks, block_count, block->cofi_destination)) == -1) {
-            //We don't have a known next-IP
-            cofi_destination_block_indexes[i] = -1;
-        } else {
-            cofi_destination_block_indexes[i] = next_block_i;
+        if (block->cofi_destination != UINT64_MAX
+            && (next_block_i = resolve_block(&filled_map, sorted_blocks, table_order, block->cofi_destination)) != -1) {
+            next_block_i = (int64_t)new_indices[next_block_i];
         }
+        successors[table_i] = next_block_i;
     }
 
-    hm_block out_block;
-    bzero(&out_block, sizeof(hm_block));
+    if (chain_ends) {
+        find_chain_ends(sorted_blocks, table_order, successors, block_count, chain_ends);
+    }
 
-    //Write out all blocks
-    for (int64_t i = 0; i < block_count; i++) {
+    hm_block *out_blocks = section_data(&writer, blocks_section);
+    hm_wide_block *out_wide_blocks = section_data(&writer, blocks_section);
+    hm_narrow_block *out_narrow_blocks = section_data(&writer, blocks_section);
+    for (int64_t table_i = 0; table_i < block_count; table_i++) {
+        int64_t i = table_order[table_i];
         const hh_disassembly_block *block = sorted_blocks + i;
-        int64_t next_block_i = cofi_destination_block_indexes[i];
-        uint64_t next_block_start_offset;
+        int64_t next_block_i = successors[table_i];
+        uint64_t next_block_start_offset = uvip_slide - 1;
         if (next_block_i != -1) {
-            next_block_start_offset = sorted_blocks[next_block_i].start_offset;
-        } else {
-            next_block_start_offset = header.uvip_slide - 1;
+            next_block_start_offset = sorted_blocks[table_order[next_block_i]].start_offset;
+        }
+
+        //Only worth marking if the chain skips at least one block. A zero not-taken index means there's no chain end.
+        int64_t chain_end_i = chain_ends && chain_ends[table_i] != next_block_i ? chain_ends[table_i] : -1;
+        uint64_t chain_end_uvip = 0;
+        if (chain_end_i == 0) {
+            chain_end_i = -1;
+        } else if (chain_end_i != -1) {
+            chain_end_uvip = sorted_blocks[table_order[chain_end_i]].start_offset - uvip_slide;
+        }
+
+        //Chains are kept together when ordering, so a conditional block's not-taken successor is always table_i + 1
+        uint64_t not_taken_i = i + 1 < block_count ? new_indices[i + 1] : (uint64_t)block_count;
+
+        if (layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+            //The taken uVIP comes from the taken block's own entry
+            hm_narrow_block *out_narrow_block = out_narrow_blocks + table_i;
+            out_narrow_block->uvip = (uint32_t)(block->start_offset - uvip_slide);
+            out_narrow_block->taken_index = next_block_i != -1 ? (uint16_t)next_block_i
+                                                               : HB_HIVE_NARROW_FLAG_INDIRECT_JUMP_INDEX_VALUE;
+            out_narrow_block->packed_not_taken_delta = 0;
+            if (block->instruction_category == XED_CATEGORY_COND_BR) {
+                out_narrow_block->packed_not_taken_delta =
+                        (uint16_t)((block->length + block->last_instruction_size) << 1 | HB_HIVE_FLAG_IS_CONDITIONAL);
+            }
+            continue;
+        }
+
+        if (wide) {
+            hm_wide_block *out_wide_block = out_wide_blocks + table_i;
+            uint64_t taken_index = next_block_i != -1 ? (uint64_t)next_block_i
+                                                      : HB_HIVE_WIDE_FLAG_INDIRECT_JUMP_INDEX_VALUE;
+            out_wide_block->taken_uvip = next_block_start_offset - uvip_slide;
+            if (block->instruction_category == XED_CATEGORY_COND_BR) {
+                out_wide_block->packed_taken_index = taken_index << 1 | 1;
+                out_wide_block->not_taken_index = not_taken_i;
+                out_wide_block->not_taken_uvip =
+                        block->start_offset + block->length + block->last_instruction_size - uvip_slide;
+            } else if (chain_end_i != -1) {
+                out_wide_block->packed_taken_index = taken_index << 1;
+                out_wide_block->not_taken_index = (uint64_t)chain_end_i;
+                out_wide_block->not_taken_uvip = chain_end_uvip;
+            } else {
+                out_wide_block->packed_taken_index = taken_index << 1;
+                out_wide_block->not_taken_index = 0;
+                out_wide_block->not_taken_uvip = 0;
+            }
+            continue;
         }
 
+        hm_block *out_block = out_blocks + table_i;
         if (block->instruction_category == XED_CATEGORY_COND_BR) {
-            out_block.packed_indices = packed_indices(/* NT */ i + 1, /* T */ next_block_i, /* COND? */ 1);
-            out_block.packed_uvips = packed_uvip(/* NT */ block->start_offset + block->length + block->last_instruction_size - header.uvip_slide, /* T */ next_block_start_offset  - header.uvip_slide);
+            out_block->packed_indices = packed_indices(/* NT */ not_taken_i, /* T */ next_block_i, /* COND? */ 1);
+            out_block->packed_uvips = packed_uvip(/* NT */ block->start_offset + block->length + block->last_instruction_size - uvip_slide, /* T */ next_block_start_offset  - uvip_slide);
         } else {
             //We have an unconditional branch. This means we KNOW our target
-            out_block.packed_indices = packed_indices(/* NT */ 0, /* T */ next_block_i, /* COND? */ 0);
-            out_block.packed_uvips = packed_uvip(/* NT */ 0, /* T */ next_block_start_offset  - header.uvip_slide);
+            out_block->packed_indices = packed_indices(/* NT */ 0, /* T */ next_block_i, /* COND? */ 0);
+            out_block->packed_uvips = packed_uvip(/* NT */ 0, /* T */ next_block_start_offset  - uvip_slide);
+            if (chain_end_i != -1) {
+                //The chain's end takes the place of the not-taken successor
+                out_block->packed_indices |= packed_indices(/* NT */ chain_end_i, 0, 0);
+                out_block->packed_uvips |= packed_uvip(/* NT */ chain_end_uvip, 0);
+            }
         }
-        fwrite(&out_block, sizeof(hm_block), 1, fp);
     }
 
-    //Write out our direct map
-    uint64_t last_block_ip = sorted_blocks[0].start_offset;
-    for (int64_t i = 0; i < block_count; i++) {
-        const hh_disassembly_block *block = sorted_blocks + i;
+    if (options->tnt_transitions) {
+        //The transitions can't be sized until we know which blocks get a row
+        uint64_t row_count = assign_tnt_transition_rows(sorted_blocks, table_order, new_indices, successors,
+                                                        block_count, section_data(&writer, transition_rows_section));
+        uint64_t transition_count = row_count << HB_HIVE_TNT_TRANSITION_BITS;
+        uint64_t transitions_section = writer.section_count;
+        if (add_mapped_section(&writer, HB_HIVE_SECTION_TNT_TRANSITIONS, transition_count, HB_HIVE_TNT_TRANSITION_BITS,
+                               transition_count * sizeof(hm_tnt_transition))) {
+            result = -1;
+            goto CLEANUP;
+        }
 
-        uint64_t invalid_count = block->start_offset - last_block_ip;
-        uint64_t this_block_count = block->length + block->last_instruction_size;
-        //invalid
-        write_uint32t_times(fp, 0, invalid_count);
-        //valid
-        write_uint32t_times(fp, (uint32_t)i, this_block_count);
+        fill_tnt_transitions(sorted_blocks, table_order, new_indices, successors, block_count, uvip_slide,
+                             section_data(&writer, transition_rows_section),
+                             section_data(&writer, transitions_section));
+    }
 
-        last_block_ip = block->start_offset + this_block_count;
+    if (options->store_disassembly) {
+        memcpy(section_data(&writer, disassembly_section), sorted_blocks, block_count * sizeof(hh_disassembly_block));
     }
 
+    if (!options->skip_section_hashes) {
+        hash_sections(&writer);
+    }
+
+    //Write out our header and section directory
+    hb_hive_v2_file_header header;
+    bzero(&header, sizeof(header));
+    header.magic = HB_HIVE_V2_FILE_HEADER_MAGIC;
+    header.version = HB_HIVE_V2_FORMAT_VERSION;
+    header.header_size = sizeof(hb_hive_v2_file_header);
+    header.uvip_slide = uvip_slide;
+    header.direct_map_count = direct_map_count;
+    header.section_alignment = HB_HIVE_V2_SECTION_ALIGNMENT;
+    header.section_directory_offset = sizeof(hb_hive_v2_file_header);
+    header.section_count = writer.section_count;
+    header.build_id_size = options->build_id_size;
+    memcpy(header.build_id, options->build_id, options->build_id_size);
+    header.address_kind = options->address_kind;
+    header.preferred_load_base = options->preferred_load_base;
+
+    memcpy(writer.image, &header, sizeof(header));
+    memcpy(writer.image + header.section_directory_offset, writer.sections,
+           writer.section_count * sizeof(hb_hive_section));
+
     CLEANUP:
-    if (fp) {
-        fclose(fp);
+    if (writer.image) {
+        munmap(writer.image, writer.image_size);
     }
 
-    if (cofi_destination_block_indexes) {
-        free(cofi_destination_block_indexes);
+    if (writer.fd >= 0 && close(writer.fd) && !result) {
+        result = -1;
     }
 
+    free(new_indices);
+    free(table_order);
+    free(successors);
+    free(chain_ends);
+
     return result;
 
 }
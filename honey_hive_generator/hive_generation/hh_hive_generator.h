@@ -5,9 +5,150 @@
 #ifndef HONEY_MIRROR_HH_HIVE_GENERATOR_H
 #define HONEY_MIRROR_HH_HIVE_GENERATOR_H
 #include <stdlib.h>
+#include <stdbool.h>
 #include "../disassembly/hh_disassembly.h"
+#include "../../honeybee_shared/hb_hive.h"
 
-int hh_hive_generator_generate(const hh_disassembly_block *sorted_blocks, int64_t block_count, const char
-*hive_destination_path);
+/**
+ * The direct map encodings which the generator can emit
+ */
+typedef enum {
+    /** One uint32_t block index per byte of the binary. Fastest lookups, but costs four times the size of the code. */
+    HH_HIVE_GENERATOR_MAP_FLAT = 0,
+    /** A two level chunk and run map. See hb_hive_sparse_file_header. */
+    HH_HIVE_GENERATOR_MAP_SPARSE = 1,
+} hh_hive_generator_map_kind;
+
+/**
+ * The block table layouts which the generator can emit
+ */
+typedef enum {
+    /** Use the smallest layout which can represent the binary */
+    HH_HIVE_GENERATOR_BLOCKS_AUTO = 0,
+    /** hm_block. See hb_hive.h. */
+    HH_HIVE_GENERATOR_BLOCKS_PACKED = 1,
+    /** hm_narrow_block. Only possible for binaries with fewer than 65535 blocks. */
+    HH_HIVE_GENERATOR_BLOCKS_NARROW = 2,
+    /** hm_wide_block. This implies a sparse direct map. */
+    HH_HIVE_GENERATOR_BLOCKS_WIDE = 3,
+} hh_hive_generator_block_layout;
+
+/**
+ * An entry of a block hit-count profile. See hh_hive_generator_read_profile.
+ */
+typedef struct {
+    /**
+     * An unslid address within the block, as reported by the decoder
+     */
+    uint64_t address;
+
+    /**
+     * The number of times the block was decoded
+     */
+    uint64_t count;
+} hh_hive_generator_profile_entry;
+
+/**
+ * Options which control how a hive is generated
+ */
+typedef struct {
+    /**
+     * The direct map encoding to emit
+     */
+    hh_hive_generator_map_kind map_kind;
+
+    /**
+     * Don't store section hashes. This saves a pass over the hive but prevents readers from verifying it.
+     */
+    bool skip_section_hashes;
+
+    /**
+     * The block table layout to emit. Generation fails if the binary can't be represented with the requested layout.
+     */
+    hh_hive_generator_block_layout block_layout;
+
+    /**
+     * A block hit-count profile. When provided, blocks are renumbered so that hot blocks are contiguous in the block
+     * table. Entries for the same block are summed, so profiles from several traces may simply be concatenated.
+     */
+    const hh_hive_generator_profile_entry *profile;
+
+    /**
+     * The number of entries in profile
+     */
+    uint64_t profile_count;
+
+    /**
+     * Store the blocks in the hive so that it can later be regenerated incrementally when the binary is rebuilt. See
+     * hh_hive_generator_get_disassembly.
+     */
+    bool store_disassembly;
+
+    /**
+     * Store the end of each unconditional block's chain of direct unconditional successors in its otherwise unused
+     * not-taken fields (see hm_block) so that decoders can skip the chain. Narrow blocks have no room for this, so the
+     * automatic layout picks packed blocks instead.
+     */
+    bool chain_skips;
+
+    /**
+     * Store TNT transitions (see hm_tnt_transition) so that decoders can consume several TNTs per lookup. This costs a
+     * row of 2^HB_HIVE_TNT_TRANSITION_BITS transitions for every block which has one. Wide blocks can't use them.
+     */
+    bool tnt_transitions;
+
+    /**
+     * The number of valid bytes in build_id, zero if the source binary has no build-id
+     */
+    uint32_t build_id_size;
+
+    /**
+     * The build-id of the source binary to record in the hive
+     */
+    uint8_t build_id[HB_HIVE_BUILD_ID_MAX_SIZE];
+
+    /**
+     * How the blocks are addressed (HB_HIVE_ADDRESS_KIND_*). This must match how they were disassembled, see
+     * HH_DISASSEMBLY_FLAG_SEGMENTS.
+     */
+    uint32_t address_kind;
+
+    /**
+     * The address the binary expects to be loaded at, see hh_disassembly_get_preferred_load_base_from_elf. Only used
+     * by HB_HIVE_ADDRESS_KIND_VIRTUAL hives.
+     */
+    uint64_t preferred_load_base;
+} hh_hive_generator_options;
+
+/**
+ * Reads a block hit-count profile, as written by honey_tester -c. Each line holds a hexadecimal unslid address and a
+ * decimal hit count, separated by whitespace. Blank lines and lines starting with # are ignored.
+ * @param path The profile to read
+ * @param entries Entries are appended to this buffer, which is reallocated as needed. Must point to NULL or a buffer
+ * allocated with malloc. The caller must free it.
+ * @param entry_count The number of entries in entries, updated as entries are appended
+ * @return Zero on success
+ */
+int hh_hive_generator_read_profile(const char *path, hh_hive_generator_profile_entry **entries, uint64_t *entry_count);
+
+/**
+ * Gets the blocks stored in a hive which was generated with store_disassembly
+ * @param hive The hive. The blocks point into it and so are only valid until it is freed.
+ * @param blocks The location to place a pointer to the blocks
+ * @param block_count The location to place the number of blocks
+ * @return Zero on success
+ */
+int hh_hive_generator_get_disassembly(hb_hive *hive, const hh_disassembly_block **blocks, int64_t *block_count);
+
+/**
+ * Generates a hive file from a set of blocks
+ * @param sorted_blocks The blocks of the binary, sorted by start offset
+ * @param block_count The number of blocks in sorted_blocks
+ * @param options Generation options. NULL selects the defaults.
+ * @param hive_destination_path The path to write the hive to
+ * @return Zero on success
+ */
+int hh_hive_generator_generate(const hh_disassembly_block *sorted_blocks, int64_t block_count,
+                               const hh_hive_generator_options *options, const char *hive_destination_path);
 
 #endif //HONEY_MIRROR_HH_HIVE_GENERATOR_H
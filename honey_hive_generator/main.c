@@ -3,12 +3,218 @@
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <inttypes.h>
 
 #include "disassembly/hh_disassembly.h"
 #include "hive_generation/hh_hive_generator.h"
+#include "hive_generation/hh_hive_cache.h"
+#include "hive_generation/hh_hive_batch.h"
+
+/**
+ * Provisions a cache with hives for a set of binaries (and optionally everything they load) and writes a manifest
+ * @return The process's exit code
+ */
+static int generate_batch(const char *const *binaries, uint64_t binary_count, const char *list_path,
+                          bool resolve_dependencies, const char *cache_directory, uint32_t thread_count,
+                          const char *manifest_path) {
+    char **listed = NULL;
+    uint64_t listed_count = 0;
+    const char **inputs = NULL;
+    char **resolved = NULL;
+    uint64_t resolved_count = 0;
+    uint64_t generated_count = 0;
+    int result = 2;
+
+    if (list_path && hh_hive_batch_read_list(list_path, &listed, &listed_count)) {
+        printf("Failed to read list '%s'\n", list_path);
+        goto CLEANUP;
+    }
+
+    //Binaries given on the command line come first so that the first of them is the bundle's primary image
+    uint64_t input_count = binary_count + listed_count;
+    if (!input_count || !(inputs = malloc(sizeof(char *) * input_count))) {
+        printf("No binaries to generate hives for\n");
+        goto CLEANUP;
+    }
+    memcpy(inputs, binaries, sizeof(char *) * binary_count);
+    for (uint64_t i = 0; i < listed_count; i++) {
+        inputs[binary_count + i] = listed[i];
+    }
+
+    if (resolve_dependencies) {
+        if (hh_hive_batch_resolve_dependencies(inputs, input_count, &resolved, &resolved_count)) {
+            printf("Failed to resolve dependencies\n");
+            goto CLEANUP;
+        }
+        printf("Found %" PRIu64 " binaries in the dependency closure\n", resolved_count);
+    }
+
+    const char *const *elf_paths = resolved ? (const char *const *) resolved : inputs;
+    uint64_t elf_count = resolved ? resolved_count : input_count;
+    if (hh_hive_batch_generate(elf_paths, elf_count, cache_directory, thread_count, manifest_path,
+                               &generated_count)) {
+        result = 3;
+        printf("Failed to generate hives\n");
+        goto CLEANUP;
+    }
+
+    printf("Generated %" PRIu64 " of %" PRIu64 " hives (the rest were cached) and wrote %s\n", generated_count,
+           elf_count, manifest_path);
+    result = 0;
+
+    CLEANUP:
+    hh_hive_batch_free_paths(listed, listed_count);
+    hh_hive_batch_free_paths(resolved, resolved_count);
+    free(inputs);
+    return result;
+}
 
 int main(int argc, const char * argv[]) {
-    if (argc != 3) {
+    hh_hive_generator_options options;
+    hh_hive_generator_profile_entry *profile = NULL;
+    uint64_t profile_count = 0;
+    const char *cache_directory = NULL;
+    bool customized = false;
+    uint32_t thread_count = 0;
+    const char *manifest_path = NULL;
+    const char *list_path = NULL;
+    bool resolve_dependencies = true;
+    uint32_t disassembly_flags = 0;
+    const char *previous_hive_path = NULL;
+    const char *previous_binary_path = NULL;
+    hb_hive *previous_hive = NULL;
+    bzero(&options, sizeof(options));
+
+    int opt = 0;
+    while ((opt = getopt(argc, (char *const *) argv, "m:nb:p:c:j:fki:e:rstvd:l:D")) != -1) {
+        //Cached hives always use the default options
+        customized |= !strchr("cjdlD", opt);
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "flat") == 0) {
+                    options.map_kind = HH_HIVE_GENERATOR_MAP_FLAT;
+                } else if (strcmp(optarg, "sparse") == 0) {
+                    options.map_kind = HH_HIVE_GENERATOR_MAP_SPARSE;
+                } else {
+                    goto SHOW_USAGE;
+                }
+                break;
+            case 'n':
+                options.skip_section_hashes = true;
+                break;
+            case 'b':
+                if (strcmp(optarg, "auto") == 0) {
+                    options.block_layout = HH_HIVE_GENERATOR_BLOCKS_AUTO;
+                } else if (strcmp(optarg, "packed") == 0) {
+                    options.block_layout = HH_HIVE_GENERATOR_BLOCKS_PACKED;
+                } else if (strcmp(optarg, "narrow") == 0) {
+                    options.block_layout = HH_HIVE_GENERATOR_BLOCKS_NARROW;
+                } else if (strcmp(optarg, "wide") == 0) {
+                    options.block_layout = HH_HIVE_GENERATOR_BLOCKS_WIDE;
+                } else {
+                    goto SHOW_USAGE;
+                }
+                break;
+            case 'p':
+                if (hh_hive_generator_read_profile(optarg, &profile, &profile_count)) {
+                    printf("Failed to read profile '%s'\n", optarg);
+                    free(profile);
+                    return 1;
+                }
+                break;
+            case 'c':
+                cache_directory = optarg;
+                break;
+            case 'j':
+                thread_count = strtoul(optarg, NULL, 10);
+                if (thread_count == 0) {
+                    goto SHOW_USAGE;
+                }
+                break;
+            case 'f':
+                disassembly_flags |= HH_DISASSEMBLY_FLAG_FULL_DECODE;
+                break;
+            case 'k':
+                options.store_disassembly = true;
+                break;
+            case 'i':
+                previous_hive_path = optarg;
+                break;
+            case 'e':
+                previous_binary_path = optarg;
+                break;
+            case 'r':
+                disassembly_flags |= HH_DISASSEMBLY_FLAG_HYBRID;
+                break;
+            case 's':
+                options.chain_skips = true;
+                break;
+            case 't':
+                options.tnt_transitions = true;
+                break;
+            case 'v':
+                disassembly_flags |= HH_DISASSEMBLY_FLAG_SEGMENTS;
+                options.address_kind = HB_HIVE_ADDRESS_KIND_VIRTUAL;
+                break;
+            case 'd':
+                manifest_path = optarg;
+                break;
+            case 'l':
+                list_path = optarg;
+                break;
+            case 'D':
+                resolve_dependencies = false;
+                break;
+            default:
+                goto SHOW_USAGE;
+        }
+    }
+
+    options.profile = profile;
+    options.profile_count = profile_count;
+
+    //Caches are shared between many binaries, so use every CPU we have unless told otherwise
+    if (cache_directory && !thread_count) {
+        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpu_count > 0 ? (uint32_t) cpu_count : 1;
+    } else if (!thread_count) {
+        thread_count = 1;
+    }
+
+    if (manifest_path || list_path || !resolve_dependencies) {
+        if (!cache_directory || !manifest_path || customized || (argc == optind && !list_path)) {
+            goto SHOW_USAGE;
+        }
+
+        return generate_batch(argv + optind, argc - optind, list_path, resolve_dependencies, cache_directory,
+                              thread_count, manifest_path);
+    }
+
+    if (cache_directory) {
+        if (argc - optind != 1 || customized) {
+            goto SHOW_USAGE;
+        }
+
+        hb_hive *hive = hh_hive_cache_open_for_elf_with_threads(argv[optind], cache_directory, 0, thread_count,
+                                                                NULL);
+        char hive_path[PATH_MAX];
+        if (!hive || hh_hive_cache_get_path(argv[optind], cache_directory, hive_path, sizeof(hive_path))) {
+            printf("Failed to get cached hive\n");
+            hb_hive_free(hive);
+            return 3;
+        }
+
+        printf("%s\n", hive_path);
+        hb_hive_free(hive);
+        return 0;
+    }
+
+    //Incremental generation reuses blocks by assuming they came from a linear sweep of the sections
+    if (argc - optind != 2 || !previous_hive_path != !previous_binary_path
+        || ((disassembly_flags & (HH_DISASSEMBLY_FLAG_HYBRID | HH_DISASSEMBLY_FLAG_SEGMENTS))
+            && (previous_hive_path || options.store_disassembly))
+        || ((disassembly_flags & HH_DISASSEMBLY_FLAG_HYBRID) && (disassembly_flags & HH_DISASSEMBLY_FLAG_SEGMENTS))) {
+        SHOW_USAGE:
         printf(
                 "                .' '.            __\n"
                 "       .        .   .           (__\\_\n"
@@ -17,7 +223,51 @@ int main(int argc, const char * argv[]) {
                 "honey_hive_generator converts an ELF binary to a 'hive' which may be used by Honeybee to accelerate "
                 "Intel Processor Trace decoding inside another program.\n\n"
                 "Usage:\n"
-                "honey_hive_generator <input binary> <output hive location>\n"
+                "honey_hive_generator [options] <input binary> <output hive location>\n"
+                "honey_hive_generator [options] -i <previous hive> -e <previous binary> <input binary> <output hive "
+                "location>\n"
+                "honey_hive_generator -c <cache directory> <input binary>\n"
+                "honey_hive_generator -c <cache directory> -d <manifest> [-l <list>] [-D] [input binaries...]\n\n"
+                "Options:\n"
+                "-m <flat|sparse> The direct map encoding to use. Flat maps are slightly faster while sparse maps are "
+                "a fraction of the size. Default: flat\n"
+                "-n Don't store section hashes in the hive\n"
+                "-b <auto|narrow|packed|wide> The block table layout to use. Narrow blocks are half the size of "
+                "packed blocks but only work for small binaries while wide blocks are twice the size but work for any "
+                "binary. Wide blocks imply a sparse direct map. Default: auto, which picks the smallest layout which "
+                "fits\n"
+                "-p <profile> A block hit-count profile (see honey_tester -c). Blocks are renumbered so that hot "
+                "blocks are contiguous, which improves decoding locality. May be given multiple times, counts are "
+                "summed\n"
+                "-c <cache directory> Find the binary's hive in a cache keyed on its build-id (or the hash of its "
+                "contents), generating it with the default options on every CPU if it is missing, and print its path\n"
+                "-j <threads> The number of threads to disassemble the binary with. The hive is identical for any "
+                "number of threads. Default: 1, or every CPU with -c\n"
+                "-d <manifest> With -c, make sure the cache holds hives for every input binary and every shared "
+                "library they load (found through DT_NEEDED like the dynamic loader does), generating the missing ones "
+                "in parallel, and write a hive bundle manifest listing them. Slides in the manifest are zero and must "
+                "be filled in once the images are loaded\n"
+                "-l <list> With -d, also generate hives for the binaries listed in this file, one per line\n"
+                "-D With -d, only generate hives for the given binaries and not the libraries they load\n"
+                "-f Fully decode every instruction instead of only those which might be branches. This is much "
+                "slower and only useful for checking that the hive is identical either way\n"
+                "-k Keep the disassembly in the hive so that the hive for the next build of the binary can be "
+                "generated incrementally\n"
+                "-i <previous hive> -e <previous binary> Generate incrementally from the hive of a previous build of "
+                "the binary, which must have been generated with -k. Only code which changed is disassembled again. "
+                "The hive is identical to a full generation and keeps its disassembly\n"
+                "-r Only disassemble code reachable from the binary's functions (from its symbols and .eh_frame), "
+                "entry point, and direct branches instead of sweeping entire executable sections. This avoids spurious "
+                "blocks from data and padding in code but misses code which is only reached indirectly. Cannot be "
+                "combined with -k or -i\n"
+                "-s Mark where each chain of direct jumps and calls ends so that decoders can skip straight to the "
+                "next block which needs the trace (see honey_tester -k). Requires packed or wide blocks\n"
+                "-t Store TNT transitions so that decoders can follow several conditional branches with a single "
+                "lookup. Every block is still reported. Requires packed or narrow blocks\n"
+                "-v Sweep the executable segments from the program headers instead of the executable sections and "
+                "address blocks by their virtual address instead of their file offset. This works on binaries without "
+                "section headers and lets the trace slide be found from the process's memory map (see honey_tester "
+                "-M). Cannot be combined with -r, -k, or -i\n"
                 );
         return 1;
     }
@@ -25,8 +275,8 @@ int main(int argc, const char * argv[]) {
     int result;
     hh_disassembly_block *blocks = NULL;
 
-    const char *input_path = argv[1];
-    const char *output_path = argv[2];
+    const char *input_path = argv[optind];
+    const char *output_path = argv[optind + 1];
 
     //Stash our starting directory so that we can get back
     char starting_directory[PATH_MAX];
@@ -34,13 +284,52 @@ int main(int argc, const char * argv[]) {
 
     //Generate our hive file
     int64_t block_count = 0;
-    if (!hh_disassembly_get_blocks_from_elf(input_path, &blocks, &block_count)) {
+    if (previous_hive_path) {
+        const hh_disassembly_block *previous_blocks;
+        int64_t previous_block_count;
+        int64_t reused_count;
+
+        //Keep the disassembly so that the next build can be generated incrementally too
+        options.store_disassembly = true;
+
+        if (!(previous_hive = hb_hive_alloc_with_flags(previous_hive_path, HB_HIVE_LOAD_FLAG_ZERO_COPY))
+            || hh_hive_generator_get_disassembly(previous_hive, &previous_blocks, &previous_block_count)) {
+            result = 2;
+            printf("Previous hive has no disassembly! Was it generated with -k?\n");
+            goto CLEANUP;
+        }
+
+        if (!hh_disassembly_get_blocks_from_elf_incrementally(input_path, previous_binary_path, previous_blocks,
+                                                              previous_block_count, &blocks, &block_count,
+                                                              &reused_count, disassembly_flags)) {
+            result = 2;
+            printf("Failed to get blocks!\n");
+            goto CLEANUP;
+        }
+
+        printf("Reused %" PRId64 " of %" PRId64 " blocks from the previous hive\n", reused_count, block_count);
+    } else if (!hh_disassembly_get_blocks_from_elf_with_threads(input_path, &blocks, &block_count, thread_count,
+                                                                disassembly_flags)) {
         result = 2;
         printf("Failed to get blocks!\n");
         goto CLEANUP;
     }
 
-    if ((result = hh_hive_generator_generate(blocks, block_count, output_path))) {
+    if (!hh_disassembly_get_build_id_from_elf(input_path, options.build_id, sizeof(options.build_id),
+                                              &options.build_id_size)) {
+        result = 2;
+        printf("Failed to get build-id!\n");
+        goto CLEANUP;
+    }
+
+    if (options.address_kind == HB_HIVE_ADDRESS_KIND_VIRTUAL
+        && !hh_disassembly_get_preferred_load_base_from_elf(input_path, &options.preferred_load_base)) {
+        result = 2;
+        printf("Failed to get the preferred load base!\n");
+        goto CLEANUP;
+    }
+
+    if ((result = hh_hive_generator_generate(blocks, block_count, &options, output_path))) {
         result = 3;
         printf("Failed to write hive file\n");
         goto CLEANUP;
@@ -50,6 +339,8 @@ int main(int argc, const char * argv[]) {
 CLEANUP:
 
     free(blocks);
+    free(profile);
+    hb_hive_free(previous_hive);
 
     return result;
 }
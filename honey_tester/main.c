@@ -14,16 +14,21 @@
 #include <inttypes.h>
 
 #include "../honey_analyzer/processor_trace/ha_pt_decoder.h"
-#include "../honey_analyzer/processor_trace/ha_pt_decoder_constants.h"
 #include "../honey_analyzer/trace_analysis/ha_session.h"
+#include "../honey_analyzer/trace_analysis/ha_parallel_decode.h"
+#include "../honey_analyzer/trace_analysis/ha_session_internal.h"
 #include "unit_testing/ha_session_audit.h"
 
 #define TAG "[" __FILE__"] "
 
 enum execution_task {
-    EXECUTION_TASK_UNKNOWN, EXECUTION_TASK_AUDIT, EXECUTION_TASK_PERFORMANCE, EXECUTION_TASK_RACE
+    EXECUTION_TASK_UNKNOWN, EXECUTION_TASK_AUDIT, EXECUTION_TASK_PERFORMANCE, EXECUTION_TASK_RACE,
+    EXECUTION_TASK_MAP_BENCHMARK
 };
 
+/** The number of lookups performed per map benchmark pass */
+#define MAP_BENCHMARK_LOOKUP_COUNT (1LLU << 24)
+
 static long current_clock() {
     struct timespec tv;
     clock_gettime(CLOCK_MONOTONIC_RAW, &tv);
@@ -31,17 +36,339 @@ static long current_clock() {
     return tv.tv_sec * 1e9 + tv.tv_nsec;
 }
 
+/**
+ * Times a pass of direct map lookups over the given queries
+ * @return The average time per lookup in nanoseconds
+ */
+static double time_map_lookups(hb_hive *hive, const uint64_t *queries, uint64_t query_count) {
+    volatile int64_t sink = 0;
+    int64_t accumulator = 0;
+
+    uint64_t start = current_clock();
+    for (uint64_t i = 0; i < MAP_BENCHMARK_LOOKUP_COUNT; i++) {
+        accumulator += hb_hive_virtual_address_to_block_index(hive, queries[i & (query_count - 1)]);
+    }
+    uint64_t stop = current_clock();
+
+    sink = accumulator;
+    (void) sink;
+    return (double) (stop - start) / MAP_BENCHMARK_LOOKUP_COUNT;
+}
+
+/**
+ * Benchmarks the latency and memory footprint of the hive's direct map. Two query mixes are timed: the decoder's
+ * real access pattern (branch targets, which are always block starts) and uniformly random mapped addresses.
+ */
+static int perform_map_benchmark(hb_hive *hive) {
+    int result = 0;
+    //Must be a power of two so that the lookup loop can wrap with a mask
+    uint64_t query_count = 1LLU << 20;
+    uint64_t *queries = NULL;
+    uint64_t map_bytes;
+    const char *map_kind;
+
+    if (hive->direct_map_kind == HB_HIVE_DIRECT_MAP_SPARSE) {
+        map_kind = "sparse";
+        map_bytes = (hive->sparse_chunk_count + 2 * hive->sparse_run_count + 1) * sizeof(uint32_t);
+    } else if (hive->direct_map_kind == HB_HIVE_DIRECT_MAP_WIDE_SPARSE) {
+        map_kind = "wide sparse";
+        map_bytes = (hive->sparse_chunk_count + 2 * hive->sparse_run_count + 1) * sizeof(uint64_t);
+    } else {
+        map_kind = "flat";
+        map_bytes = hive->direct_map_count * sizeof(uint32_t);
+    }
+
+    printf(TAG "Map kind = %s, blocks = %"PRIu64", code bytes = %"PRIu64", map bytes = %"PRIu64" "
+               "(%.3f bytes/code byte)\n",
+           map_kind, hive->block_count, hive->direct_map_count, map_bytes,
+           (double) map_bytes / (double) hive->direct_map_count);
+
+    if (!hive->block_count || !hive->direct_map_count) {
+        printf(TAG "Hive is empty, nothing to benchmark\n");
+        result = -1;
+        goto CLEANUP;
+    }
+
+    if (!(queries = malloc(query_count * sizeof(uint64_t)))) {
+        printf(TAG "Out of memory\n");
+        result = -1;
+        goto CLEANUP;
+    }
+
+    //xorshift64, seeded constantly so that runs over different map kinds see identical queries
+    uint64_t state = 0x9E3779B97F4A7C15LLU;
+#define NEXT_RANDOM() (state ^= state << 13, state ^= state >> 7, state ^= state << 17, state)
+
+    for (uint64_t i = 0; i < query_count; i++) {
+        uint64_t block_index = NEXT_RANDOM() % hive->block_count;
+        uint64_t uvip;
+        if (hive->block_layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+            uvip = ((hm_narrow_block *) hive->blocks)[block_index].uvip;
+        } else if (hive->block_layout == HB_HIVE_BLOCK_LAYOUT_WIDE) {
+            hm_wide_block *block = ((hm_wide_block *) hive->blocks) + block_index;
+            uvip = block->taken_uvip;
+            if (block->packed_taken_index >> 1 == HB_HIVE_WIDE_FLAG_INDIRECT_JUMP_INDEX_VALUE) {
+                uvip = block->not_taken_uvip;
+            }
+        } else {
+            hm_block *block = ((hm_block *) hive->blocks) + block_index;
+            uvip = block->packed_uvips & 0xFFFFFFFF;
+            if (((block->packed_indices >> 1) & HB_HIVE_FLAG_INDIRECT_JUMP_INDEX_VALUE)
+                == HB_HIVE_FLAG_INDIRECT_JUMP_INDEX_VALUE) {
+                uvip = block->packed_uvips >> 32;
+            }
+        }
+        queries[i] = uvip + hive->uvip_slide;
+    }
+    printf(TAG "Block start lookups = %.2f ns\n", time_map_lookups(hive, queries, query_count));
+
+    for (uint64_t i = 0; i < query_count; i++) {
+        queries[i] = NEXT_RANDOM() % hive->direct_map_count + hive->uvip_slide;
+    }
+    printf(TAG "Random address lookups = %.2f ns\n", time_map_lookups(hive, queries, query_count));
+#undef NEXT_RANDOM
+
+    CLEANUP:
+    if (queries) {
+        free(queries);
+    }
+
+    return result;
+}
+
+/**
+ * Block hit counts gathered while decoding, see -c
+ */
+typedef struct {
+    hb_hive *hive;
+    /* The number of times each block was decoded */
+    uint64_t *counts;
+    /* The first address each block was decoded at */
+    uint64_t *addresses;
+} block_profile;
+
+static void profile_block_reported(ha_session_t session, void *context, uint64_t unslid_ip) {
+    block_profile *profile = context;
+    int64_t index = hb_hive_virtual_address_to_block_index(profile->hive, unslid_ip);
+    if (index < 0 || (uint64_t) index >= profile->hive->block_count) {
+        return;
+    }
+
+    if (!profile->counts[index]++) {
+        profile->addresses[index] = unslid_ip;
+    }
+}
+
+/**
+ * Discards a block. Used to time parallel decodes, since ha_session_print_trace can only decode on one thread.
+ */
+static void ignore_block_reported(ha_session_t session, void *context, uint64_t unslid_ip) {
+}
+
+/**
+ * The blocks reported while decoding, see -d
+ */
+typedef struct {
+    FILE *fp;
+    /* The hive of a single hive session */
+    hb_hive *hive;
+    /* The bundle of a bundle session */
+    hb_hive_bundle *bundle;
+} block_dump;
+
+/**
+ * Gets the end of the chain which decoding skips to from a block when chain skipping is enabled
+ * @return The unslid IP of the chain end or zero if the block does not skip a chain
+ */
+static uint64_t get_chain_end(hb_hive *hive, uint64_t unslid_ip) {
+    int64_t index = hb_hive_virtual_address_to_block_index(hive, unslid_ip);
+    if (index < 0 || (uint64_t) index >= hive->block_count) {
+        return 0;
+    }
+
+    if (hive->block_layout == HB_HIVE_BLOCK_LAYOUT_PACKED) {
+        hm_block *block = ((hm_block *) hive->blocks) + index;
+        if (!(block->packed_indices & HB_HIVE_FLAG_IS_CONDITIONAL) && block->packed_indices >> 33) {
+            return (block->packed_uvips >> 32) + hive->uvip_slide;
+        }
+    } else if (hive->block_layout == HB_HIVE_BLOCK_LAYOUT_WIDE) {
+        hm_wide_block *block = ((hm_wide_block *) hive->blocks) + index;
+        if (!(block->packed_taken_index & HB_HIVE_FLAG_IS_CONDITIONAL) && block->not_taken_index) {
+            return block->not_taken_uvip + hive->uvip_slide;
+        }
+    }
+
+    //Narrow blocks never skip chains
+    return 0;
+}
+
+/**
+ * Writes a block as `<image> <unslid ip> [chain end]` so that decodes can be compared by unittest.py. The chain end is
+ * written for every block which would skip a chain so that a full decode can be compared with one which skips them.
+ */
+static void dump_block_reported(ha_session_t session, void *context, uint64_t unslid_ip) {
+    block_dump *dump = context;
+    uint64_t image = ha_session_get_current_image(session);
+    hb_hive *hive = dump->bundle ? dump->bundle->images[image].hive : dump->hive;
+    uint64_t chain_end = get_chain_end(hive, unslid_ip);
+
+    fprintf(dump->fp, "%"PRIu64" %#"PRIx64, image, unslid_ip);
+    if (chain_end) {
+        fprintf(dump->fp, " %#"PRIx64, chain_end);
+    }
+    fputc('\n', dump->fp);
+}
+
+/**
+ * Decodes the trace and writes a block hit-count profile suitable for honey_hive_generator -p. The profile is written
+ * even if decoding fails part way since what was decoded is still representative.
+ * @return The decode result or -HA_PT_DECODER_INTERNAL if the profile could not be written
+ */
+static int perform_profile_decode(ha_session_t session, hb_hive *hive, const char *profile_path) {
+    int result;
+    FILE *fp = NULL;
+    block_profile profile = {
+            .hive = hive,
+            .counts = calloc(hive->block_count, sizeof(uint64_t)),
+            .addresses = calloc(hive->block_count, sizeof(uint64_t)),
+    };
+
+    if (!profile.counts || !profile.addresses) {
+        result = -HA_PT_DECODER_INTERNAL;
+        goto CLEANUP;
+    }
+
+    result = ha_session_decode(session, profile_block_reported, &profile);
+
+    if (!(fp = fopen(profile_path, "w"))) {
+        printf(TAG "Could not open profile '%s'\n", profile_path);
+        result = -HA_PT_DECODER_INTERNAL;
+        goto CLEANUP;
+    }
+
+    fprintf(fp, "# address hit_count\n");
+    for (uint64_t i = 0; i < hive->block_count; i++) {
+        if (profile.counts[i]) {
+            fprintf(fp, "%#"PRIx64" %"PRIu64"\n", profile.addresses[i], profile.counts[i]);
+        }
+    }
+
+    CLEANUP:
+    if (fp && fclose(fp)) {
+        result = -HA_PT_DECODER_INTERNAL;
+    }
+
+    free(profile.counts);
+    free(profile.addresses);
+
+    return result;
+}
+
+/**
+ * Decodes the trace one PSB window at a time, in order. With a block dump, each window's blocks are preceded by a
+ * `# window <n>` line so that unittest.py can check how the windows fit together.
+ * @return The first error other than the end of a window
+ */
+static int perform_window_decode(ha_session_t session, const uint8_t *trace_buffer, uint64_t trace_length,
+                                 block_dump *dump) {
+    int result;
+    ha_pt_decoder_psb_index *index = NULL;
+    if ((result = ha_pt_decoder_psb_index_alloc(&index, trace_buffer, trace_length))) {
+        return result;
+    }
+
+    for (uint64_t i = 0; i < index->psb_count; i++) {
+        if (dump->fp) {
+            fprintf(dump->fp, "# window %"PRIu64"\n", i);
+        }
+
+        result = ha_session_decode_window(session, index, i, i + 1,
+                                          dump->fp ? dump_block_reported : ignore_block_reported, dump);
+        if (result < 0 && result != -HA_PT_DECODER_END_OF_STREAM) {
+            printf(TAG "Window %"PRIu64" failed\n", i);
+            break;
+        }
+    }
+
+    ha_pt_decoder_psb_index_free(index);
+    return result;
+}
+
+/**
+ * Decodes the trace by streaming it to the session in chunks of chunk_size bytes, as if it were read from a pipe. Each
+ * chunk is passed from a scratch buffer which is clobbered once the session is done with it. The number of times the
+ * decode loops suspended at each point to wait for more trace is printed so that unittest.py can check that both are
+ * exercised.
+ * @return The decode result
+ */
+static int perform_stream_decode(ha_session_t session, const uint8_t *trace_buffer, uint64_t trace_length,
+                                 uint64_t chunk_size, uint64_t trace_slide,
+                                 ha_hive_on_block_function *on_block_function, void *context) {
+    int result;
+    uint64_t branch_suspend_count = 0;
+    uint64_t indirect_suspend_count = 0;
+    uint8_t *chunk = malloc(chunk_size);
+    if (!chunk) {
+        printf(TAG "Out of memory\n");
+        return -HA_PT_DECODER_INTERNAL;
+    }
+
+    if ((result = ha_session_reconfigure_with_stream(session, trace_slide))) {
+        goto CLEANUP;
+    }
+
+    for (uint64_t offset = 0; offset < trace_length; offset += chunk_size) {
+        uint64_t length = trace_length - offset < chunk_size ? trace_length - offset : chunk_size;
+        memcpy(chunk, trace_buffer + offset, length);
+        result = ha_session_decode_stream(session, chunk, length, on_block_function, context);
+        if (result != -HA_PT_DECODER_NEED_MORE_TRACE) {
+            printf(TAG "Stream stopped early at offset %"PRIu64"\n", offset);
+            goto CLEANUP;
+        }
+
+        if (session->suspend_point == HA_SESSION_SUSPEND_AT_BRANCH) {
+            branch_suspend_count++;
+        } else if (session->suspend_point == HA_SESSION_SUSPEND_AT_INDIRECT) {
+            indirect_suspend_count++;
+        }
+
+        //The session must not read the chunk once it returns
+        memset(chunk, 0xFF, length);
+    }
+
+    result = ha_session_decode_stream(session, NULL, 0, on_block_function, context);
+
+    CLEANUP:
+    printf(TAG "Stream suspended at branches = %"PRIu64", at indirect jumps = %"PRIu64"\n", branch_suspend_count,
+           indirect_suspend_count);
+    free(chunk);
+    return result;
+}
+
 int main(int argc, const char * argv[]) {
     char *end_ptr = NULL;
     enum execution_task task = EXECUTION_TASK_UNKNOWN;
     char *trace_path = NULL;
     char *binary_path = NULL;
     char *hive_path = NULL;
+    char *bundle_path = NULL;
+    char *profile_path = NULL;
+    char *maps_path = NULL;
+    char *image_path = NULL;
+    char *dump_path = NULL;
     uint64_t slid_load_sideband_address = -1;
     uint64_t binary_offset_sideband = -1;
+    uint32_t placement_flags = 0;
+    bool skip_chains = false;
+    bool decode_windows = false;
+    uint32_t decode_thread_count = 0;
+    uint64_t decode_segment_size = HA_PARALLEL_DECODE_SEGMENT_SIZE;
+    bool wrap_trace = false;
+    uint64_t wrap_offset = 0;
+    uint64_t stream_chunk_size = 0;
 
     int opt = 0;
-    while ((opt = getopt(argc, (char *const *) argv, "aprh:s:o:t:b:")) != -1) {
+    while ((opt = getopt(argc, (char *const *) argv, "aprmkwh:B:c:d:L:s:o:t:b:M:e:j:g:W:S:")) != -1) {
         switch (opt) {
             case 'a':
                 task = EXECUTION_TASK_AUDIT;
@@ -52,8 +379,33 @@ int main(int argc, const char * argv[]) {
             case 'r':
                 task = EXECUTION_TASK_RACE;
                 break;
+            case 'm':
+                task = EXECUTION_TASK_MAP_BENCHMARK;
+                break;
             case 'h':
                 hive_path = optarg;
+                break;
+            case 'B':
+                bundle_path = optarg;
+                break;
+            case 'c':
+                profile_path = optarg;
+                break;
+            case 'd':
+                dump_path = optarg;
+                break;
+            case 'L':
+                if (!strcmp(optarg, "thp")) {
+                    placement_flags |= HB_HIVE_LOAD_FLAG_HUGEPAGES;
+                } else if (!strcmp(optarg, "hugetlb")) {
+                    placement_flags |= HB_HIVE_LOAD_FLAG_EXPLICIT_HUGEPAGES;
+                } else if (!strcmp(optarg, "numa")) {
+                    placement_flags |= HB_HIVE_LOAD_FLAG_NUMA_LOCAL;
+                } else {
+                    printf(TAG "Unknown placement '%s'\n", optarg);
+                    goto SHOW_USAGE;
+                }
+                break;
             case 's':
                 slid_load_sideband_address = strtoull(optarg, &end_ptr, 16);
                 break;
@@ -66,6 +418,47 @@ int main(int argc, const char * argv[]) {
             case 'b':
                 binary_path = optarg;
                 break;
+            case 'k':
+                skip_chains = true;
+                break;
+            case 'w':
+                decode_windows = true;
+                break;
+            case 'M':
+                maps_path = optarg;
+                break;
+            case 'e':
+                image_path = optarg;
+                break;
+            case 'j':
+                decode_thread_count = strtoul(optarg, &end_ptr, 10);
+                if (*end_ptr || !decode_thread_count) {
+                    printf(TAG "Invalid thread count '%s'\n", optarg);
+                    goto SHOW_USAGE;
+                }
+                break;
+            case 'g':
+                decode_segment_size = strtoull(optarg, &end_ptr, 10);
+                if (*end_ptr || !decode_segment_size) {
+                    printf(TAG "Invalid segment size '%s'\n", optarg);
+                    goto SHOW_USAGE;
+                }
+                break;
+            case 'W':
+                wrap_trace = true;
+                wrap_offset = strtoull(optarg, &end_ptr, 10);
+                if (*end_ptr) {
+                    printf(TAG "Invalid wrap offset '%s'\n", optarg);
+                    goto SHOW_USAGE;
+                }
+                break;
+            case 'S':
+                stream_chunk_size = strtoull(optarg, &end_ptr, 10);
+                if (*end_ptr || !stream_chunk_size) {
+                    printf(TAG "Invalid chunk size '%s'\n", optarg);
+                    goto SHOW_USAGE;
+                }
+                break;
             default:
             SHOW_USAGE:
                 printf(
@@ -79,9 +472,34 @@ int main(int argc, const char * argv[]) {
                         "-a Run a correctness audit using libipt\n"
                         "-p Run a performance test\n"
                         "-r Run a drag race between libipt and Honeybee\n"
+                        "-m Benchmark the hive's direct map lookup latency and memory. Only -h is required\n"
                         "-h The path to the Honeybee Hive to use to decode the trace\n"
+                        "-B The path to a hive bundle manifest to decode the trace with instead of a single hive. "
+                        "-s and -o are optional and override the primary image's slide. Only used with -p\n"
+                        "-c Write a block hit-count profile of the trace to this path for honey_hive_generator -p. "
+                        "Only used with -p and -h\n"
+                        "-d Write every block the trace reports to this path, one per line as '<image> <unslid ip>', "
+                        "for comparing decodes. Blocks which skip a chain with -k are followed by the chain's end. "
+                        "Only used with -p and not with -c\n"
+                        "-k Skip chains of direct unconditional blocks in hives generated with honey_hive_generator "
+                        "-s. Only used with -p and not with -c\n"
+                        "-L Place the hive's tables: 'thp' (transparent hugepages), 'hugetlb' (explicit hugepages), or "
+                        "'numa' (on the current NUMA node). May be repeated. The achieved placement is printed\n"
                         "-s The slid binary address according to sideband\n"
                         "-o The executable segment offset according to sideband\n"
+                        "-M A memory map of the traced process (a copy of /proc/<pid>/maps) to find the slide in "
+                        "instead of using -s and -o. Requires -e and -h\n"
+                        "-e The path of the traced binary as it appears in the memory map given by -M\n"
+                        "-j Decode the trace on this many threads, splitting it at PSBs. Only used with -p and not "
+                        "with -c\n"
+                        "-g The smallest number of trace bytes each thread decodes at once with -j. "
+                        "Defaults to 256KiB. Only used with -j\n"
+                        "-w Decode the trace one PSB window at a time, in order. With -d, each window's blocks follow "
+                        "a '# window <n>' line. Only used with -p and not with -c or -j\n"
+                        "-W Decode the trace as a ring buffer which wrapped around this many bytes into the trace, so "
+                        "that the trace is split in two segments there. Only used with -p and not with -w\n"
+                        "-S Decode the trace by streaming it to the session in chunks of this many bytes. Only used "
+                        "with -p and not with -c, -j, -w, or -W\n"
                         "-t The Processor Trace file to decode\n"
                         "-b The binary to decode with. This is only used in libipt based tests!\n"
                 );
@@ -90,12 +508,85 @@ int main(int argc, const char * argv[]) {
     }
 
     //Validate
-    if (!trace_path || slid_load_sideband_address == -1 || binary_offset_sideband == -1
+    if (task == EXECUTION_TASK_MAP_BENCHMARK) {
+        if (!hive_path) {
+            printf(TAG "Required argument missing\n");
+            goto SHOW_USAGE;
+        }
+
+        hb_hive *benchmark_hive = hb_hive_alloc_with_flags(hive_path, HB_HIVE_LOAD_FLAG_ZERO_COPY
+                                                                      | HB_HIVE_LOAD_FLAG_POPULATE | placement_flags);
+        if (!benchmark_hive) {
+            printf(TAG "Could not load hive at path %s\n", hive_path);
+            return 1;
+        }
+
+        if (placement_flags) {
+            hb_hive_describe_placement(benchmark_hive);
+        }
+
+        int benchmark_result = perform_map_benchmark(benchmark_hive);
+        hb_hive_free(benchmark_hive);
+        return -benchmark_result;
+    }
+
+    if (bundle_path) {
+        if (!trace_path || task != EXECUTION_TASK_PERFORMANCE || hive_path) {
+            printf(TAG "Bundles require -t and may only be used with -p\n");
+            goto SHOW_USAGE;
+        }
+    } else if (!trace_path || ((slid_load_sideband_address == -1 || binary_offset_sideband == -1) && !maps_path)
         || task == EXECUTION_TASK_UNKNOWN || !hive_path) {
         printf(TAG "Required argument missing\n");
         goto SHOW_USAGE;
     }
 
+    if (profile_path && (task != EXECUTION_TASK_PERFORMANCE || bundle_path)) {
+        printf(TAG "Profiles may only be written by -p with a single hive\n");
+        goto SHOW_USAGE;
+    }
+
+    if (dump_path && (task != EXECUTION_TASK_PERFORMANCE || profile_path)) {
+        printf(TAG "Block dumps may only be written by -p without -c\n");
+        goto SHOW_USAGE;
+    }
+
+    if (skip_chains && (task != EXECUTION_TASK_PERFORMANCE || profile_path)) {
+        printf(TAG "Chain skipping may only be used by -p without -c since it doesn't report every block\n");
+        goto SHOW_USAGE;
+    }
+
+    if (decode_thread_count && (task != EXECUTION_TASK_PERFORMANCE || profile_path)) {
+        printf(TAG "Parallel decoding may only be used by -p without -c\n");
+        goto SHOW_USAGE;
+    }
+
+    if (decode_segment_size != HA_PARALLEL_DECODE_SEGMENT_SIZE && !decode_thread_count) {
+        printf(TAG "Segment sizes may only be used with -j\n");
+        goto SHOW_USAGE;
+    }
+
+    if (decode_windows && (task != EXECUTION_TASK_PERFORMANCE || profile_path || decode_thread_count)) {
+        printf(TAG "Window decoding may only be used by -p without -c or -j\n");
+        goto SHOW_USAGE;
+    }
+
+    if (wrap_trace && (task != EXECUTION_TASK_PERFORMANCE || decode_windows)) {
+        printf(TAG "Wrapped traces may only be decoded by -p without -w\n");
+        goto SHOW_USAGE;
+    }
+
+    if (stream_chunk_size && (task != EXECUTION_TASK_PERFORMANCE || profile_path || decode_thread_count
+                              || decode_windows || wrap_trace)) {
+        printf(TAG "Streamed traces may only be decoded by -p without -c, -j, -w, or -W\n");
+        goto SHOW_USAGE;
+    }
+
+    if (!maps_path != !image_path || (maps_path && bundle_path)) {
+        printf(TAG "Memory maps require -e and may only be used with -h\n");
+        goto SHOW_USAGE;
+    }
+
     if ((task == EXECUTION_TASK_AUDIT || task == EXECUTION_TASK_RACE) && !binary_path) {
         printf(TAG "Binary path is required for test run mode\n");
         goto SHOW_USAGE;
@@ -105,13 +596,16 @@ int main(int argc, const char * argv[]) {
 
     int result = HA_PT_DECODER_NO_ERROR;
     hb_hive *hive = NULL;
+    hb_hive_bundle *bundle = NULL;
     ha_session_t session = NULL;
     int fd = 0;
     void *trace_map_handle = NULL;
-    uint64_t trace_file_size;
-    uint8_t *trace_buffer = NULL;
+    uint64_t trace_file_size = 0;
+    const uint8_t *trace_buffer = NULL;
+    uint8_t *ring_buffer = NULL;
+    block_dump dump = {0};
 
-    /* Copy in the trace file */
+    /* Map in the trace file. The decoder only reads the trace, so it is decoded straight from the map. */
 
     fd = open(trace_path, O_RDONLY);
     if (fd < 0) {
@@ -133,28 +627,87 @@ int main(int argc, const char * argv[]) {
         goto CLEANUP;
     }
 
-    if (!(trace_buffer = malloc(trace_file_size + 1 /* Required for the stop codon */))) {
-        printf(TAG "Out of memory\n");
-        goto CLEANUP;
+    trace_buffer = trace_map_handle;
+
+    if (wrap_trace) {
+        if (wrap_offset > trace_file_size) {
+            printf(TAG "Wrap offset is past the end of the trace\n");
+            goto CLEANUP;
+        }
+
+        //The newer part of the trace goes at the start of the ring and the older part at the end, as if the ring had
+        //just filled up. Each segment is then decoded where it lies in the ring.
+        if (!(ring_buffer = malloc(trace_file_size ? trace_file_size : 1))) {
+            printf(TAG "Out of memory\n");
+            goto CLEANUP;
+        }
+
+        memcpy(ring_buffer, trace_buffer + wrap_offset, trace_file_size - wrap_offset);
+        memcpy(ring_buffer + trace_file_size - wrap_offset, trace_buffer, wrap_offset);
     }
-    memcpy(trace_buffer, trace_map_handle, trace_file_size);
-    trace_buffer[trace_file_size] = PT_TRACE_END; //terminate the buffer since we're pulling from a file
 
     /* Setup the session */
 
-    if (!(hive = hb_hive_alloc(hive_path))) {
-        printf(TAG "Could not load hive at path %s\n", hive_path);
-        goto CLEANUP;
+    uint64_t trace_base_address = slid_load_sideband_address - binary_offset_sideband;
+    if (bundle_path) {
+        if (!(bundle = hb_hive_bundle_alloc_from_manifest(bundle_path, HB_HIVE_LOAD_FLAG_ZERO_COPY
+                                                                       | HB_HIVE_LOAD_FLAG_POPULATE
+                                                                       | placement_flags))) {
+            printf(TAG "Could not load bundle at path %s\n", bundle_path);
+            goto CLEANUP;
+        }
+
+        for (uint64_t i = 0; placement_flags && i < bundle->image_count; i++) {
+            hb_hive_describe_placement(bundle->images[i].hive);
+        }
+
+        if (slid_load_sideband_address == -1 || binary_offset_sideband == -1) {
+            trace_base_address = bundle->images[0].trace_slide;
+        }
+
+        result = ha_session_alloc_with_bundle(&session, bundle);
+    } else {
+        if (!(hive = hb_hive_alloc_with_flags(hive_path, HB_HIVE_LOAD_FLAG_ZERO_COPY | HB_HIVE_LOAD_FLAG_POPULATE
+                                                         | placement_flags))) {
+            printf(TAG "Could not load hive at path %s\n", hive_path);
+            goto CLEANUP;
+        }
+
+        if (placement_flags) {
+            hb_hive_describe_placement(hive);
+        }
+
+        if (maps_path && hb_hive_get_trace_slide_from_maps(hive, maps_path, image_path, &trace_base_address)) {
+            printf(TAG "Could not find the slide of '%s' in '%s'\n", image_path, maps_path);
+            goto CLEANUP;
+        }
+
+        result = ha_session_alloc(&session, hive);
     }
 
-    uint64_t trace_base_address = slid_load_sideband_address - binary_offset_sideband;
-    if ((result = ha_session_alloc(&session, hive)) < 0
-        || (result = ha_session_reconfigure_with_terminated_trace_buffer(session, trace_buffer, trace_file_size,
-                                                                         trace_base_address))) {
+    if (result < 0
+        || (result = ha_session_set_chain_skipping(session, skip_chains))
+        || (result = ring_buffer
+                     ? ha_session_reconfigure_with_wrapped_trace_buffer(session,
+                                                                        ring_buffer + trace_file_size - wrap_offset,
+                                                                        wrap_offset, ring_buffer,
+                                                                        trace_file_size - wrap_offset,
+                                                                        trace_base_address)
+                     : ha_session_reconfigure_with_trace_buffer(session, trace_buffer, trace_file_size,
+                                                                trace_base_address))) {
         printf(TAG "Failed to start session, error=%d\n", result);
         goto CLEANUP;
     }
 
+    if (dump_path) {
+        dump.hive = hive;
+        dump.bundle = bundle;
+        if (!(dump.fp = fopen(dump_path, "w"))) {
+            printf(TAG "Could not open block dump '%s'\n", dump_path);
+            goto CLEANUP;
+        }
+    }
+
     /* Execute our operation */
 
     uint64_t start = current_clock();
@@ -169,7 +722,23 @@ int main(int argc, const char * argv[]) {
             printf(TAG "Test pass!\n");
         }
     } else if (task == EXECUTION_TASK_PERFORMANCE) {
-        result = ha_session_print_trace(session);
+        if (profile_path) {
+            result = perform_profile_decode(session, hive, profile_path);
+        } else if (decode_thread_count) {
+            result = ha_parallel_decode_with_segment_size(session, decode_thread_count, decode_segment_size,
+                                                          dump_path ? dump_block_reported : ignore_block_reported,
+                                                          &dump);
+        } else if (stream_chunk_size) {
+            result = perform_stream_decode(session, trace_buffer, trace_file_size, stream_chunk_size,
+                                           trace_base_address, dump_path ? dump_block_reported : ignore_block_reported,
+                                           &dump);
+        } else if (decode_windows) {
+            result = perform_window_decode(session, trace_buffer, trace_file_size, &dump);
+        } else if (dump_path) {
+            result = ha_session_decode(session, dump_block_reported, &dump);
+        } else {
+            result = ha_session_print_trace(session);
+        }
         stop = current_clock();
 
         if (result < 0 && result != -HA_PT_DECODER_END_OF_STREAM) {
@@ -193,12 +762,21 @@ int main(int argc, const char * argv[]) {
 
     /* Completed OK, clear the result if there is any */
     CLEANUP:
+    if (session) {
+        ha_session_free(session);
+    }
+
     if (hive) {
         hb_hive_free(hive);
     }
 
-    if (session) {
-        ha_session_free(session);
+    if (bundle) {
+        hb_hive_bundle_free(bundle);
+    }
+
+    if (dump.fp && fclose(dump.fp)) {
+        printf(TAG "Could not write block dump '%s'\n", dump_path);
+        result = -HA_PT_DECODER_INTERNAL;
     }
 
     if (fd > 0) {
@@ -209,9 +787,7 @@ int main(int argc, const char * argv[]) {
         munmap(trace_map_handle, trace_file_size);
     }
 
-    if (trace_buffer) {
-        free(trace_buffer);
-    }
+    free(ring_buffer);
 
     return -result;
 }
\ No newline at end of file
@@ -89,7 +89,7 @@ static void libipt_audit_on_block(ha_session_t session, void *context, uint64_t
 }
 
 int ha_session_audit_perform_libipt_audit(ha_session_t session, const char *binary_path,
-                                          uint8_t *trace_buffer, uint64_t trace_length) {
+                                          const uint8_t *trace_buffer, uint64_t trace_length) {
     int result = 0;
     int fd = 0;
     struct stat sb;
@@ -127,8 +127,9 @@ int ha_session_audit_perform_libipt_audit(ha_session_t session, const char *bina
     /* libipt configuration */
     struct pt_config config;
     config.size = sizeof(struct pt_config);
-    config.begin = trace_buffer;
-    config.end = trace_buffer + trace_length;
+    //libipt only reads the trace, it just doesn't say so
+    config.begin = (uint8_t *) trace_buffer;
+    config.end = (uint8_t *) trace_buffer + trace_length;
     //Stop on all control flow in order to duplicate the behavior of mirrors
     config.flags.variant.block.end_on_jump = 1;
     config.flags.variant.block.end_on_call = 1;
@@ -193,7 +194,7 @@ static void nop_decode_block(ha_session_t session, void *context, uint64_t block
 }
 
 int ha_session_audit_libipt_drag_race(ha_session_t session, unsigned int iterations, const char *binary_path,
-                                      uint8_t *trace_buffer, uint64_t trace_length) {
+                                      const uint8_t *trace_buffer, uint64_t trace_length) {
     int result = 0;
     int fd = 0;
     struct stat sb;
@@ -231,8 +232,9 @@ int ha_session_audit_libipt_drag_race(ha_session_t session, unsigned int iterati
     /* libipt configuration */
     struct pt_config config;
     config.size = sizeof(struct pt_config);
-    config.begin = trace_buffer;
-    config.end = trace_buffer + trace_length;
+    //libipt only reads the trace, it just doesn't say so
+    config.begin = (uint8_t *) trace_buffer;
+    config.end = (uint8_t *) trace_buffer + trace_length;
     //Stop on all control flow in order to duplicate the behavior of mirrors
     config.flags.variant.block.end_on_jump = 1;
     config.flags.variant.block.end_on_call = 1;
@@ -312,8 +314,8 @@ int ha_session_audit_libipt_drag_race(ha_session_t session, unsigned int iterati
         }
 
         //Reconfigure the decoder in to prepare for the next round
-        if ((result = ha_session_reconfigure_with_terminated_trace_buffer(session, trace_buffer,
-                                                                          trace_length, session->trace_slide)) < 0) {
+        if ((result = ha_session_reconfigure_with_trace_buffer(session, trace_buffer, trace_length,
+                                                               session->trace_slide)) < 0) {
             printf(TAG "Drag race failed, Honeybee failed to reset. error=%d\n", result);
             goto CLEANUP;
         }
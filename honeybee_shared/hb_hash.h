@@ -0,0 +1,20 @@
+//
+// Created by Allison Husain on 3/8/21.
+//
+
+#ifndef HB_HASH_H
+#define HB_HASH_H
+
+#include <stdint.h>
+
+/**
+ * Computes the 64-bit xxHash (XXH64) of a buffer. This is a fast, non-cryptographic hash which is used to identify
+ * hive contents and detect stale data. It is NOT suitable for anything security sensitive.
+ * @param data The buffer to hash
+ * @param length The number of bytes to hash
+ * @param seed The seed value. Different seeds produce unrelated hashes for the same input.
+ * @return The hash
+ */
+uint64_t hb_hash_xxh64(const void *data, uint64_t length, uint64_t seed);
+
+#endif //HB_HASH_H
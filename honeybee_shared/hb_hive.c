@@ -11,100 +11,1044 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
 
 #include "hb_hive.h"
+#include "hb_hash.h"
 #define TAG "[" __FILE__ "] "
 
-hb_hive *hb_hive_alloc(const char *hive_path) {
-    int fd = 0;
-    void *map_handle = NULL;
-    hb_hive *hive = NULL;
-    bool success = false;
+/**
+ * The header placed at the start of a shared hive segment. The hive file image follows at
+ * HB_HIVE_SHARED_SEGMENT_HEADER_SIZE, which is a whole hugepage so that the image's v2 sections stay hugepage aligned
+ * in a segment mapped at a hugepage boundary. Only the header's first page is ever touched.
+ */
+typedef struct {
+    /** HB_HIVE_SHARED_SEGMENT_MAGIC */
+    uint64_t magic;
+    /** The size of the hive file image in bytes */
+    uint64_t image_size;
+    /** The key of the hive file the image was read from. This is also part of the segment name. */
+    uint64_t file_key;
+    /** Set to one (with release semantics) by the publisher once the image has been completely written */
+    uint32_t ready;
+} hb_hive_shared_segment_header;
 
-    if (!(hive = calloc(1, sizeof(hb_hive)))) {
-        printf(TAG "Out of memory\n");
-        goto CLEANUP;
-    }
+/** HBSHARED (little endian) */
+#define HB_HIVE_SHARED_SEGMENT_MAGIC (0x4445524148534248)
+#define HB_HIVE_SHARED_SEGMENT_HEADER_SIZE (HB_HIVE_V2_SECTION_ALIGNMENT)
+/** How long we'll wait on another process to finish publishing a segment before giving up on it */
+#define HB_HIVE_SHARED_ATTACH_TIMEOUT_MS (10000)
 
-    fd = open(hive_path, O_RDONLY);
-    if (fd < 0) {
-        printf(TAG "Could not open file '%s'!\n", hive_path);
-        goto CLEANUP;
-    }
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT (26)
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+/** From linux/mempolicy.h. We make the NUMA syscalls directly rather than depend on libnuma. */
+#define HB_MPOL_PREFERRED (1)
+#define HB_MPOL_F_NODE (1 << 0)
+#define HB_MPOL_F_ADDR (1 << 1)
+/** The number of NUMA nodes we can place a hive on (and look for shared replicas of) */
+#define HB_HIVE_MAX_NUMA_NODES (64)
 
-    struct stat sb;
-    int stat_result = fstat(fd, &sb);
-    if (stat_result < 0) {
-        printf(TAG "Could not stat file '%s'!\n", hive_path);
-        goto CLEANUP;
-    }
-
-    map_handle = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (map_handle == MAP_FAILED) {
-        printf(TAG "Could not mmap file '%s'!\n", hive_path);
-        goto CLEANUP;
+/**
+ * Locates a table of element_count elements of element_size bytes at *cursor, advancing the cursor past it.
+ * @return NULL if the table overflows or runs past end
+ */
+static void *take_table(uint8_t **cursor, const uint8_t *end, uint64_t element_count, uint64_t element_size,
+                        const char *table_name) {
+    uint64_t table_size;
+    if (__builtin_mul_overflow(element_count, element_size, &table_size)) {
+        printf(TAG "Hazardous file -> %s count overflow.\n", table_name);
+        return NULL;
     }
 
-    if (sb.st_size < sizeof(hb_hive_file_header)) {
-        printf(TAG "File too small (cannot contain header!)\n");
-        goto CLEANUP;
+    //Bounds check for the region
+    if (*cursor > end || table_size > (uint64_t)(end - *cursor)) {
+        printf(TAG "Hazardous file -> %s buffer overrun.\n", table_name);
+        return NULL;
     }
 
-    hb_hive_file_header *header = map_handle;
-    if (header->magic != HB_HIVE_FILE_HEADER_MAGIC) {
-        printf(TAG "Bad magic.\n");
-        goto CLEANUP;
-    }
+    void *table = *cursor;
+    *cursor += table_size;
+    return table;
+}
 
+/**
+ * Parses a legacy hive with a flat direct map and points the hive's tables into image
+ * @return true on success
+ */
+static bool load_flat_hive_image(hb_hive *hive, uint8_t *image, uint64_t image_size) {
+    hb_hive_file_header *header = (hb_hive_file_header *)image;
     hive->block_count = header->block_count;
     hive->direct_map_count = header->direct_map_count;
     hive->uvip_slide = header->uvip_slide;
+    hive->direct_map_kind = HB_HIVE_DIRECT_MAP_FLAT;
 
     uint8_t *raw_file_data_start_ptr = header->buffer;
-    uint8_t *raw_file_data_end_ptr = ((uint8_t *)map_handle) + sb.st_size;
+    uint8_t *raw_file_data_end_ptr = image + image_size;
 
-    /* copy in blocks */
+    /* locate blocks */
     uint64_t blocks_size;
     if (__builtin_mul_overflow(hive->block_count, sizeof(uint64_t), &blocks_size)
         || __builtin_mul_overflow(blocks_size, 2 /* each block is a pair of two uint64_t */, &blocks_size)) {
         printf(TAG "Hazardous file -> block_count overflow.\n");
-        goto CLEANUP;
+        return false;
     }
     //Bounds check for the region
     if (raw_file_data_start_ptr >= raw_file_data_end_ptr || raw_file_data_start_ptr + blocks_size >= raw_file_data_end_ptr) {
         printf(TAG "Hazardous file -> blocks buffer overrun.\n");
-        goto CLEANUP;
+        return false;
     }
 
-    if (!(hive->blocks = malloc(blocks_size))) {
-        printf(TAG "Out of memory\n");
-        goto CLEANUP;
-    }
-
-    memcpy(hive->blocks, raw_file_data_start_ptr, blocks_size);
-
     uint8_t *blocks_end_ptr = raw_file_data_start_ptr + blocks_size;
 
-    /* copy in the direct map */
+    /* locate the direct map */
     uint64_t direct_map_size;
     if (__builtin_mul_overflow(hive->direct_map_count, sizeof(uint32_t), &direct_map_size)) {
         printf(TAG "Hazardous file -> direct_map_count overflow.\n");
-        goto CLEANUP;
+        return false;
     }
 
     //Bounds check for the region
     if (blocks_end_ptr + direct_map_size >= raw_file_data_end_ptr) {
         printf(TAG "Hazardous file -> direct map buffer overrun.\n");
+        return false;
+    }
+
+    hive->blocks = (uint64_t *)raw_file_data_start_ptr;
+    hive->direct_map_buffer = (uint32_t *)blocks_end_ptr;
+    return true;
+}
+
+/**
+ * Validates the sparse map geometry of a hive whose sparse_* fields have been populated
+ * @return true if lookups on this map cannot run off the end of a table
+ */
+static bool validate_sparse_map(hb_hive *hive) {
+    bool wide = hive->direct_map_kind == HB_HIVE_DIRECT_MAP_WIDE_SPARSE;
+    uint64_t shift = hive->sparse_chunk_shift;
+
+    //Every byte of the map must be covered by a chunk and every chunk must point at a run
+    if (shift >= 64
+        || hive->sparse_chunk_count < (hive->direct_map_count >> shift)
+                                      + ((hive->direct_map_count & ((1LLU << shift) - 1)) != 0)
+        || hive->sparse_run_count == 0
+        || (!wide && (shift >= 32 || hive->direct_map_count > UINT32_MAX || hive->sparse_run_count >= UINT32_MAX))) {
+        printf(TAG "Hazardous file -> bad sparse map geometry.\n");
+        return false;
+    }
+
+    //Lookups rely on the terminator and on chunks pointing at real runs. Verify these so a bad file can't walk us off
+    // the end of a table.
+    if (wide ? hive->wide_sparse_run_starts[hive->sparse_run_count] != UINT64_MAX
+             : hive->sparse_run_starts[hive->sparse_run_count] != UINT32_MAX) {
+        printf(TAG "Hazardous file -> unterminated run table.\n");
+        return false;
+    }
+
+    for (uint64_t i = 0; i < hive->sparse_chunk_count; i++) {
+        uint64_t run = wide ? hive->wide_sparse_chunks[i] : hive->sparse_chunks[i];
+        if (run >= hive->sparse_run_count) {
+            printf(TAG "Hazardous file -> chunk references a missing run.\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Checks that every taken index in a narrow block table is in bounds. The decoder reads the uVIP of a taken block
+ * before it has a chance to check the block's index, so unlike the other layouts this can't be left to decoding.
+ * @return True if the table is safe to decode with
+ */
+static bool validate_narrow_blocks(hb_hive *hive) {
+    if (hive->block_count >= HB_HIVE_NARROW_FLAG_INDIRECT_JUMP_INDEX_VALUE) {
+        printf(TAG "Hazardous file -> too many narrow blocks.\n");
+        return false;
+    }
+
+    hm_narrow_block *blocks = (hm_narrow_block *) hive->blocks;
+    for (uint64_t i = 0; i < hive->block_count; i++) {
+        if (blocks[i].taken_index >= hive->block_count
+            && blocks[i].taken_index != HB_HIVE_NARROW_FLAG_INDIRECT_JUMP_INDEX_VALUE) {
+            printf(TAG "Hazardous file -> block %" PRIu64 " has a bad taken index.\n", i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Parses a legacy hive with a sparse direct map and points the hive's tables into image
+ * @return true on success
+ */
+static bool load_sparse_hive_image(hb_hive *hive, uint8_t *image, uint64_t image_size) {
+    if (image_size < sizeof(hb_hive_sparse_file_header)) {
+        printf(TAG "File too small (cannot contain header!)\n");
+        return false;
+    }
+
+    hb_hive_sparse_file_header *header = (hb_hive_sparse_file_header *)image;
+    hive->block_count = header->block_count;
+    hive->direct_map_count = header->direct_map_count;
+    hive->uvip_slide = header->uvip_slide;
+    hive->direct_map_kind = HB_HIVE_DIRECT_MAP_SPARSE;
+    hive->sparse_chunk_shift = header->chunk_shift;
+    hive->sparse_chunk_count = header->chunk_count;
+    hive->sparse_run_count = header->run_count;
+
+    if (hive->sparse_run_count >= UINT32_MAX) {
+        printf(TAG "Hazardous file -> bad sparse map geometry.\n");
+        return false;
+    }
+
+    uint8_t *cursor = header->buffer;
+    uint8_t *end = image + image_size;
+    if (!(hive->blocks = take_table(&cursor, end, hive->block_count, sizeof(hm_block), "blocks"))
+        || !(hive->sparse_chunks = take_table(&cursor, end, hive->sparse_chunk_count, sizeof(uint32_t), "chunk"))
+        || !(hive->sparse_run_starts = take_table(&cursor, end, hive->sparse_run_count + 1, sizeof(uint32_t),
+                                                  "run start"))
+        || !(hive->sparse_run_blocks = take_table(&cursor, end, hive->sparse_run_count, sizeof(uint32_t),
+                                                  "run block"))) {
+        return false;
+    }
+
+    return validate_sparse_map(hive);
+}
+
+/**
+ * Locates and bounds checks the header and section directory of a v2 hive image. Every section is checked to lie
+ * within the image.
+ * @return The header or NULL if the image is malformed
+ */
+static const hb_hive_v2_file_header *locate_v2_directory(const uint8_t *image, uint64_t image_size) {
+    if (image_size < HB_HIVE_V2_MINIMUM_HEADER_SIZE) {
+        printf(TAG "File too small (cannot contain header!)\n");
+        return NULL;
+    }
+
+    const hb_hive_v2_file_header *header = (const hb_hive_v2_file_header *)image;
+    if (header->version > HB_HIVE_V2_FORMAT_VERSION) {
+        printf(TAG "Hive format version %u is newer than this reader (%u)\n", header->version,
+               HB_HIVE_V2_FORMAT_VERSION);
+        return NULL;
+    }
+
+    uint64_t directory_size;
+    if (header->header_size < HB_HIVE_V2_MINIMUM_HEADER_SIZE || header->header_size > image_size
+        || header->build_id_size > HB_HIVE_BUILD_ID_MAX_SIZE
+        || __builtin_mul_overflow(header->section_count, sizeof(hb_hive_section), &directory_size)
+        || header->section_directory_offset < header->header_size
+        || header->section_directory_offset % sizeof(uint64_t) != 0
+        || header->section_directory_offset > image_size
+        || directory_size > image_size - header->section_directory_offset) {
+        printf(TAG "Hazardous file -> bad section directory.\n");
+        return NULL;
+    }
+
+    const hb_hive_section *sections = (const hb_hive_section *)(image + header->section_directory_offset);
+    for (uint64_t i = 0; i < header->section_count; i++) {
+        const hb_hive_section *section = sections + i;
+        if (section->offset > image_size || section->size > image_size - section->offset
+            || section->offset % sizeof(uint64_t) != 0) {
+            printf(TAG "Hazardous file -> section %" PRIu64 " overruns the file.\n", i);
+            return NULL;
+        }
+    }
+
+    return header;
+}
+
+/**
+ * Gets a pointer to the table held by a v2 section after checking that it holds at least count elements
+ * @return NULL if the section is missing or too small
+ */
+static void *take_section_table(uint8_t *image, const hb_hive_section *section, uint64_t count, uint64_t element_size,
+                                const char *table_name) {
+    if (!section) {
+        printf(TAG "Hazardous file -> missing %s section.\n", table_name);
+        return NULL;
+    }
+
+    uint8_t *cursor = image + section->offset;
+    return take_table(&cursor, cursor + section->size, count, element_size, table_name);
+}
+
+/**
+ * Points the hive's TNT transition tables into image if it has any. Transitions with a different number of bits were
+ * written for another reader, so they are ignored rather than rejected.
+ * @return true unless the tables are malformed
+ */
+static bool load_tnt_transitions(hb_hive *hive, uint8_t *image) {
+    const hb_hive_section *rows = hb_hive_get_section(hive, HB_HIVE_SECTION_TNT_TRANSITION_ROWS);
+    const hb_hive_section *transitions = hb_hive_get_section(hive, HB_HIVE_SECTION_TNT_TRANSITIONS);
+    if (!rows || !transitions || rows->parameter != HB_HIVE_TNT_TRANSITION_BITS
+        || transitions->parameter != HB_HIVE_TNT_TRANSITION_BITS) {
+        return true;
+    }
+
+    if (hive->block_layout == HB_HIVE_BLOCK_LAYOUT_WIDE || rows->count != hive->block_count) {
+        printf(TAG "Hazardous file -> TNT transitions don't match the blocks.\n");
+        return false;
+    }
+
+    uint32_t *row_table = take_section_table(image, rows, rows->count, sizeof(uint32_t), "TNT transition row");
+    hm_tnt_transition *transition_table = take_section_table(image, transitions, transitions->count,
+                                                             sizeof(hm_tnt_transition), "TNT transition");
+    if (!row_table || !transition_table) {
+        return false;
+    }
+
+    //Destinations are checked like any other block index when decoding, but rows and TNT counts are used as is
+    uint64_t row_count = transitions->count >> HB_HIVE_TNT_TRANSITION_BITS;
+    for (uint64_t i = 0; i < rows->count; i++) {
+        if (row_table[i] >= row_count && row_table[i] != HB_HIVE_TNT_TRANSITION_NO_ROW) {
+            printf(TAG "Hazardous file -> block %" PRIu64 " has a bad TNT transition row.\n", i);
+            return false;
+        }
+    }
+
+    for (uint64_t i = 0; i < transitions->count; i++) {
+        if (transition_table[i].tnt_count == 0 || transition_table[i].tnt_count > HB_HIVE_TNT_TRANSITION_BITS) {
+            printf(TAG "Hazardous file -> TNT transition %" PRIu64 " has a bad TNT count.\n", i);
+            return false;
+        }
+    }
+
+    hive->tnt_transition_rows = row_table;
+    hive->tnt_transitions = transition_table;
+    return true;
+}
+
+/**
+ * Parses a v2 hive and points the hive's tables into image
+ * @return true on success
+ */
+static bool load_v2_hive_image(hb_hive *hive, uint8_t *image, uint64_t image_size, uint32_t flags) {
+    const hb_hive_v2_file_header *header = locate_v2_directory(image, image_size);
+    if (!header) {
+        return false;
+    }
+
+    hive->format_version = header->version;
+    hive->sections = (const hb_hive_section *)(image + header->section_directory_offset);
+    hive->section_count = header->section_count;
+    hive->uvip_slide = header->uvip_slide;
+    hive->direct_map_count = header->direct_map_count;
+    hive->build_id_size = header->build_id_size;
+    memcpy(hive->build_id, header->build_id, header->build_id_size);
+
+    //Slides are computed differently for each kind of address, so guessing would silently decode garbage
+    hive->address_kind = header->address_kind;
+    if (hive->address_kind != HB_HIVE_ADDRESS_KIND_FILE_OFFSET && hive->address_kind != HB_HIVE_ADDRESS_KIND_VIRTUAL) {
+        printf(TAG "Unsupported address kind %u\n", hive->address_kind);
+        return false;
+    }
+
+    if (hive->address_kind == HB_HIVE_ADDRESS_KIND_VIRTUAL) {
+        if (header->header_size < sizeof(hb_hive_v2_file_header)) {
+            printf(TAG "Hazardous file -> virtually addressed hive has no load base.\n");
+            return false;
+        }
+
+        hive->preferred_load_base = header->preferred_load_base;
+    }
+
+    if (flags & HB_HIVE_LOAD_FLAG_VERIFY) {
+        for (uint64_t i = 0; i < hive->section_count; i++) {
+            const hb_hive_section *section = hive->sections + i;
+            if ((section->flags & HB_HIVE_SECTION_FLAG_HASHED)
+                && hb_hash_xxh64(image + section->offset, section->size, 0) != section->hash) {
+                printf(TAG "Section %" PRIu64 " (type %u) failed verification\n", i, section->type);
+                return false;
+            }
+        }
+    }
+
+    const hb_hive_section *blocks = hb_hive_get_section(hive, HB_HIVE_SECTION_BLOCKS);
+    uint64_t block_size = sizeof(hm_block);
+    hive->block_layout = HB_HIVE_BLOCK_LAYOUT_PACKED;
+    if (!blocks && (blocks = hb_hive_get_section(hive, HB_HIVE_SECTION_NARROW_BLOCKS))) {
+        block_size = sizeof(hm_narrow_block);
+        hive->block_layout = HB_HIVE_BLOCK_LAYOUT_NARROW;
+    } else if (!blocks && (blocks = hb_hive_get_section(hive, HB_HIVE_SECTION_WIDE_BLOCKS))) {
+        block_size = sizeof(hm_wide_block);
+        hive->block_layout = HB_HIVE_BLOCK_LAYOUT_WIDE;
+    }
+
+    if (blocks) {
+        hive->block_count = blocks->count;
+    }
+
+    if (!(hive->blocks = take_section_table(image, blocks, hive->block_count, block_size, "blocks"))) {
+        return false;
+    }
+
+    if (hive->block_layout == HB_HIVE_BLOCK_LAYOUT_NARROW && !validate_narrow_blocks(hive)) {
+        return false;
+    }
+
+    if (!load_tnt_transitions(hive, image)) {
+        return false;
+    }
+
+    const hb_hive_section *flat_map = hb_hive_get_section(hive, HB_HIVE_SECTION_FLAT_MAP);
+    if (flat_map) {
+        hive->direct_map_kind = HB_HIVE_DIRECT_MAP_FLAT;
+        //Lookups only bounds check against direct_map_count, so the table must cover at least that much
+        return (hive->direct_map_buffer = take_section_table(image, flat_map, hive->direct_map_count,
+                                                             sizeof(uint32_t), "direct map")) != NULL;
+    }
+
+    const hb_hive_section *chunks = hb_hive_get_section(hive, HB_HIVE_SECTION_SPARSE_CHUNKS);
+    const hb_hive_section *run_starts = hb_hive_get_section(hive, HB_HIVE_SECTION_SPARSE_RUN_STARTS);
+    const hb_hive_section *run_blocks = hb_hive_get_section(hive, HB_HIVE_SECTION_SPARSE_RUN_BLOCKS);
+    uint64_t entry_size = sizeof(uint32_t);
+    hive->direct_map_kind = HB_HIVE_DIRECT_MAP_SPARSE;
+    if (!chunks) {
+        chunks = hb_hive_get_section(hive, HB_HIVE_SECTION_WIDE_SPARSE_CHUNKS);
+        run_starts = hb_hive_get_section(hive, HB_HIVE_SECTION_WIDE_SPARSE_RUN_STARTS);
+        run_blocks = hb_hive_get_section(hive, HB_HIVE_SECTION_WIDE_SPARSE_RUN_BLOCKS);
+        entry_size = sizeof(uint64_t);
+        hive->direct_map_kind = HB_HIVE_DIRECT_MAP_WIDE_SPARSE;
+    }
+
+    if (!chunks || !run_starts || !run_blocks || run_starts->count == 0) {
+        printf(TAG "Hazardous file -> hive has no direct map.\n");
+        return false;
+    }
+
+    hive->sparse_chunk_shift = chunks->parameter;
+    hive->sparse_chunk_count = chunks->count;
+    hive->sparse_run_count = run_starts->count - 1;
+    void *chunk_table, *run_start_table, *run_block_table;
+    if (!(chunk_table = take_section_table(image, chunks, hive->sparse_chunk_count, entry_size, "chunk"))
+        || !(run_start_table = take_section_table(image, run_starts, run_starts->count, entry_size, "run start"))
+        || !(run_block_table = take_section_table(image, run_blocks, hive->sparse_run_count, entry_size,
+                                                  "run block"))) {
+        return false;
+    }
+
+    if (hive->direct_map_kind == HB_HIVE_DIRECT_MAP_WIDE_SPARSE) {
+        hive->wide_sparse_chunks = chunk_table;
+        hive->wide_sparse_run_starts = run_start_table;
+        hive->wide_sparse_run_blocks = run_block_table;
+    } else {
+        hive->sparse_chunks = chunk_table;
+        hive->sparse_run_starts = run_start_table;
+        hive->sparse_run_blocks = run_block_table;
+    }
+
+    return validate_sparse_map(hive);
+}
+
+/**
+ * Parses a raw hive file image and points the hive's tables into it. The image must outlive the hive.
+ * @return true on success
+ */
+static bool load_hive_image(hb_hive *hive, uint8_t *image, uint64_t image_size, uint32_t flags) {
+    if (image_size < sizeof(hb_hive_file_header)) {
+        printf(TAG "File too small (cannot contain header!)\n");
+        return false;
+    }
+
+    hive->image = image;
+    hive->image_size = image_size;
+    hive->format_version = 1;
+
+    uint64_t magic = *(uint64_t *)image;
+    if (magic == HB_HIVE_V2_FILE_HEADER_MAGIC) {
+        return load_v2_hive_image(hive, image, image_size, flags);
+    } else if (magic == HB_HIVE_FILE_HEADER_MAGIC) {
+        return load_flat_hive_image(hive, image, image_size);
+    } else if (magic == HB_HIVE_SPARSE_FILE_HEADER_MAGIC) {
+        return load_sparse_hive_image(hive, image, image_size);
+    }
+
+    printf(TAG "Bad magic.\n");
+    return false;
+}
+
+/**
+ * Copies a hive file image into a zero filled destination of the same size. For v2 hives, only the header, section
+ * directory, and sections are copied so that the alignment padding between sections is never touched.
+ * @param backing_fd If not -1, the file backing destination. Storage is allocated in it for each copied range so that
+ * running out of space fails here rather than with a SIGBUS.
+ * @param backing_offset The offset of destination within backing_fd
+ * @return true on success
+ */
+static bool copy_hive_image(uint8_t *destination, const uint8_t *image, uint64_t image_size, int backing_fd,
+                            uint64_t backing_offset) {
+    const hb_hive_v2_file_header *header = NULL;
+    if (image_size >= sizeof(uint64_t) && *(uint64_t *)image == HB_HIVE_V2_FILE_HEADER_MAGIC) {
+        header = locate_v2_directory(image, image_size);
+    }
+
+    //Legacy hives are packed, so copy the whole thing. Malformed v2 hives are copied whole too and then fail to load.
+    if (!header) {
+        if (backing_fd != -1 && posix_fallocate(backing_fd, backing_offset, image_size) != 0) {
+            return false;
+        }
+
+        memcpy(destination, image, image_size);
+        return true;
+    }
+
+    const hb_hive_section *sections = (const hb_hive_section *)(image + header->section_directory_offset);
+    for (int64_t i = -1; i < (int64_t)header->section_count; i++) {
+        uint64_t offset, size;
+        if (i == -1) {
+            //The header and directory
+            offset = 0;
+            size = header->section_directory_offset + header->section_count * sizeof(hb_hive_section);
+        } else {
+            offset = sections[i].offset;
+            size = sections[i].size;
+        }
+
+        if (size == 0) {
+            continue;
+        }
+
+        if (backing_fd != -1 && posix_fallocate(backing_fd, backing_offset + offset, size) != 0) {
+            return false;
+        }
+
+        memcpy(destination + offset, image + offset, size);
+    }
+
+    return true;
+}
+
+/**
+ * Gets the NUMA node of the CPU which the calling thread is running on
+ * @return The node or -1 if it could not be determined
+ */
+static int get_current_numa_node(void) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0 || node >= HB_HIVE_MAX_NUMA_NODES) {
+        return -1;
+    }
+
+    return (int)node;
+}
+
+/**
+ * Gets the NUMA node which holds the page containing an address, faulting it in if it is not already
+ * @return The node or -1 if it could not be determined
+ */
+static int get_address_numa_node(const void *address) {
+    int node = -1;
+    if (!address || syscall(SYS_get_mempolicy, &node, NULL, 0, address, HB_MPOL_F_NODE | HB_MPOL_F_ADDR) < 0) {
+        return -1;
+    }
+
+    return node;
+}
+
+/**
+ * Applies the hugepage advice and NUMA preference requested by flags to a mapping before any of it is touched. This
+ * is all advice, so failures are reported through the return value rather than treated as errors.
+ * @param node The node to prefer for the mapping's pages or -1 to leave the policy alone
+ * @return HB_HIVE_PLACEMENT_TRANSPARENT_HUGEPAGES if hugepages were requested and the kernel accepted the advice,
+ * otherwise zero
+ */
+static uint32_t advise_placement(void *mapping, uint64_t size, uint32_t flags, int node) {
+    uint32_t placement = 0;
+    if ((flags & HB_HIVE_LOAD_FLAG_HUGEPAGES) && madvise(mapping, size, MADV_HUGEPAGE) == 0) {
+        placement |= HB_HIVE_PLACEMENT_TRANSPARENT_HUGEPAGES;
+    }
+
+    if (node >= 0) {
+        //Only a preference so that a full node degrades to remote memory rather than failing the load
+        unsigned long node_mask = 1LU << node;
+        syscall(SYS_mbind, mapping, size, HB_MPOL_PREFERRED, &node_mask, sizeof(node_mask) * 8 + 1, 0);
+    }
+
+    return placement;
+}
+
+/**
+ * Maps size bytes at a hugepage aligned address. Since v2 sections are aligned to the hugepage size, every section of
+ * an image placed at a hugepage aligned offset into the mapping is then hugepage aligned too.
+ * @param prot The mmap protection
+ * @param flags The mmap flags, not including MAP_FIXED
+ * @param fd The file to map from its start or -1 for an anonymous mapping
+ * @return The mapping or MAP_FAILED
+ */
+static uint8_t *mmap_hugepage_aligned(uint64_t size, int prot, int flags, int fd) {
+    //Reserve an extra hugepage of address space so that the mapping can be placed at an aligned start within it
+    uint64_t padded_size = size + HB_HIVE_V2_SECTION_ALIGNMENT;
+    uint8_t *padded = mmap(NULL, padded_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (padded == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    uint8_t *aligned = (uint8_t *)(((uintptr_t)padded + HB_HIVE_V2_SECTION_ALIGNMENT - 1)
+                                   & ~(HB_HIVE_V2_SECTION_ALIGNMENT - 1));
+    uint8_t *mapping = mmap(aligned, size, prot, flags | MAP_FIXED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        munmap(padded, padded_size);
+        return MAP_FAILED;
+    }
+
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint8_t *mapping_end = mapping + ((size + page_size - 1) & ~(page_size - 1));
+    if (mapping != padded) {
+        munmap(padded, mapping - padded);
+    }
+    munmap(mapping_end, (padded + padded_size) - mapping_end);
+
+    return mapping;
+}
+
+/**
+ * Allocates the zero filled buffer a private copy of a hive image is made into. This is a plain heap allocation
+ * unless hugepages or node-local placement were requested, in which case it is an anonymous mapping which starts on a
+ * hugepage boundary (and so, since v2 sections are aligned to the hugepage size, so does every section).
+ * @return true on success
+ */
+static bool alloc_heap_image(hb_hive *hive, uint64_t image_size, uint32_t flags, int node) {
+    if (!(flags & (HB_HIVE_LOAD_FLAG_HUGEPAGES | HB_HIVE_LOAD_FLAG_EXPLICIT_HUGEPAGES
+                   | HB_HIVE_LOAD_FLAG_NUMA_LOCAL))) {
+        hive->heap_image = calloc(1, image_size);
+        return hive->heap_image != NULL;
+    }
+
+    uint64_t map_size = (image_size + HB_HIVE_V2_SECTION_ALIGNMENT - 1) & ~(HB_HIVE_V2_SECTION_ALIGNMENT - 1);
+    uint8_t *mapping = MAP_FAILED;
+    if (flags & HB_HIVE_LOAD_FLAG_EXPLICIT_HUGEPAGES) {
+        mapping = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if (mapping == MAP_FAILED) {
+            printf(TAG "Explicit hugepages unavailable, falling back to transparent hugepages\n");
+            flags |= HB_HIVE_LOAD_FLAG_HUGEPAGES;
+        } else {
+            hive->placement |= HB_HIVE_PLACEMENT_EXPLICIT_HUGEPAGES;
+            flags &= ~HB_HIVE_LOAD_FLAG_HUGEPAGES;
+        }
+    }
+
+    if (mapping == MAP_FAILED) {
+        mapping = mmap_hugepage_aligned(map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+    }
+
+    hive->placement |= advise_placement(mapping, map_size, flags, node);
+    hive->heap_image = mapping;
+    hive->heap_image_map_size = map_size;
+    return true;
+}
+
+/**
+ * Records which NUMA node the hive's tables ended up on. Only the first page of each table is checked.
+ * @param node The node the tables were meant to be placed on or -1 if no placement was requested
+ */
+static void record_numa_placement(hb_hive *hive, int node) {
+    hive->numa_node = get_address_numa_node(hive->blocks);
+    if (node < 0 || hive->numa_node != node) {
+        return;
+    }
+
+    const void *tables[] = {
+            hive->direct_map_buffer, hive->sparse_chunks, hive->sparse_run_starts, hive->sparse_run_blocks,
+            hive->wide_sparse_chunks, hive->wide_sparse_run_starts, hive->wide_sparse_run_blocks
+    };
+    for (size_t i = 0; i < sizeof(tables) / sizeof(*tables); i++) {
+        if (tables[i] && get_address_numa_node(tables[i]) != node) {
+            return;
+        }
+    }
+
+    hive->placement |= HB_HIVE_PLACEMENT_NUMA_LOCAL;
+}
+
+/**
+ * Builds the POSIX shared memory name for a hive. The name is keyed on the identity of the hive file (its device,
+ * inode, size, and modification time) rather than its contents so that finding the segment doesn't need to read the
+ * file, while a regenerated hive still never attaches to a stale segment.
+ * @param sb The hive file's stat
+ * @param node The NUMA node of a per-node replica or -1 for the host-wide segment
+ * @param file_key_out The location to place the key, which the segment's header also holds
+ */
+static void get_shared_segment_name(const struct stat *sb, int node, char *name_out, size_t name_size,
+                                    uint64_t *file_key_out) {
+    uint64_t identity[] = {
+            (uint64_t) sb->st_dev, (uint64_t) sb->st_ino, (uint64_t) sb->st_size, (uint64_t) sb->st_mtim.tv_sec,
+            (uint64_t) sb->st_mtim.tv_nsec
+    };
+    uint64_t file_key = hb_hash_xxh64(identity, sizeof(identity), 0);
+    if (node >= 0) {
+        snprintf(name_out, name_size, "/honeybee_hive_%016" PRIx64 "_node%d", file_key, node);
+    } else {
+        snprintf(name_out, name_size, "/honeybee_hive_%016" PRIx64, file_key);
+    }
+
+    *file_key_out = file_key;
+}
+
+static void sleep_one_millisecond(void) {
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Checks whether the publisher of a segment is gone. Publishers hold an exclusive lock on the segment until it is
+ * ready, and the lock is dropped if they die, so a segment which isn't ready but isn't locked will never be ready. The
+ * one exception is a segment which was only just created and so is still empty, since it can't be created and locked
+ * at once.
+ */
+static bool is_publisher_gone(int shm_fd) {
+    if (flock(shm_fd, LOCK_SH | LOCK_NB) < 0) {
+        return false;
+    }
+
+    flock(shm_fd, LOCK_UN);
+    return true;
+}
+
+/**
+ * Removes a segment whose publisher died before finishing it, unless someone has already replaced it
+ */
+static void unlink_stale_segment(const char *name, int stale_fd) {
+    struct stat stale_sb, current_sb;
+    int current_fd = shm_open(name, O_RDONLY, 0);
+    if (current_fd < 0) {
+        return;
+    }
+
+    if (fstat(stale_fd, &stale_sb) == 0 && fstat(current_fd, &current_sb) == 0
+        && stale_sb.st_dev == current_sb.st_dev && stale_sb.st_ino == current_sb.st_ino) {
+        printf(TAG "Removing shared segment '%s' since its publisher died\n", name);
+        shm_unlink(name);
+    }
+
+    close(current_fd);
+}
+
+/**
+ * Attaches to a segment which another process has published (or is in the middle of publishing).
+ * @param is_stale_out Set if the segment was abandoned by its publisher and has been removed
+ * @return The read-only segment mapping or NULL if the segment could not be attached
+ */
+static uint8_t *attach_shared_segment(const char *name, uint64_t image_size, uint64_t file_key, bool *is_stale_out) {
+    int shm_fd = -1;
+    uint8_t *segment = NULL;
+    uint64_t segment_size = HB_HIVE_SHARED_SEGMENT_HEADER_SIZE + image_size;
+    bool success = false;
+    bool is_gone;
+
+    *is_stale_out = false;
+    shm_fd = shm_open(name, O_RDONLY, 0);
+    if (shm_fd < 0) {
+        printf(TAG "Could not open shared segment '%s'!\n", name);
+        goto CLEANUP;
+    }
+
+    //The publisher may not have sized the segment yet
+    struct stat sb;
+    int waited_ms = 0;
+    while (1) {
+        //We check the lock first so that a publisher which finishes in between isn't mistaken for a dead one
+        is_gone = is_publisher_gone(shm_fd);
+        if (fstat(shm_fd, &sb) < 0) {
+            printf(TAG "Could not stat shared segment '%s'!\n", name);
+            goto CLEANUP;
+        }
+
+        //Publishers lock the segment just after creating it and only size it once it is locked, so an empty segment
+        //which isn't locked is most likely still being created. It's only given up on once the timeout is up.
+        if ((uint64_t) sb.st_size == segment_size) {
+            break;
+        } else if (sb.st_size != 0 || waited_ms++ >= HB_HIVE_SHARED_ATTACH_TIMEOUT_MS) {
+            if (is_gone) {
+                *is_stale_out = true;
+            } else {
+                printf(TAG "Shared segment '%s' has an unexpected size!\n", name);
+            }
+            goto CLEANUP;
+        }
+
+        sleep_one_millisecond();
+    }
+
+    segment = mmap_hugepage_aligned(segment_size, PROT_READ, MAP_SHARED, shm_fd);
+    if (segment == MAP_FAILED) {
+        segment = NULL;
+        printf(TAG "Could not mmap shared segment '%s'!\n", name);
+        goto CLEANUP;
+    }
+
+    hb_hive_shared_segment_header *header = (hb_hive_shared_segment_header *)segment;
+    while (1) {
+        is_gone = is_publisher_gone(shm_fd);
+        if (__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE)) {
+            break;
+        } else if (is_gone) {
+            *is_stale_out = true;
+            goto CLEANUP;
+        } else if (waited_ms++ >= HB_HIVE_SHARED_ATTACH_TIMEOUT_MS) {
+            printf(TAG "Timed out waiting for shared segment '%s' to be published!\n", name);
+            goto CLEANUP;
+        }
+
+        sleep_one_millisecond();
+    }
+
+    if (header->magic != HB_HIVE_SHARED_SEGMENT_MAGIC || header->image_size != image_size
+        || header->file_key != file_key) {
+        printf(TAG "Shared segment '%s' does not match its hive!\n", name);
         goto CLEANUP;
     }
 
-    if (!(hive->direct_map_buffer = malloc(direct_map_size))) {
+    success = true;
+    CLEANUP:
+    if (*is_stale_out) {
+        unlink_stale_segment(name, shm_fd);
+    }
+
+    if (shm_fd >= 0) {
+        close(shm_fd);
+    }
+
+    if (!success && segment) {
+        munmap(segment, segment_size);
+        segment = NULL;
+    }
+
+    return segment;
+}
+
+/**
+ * Publishes a hive file image into a new shared segment. The segment is locked until it is ready so that attachers can
+ * tell if we die part way through (see is_publisher_gone).
+ * @param flags The load flags, used to place the segment's pages before they are first touched
+ * @param node The NUMA node to place the segment on or -1
+ * @return The read-only segment mapping, NULL if the segment could not be created. If another process created the
+ * segment first, errno is set to EEXIST.
+ */
+static uint8_t *publish_shared_segment(const char *name, const uint8_t *image, uint64_t image_size,
+                                       uint64_t file_key, uint32_t flags, int node) {
+    int shm_fd = -1;
+    uint8_t *segment = NULL;
+    uint64_t segment_size = HB_HIVE_SHARED_SEGMENT_HEADER_SIZE + image_size;
+    bool success = false;
+
+    shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (shm_fd < 0) {
+        //We lost the race or we can't use shm at all. Either way, the caller decides.
+        return NULL;
+    }
+
+    //Closing the descriptor (or dying) releases this
+    if (flock(shm_fd, LOCK_EX) < 0) {
+        printf(TAG "Could not lock shared segment '%s'!\n", name);
+        goto CLEANUP;
+    }
+
+    //Reserve the header's backing memory now so that we fail here rather than SIGBUS while copying if /dev/shm is full
+    if (ftruncate(shm_fd, segment_size) < 0
+        || posix_fallocate(shm_fd, 0, sizeof(hb_hive_shared_segment_header)) != 0) {
+        printf(TAG "Could not size shared segment '%s'!\n", name);
+        goto CLEANUP;
+    }
+
+    segment = mmap_hugepage_aligned(segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd);
+    if (segment == MAP_FAILED) {
+        segment = NULL;
+        printf(TAG "Could not mmap shared segment '%s'!\n", name);
+        goto CLEANUP;
+    }
+
+    advise_placement(segment, segment_size, flags, node);
+
+    hb_hive_shared_segment_header *header = (hb_hive_shared_segment_header *)segment;
+    header->magic = HB_HIVE_SHARED_SEGMENT_MAGIC;
+    header->image_size = image_size;
+    header->file_key = file_key;
+    if (!copy_hive_image(segment + HB_HIVE_SHARED_SEGMENT_HEADER_SIZE, image, image_size, shm_fd,
+                         HB_HIVE_SHARED_SEGMENT_HEADER_SIZE)) {
+        printf(TAG "Could not copy hive into shared segment '%s'!\n", name);
+        goto CLEANUP;
+    }
+    __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+
+    if (mprotect(segment, segment_size, PROT_READ) < 0) {
+        printf(TAG "Could not seal shared segment '%s'!\n", name);
+        goto CLEANUP;
+    }
+
+    success = true;
+    CLEANUP:
+    if (!success) {
+        if (segment) {
+            munmap(segment, segment_size);
+            segment = NULL;
+        }
+
+        //Don't leave a segment around which will never become ready. We unlink before unlocking so that nobody
+        //mistakes it for an abandoned segment and unlinks its replacement.
+        shm_unlink(name);
+    }
+
+    if (shm_fd >= 0) {
+        close(shm_fd);
+    }
+
+    if (!success) {
+        //Make sure the caller doesn't mistake this for losing the race to publish
+        errno = 0;
+    }
+
+    return segment;
+}
+
+/**
+ * Gets the host-wide shared copy of a hive file image, publishing it if no other process has already.
+ * @param sb The hive file's stat
+ * @param node The NUMA node of the replica to get or -1 for the host-wide copy
+ * @return The read-only segment mapping (the image begins HB_HIVE_SHARED_SEGMENT_HEADER_SIZE bytes in) or NULL if
+ * the shared copy is unavailable.
+ */
+static uint8_t *get_shared_segment(const struct stat *sb, const uint8_t *image, uint64_t image_size, uint32_t flags,
+                                   int node) {
+    char name[NAME_MAX];
+    uint64_t file_key;
+    uint8_t *segment = NULL;
+    get_shared_segment_name(sb, node, name, sizeof(name), &file_key);
+
+    //If the segment was abandoned by a publisher which died, it's removed and we try publishing it again ourselves
+    for (int attempt = 0; attempt < 2 && !segment; attempt++) {
+        bool is_stale = false;
+        segment = publish_shared_segment(name, image, image_size, file_key, flags, node);
+        if (!segment && errno == EEXIST) {
+            segment = attach_shared_segment(name, image_size, file_key, &is_stale);
+        }
+
+        if (!is_stale) {
+            break;
+        }
+    }
+
+    return segment;
+}
+
+hb_hive *hb_hive_alloc(const char *hive_path) {
+    return hb_hive_alloc_with_flags(hive_path, 0);
+}
+
+hb_hive *hb_hive_alloc_with_flags(const char *hive_path, uint32_t flags) {
+    int fd = 0;
+    void *map_handle = NULL;
+    hb_hive *hive = NULL;
+    bool success = false;
+    int node = -1;
+
+    //Explicit hugepages need a private copy, as does node-local placement unless we can use a per-node shared replica
+    if (flags & HB_HIVE_LOAD_FLAG_EXPLICIT_HUGEPAGES) {
+        flags &= ~(HB_HIVE_LOAD_FLAG_ZERO_COPY | HB_HIVE_LOAD_FLAG_SHARED);
+    } else if ((flags & HB_HIVE_LOAD_FLAG_NUMA_LOCAL) && !(flags & HB_HIVE_LOAD_FLAG_SHARED)) {
+        flags &= ~HB_HIVE_LOAD_FLAG_ZERO_COPY;
+    }
+    bool zero_copy = flags & (HB_HIVE_LOAD_FLAG_ZERO_COPY | HB_HIVE_LOAD_FLAG_SHARED);
+
+    if ((flags & HB_HIVE_LOAD_FLAG_NUMA_LOCAL) && (node = get_current_numa_node()) < 0) {
+        printf(TAG "Could not determine the NUMA node of the calling thread, placement will not be node-local\n");
+    }
+
+    if (!(hive = calloc(1, sizeof(hb_hive)))) {
         printf(TAG "Out of memory\n");
         goto CLEANUP;
     }
 
-    memcpy(hive->direct_map_buffer, blocks_end_ptr, direct_map_size);
+    fd = open(hive_path, O_RDONLY);
+    if (fd < 0) {
+        printf(TAG "Could not open file '%s'!\n", hive_path);
+        goto CLEANUP;
+    }
+
+    struct stat sb;
+    int stat_result = fstat(fd, &sb);
+    if (stat_result < 0) {
+        printf(TAG "Could not stat file '%s'!\n", hive_path);
+        goto CLEANUP;
+    }
+
+    int map_flags = MAP_SHARED;
+    if (flags & HB_HIVE_LOAD_FLAG_POPULATE) {
+        map_flags |= MAP_POPULATE;
+    }
+
+    map_handle = mmap(NULL, sb.st_size, PROT_READ, map_flags, fd, 0);
+    if (map_handle == MAP_FAILED) {
+        printf(TAG "Could not mmap file '%s'!\n", hive_path);
+        goto CLEANUP;
+    }
 
+    if (flags & HB_HIVE_LOAD_FLAG_READAHEAD) {
+        //This is only advice, so a failure here is not fatal
+        madvise(map_handle, sb.st_size, MADV_WILLNEED);
+    }
+
+    if (flags & HB_HIVE_LOAD_FLAG_SHARED) {
+        uint8_t *segment = get_shared_segment(&sb, map_handle, sb.st_size, flags, node);
+        if (segment) {
+            hive->map_handle = segment;
+            hive->map_size = HB_HIVE_SHARED_SEGMENT_HEADER_SIZE + sb.st_size;
+            hive->placement |= advise_placement(segment, hive->map_size, flags, -1);
+            if (!load_hive_image(hive, segment + HB_HIVE_SHARED_SEGMENT_HEADER_SIZE, sb.st_size, flags)) {
+                goto CLEANUP;
+            }
+
+            record_numa_placement(hive, node);
+            success = true;
+            goto CLEANUP;
+        }
+
+        if (node >= 0) {
+            //A private mapping would live wherever the page cache put it, so make a node-local copy instead
+            printf(TAG "Shared hive unavailable, falling back to a private copy of '%s'\n", hive_path);
+            zero_copy = false;
+        } else {
+            printf(TAG "Shared hive unavailable, falling back to a private mapping of '%s'\n", hive_path);
+        }
+    }
+
+    if (zero_copy) {
+        //The hive now owns the mapping and will unmap it when freed
+        hive->map_handle = map_handle;
+        hive->map_size = sb.st_size;
+        map_handle = NULL;
+        hive->placement |= advise_placement(hive->map_handle, hive->map_size, flags, -1);
+
+        if (!load_hive_image(hive, hive->map_handle, hive->map_size, flags)) {
+            goto CLEANUP;
+        }
+    } else {
+        /* copy the hive onto the heap so that we don't depend on the file after loading */
+        if (!alloc_heap_image(hive, sb.st_size, flags, node)) {
+            printf(TAG "Out of memory\n");
+            goto CLEANUP;
+        }
+
+        copy_hive_image(hive->heap_image, map_handle, sb.st_size, -1, 0);
+
+        if (!load_hive_image(hive, hive->heap_image, sb.st_size, flags)) {
+            goto CLEANUP;
+        }
+    }
+
+    record_numa_placement(hive, node);
     success = true;
     CLEANUP:
     if (fd > 0) {
@@ -123,27 +1067,202 @@ hb_hive *hb_hive_alloc(const char *hive_path) {
     }
 }
 
+int hb_hive_unlink_shared(const char *hive_path) {
+    int result = -1;
+    char name[NAME_MAX];
+    uint64_t file_key;
+
+    struct stat sb;
+    if (stat(hive_path, &sb) < 0) {
+        printf(TAG "Could not stat file '%s'!\n", hive_path);
+        return result;
+    }
+
+    //Remove the host-wide segment along with any per-node replicas (see HB_HIVE_LOAD_FLAG_NUMA_LOCAL)
+    for (int node = -1; node < HB_HIVE_MAX_NUMA_NODES; node++) {
+        get_shared_segment_name(&sb, node, name, sizeof(name), &file_key);
+        if (shm_unlink(name) == 0) {
+            result = 0;
+        }
+    }
+
+    return result;
+}
+
 void hb_hive_free(hb_hive *hive) {
     if (!hive) {
         return;
     }
 
-    if (hive->blocks) {
-        free(hive->blocks);
-        hive->blocks = NULL;
+    //All of our tables are views into either the mapping or the heap copy
+    if (hive->map_handle) {
+        munmap(hive->map_handle, hive->map_size);
+        hive->map_handle = NULL;
     }
 
-    if (hive->direct_map_buffer) {
-        free(hive->direct_map_buffer);
-        hive->direct_map_buffer = NULL;
+    if (hive->heap_image) {
+        if (hive->heap_image_map_size) {
+            munmap(hive->heap_image, hive->heap_image_map_size);
+        } else {
+            free(hive->heap_image);
+        }
+        hive->heap_image = NULL;
     }
+
+    free(hive);
+}
+
+const hb_hive_section *hb_hive_get_section(hb_hive *hive, uint32_t type) {
+    for (uint64_t i = 0; i < hive->section_count; i++) {
+        if (hive->sections[i].type == type) {
+            return hive->sections + i;
+        }
+    }
+
+    return NULL;
 }
 
 void hb_hive_describe_block(hb_hive *hive, uint64_t i) {
+    if (hive->block_layout == HB_HIVE_BLOCK_LAYOUT_WIDE) {
+        hm_wide_block *block = ((hm_wide_block *) hive->blocks) + i;
+        printf("Block %" PRIu64 " (wide):\n", i);
+        printf("Not-taken index = %" PRIu64 ", Taken index = %" PRIu64 ", Conditional=%" PRIu64 "\n",
+               block->not_taken_index, block->packed_taken_index >> 1, block->packed_taken_index & 1);
+        printf("Not-taken VIP = %p, Taken VIP = %p\n", (void *) block->not_taken_uvip, (void *) block->taken_uvip);
+        if (!(block->packed_taken_index & 1) && block->not_taken_index) {
+            printf("Skips chain to index = %" PRIu64 "\n", block->not_taken_index);
+        }
+        return;
+    } else if (hive->block_layout == HB_HIVE_BLOCK_LAYOUT_NARROW) {
+        hm_narrow_block *block = ((hm_narrow_block *) hive->blocks) + i;
+        printf("Block %" PRIu64 " (narrow):\n", i);
+        printf("VIP = %p, Taken index = %u, Not-taken VIP delta = %u, Conditional=%u\n", (void *) (uint64_t) block->uvip,
+               block->taken_index, block->packed_not_taken_delta >> 1,
+               block->packed_not_taken_delta & HB_HIVE_FLAG_IS_CONDITIONAL);
+        return;
+    }
+
     uint64_t index = hive->blocks[2 * i];
     uint64_t vip = hive->blocks[2 * i + 1];
     printf("Block %" PRIu64 ":\n", i);
     printf("Not-taken index = %" PRIu64 ", Taken index = %" PRIu64 ", Conditional=%" PRIu64 "\n",
            (index >> 33), (uint64_t) ((index >> 1) & ((1LLU << 31) - 1)), index & 1);
     printf("Not-taken VIP = %p, Taken VIP = %p\n", (void *) (vip >> 32), (void *) (vip & ((1LLU << 32) - 1)));
+    if (!(index & HB_HIVE_FLAG_IS_CONDITIONAL) && (index >> 33)) {
+        printf("Skips chain to index = %" PRIu64 "\n", index >> 33);
+    }
+}
+
+int hb_hive_get_trace_slide_from_maps(hb_hive *hive, const char *maps_path, const char *image_path,
+                                      uint64_t *trace_slide) {
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+    bool found = false;
+    uint64_t best_start = 0;
+    uint64_t best_offset = 0;
+
+    if (!(fp = fopen(maps_path, "r"))) {
+        printf(TAG "Could not open memory map '%s'!\n", maps_path);
+        return -1;
+    }
+
+    while (getline(&line, &line_size, fp) >= 0) {
+        uint64_t mapping_start, mapping_end, mapping_offset;
+        char permissions[5];
+        int path_start = 0;
+        if (sscanf(line, "%" SCNx64 "-%" SCNx64 " %4s %" SCNx64 " %*s %*s %n", &mapping_start, &mapping_end,
+                   permissions, &mapping_offset, &path_start) != 4 || !path_start) {
+            continue;
+        }
+
+        char *path = line + path_start;
+        path[strcspn(path, "\n")] = '\0';
+        if (strcmp(path, image_path) != 0) {
+            continue;
+        }
+
+        /*
+         * File offset hives only know where their code is in the file, so they must be slid using the mapping which
+         * holds it. Virtual address hives may use any mapping, but the one at the lowest offset is the one whose
+         * address the kernel picked.
+         */
+        if (hive->address_kind == HB_HIVE_ADDRESS_KIND_FILE_OFFSET) {
+            if (permissions[2] == 'x' && !found) {
+                found = true;
+                best_start = mapping_start;
+                best_offset = mapping_offset;
+            }
+        } else if (!found || mapping_offset < best_offset) {
+            found = true;
+            best_start = mapping_start;
+            best_offset = mapping_offset;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (!found) {
+        printf(TAG "'%s' is not mapped in '%s'\n", image_path, maps_path);
+        return -2;
+    }
+
+    *trace_slide = best_start - best_offset - hive->preferred_load_base;
+    return 0;
+}
+
+/**
+ * Sums the hugepage backed memory of every mapping which overlaps a range according to /proc/self/smaps
+ * @return The number of hugepage backed bytes or -1 if smaps could not be read
+ */
+static int64_t get_hugepage_backed_size(const void *start, uint64_t size) {
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+    bool in_range = false;
+    int64_t huge_kb = 0;
+
+    if (!(fp = fopen("/proc/self/smaps", "r"))) {
+        return -1;
+    }
+
+    while (getline(&line, &line_size, fp) >= 0) {
+        uint64_t mapping_start, mapping_end, value;
+        char key[64];
+        if (sscanf(line, "%" SCNx64 "-%" SCNx64 " ", &mapping_start, &mapping_end) == 2) {
+            in_range = mapping_start < (uintptr_t)start + size && (uintptr_t)start < mapping_end;
+        } else if (in_range && sscanf(line, "%63[^:]: %" SCNu64 " kB", key, &value) == 2) {
+            if (!strcmp(key, "AnonHugePages") || !strcmp(key, "ShmemPmdMapped") || !strcmp(key, "FilePmdMapped")
+                || !strcmp(key, "Private_Hugetlb") || !strcmp(key, "Shared_Hugetlb")) {
+                huge_kb += value;
+            }
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    return huge_kb * 1024;
+}
+
+void hb_hive_describe_placement(hb_hive *hive) {
+    const char *hugepages = "none";
+    if (hive->placement & HB_HIVE_PLACEMENT_EXPLICIT_HUGEPAGES) {
+        hugepages = "explicit";
+    } else if (hive->placement & HB_HIVE_PLACEMENT_TRANSPARENT_HUGEPAGES) {
+        hugepages = "transparent";
+    }
+
+    printf("Hugepages = %s", hugepages);
+    int64_t huge_size = get_hugepage_backed_size(hive->image, hive->image_size);
+    if (huge_size >= 0) {
+        //Mappings which only partially overlap the image count in full, so clamp to the image's size
+        uint64_t huge_image_size = (uint64_t)huge_size < hive->image_size ? (uint64_t)huge_size : hive->image_size;
+        printf(", %" PRIu64 " of %" PRIu64 " KiB hugepage backed", huge_image_size / 1024, hive->image_size / 1024);
+    }
+    printf("\n");
+
+    int current_node = get_current_numa_node();
+    printf("NUMA node = %" PRId32 " (%s), current thread node = %d\n", hive->numa_node,
+           hive->placement & HB_HIVE_PLACEMENT_NUMA_LOCAL ? "local" : "not placed", current_node);
 }
@@ -7,13 +7,149 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 
 /** HONEYBEE (little endian) :) */
 #define HB_HIVE_FILE_HEADER_MAGIC (0x45454259454E4F48)
+/** HONEYSPM (little endian). A hive which uses a sparse direct map. */
+#define HB_HIVE_SPARSE_FILE_HEADER_MAGIC (0x4D505359454E4F48)
+/** HONEYHIV (little endian). A versioned hive container. See hb_hive_v2_file_header. */
+#define HB_HIVE_V2_FILE_HEADER_MAGIC (0x56494859454E4F48)
+/** The newest container version which this reader understands */
+#define HB_HIVE_V2_FORMAT_VERSION (2)
+/** The alignment of sections in files written by honey_hive_generator. This allows tables to be hugepage mapped. */
+#define HB_HIVE_V2_SECTION_ALIGNMENT (2LLU << 20)
+/** The largest build-id which a hive can record */
+#define HB_HIVE_BUILD_ID_MAX_SIZE (64)
+/** The hive's blocks are addressed by their offset in the ELF file. This is the case for all legacy hives. */
+#define HB_HIVE_ADDRESS_KIND_FILE_OFFSET (0)
+/** The hive's blocks are addressed by the virtual address the ELF's program headers load them at */
+#define HB_HIVE_ADDRESS_KIND_VIRTUAL (1)
 /** Is this index block a conditional jump? */
 #define HB_HIVE_FLAG_IS_CONDITIONAL (1)
 /** Is this jump index target an indirect jump? */
 #define HB_HIVE_FLAG_INDIRECT_JUMP_INDEX_VALUE ((1LLU<<31) - 1) //31 bits of ones
+/** Is this jump index target of a narrow block an indirect jump? */
+#define HB_HIVE_NARROW_FLAG_INDIRECT_JUMP_INDEX_VALUE (UINT16_MAX)
+/** Is this jump index target of a wide block an indirect jump? */
+#define HB_HIVE_WIDE_FLAG_INDIRECT_JUMP_INDEX_VALUE ((1LLU<<63) - 1) //63 bits of ones
+
+/**
+ * Load flags for hb_hive_alloc_with_flags
+ */
+/**
+ * Point the hive's block table and direct map directly into a read-only mapping of the hive file rather than copying
+ * them onto the heap. Processes which load the same hive this way share a single page cache copy.
+ */
+#define HB_HIVE_LOAD_FLAG_ZERO_COPY (1U << 0)
+/** Pre-fault the hive file mapping while loading (MAP_POPULATE) so that decoding never takes a page fault */
+#define HB_HIVE_LOAD_FLAG_POPULATE (1U << 1)
+/** Ask the kernel to start reading the hive file mapping in the background (MADV_WILLNEED) */
+#define HB_HIVE_LOAD_FLAG_READAHEAD (1U << 2)
+/**
+ * Attach to a host-wide read-only copy of the hive in POSIX shared memory, publishing it first if no other process
+ * has. Segments are keyed by the hive file's device, inode, size, and modification time, so every process on the host
+ * which loads the same hive shares one physical copy of it while a regenerated hive gets a new segment. Segments which
+ * were abandoned by a publisher which died are removed and published again. Implies HB_HIVE_LOAD_FLAG_ZERO_COPY. If the
+ * shared copy is unavailable, the hive is loaded as a private zero-copy mapping instead.
+ */
+#define HB_HIVE_LOAD_FLAG_SHARED (1U << 3)
+/** Verify the hash of every hashed section while loading and refuse the hive if any do not match */
+#define HB_HIVE_LOAD_FLAG_VERIFY (1U << 4)
+/**
+ * Ask for the block table and direct map to be backed by transparent hugepages (MADV_HUGEPAGE). Private copies are
+ * placed so that every section begins on a hugepage boundary. For zero-copy and shared hives this is only advice to
+ * the page cache and whether it is honored depends on the kernel's configuration.
+ */
+#define HB_HIVE_LOAD_FLAG_HUGEPAGES (1U << 5)
+/**
+ * Back a private copy of the hive with explicit hugepages (MAP_HUGETLB) from the preallocated hugepage pool. This
+ * implies a private copy, so HB_HIVE_LOAD_FLAG_ZERO_COPY and HB_HIVE_LOAD_FLAG_SHARED are ignored. If the pool cannot
+ * satisfy the allocation, the hive falls back to HB_HIVE_LOAD_FLAG_HUGEPAGES.
+ */
+#define HB_HIVE_LOAD_FLAG_EXPLICIT_HUGEPAGES (1U << 6)
+/**
+ * Place the hive's tables on the NUMA node of the calling thread. Alone (or with HB_HIVE_LOAD_FLAG_ZERO_COPY) this
+ * makes a private node-local copy. With HB_HIVE_LOAD_FLAG_SHARED, one shared segment is kept per node and the hive
+ * attaches to the replica for the calling thread's node.
+ */
+#define HB_HIVE_LOAD_FLAG_NUMA_LOCAL (1U << 7)
+
+/**
+ * Placement flags describing what a hive's load flags actually achieved (see hb_hive.placement)
+ */
+/** The kernel accepted MADV_HUGEPAGE for the hive's tables */
+#define HB_HIVE_PLACEMENT_TRANSPARENT_HUGEPAGES (1U << 0)
+/** The hive's tables live in explicit hugepages */
+#define HB_HIVE_PLACEMENT_EXPLICIT_HUGEPAGES (1U << 1)
+/** The hive's tables were found on the NUMA node of the thread which loaded it */
+#define HB_HIVE_PLACEMENT_NUMA_LOCAL (1U << 2)
+
+/**
+ * Section types in a v2 hive. Readers skip sections with types they do not understand.
+ */
+/** The block table. Count is the number of hm_blocks. */
+#define HB_HIVE_SECTION_BLOCKS (1)
+/** A flat direct map. Count is the number of uint32_t block indices. */
+#define HB_HIVE_SECTION_FLAT_MAP (2)
+/** The chunk table of a sparse direct map. Count is the number of chunks, parameter is the chunk shift. */
+#define HB_HIVE_SECTION_SPARSE_CHUNKS (3)
+/** The run start table of a sparse direct map. Count is the number of runs plus the UINT32_MAX terminator. */
+#define HB_HIVE_SECTION_SPARSE_RUN_STARTS (4)
+/** The run block index table of a sparse direct map. Count is the number of runs. */
+#define HB_HIVE_SECTION_SPARSE_RUN_BLOCKS (5)
+/** The block table of a hive with wide blocks. Count is the number of hm_wide_blocks. */
+#define HB_HIVE_SECTION_WIDE_BLOCKS (6)
+/** The chunk table of a wide sparse direct map (uint64_t). Count is the number of chunks, parameter is the shift. */
+#define HB_HIVE_SECTION_WIDE_SPARSE_CHUNKS (7)
+/** The run start table of a wide sparse direct map (uint64_t). Count includes the UINT64_MAX terminator. */
+#define HB_HIVE_SECTION_WIDE_SPARSE_RUN_STARTS (8)
+/** The run block index table of a wide sparse direct map (uint64_t). Count is the number of runs. */
+#define HB_HIVE_SECTION_WIDE_SPARSE_RUN_BLOCKS (9)
+/** The block table of a hive with narrow blocks. Count is the number of hm_narrow_blocks. */
+#define HB_HIVE_SECTION_NARROW_BLOCKS (10)
+/**
+ * The disassembly the hive was generated from, kept so that the generator can regenerate the hive incrementally when
+ * the binary is rebuilt. Count is the number of blocks, parameter is the size of each generator-defined record.
+ */
+#define HB_HIVE_SECTION_DISASSEMBLY (11)
+/**
+ * The TNT transition row of each block (uint32_t), or HB_HIVE_TNT_TRANSITION_NO_ROW. Count is the number of blocks,
+ * parameter is the number of TNT bits each transition consumes.
+ */
+#define HB_HIVE_SECTION_TNT_TRANSITION_ROWS (12)
+/**
+ * The TNT transitions (hm_tnt_transition), one row of 2^parameter transitions per block with a row. Count is the number
+ * of transitions, parameter is the number of TNT bits each transition consumes.
+ */
+#define HB_HIVE_SECTION_TNT_TRANSITIONS (13)
+
+/** The number of TNT bits consumed by each TNT transition */
+#define HB_HIVE_TNT_TRANSITION_BITS (4)
+/** The TNT transition row of a block which doesn't have one */
+#define HB_HIVE_TNT_TRANSITION_NO_ROW (UINT32_MAX)
+
+/**
+ * Block table layouts
+ */
+/** Blocks are hm_blocks with 31-bit indices and 32-bit uVIPs */
+#define HB_HIVE_BLOCK_LAYOUT_PACKED (0)
+/** Blocks are hm_wide_blocks with 63-bit indices and 64-bit uVIPs */
+#define HB_HIVE_BLOCK_LAYOUT_WIDE (1)
+/** Blocks are hm_narrow_blocks with 16-bit indices and 32-bit uVIPs */
+#define HB_HIVE_BLOCK_LAYOUT_NARROW (2)
+
+/** The section's hash field holds the XXH64 (seed zero) of the section's contents */
+#define HB_HIVE_SECTION_FLAG_HASHED (1U << 0)
+
+/** The direct map is a flat array with one block index per byte of the binary */
+#define HB_HIVE_DIRECT_MAP_FLAT (0)
+/** The direct map is a sparse two level map. See hb_hive_sparse_file_header. */
+#define HB_HIVE_DIRECT_MAP_SPARSE (1)
+/** The direct map is a sparse two level map with 64-bit entries. This is used by hives with wide blocks. */
+#define HB_HIVE_DIRECT_MAP_WIDE_SPARSE (2)
+/** The default log2 of the number of bytes of the binary covered by each sparse direct map chunk */
+#define HB_HIVE_SPARSE_DEFAULT_CHUNK_SHIFT (4)
 
 /**
  * This is the header of the Honeybee Hive file
@@ -52,6 +188,186 @@ typedef struct {
     /* slid virtual address to block index -- uint32_t */
 } hb_hive_file_header;
 
+/**
+ * This is the header of a Honeybee Hive file which uses a sparse direct map.
+ *
+ * Rather than storing a block index for every byte of the binary, a sparse map stores "runs": sorted slid start
+ * addresses where the block index changes along with the block index of each run. Since blocks are contiguous, this
+ * is one run per block (plus one per gap between blocks). To avoid searching the runs, a coarse chunk table stores,
+ * for every (1 << chunk_shift) bytes of the binary, the index of the run which contains the chunk's first byte. A
+ * lookup is then one chunk table load followed by a short forward scan of the run starts.
+ */
+typedef struct {
+    /**
+     * The file magic
+     * 0x4D505359454E4F48 which is HONEYSPM (little endian)
+     */
+    uint64_t magic;
+
+    /**
+     * The number of 64-bit pairs in the blocks buffer
+     */
+    uint64_t block_count;
+
+    /**
+     * The value by which virtual IPs in blocks and the direct map are slid by. See hb_hive_file_header.
+     */
+    uint64_t uvip_slide;
+
+    /**
+     * The number of bytes of the binary covered by the map. This is the direct_map_count of the equivalent flat map.
+     */
+    uint64_t direct_map_count;
+
+    /**
+     * The log2 of the number of bytes covered by each chunk
+     */
+    uint64_t chunk_shift;
+
+    /**
+     * The number of 32-bit elements in the chunk table
+     */
+    uint64_t chunk_count;
+
+    /**
+     * The number of runs. The run start table has one additional element, UINT32_MAX, which terminates scans.
+     */
+    uint64_t run_count;
+
+    /**
+     * A zero length array used to provide a pointer after the header. This is not a real field, this is for convenience
+     */
+    uint8_t buffer[0];
+
+    /* blocks -- uint64_t */
+
+    /* chunk index to run index -- uint32_t */
+
+    /* run slid start address -- uint32_t, run_count + 1 elements */
+
+    /* run block index -- uint32_t */
+} hb_hive_sparse_file_header;
+
+/**
+ * An entry in the section directory of a v2 hive
+ */
+typedef struct {
+    /**
+     * The kind of data held by this section (HB_HIVE_SECTION_*)
+     */
+    uint32_t type;
+
+    /**
+     * HB_HIVE_SECTION_FLAG_* bits
+     */
+    uint32_t flags;
+
+    /**
+     * The offset of the section from the start of the file
+     */
+    uint64_t offset;
+
+    /**
+     * The size of the section in bytes
+     */
+    uint64_t size;
+
+    /**
+     * The number of elements in the section. The meaning depends on the type.
+     */
+    uint64_t count;
+
+    /**
+     * A type specific parameter, zero if unused
+     */
+    uint64_t parameter;
+
+    /**
+     * The XXH64 of the section's contents if HB_HIVE_SECTION_FLAG_HASHED is set, otherwise zero
+     */
+    uint64_t hash;
+} hb_hive_section;
+
+/**
+ * This is the header of a versioned (v2) Honeybee Hive file.
+ *
+ * Rather than packing tables back to back, a v2 hive describes its contents with a directory of sections. Each
+ * section begins at a multiple of section_alignment (HB_HIVE_V2_SECTION_ALIGNMENT when written by
+ * honey_hive_generator) so that the block table and direct map can be hugepage mapped. The padding between sections
+ * is left as holes in the file and so does not take up any space on disk. New data is added by adding new section
+ * types which older readers simply skip.
+ */
+typedef struct {
+    /**
+     * The file magic
+     * 0x56494859454E4F48 which is HONEYHIV (little endian)
+     */
+    uint64_t magic;
+
+    /**
+     * The container version. Readers refuse files with a version newer than HB_HIVE_V2_FORMAT_VERSION.
+     */
+    uint32_t version;
+
+    /**
+     * The size of this header in bytes. Newer writers may append fields, which older readers skip.
+     */
+    uint32_t header_size;
+
+    /**
+     * The value by which virtual IPs in blocks and the direct map are slid by. See hb_hive_file_header.
+     */
+    uint64_t uvip_slide;
+
+    /**
+     * The number of bytes of the binary covered by the direct map
+     */
+    uint64_t direct_map_count;
+
+    /**
+     * The alignment of each section's offset
+     */
+    uint64_t section_alignment;
+
+    /**
+     * The offset of the section directory from the start of the file
+     */
+    uint64_t section_directory_offset;
+
+    /**
+     * The number of hb_hive_section entries in the section directory
+     */
+    uint64_t section_count;
+
+    /**
+     * The number of valid bytes in build_id. Zero if the source ELF had no build-id.
+     */
+    uint32_t build_id_size;
+
+    /**
+     * The GNU build-id of the ELF this hive was generated from
+     */
+    uint8_t build_id[HB_HIVE_BUILD_ID_MAX_SIZE];
+
+    /**
+     * How the hive's blocks are addressed (HB_HIVE_ADDRESS_KIND_*). This was a reserved zero field in older hives, and
+     * so they read as HB_HIVE_ADDRESS_KIND_FILE_OFFSET.
+     */
+    uint32_t address_kind;
+
+    /**
+     * The virtual address at which the ELF expects the start of its file to be loaded (the first PT_LOAD segment's
+     * address less its offset). This is only meaningful for HB_HIVE_ADDRESS_KIND_VIRTUAL hives, which are traced with
+     * a slide of their actual load address less this value. Older hives end before this field.
+     */
+    uint64_t preferred_load_base;
+} hb_hive_v2_file_header;
+
+/**
+ * The size of the header written by readers which predate hb_hive_v2_file_header.preferred_load_base
+ */
+#define HB_HIVE_V2_MINIMUM_HEADER_SIZE (offsetof(hb_hive_v2_file_header, preferred_load_base))
+
 /**
  * Each block is a pair of 64-bit packet values
  */
@@ -61,6 +377,12 @@ typedef struct {
      * The conditional flag should be tested for using HB_HIVE_FLAG_IS_CONDITIONAL.
      * If this block contains an indirect jump, the index for a branch will be HB_HIVE_FLAG_INDIRECT_JUMP_INDEX_VALUE.
      *
+     * Unconditional blocks don't have a not-taken successor. If the not-taken index of an unconditional block is
+     * non-zero, it (and the not-taken uVIP) instead hold the end of the block's chain of direct unconditional
+     * successors: the first block reached by following taken successors which ends in a conditional or indirect
+     * branch. Decoders may jump straight there since nothing in the trace depends on the blocks between, which are
+     * still reachable through the taken successors. Chains which end at block zero are never marked.
+     *
      * [{31 bits of not-taken}, {zero}][{31 bits of taken}, {1 bit conditional flag}]
      */
     uint64_t packed_indices;
@@ -68,26 +390,113 @@ typedef struct {
     /**
      * This is a packed field which holds the slid virtual instruction pointers for the block(s) after this one.
      * Holding slid VIPs in 32-bits is technically okay, even on a 64-bit OS, since our decoding stategy breaks down
-     * as a result of the direct map on binaries >=4GB (since the direct map would necessarily be 16GB).
+     * as a result of the direct map on binaries >=4GB (since the direct map would necessarily be 16GB). Binaries which
+     * are this large use hm_wide_block instead.
      *
      * [{32 bits of not-taken uVIP}][{32 bits of taken uVIP}]
      */
     uint64_t packed_uvips;
 } hm_block;
 
+/**
+ * A block in a hive which is too large for hm_block's 31-bit indices and 32-bit uVIPs. These are selected
+ * automatically by honey_hive_generator when a binary exceeds those limits.
+ */
+typedef struct {
+    /**
+     * [{63 bits of taken}, {1 bit conditional flag}]
+     * If this block ends in an indirect jump, the index is HB_HIVE_WIDE_FLAG_INDIRECT_JUMP_INDEX_VALUE.
+     */
+    uint64_t packed_taken_index;
+
+    /**
+     * The not-taken index. Only valid for conditional blocks. As with hm_block, a non-zero index in an unconditional
+     * block is instead the end of its chain.
+     */
+    uint64_t not_taken_index;
+
+    /**
+     * The slid virtual instruction pointer of the taken block
+     */
+    uint64_t taken_uvip;
+
+    /**
+     * The slid virtual instruction pointer of the not-taken block (or chain end). Only valid for conditional blocks
+     * and blocks which skip a chain.
+     */
+    uint64_t not_taken_uvip;
+} hm_wide_block;
+
+/**
+ * A block in a hive for a small binary (fewer than 65535 blocks). These are half the size of an hm_block so that the
+ * block table of a typical fuzzing target stays cache resident.
+ *
+ * Rather than holding its successors' uVIPs, a narrow block holds its own. The taken uVIP is read from the taken
+ * block's entry and the not-taken uVIP is stored as a delta from this block's uVIP. As with hm_block, the not-taken
+ * index is always the next block.
+ */
+typedef struct {
+    /**
+     * The slid virtual instruction pointer of the start of this block
+     */
+    uint32_t uvip;
+
+    /**
+     * The index of the taken block or HB_HIVE_NARROW_FLAG_INDIRECT_JUMP_INDEX_VALUE if this block ends in an indirect
+     * jump
+     */
+    uint16_t taken_index;
+
+    /**
+     * The not-taken uVIP delta is zero for blocks which aren't conditional
+     *
+     * [{15 bits of not-taken uVIP - uvip}, {1 bit conditional flag}]
+     */
+    uint16_t packed_not_taken_delta;
+} hm_narrow_block;
+
+/**
+ * Where the next HB_HIVE_TNT_TRANSITION_BITS TNTs lead from a conditional block. Conditional blocks whose successors are
+ * both conditional (packed and narrow layouts only) have a row of transitions, indexed by the next TNTs with the first
+ * as the most significant bit. A transition follows TNTs until it has consumed all of them or reaches a block which
+ * doesn't end in a conditional branch with a known target. This lets decoders consume several TNTs with a single lookup
+ * rather than walking the block table one branch at a time.
+ */
+typedef struct {
+    /**
+     * The slid virtual instruction pointer of the block reached after each consumed TNT. The last one is the
+     * destination.
+     */
+    uint32_t uvips[HB_HIVE_TNT_TRANSITION_BITS];
+
+    /**
+     * The index of the destination block
+     */
+    uint32_t end_index;
+
+    /**
+     * The number of TNTs consumed, from two to HB_HIVE_TNT_TRANSITION_BITS
+     */
+    uint32_t tnt_count;
+} hm_tnt_transition;
 
 typedef struct {
     /**
      * A pointer to a buffer of blocks
-     * This can also be read as an hm_block or simply stride-d
+     * This can also be read as an hm_block (or an hm_wide_block or hm_narrow_block, see block_layout) or simply stride-d
      */
     uint64_t *blocks;
 
     /**
-     * The number of pairs (or just hm_blocks) in the blocks buffer
+     * The number of blocks in the blocks buffer
      */
     uint64_t block_count;
 
+    /**
+     * The layout of the blocks buffer (HB_HIVE_BLOCK_LAYOUT_*)
+     */
+    uint64_t block_layout;
+
     /**
      * This bias value/positive slide for uVIPs. This is also the amount that values must be slid negatively to get
      * the index into the direct map buffer
@@ -105,6 +514,147 @@ typedef struct {
      * assigned an index, starting from zero.
      */
     uint64_t direct_map_count;
+
+    /**
+     * The kind of direct map this hive uses (HB_HIVE_DIRECT_MAP_*). When this is HB_HIVE_DIRECT_MAP_SPARSE,
+     * direct_map_buffer is NULL and the sparse_* fields describe the map instead.
+     */
+    uint64_t direct_map_kind;
+
+    /**
+     * The log2 of the number of bytes of the binary covered by each element of sparse_chunks
+     */
+    uint64_t sparse_chunk_shift;
+
+    /**
+     * The sparse chunk table. Each element is the index of the run which contains the first byte of the chunk.
+     */
+    uint32_t *sparse_chunks;
+
+    /**
+     * The number of elements in sparse_chunks
+     */
+    uint64_t sparse_chunk_count;
+
+    /**
+     * The sorted slid start address of each run. This has sparse_run_count + 1 elements, the last being UINT32_MAX.
+     */
+    uint32_t *sparse_run_starts;
+
+    /**
+     * The block index of each run
+     */
+    uint32_t *sparse_run_blocks;
+
+    /**
+     * The number of runs in the sparse map
+     */
+    uint64_t sparse_run_count;
+
+    /**
+     * The chunk table of a wide sparse map. The wide sparse map uses sparse_chunk_shift, sparse_chunk_count, and
+     * sparse_run_count for its geometry.
+     */
+    uint64_t *wide_sparse_chunks;
+
+    /**
+     * The run start table of a wide sparse map. This has sparse_run_count + 1 elements, the last being UINT64_MAX.
+     */
+    uint64_t *wide_sparse_run_starts;
+
+    /**
+     * The block index of each run in a wide sparse map
+     */
+    uint64_t *wide_sparse_run_blocks;
+
+    /**
+     * The TNT transition row of each block (see hm_tnt_transition) or NULL if the hive has no TNT transitions
+     */
+    uint32_t *tnt_transition_rows;
+
+    /**
+     * The TNT transitions. Row i starts at element i << HB_HIVE_TNT_TRANSITION_BITS.
+     */
+    hm_tnt_transition *tnt_transitions;
+
+    /**
+     * If this hive was loaded with HB_HIVE_LOAD_FLAG_ZERO_COPY or HB_HIVE_LOAD_FLAG_SHARED, this is the read-only
+     * mapping (of either the hive file or its shared segment) which blocks and direct_map_buffer point into. NULL if
+     * blocks and direct_map_buffer are owned heap buffers.
+     */
+    void *map_handle;
+
+    /**
+     * The size of map_handle in bytes
+     */
+    uint64_t map_size;
+
+    /**
+     * If this hive was not loaded zero-copy, this is the owned heap copy of the hive file which the tables point into
+     */
+    void *heap_image;
+
+    /**
+     * If non-zero, heap_image is an anonymous mapping of this many bytes (used for hugepage and node-local copies)
+     * rather than a malloc-ed buffer
+     */
+    uint64_t heap_image_map_size;
+
+    /**
+     * The placement this hive's load flags achieved, a bitwise OR of HB_HIVE_PLACEMENT_* values
+     */
+    uint32_t placement;
+
+    /**
+     * The NUMA node holding the start of the block table, or -1 if it could not be determined
+     */
+    int32_t numa_node;
+
+    /**
+     * The start of the hive file image which the tables point into
+     */
+    uint8_t *image;
+
+    /**
+     * The size of the hive file image in bytes
+     */
+    uint64_t image_size;
+
+    /**
+     * The container version of the hive file. Legacy hives are version one.
+     */
+    uint32_t format_version;
+
+    /**
+     * The section directory of a v2 hive, NULL for legacy hives
+     */
+    const hb_hive_section *sections;
+
+    /**
+     * The number of entries in sections
+     */
+    uint64_t section_count;
+
+    /**
+     * The number of valid bytes in build_id. Zero if the hive does not record the build-id of its source.
+     */
+    uint32_t build_id_size;
+
+    /**
+     * The GNU build-id of the ELF this hive was generated from
+     */
+    uint8_t build_id[HB_HIVE_BUILD_ID_MAX_SIZE];
+
+    /**
+     * How the hive's blocks are addressed (HB_HIVE_ADDRESS_KIND_*)
+     */
+    uint32_t address_kind;
+
+    /**
+     * The address the ELF expects to be loaded at (see hb_hive_v2_file_header). Zero unless address_kind is
+     * HB_HIVE_ADDRESS_KIND_VIRTUAL.
+     */
+    uint64_t preferred_load_base;
 } hb_hive;
 
 
@@ -116,15 +666,110 @@ typedef struct {
 hb_hive *hb_hive_alloc(const char *hive_path);
 
 /**
- * Frees a hive and all of its contents
+ * Load a hive from disk and parse it
+ * @param hive_path The path to the honeybee hive file
+ * @param flags A bitwise OR of HB_HIVE_LOAD_FLAG_* values. Zero behaves identically to hb_hive_alloc.
+ * @return NULL if parsing failed for any reason
+ */
+hb_hive *hb_hive_alloc_with_flags(const char *hive_path, uint32_t flags);
+
+/**
+ * Frees a hive and all of its contents. For zero-copy hives, this unmaps the hive file.
  */
 void hb_hive_free(hb_hive *hive);
 
+/**
+ * Removes the host-wide shared segment for a hive (see HB_HIVE_LOAD_FLAG_SHARED) along with any per-node replicas (see
+ * HB_HIVE_LOAD_FLAG_NUMA_LOCAL). Processes which are already attached keep their mapping, but later loads will publish
+ * a new segment. This is useful for reclaiming memory once a campaign is over since segments otherwise persist until
+ * reboot.
+ * @return Zero if any segment was removed
+ */
+int hb_hive_unlink_shared(const char *hive_path);
+
 /**
  * Print a description of a given block to the console
  */
 void hb_hive_describe_block(hb_hive *hive, uint64_t i);
 
+/**
+ * Print a description of where the hive's tables were placed (hugepage backing and NUMA node) to the console
+ */
+void hb_hive_describe_placement(hb_hive *hive);
+
+/**
+ * Computes the trace slide of a hive's image in a running process from the process's memory map. File offset hives
+ * are slid so that the image's executable mapping lines up with its offset in the file, while virtual address hives
+ * are slid by how far the image was loaded from its preferred load base.
+ * @param hive The hive of the image
+ * @param maps_path The memory map of the process, such as /proc/<pid>/maps or a saved copy of it
+ * @param image_path The path of the image as it appears in maps_path
+ * @param trace_slide The location to place the trace slide
+ * @return Zero on success
+ */
+int hb_hive_get_trace_slide_from_maps(hb_hive *hive, const char *maps_path, const char *image_path,
+                                      uint64_t *trace_slide);
+
+/**
+ * Finds a section of a v2 hive by type
+ * @return The section or NULL if the hive has no section of this type
+ */
+const hb_hive_section *hb_hive_get_section(hb_hive *hive, uint32_t type);
+
+/**
+ * Gets a pointer to the contents of a section
+ */
+static inline const void *hb_hive_get_section_data(hb_hive *hive, const hb_hive_section *section) {
+    return hive->image + section->offset;
+}
+
+/**
+ * Get the block index for a given unslid virtual address using a flat direct map
+ */
+static inline int64_t hb_hive_flat_map_virtual_address_to_block_index(hb_hive *hive, uint64_t virtual_address) {
+    uint64_t map_index = virtual_address - hive->uvip_slide;
+    if (map_index >= hive->direct_map_count) {
+        return -1;
+    }
+    return hive->direct_map_buffer[map_index];
+}
+
+/**
+ * Get the block index for a given unslid virtual address using a sparse direct map
+ */
+static inline int64_t hb_hive_sparse_map_virtual_address_to_block_index(hb_hive *hive, uint64_t virtual_address) {
+    uint64_t map_index = virtual_address - hive->uvip_slide;
+    if (map_index >= hive->direct_map_count) {
+        return -1;
+    }
+
+    uint64_t run = hive->sparse_chunks[map_index >> hive->sparse_chunk_shift];
+    //The run start table is terminated by UINT32_MAX (which is never a valid map index) so this cannot run off the end
+    while (hive->sparse_run_starts[run + 1] <= map_index) {
+        run++;
+    }
+
+    return hive->sparse_run_blocks[run];
+}
+
+/**
+ * Get the block index for a given unslid virtual address using a wide sparse direct map
+ */
+static inline int64_t hb_hive_wide_sparse_map_virtual_address_to_block_index(hb_hive *hive, uint64_t virtual_address) {
+    uint64_t map_index = virtual_address - hive->uvip_slide;
+    if (map_index >= hive->direct_map_count) {
+        return -1;
+    }
+
+    uint64_t run = hive->wide_sparse_chunks[map_index >> hive->sparse_chunk_shift];
+    //Terminated by UINT64_MAX, just like the narrow map
+    while (hive->wide_sparse_run_starts[run + 1] <= map_index) {
+        run++;
+    }
+
+    return (int64_t) hive->wide_sparse_run_blocks[run];
+}
+
 /**
  * Get the block index for a given unslid virtual address
  * @param hive The hive corresponding to the binary being traced
@@ -132,11 +777,13 @@ void hb_hive_describe_block(hb_hive *hive, uint64_t i);
  * @return The index or -1 if the virtual address is not mapped in this hive
  */
 static inline int64_t hb_hive_virtual_address_to_block_index(hb_hive *hive, uint64_t virtual_address) {
-    uint64_t map_index = virtual_address - hive->uvip_slide;
-    if (map_index >= hive->direct_map_count) {
-        return -1;
+    if (hive->direct_map_kind == HB_HIVE_DIRECT_MAP_SPARSE) {
+        return hb_hive_sparse_map_virtual_address_to_block_index(hive, virtual_address);
+    } else if (hive->direct_map_kind == HB_HIVE_DIRECT_MAP_WIDE_SPARSE) {
+        return hb_hive_wide_sparse_map_virtual_address_to_block_index(hive, virtual_address);
     }
-    return hive->direct_map_buffer[map_index];
+
+    return hb_hive_flat_map_virtual_address_to_block_index(hive, virtual_address);
 }
 
 #endif //HB_HIVE_H
@@ -0,0 +1,161 @@
+//
+// Created by Allison Husain on 3/14/21.
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "hb_hive_bundle.h"
+#define TAG "[" __FILE__ "] "
+
+hb_hive_bundle *hb_hive_bundle_alloc(void) {
+    hb_hive_bundle *bundle = calloc(1, sizeof(hb_hive_bundle));
+    if (!bundle) {
+        printf(TAG "Out of memory\n");
+    }
+
+    return bundle;
+}
+
+int hb_hive_bundle_add_image(hb_hive_bundle *bundle, hb_hive *hive, uint64_t trace_slide) {
+    if (!bundle || !hive) {
+        return -1;
+    }
+
+    if (bundle->image_count >= bundle->image_capacity) {
+        uint64_t new_capacity = bundle->image_capacity ? bundle->image_capacity * 2 : 4;
+        hb_hive_bundle_image *new_images = realloc(bundle->images, new_capacity * sizeof(hb_hive_bundle_image));
+        if (!new_images) {
+            printf(TAG "Out of memory\n");
+            return -2;
+        }
+
+        bundle->images = new_images;
+        bundle->image_capacity = new_capacity;
+    }
+
+    hb_hive_bundle_image *image = &bundle->images[bundle->image_count++];
+    image->hive = hive;
+    image->trace_slide = trace_slide;
+    return 0;
+}
+
+hb_hive_bundle *hb_hive_bundle_alloc_from_manifest(const char *manifest_path, uint32_t flags) {
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    hb_hive_bundle *bundle = NULL;
+    hb_hive *hive = NULL;
+    bool success = false;
+    uint64_t line_number = 0;
+
+    if (!(bundle = hb_hive_bundle_alloc())) {
+        goto CLEANUP;
+    }
+
+    fp = fopen(manifest_path, "r");
+    if (!fp) {
+        printf(TAG "Could not open manifest '%s'!\n", manifest_path);
+        goto CLEANUP;
+    }
+
+    //Relative hive paths are relative to the manifest
+    char manifest_directory[PATH_MAX];
+    const char *last_slash = strrchr(manifest_path, '/');
+    if (last_slash) {
+        snprintf(manifest_directory, sizeof(manifest_directory), "%.*s/", (int) (last_slash - manifest_path),
+                 manifest_path);
+    } else {
+        manifest_directory[0] = '\0';
+    }
+
+    while (getline(&line, &line_capacity, fp) != -1) {
+        line_number++;
+
+        //Trim trailing whitespace (including the newline)
+        size_t length = strlen(line);
+        while (length && isspace((unsigned char) line[length - 1])) {
+            line[--length] = '\0';
+        }
+
+        char *cursor = line;
+        while (isspace((unsigned char) *cursor)) {
+            cursor++;
+        }
+
+        if (*cursor == '\0' || *cursor == '#') {
+            continue;
+        }
+
+        char *end_ptr = NULL;
+        uint64_t trace_slide = strtoull(cursor, &end_ptr, 16);
+        if (end_ptr == cursor || !isspace((unsigned char) *end_ptr)) {
+            printf(TAG "%s:%" PRIu64 ": expected '<trace slide> <hive path>'\n", manifest_path, line_number);
+            goto CLEANUP;
+        }
+
+        cursor = end_ptr;
+        while (isspace((unsigned char) *cursor)) {
+            cursor++;
+        }
+
+        char hive_path[PATH_MAX];
+        snprintf(hive_path, sizeof(hive_path), "%s%s", *cursor == '/' ? "" : manifest_directory, cursor);
+
+        if (!(hive = hb_hive_alloc_with_flags(hive_path, flags))) {
+            printf(TAG "%s:%" PRIu64 ": could not load hive '%s'\n", manifest_path, line_number, hive_path);
+            goto CLEANUP;
+        }
+
+        if (hb_hive_bundle_add_image(bundle, hive, trace_slide)) {
+            goto CLEANUP;
+        }
+
+        //The bundle owns it now
+        hive = NULL;
+    }
+
+    if (!bundle->image_count) {
+        printf(TAG "Manifest '%s' does not list any images\n", manifest_path);
+        goto CLEANUP;
+    }
+
+    success = true;
+    CLEANUP:
+    if (fp) {
+        fclose(fp);
+    }
+
+    if (line) {
+        free(line);
+    }
+
+    if (hive) {
+        hb_hive_free(hive);
+    }
+
+    if (!success) {
+        hb_hive_bundle_free(bundle);
+        bundle = NULL;
+    }
+
+    return bundle;
+}
+
+void hb_hive_bundle_free(hb_hive_bundle *bundle) {
+    if (!bundle) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < bundle->image_count; i++) {
+        hb_hive_free(bundle->images[i].hive);
+    }
+
+    free(bundle->images);
+    free(bundle);
+}
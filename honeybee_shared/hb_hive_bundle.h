@@ -0,0 +1,76 @@
+//
+// Created by Allison Husain on 3/14/21.
+//
+
+#ifndef HB_HIVE_BUNDLE_H
+#define HB_HIVE_BUNDLE_H
+
+#include <stdint.h>
+#include "hb_hive.h"
+
+/**
+ * A single binary image in a bundle
+ */
+typedef struct {
+    /**
+     * The hive for this image. This is owned by the bundle.
+     */
+    hb_hive *hive;
+
+    /**
+     * The base address of this image in the traced process. This is the trace slide of this image.
+     */
+    uint64_t trace_slide;
+} hb_hive_bundle_image;
+
+/**
+ * A bundle is a collection of hives for every image (the main executable along with any shared libraries) which may
+ * appear in a trace. Decoding a trace with a bundle allows decoding to continue across calls between images.
+ */
+typedef struct {
+    /**
+     * The images in this bundle, in the order they were added. The first image is the primary image.
+     */
+    hb_hive_bundle_image *images;
+
+    /**
+     * The number of images in the bundle
+     */
+    uint64_t image_count;
+
+    /**
+     * The number of images which may be held without growing images
+     */
+    uint64_t image_capacity;
+} hb_hive_bundle;
+
+/**
+ * Creates an empty bundle
+ * @return NULL if out of memory
+ */
+hb_hive_bundle *hb_hive_bundle_alloc(void);
+
+/**
+ * Loads a bundle from a manifest file. Each line of the manifest describes a single image as
+ * `<trace slide in hex> <hive path>`. Relative hive paths are resolved relative to the directory containing the
+ * manifest. Blank lines and lines starting with '#' are ignored. The first image listed is the primary image.
+ * @param manifest_path The path to the manifest file
+ * @param flags The HB_HIVE_LOAD_FLAG_* flags to load each hive with
+ * @return NULL if the manifest or any hive could not be loaded
+ */
+hb_hive_bundle *hb_hive_bundle_alloc_from_manifest(const char *manifest_path, uint32_t flags);
+
+/**
+ * Adds an image to a bundle
+ * @param hive The hive for the image. On success, the bundle takes ownership of the hive.
+ * @param trace_slide The base address of the image in the traced process
+ * @return Zero on success
+ */
+int hb_hive_bundle_add_image(hb_hive_bundle *bundle, hb_hive *hive, uint64_t trace_slide);
+
+/**
+ * Frees a bundle along with all of its hives
+ */
+void hb_hive_bundle_free(hb_hive_bundle *bundle);
+
+#endif //HB_HIVE_BUNDLE_H
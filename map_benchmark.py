@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+
+"""
+Honeybee Project Direct Map Benchmark
+
+Compares the lookup latency and memory footprint of the flat, sparse, and wide sparse hive direct maps.
+
+---
+Author: Allison Husain <$first.$last@berkeley.edu>
+Date: January 30th, 2021
+"""
+import subprocess
+
+TESTS_ROOT = "../honeybee_unittest_data/"
+HONEY_HIVE_GENERATOR_PATH = "cmake-build-debug/honey_hive_generator"
+HONEY_TESTER_PATH = "cmake-build-debug/honey_tester"
+HIVE_TEMP_PATH = "/tmp/benchmark_hive.hive"
+MAP_KINDS = [
+	("flat", ["-m", "flat"]),
+	("sparse", ["-m", "sparse"]),
+	("wide", ["-b", "wide"]),
+]
+
+targets = [
+	("tar", TESTS_ROOT + "tar/tar"),
+	("clang", TESTS_ROOT + "clang/clang"),
+]
+
+
+def benchmark_map(display_name, binary_path, map_kind, generator_options):
+	"""
+	Generates a hive for the binary using the given map kind and benchmarks its direct map.
+	Returns true on success.
+	"""
+	print(f"[***] Generating {map_kind} hive for {display_name}")
+	task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH] + generator_options + [binary_path, HIVE_TEMP_PATH])
+	task.communicate() #wait
+	if task.returncode != 0:
+		print(f"[!!!] Hive generator for {display_name} failed with code {str(task.returncode)}")
+		return False
+
+	print(f"[***] Benchmarking {map_kind} map for {display_name}")
+	task = subprocess.Popen([HONEY_TESTER_PATH, "-m", "-h", HIVE_TEMP_PATH])
+	task.communicate() #wait
+	if task.returncode != 0:
+		print(f"[!!!] Map benchmark for {display_name} failed with code {str(task.returncode)}")
+		return False
+	return True
+
+
+failure_count = 0
+for display_name, binary_path in targets:
+	for map_kind, generator_options in MAP_KINDS:
+		if not benchmark_map(display_name, binary_path, map_kind, generator_options):
+			failure_count += 1
+
+print("-" * 60)
+print(f"Summary: {str(failure_count)} benchmark(s) failed")
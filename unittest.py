@@ -7,28 +7,82 @@ Honeybee Project Unit Tester
 Author: Allison Husain <$first.$last@berkeley.edu>
 Date: December 31st, 2020
 """
+import filecmp
+import os
+import re
+import shutil
+import struct
 import subprocess
+import tempfile
 
 TESTS_ROOT = "../honeybee_unittest_data/"
 HONEY_HIVE_GENERATOR_PATH = "cmake-build-debug/honey_hive_generator"
 HONEY_TESTER_PATH = "cmake-build-debug/honey_tester"
 HIVE_TEMP_PATH = "/tmp/test_hive.hive"
+FULL_DECODE_HIVE_TEMP_PATH = "/tmp/test_hive_full_decode.hive"
+COMPARED_HIVE_TEMP_PATH = "/tmp/test_hive_compared.hive"
+PREVIOUS_HIVE_TEMP_PATH = "/tmp/test_hive_previous.hive"
+REBUILT_HIVE_TEMP_PATH = "/tmp/test_hive_rebuilt.hive"
+REBUILT_BINARY_TEMP_PATH = "/tmp/test_rebuilt_binary"
+HYBRID_HIVE_TEMP_PATH = "/tmp/test_hive_hybrid.hive"
+SEGMENT_HIVE_TEMP_PATH = "/tmp/test_hive_segments.hive"
+STRIPPED_BINARY_TEMP_PATH = "/tmp/test_stripped_binary"
+BLOCK_DUMP_TEMP_PATH = "/tmp/test_blocks.txt"
+PROFILE_TEMP_PATH = "/tmp/test_profile.txt"
+BUNDLE_MANIFEST_TEMP_PATH = "/tmp/test_bundle.txt"
+# Where the bundle test places an image which the trace never enters
+BUNDLE_DECOY_IMAGE_OFFSET = 1 << 40
+# The thread count of parallel decodes. Each is compared with a single threaded decode using the same segments, and
+# segments which start at every PSB exercise many more segment boundaries than the default size does.
+PARALLEL_DECODE_THREAD_COUNT = 4
+PARALLEL_DECODE_SEGMENTS = [("a segment per PSB", ["-g", "1"]), ("default segments", [])]
+# A PSB packet, which wrapped decodes split to check that the decoder syncs across the wrap
+PSB_PACKET = bytes([0x02, 0x82] * 8)
+# How many consecutive wrap offsets are decoded in the middle of each trace. Since no packet is longer than a PSB, some
+# of these always fall inside a multi-byte packet.
+WRAP_OFFSET_RUN_LENGTH = 16
+# The chunk sizes streamed decodes push the trace in: single bytes, a size which splits packets, a size which splits
+# every PSB, and a size closer to a real read
+STREAM_CHUNK_SIZES = [1, 7, 13, 4099]
+
+# Hives generated with other options, each of which must decode every trace to exactly the same blocks as the default
+# hive. Each is (name, generator arguments, whether the generator may refuse the binary).
+HIVE_VARIANTS = [
+	("packed", ["-b", "packed"], False),
+	("wide", ["-b", "wide"], False),
+	# Narrow hives only fit small binaries
+	("narrow", ["-b", "narrow"], True),
+	# Traces are also decoded with chain skipping (honey_tester -k) with these, see compare_chain_skip_block_stream
+	("chain skip", ["-s", "-b", "packed"], False),
+	("wide chain skip", ["-s", "-b", "wide"], False),
+	("TNT transition", ["-t", "-b", "packed"], False),
+	("narrow TNT transition", ["-t", "-b", "narrow"], True),
+]
 
 class Test:
-	__slots__ = ["display_name", "binary_path", "traces", "hive_exit_code"]
+	__slots__ = ["display_name", "binary_path", "traces", "hive_exit_code", "full_decode_hive_matches",
+				 "hive_check_results"]
 	def __init__(self, display_name, binary_path, traces):
 		self.display_name = display_name
 		self.binary_path = binary_path
 		self.traces = traces
 		
 		self.hive_exit_code = -1
+		self.full_decode_hive_matches = False
+		# (name, success) for every other hive generated for the test target
+		self.hive_check_results = []
 	
 	def print_test_result_and_return_summary(self):
 		"""
 		Prints the results of this test and all of its traces
 		"""
-		overall_success = self.hive_exit_code == 0
-		print(f"[[{self.display_name}]]\n* Hive generator exit code = {str(self.hive_exit_code)}")
+		overall_success = self.hive_exit_code == 0 and self.full_decode_hive_matches
+		print(f"[[{self.display_name}]]\n* Hive generator exit code = {str(self.hive_exit_code)}\n"
+			  f"* Full decode hive matches = {str(self.full_decode_hive_matches)}")
+		for name, success in self.hive_check_results:
+			if not success:
+				overall_success = False
+			print(f"* {name} = {str(success)}")
 		
 		for trace in self.traces:
 			description, success = trace.get_result_description_and_success()
@@ -40,23 +94,30 @@ class Test:
 		return overall_success
 	
 class Trace:
-	__slots__ = ["display_name", "trace_path", "sideband_load_address", "sideband_offset", "libipt_audit_exit_code"]
+	__slots__ = ["display_name", "trace_path", "sideband_load_address", "sideband_offset", "libipt_audit_exit_code",
+				 "block_stream_results"]
 	def __init__(self, display_name, trace_path, sideband_load_address, sideband_offset):
 		self.display_name = display_name
 		self.trace_path = trace_path
 		self.sideband_load_address = sideband_load_address
 		self.sideband_offset = sideband_offset
 		self.libipt_audit_exit_code = -1
+		# (name, matches) for every decode compared against the reference block stream
+		self.block_stream_results = []
 	
 	def get_result_description_and_success(self):
 		"""
 		Returns a string representation of the test report. Returns true iff all modules passed on this trace.
 		"""
 		success = self.libipt_audit_exit_code == 0
-		summary_label = "PASSED" if success else "FAILED"
 		description = f"\t[[{self.display_name}]]\n"\
-					  f"\t* libipt audit exit code = {str(self.libipt_audit_exit_code)}\n"\
-					  f"\t* TRACE {summary_label}"
+					  f"\t* libipt audit exit code = {str(self.libipt_audit_exit_code)}\n"
+		for name, matches in self.block_stream_results:
+			if not matches:
+				success = False
+			description += f"\t* {name} block stream matches = {str(matches)}\n"
+		summary_label = "PASSED" if success else "FAILED"
+		description += f"\t* TRACE {summary_label}"
 		
 		return description, success
 		
@@ -74,7 +135,235 @@ def generate_test_hive(test):
 		print(f"Hive generator for {test.display_name} failed with code {str(task.returncode)}")
 		return False
 	return True
+
+def compare_full_decode_hive(test):
+	"""
+	Generates the hive for the test target again while fully decoding every instruction and checks that it is
+	byte-for-byte identical to the one generated using the length decoding fast path.
+	Returns true on success.
+	"""
+	print(f"[***] Running full decode hive generator on {test.display_name}")
+	task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH, "-f", test.binary_path, FULL_DECODE_HIVE_TEMP_PATH])
+	task.communicate() #wait
+	test.full_decode_hive_matches = task.returncode == 0 \
+									and filecmp.cmp(HIVE_TEMP_PATH, FULL_DECODE_HIVE_TEMP_PATH, shallow=False)
+	if not test.full_decode_hive_matches:
+		print(f"[!!!] Full decode hive for {test.display_name} does not match")
+		return False
+	return True
 	
+def compare_generated_hive(test, name, expected_hive_path, arguments, binary_path=None):
+	"""
+	Generates a hive for the test target (or binary_path in its place) with the given generator arguments and checks
+	that it is byte-for-byte identical to the expected hive.
+	Returns true on success.
+	"""
+	print(f"[***] Running {name} hive generator on {test.display_name}")
+	task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH] + arguments
+							+ [binary_path or test.binary_path, COMPARED_HIVE_TEMP_PATH])
+	task.communicate() #wait
+	matches = task.returncode == 0 and filecmp.cmp(expected_hive_path, COMPARED_HIVE_TEMP_PATH, shallow=False)
+	test.hive_check_results.append((f"{name} hive matches", matches))
+	if not matches:
+		print(f"[!!!] {name} hive for {test.display_name} does not match")
+		return False
+	return True
+
+def generate_hive(test, name, hive_path, arguments, binary_path=None):
+	"""
+	Generates a hive for the test target (or binary_path in its place) with the given generator arguments.
+	Returns true on success.
+	"""
+	print(f"[***] Running {name} hive generator on {test.display_name}")
+	task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH] + arguments + [binary_path or test.binary_path, hive_path])
+	task.communicate() #wait
+	test.hive_check_results.append((f"{name} hive generator succeeded", task.returncode == 0))
+	if task.returncode != 0:
+		print(f"[!!!] {name} hive generator for {test.display_name} failed with code {str(task.returncode)}")
+		return False
+	return True
+
+def write_rebuilt_binary(binary_path, rebuilt_path):
+	"""
+	Writes a copy of a binary with some code early in its largest executable section replaced by NOPs. This
+	stands in for a rebuild which changed a function.
+	Returns true on success.
+	"""
+	SHF_EXECINSTR = 0x4
+	SHT_NOBITS = 8
+	with open(binary_path, "rb") as binary:
+		image = bytearray(binary.read())
+	if image[:4] != b"\x7fELF":
+		return False
+
+	section_headers_offset, = struct.unpack_from("<Q", image, 0x28)
+	section_header_size, section_count = struct.unpack_from("<HH", image, 0x3A)
+	code_offset, code_size = 0, 0
+	for i in range(section_count):
+		_, section_type, flags, _, offset, size = struct.unpack_from("<IIQQQQ", image,
+																	 section_headers_offset + i * section_header_size)
+		if flags & SHF_EXECINSTR and section_type != SHT_NOBITS and size > code_size:
+			code_offset, code_size = offset, size
+	if code_size < 256:
+		return False
+
+	edit_offset = code_offset + code_size // 16
+	image[edit_offset:edit_offset + 64] = b"\x90" * 64
+	with open(rebuilt_path, "wb") as rebuilt:
+		rebuilt.write(image)
+	return True
+
+def write_stripped_binary(binary_path, stripped_path):
+	"""
+	Writes a copy of a binary without its section headers, as `strip --strip-section-headers` would.
+	Returns true on success.
+	"""
+	with open(binary_path, "rb") as binary:
+		image = bytearray(binary.read())
+	if image[:4] != b"\x7fELF":
+		return False
+
+	struct.pack_into("<Q", image, 0x28, 0) # e_shoff
+	struct.pack_into("<HH", image, 0x3C, 0, 0) # e_shnum, e_shstrndx
+	with open(stripped_path, "wb") as stripped:
+		stripped.write(image)
+	return True
+
+def compare_incremental_hives(test):
+	"""
+	Regenerates the test target's hive incrementally after a stand-in rebuild (see write_rebuilt_binary), and back
+	again, and checks that each is byte-for-byte identical to a full regeneration.
+	Returns true on success.
+	"""
+	if not write_rebuilt_binary(test.binary_path, REBUILT_BINARY_TEMP_PATH):
+		print(f"[!!!] Could not write a rebuilt binary for {test.display_name}")
+		test.hive_check_results.append(("Rebuilt binary written", False))
+		return False
+
+	if not generate_hive(test, "previous", PREVIOUS_HIVE_TEMP_PATH, ["-k"]) \
+			or not generate_hive(test, "rebuilt", REBUILT_HIVE_TEMP_PATH, ["-k"], REBUILT_BINARY_TEMP_PATH):
+		return False
+
+	rebuilt_matches = compare_generated_hive(test, "incremental", REBUILT_HIVE_TEMP_PATH,
+											 ["-i", PREVIOUS_HIVE_TEMP_PATH, "-e", test.binary_path],
+											 REBUILT_BINARY_TEMP_PATH)
+	reverted_matches = compare_generated_hive(test, "reverted incremental", PREVIOUS_HIVE_TEMP_PATH,
+											  ["-i", REBUILT_HIVE_TEMP_PATH, "-e", REBUILT_BINARY_TEMP_PATH])
+	return rebuilt_matches and reverted_matches
+
+def compare_cached_hive(test):
+	"""
+	Gets the test target's hive from an empty hive cache twice, once missing and once hitting, and checks that both
+	return the same file and that it is byte-for-byte identical to the hive generated without the cache.
+	Returns true on success.
+	"""
+	print(f"[***] Running cached hive generator on {test.display_name}")
+	cache_directory = tempfile.mkdtemp(prefix="test_hive_cache_")
+	hive_paths = []
+	hive_stats = []
+	for _ in range(2):
+		task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH, "-c", cache_directory, test.binary_path],
+								stdout=subprocess.PIPE, text=True)
+		output, _ = task.communicate() #wait
+		lines = output.splitlines()
+		if task.returncode != 0 or not lines:
+			break
+		hive_paths.append(lines[-1])
+		hive_stats.append(os.stat(lines[-1]))
+
+	#The hit must not have generated the hive again
+	matches = len(hive_paths) == 2 and hive_paths[0] == hive_paths[1] \
+			  and hive_stats[0].st_ino == hive_stats[1].st_ino \
+			  and hive_stats[0].st_mtime_ns == hive_stats[1].st_mtime_ns \
+			  and filecmp.cmp(HIVE_TEMP_PATH, hive_paths[0], shallow=False)
+	shutil.rmtree(cache_directory)
+	test.hive_check_results.append(("Cached hive matches", matches))
+	if not matches:
+		print(f"[!!!] Cached hive for {test.display_name} does not match")
+		return False
+	return True
+
+def compare_batch_hives(test):
+	"""
+	Generates the hives for the test target and every library it loads as a batch into an empty hive cache and checks
+	that the target comes first in the batch's manifest and that every hive is byte-for-byte identical to the hive
+	generated for its binary on its own.
+	Returns true on success.
+	"""
+	print(f"[***] Running batch hive generator on {test.display_name}")
+	cache_directory = tempfile.mkdtemp(prefix="test_hive_batch_")
+	manifest_path = os.path.join(cache_directory, "manifest.txt")
+	task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH, "-c", cache_directory, "-d", manifest_path, test.binary_path])
+	task.communicate() #wait
+
+	#Each image is listed as a comment naming its binary followed by its slide and hive
+	images = []
+	if task.returncode == 0:
+		with open(manifest_path) as manifest:
+			binary_path = None
+			for line in manifest:
+				if line.startswith("#"):
+					binary_path = line[1:].strip()
+				elif line.strip():
+					images.append((binary_path, os.path.join(cache_directory, line.split()[1])))
+
+	matches = len(images) > 0 and os.path.realpath(images[0][0]) == os.path.realpath(test.binary_path)
+	for binary_path, hive_path in images:
+		task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH, binary_path, COMPARED_HIVE_TEMP_PATH])
+		task.communicate() #wait
+		if task.returncode != 0 or not filecmp.cmp(hive_path, COMPARED_HIVE_TEMP_PATH, shallow=False):
+			print(f"[!!!] Batch hive for {binary_path} does not match")
+			matches = False
+	shutil.rmtree(cache_directory)
+	test.hive_check_results.append(("Batch hives match", matches))
+	return matches
+
+def get_hive_variant_path(name):
+	return f"/tmp/test_hive_{name}.hive"
+
+def generate_hive_variants(test):
+	"""
+	Generates every hive in HIVE_VARIANTS for the test target.
+	Returns the (name, hive path, generator arguments) of each hive which was generated.
+	"""
+	variants = []
+	for name, arguments, may_refuse in HIVE_VARIANTS:
+		print(f"[***] Running {name} hive generator on {test.display_name}")
+		hive_path = get_hive_variant_path(name)
+		task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH] + arguments + [test.binary_path, hive_path])
+		task.communicate() #wait
+		if task.returncode != 0:
+			if may_refuse:
+				print(f"[***] Skipping {name} hive for {test.display_name} since the generator refused it")
+				continue
+			print(f"[!!!] {name} hive generator for {test.display_name} failed with code {str(task.returncode)}")
+		test.hive_check_results.append((f"{name} hive generator succeeded", task.returncode == 0))
+		if task.returncode == 0:
+			variants.append((name, hive_path, arguments))
+	return variants
+
+def generate_profile_guided_hive(test):
+	"""
+	Profiles the test's first trace and generates a hive with its blocks reordered by that profile.
+	Returns the (name, hive path, generator arguments) of the hive or None if it could not be generated.
+	"""
+	name = "profile guided"
+	trace = test.traces[0]
+	print(f"[***] Profiling {test.display_name}.{trace.display_name}")
+	task = subprocess.Popen([HONEY_TESTER_PATH, "-p", "-t", trace.trace_path, "-c", PROFILE_TEMP_PATH]
+							+ get_hive_arguments(trace, HIVE_TEMP_PATH), stdout=subprocess.DEVNULL)
+	task.communicate() #wait
+	if task.returncode == 0:
+		print(f"[***] Running {name} hive generator on {test.display_name}")
+		arguments = ["-p", PROFILE_TEMP_PATH]
+		task = subprocess.Popen([HONEY_HIVE_GENERATOR_PATH] + arguments
+								+ [test.binary_path, get_hive_variant_path("profile_guided")])
+		task.communicate() #wait
+	if task.returncode != 0:
+		print(f"[!!!] {name} hive for {test.display_name} failed with code {str(task.returncode)}")
+	test.hive_check_results.append((f"{name} hive generator succeeded", task.returncode == 0))
+	return (name, get_hive_variant_path("profile_guided"), arguments) if task.returncode == 0 else None
+
 def perform_libipt_audit(test, trace):
 	"""
 	Performs a libipt audit to verify that the decoder and hive are working correctly.
@@ -90,6 +379,230 @@ def perform_libipt_audit(test, trace):
 		return False
 	return True
 
+def dump_block_sections(test, trace, hive_arguments, extra_arguments=[], output_lines=None):
+	"""
+	Decodes the trace with the tester and reads back every block it reported (see honey_tester -d).
+	hive_arguments selects what to decode with, see get_hive_arguments.
+	If output_lines is given, the tester's output is appended to it line by line.
+	Returns a list of sections, each a list of (image, unslid ip, chain end) tuples where the chain end is zero for
+	blocks which don't skip a chain, or None if decoding failed. A new section starts at each '#' line of the dump, such
+	as at each window of honey_tester -w.
+	"""
+	task = subprocess.Popen([HONEY_TESTER_PATH, "-p", "-t", trace.trace_path, "-d", BLOCK_DUMP_TEMP_PATH]
+							+ hive_arguments + extra_arguments,
+							stdout=subprocess.DEVNULL if output_lines is None else subprocess.PIPE, text=True)
+	output, _ = task.communicate() #wait
+	if output_lines is not None:
+		output_lines.extend(output.splitlines())
+	if task.returncode != 0:
+		print(f"[!!!] Decoding {test.display_name}.{trace.display_name} failed with code {str(task.returncode)}")
+		return None
+
+	sections = [[]]
+	with open(BLOCK_DUMP_TEMP_PATH) as dump:
+		for line in dump:
+			if line.startswith("#"):
+				sections.append([])
+				continue
+			fields = [int(field, 0) for field in line.split()]
+			sections[-1].append((fields[0], fields[1], fields[2] if len(fields) > 2 else 0))
+	return sections
+
+def dump_block_stream(test, trace, hive_arguments, extra_arguments=[], output_lines=None):
+	"""
+	Decodes the trace with the tester like dump_block_sections, but returns every block in one list.
+	"""
+	sections = dump_block_sections(test, trace, hive_arguments, extra_arguments, output_lines)
+	if sections is None:
+		return None
+	return [block for section in sections for block in section]
+
+def get_hive_arguments(trace, hive_path):
+	"""
+	Returns the tester arguments to decode a trace with a single hive
+	"""
+	return ["-h", hive_path, "-s", trace.sideband_load_address, "-o", trace.sideband_offset]
+
+def compare_block_stream(test, trace, name, blocks, expected_blocks):
+	"""
+	Records whether a decode of the trace reported exactly the expected blocks.
+	Returns true on success.
+	"""
+	matches = blocks is not None and expected_blocks is not None \
+			  and [block[:2] for block in blocks] == [block[:2] for block in expected_blocks]
+	trace.block_stream_results.append((name, matches))
+	if not matches:
+		print(f"[!!!] {test.display_name}.{trace.display_name} {name} block stream does not match")
+		return False
+	return True
+
+def remove_chain_interiors(blocks):
+	"""
+	Removes the blocks which decoding with chain skipping never reports from a full decode's blocks. These are the blocks
+	after each block which skips a chain up until the chain's end.
+	"""
+	remaining = []
+	chain_end = 0
+	for block in blocks:
+		if chain_end and block[1] != chain_end:
+			continue
+		remaining.append(block)
+		chain_end = block[2]
+	return remaining
+
+def compare_chain_skip_block_stream(test, trace, name, hive_path, full_blocks):
+	"""
+	Decodes the trace while skipping chains with a hive which marks them and checks that it reports the blocks of a full
+	decode with the same hive, less those inside the chains.
+	Returns true on success.
+	"""
+	print(f"[***] Comparing {name} hive decode of {test.display_name}.{trace.display_name} while skipping chains")
+	blocks = dump_block_stream(test, trace, get_hive_arguments(trace, hive_path), ["-k"])
+	expected_blocks = remove_chain_interiors(full_blocks) if full_blocks is not None else None
+	return compare_block_stream(test, trace, f"{name} hive skipping chains", blocks, expected_blocks)
+
+def find_window_overlap(window, blocks, position, is_first):
+	"""
+	Finds how many of a window's first blocks were already reported by the end of the window before it, given that the
+	windows so far have matched the first position blocks of a full decode. The first window may instead report blocks
+	which the full decode never does, since it starts at the IP of its PSB rather than at the first TIP.
+	Returns the overlap or None if the window doesn't continue the full decode.
+	"""
+	for overlap in range(len(window) + 1):
+		if not is_first and (overlap > position or window[:overlap] != blocks[position - overlap:position]):
+			continue
+		if window[overlap:] == blocks[position:position + len(window) - overlap]:
+			return overlap
+	return None
+
+def compare_window_block_stream(test, trace, reference_blocks):
+	"""
+	Decodes the trace one PSB window at a time and checks that the windows, less the blocks each repeats from the end of
+	the window before it, report exactly the blocks of the plain decode.
+	Returns true on success.
+	"""
+	print(f"[***] Comparing windowed decode of {test.display_name}.{trace.display_name}")
+	sections = dump_block_sections(test, trace, get_hive_arguments(trace, HIVE_TEMP_PATH), ["-w"])
+	matches = sections is not None
+	if matches:
+		blocks = [block[:2] for block in reference_blocks]
+		position = 0
+		#The first section holds whatever was reported before the first window marker, which should be nothing
+		for index, window in enumerate(sections):
+			overlap = find_window_overlap([block[:2] for block in window], blocks, position, index <= 1)
+			if overlap is None:
+				print(f"[!!!] {test.display_name}.{trace.display_name} window {index - 1} does not continue the plain decode "
+					  f"at block {position}")
+				matches = False
+				break
+			position += len(window) - overlap
+		matches = matches and position == len(blocks)
+	trace.block_stream_results.append(("windowed", matches))
+	if not matches:
+		print(f"[!!!] {test.display_name}.{trace.display_name} windowed block stream does not match")
+		return False
+	return True
+
+def write_bundle_manifest(trace):
+	"""
+	Writes a bundle manifest holding the test's hive at the trace's slide along with an image which the trace never
+	enters.
+	Returns the tester arguments to decode with the bundle.
+	"""
+	trace_slide = int(trace.sideband_load_address, 16) - int(trace.sideband_offset, 16)
+	with open(BUNDLE_MANIFEST_TEMP_PATH, "w") as manifest:
+		manifest.write(f"{trace_slide:#x} {HIVE_TEMP_PATH}\n")
+		manifest.write(f"{trace_slide + BUNDLE_DECOY_IMAGE_OFFSET:#x} {HIVE_TEMP_PATH}\n")
+	return ["-B", BUNDLE_MANIFEST_TEMP_PATH]
+
+def compare_bundle_block_stream(test, trace, reference_blocks):
+	"""
+	Decodes the trace with a bundle holding the test's hive along with an image which the trace never enters, and
+	checks that it reports the same blocks as the hive alone.
+	Returns true on success.
+	"""
+	print(f"[***] Comparing bundle decode of {test.display_name}.{trace.display_name}")
+	blocks = dump_block_stream(test, trace, write_bundle_manifest(trace))
+	return compare_block_stream(test, trace, "bundle", blocks, reference_blocks)
+
+def get_wrap_offsets(trace):
+	"""
+	Returns the offsets at which compare_wrapped_block_stream splits a trace: a run in the middle of the trace, the
+	middle of the first PSB and of a PSB past the middle, and just before the end.
+	"""
+	with open(trace.trace_path, "rb") as trace_file:
+		trace_bytes = trace_file.read()
+	middle = len(trace_bytes) // 2
+	offsets = list(range(middle, middle + WRAP_OFFSET_RUN_LENGTH))
+	for start in [0, middle]:
+		psb_offset = trace_bytes.find(PSB_PACKET, start)
+		if psb_offset >= 0:
+			offsets.append(psb_offset + len(PSB_PACKET) // 2)
+	offsets.append(max(len(trace_bytes) - 3, 0))
+	return sorted(set(offset for offset in offsets if 0 < offset < len(trace_bytes)))
+
+def compare_wrapped_block_stream(test, trace, reference_blocks):
+	"""
+	Decodes the trace as a ring buffer which wrapped at several offsets, including inside packets, and checks that each
+	decode reports the same blocks as the plain decode.
+	Returns true on success.
+	"""
+	print(f"[***] Comparing wrapped decodes of {test.display_name}.{trace.display_name}")
+	matches = True
+	for offset in get_wrap_offsets(trace):
+		blocks = dump_block_stream(test, trace, get_hive_arguments(trace, HIVE_TEMP_PATH), ["-W", str(offset)])
+		if blocks is None or [block[:2] for block in blocks] != [block[:2] for block in reference_blocks]:
+			print(f"[!!!] {test.display_name}.{trace.display_name} wrapped at {offset} does not match")
+			matches = False
+	trace.block_stream_results.append(("wrapped", matches))
+	return matches
+
+def compare_stream_block_stream(test, trace, reference_blocks):
+	"""
+	Decodes the trace by streaming it to the session in chunks of several sizes and checks that each decode reports the
+	same blocks as the plain decode. Single byte chunks must suspend the decode both at a branch and at an indirect
+	jump, so that resuming from each is covered.
+	Returns true on success.
+	"""
+	print(f"[***] Comparing streamed decodes of {test.display_name}.{trace.display_name}")
+	matches = True
+	for chunk_size in STREAM_CHUNK_SIZES:
+		output_lines = []
+		blocks = dump_block_stream(test, trace, get_hive_arguments(trace, HIVE_TEMP_PATH), ["-S", str(chunk_size)],
+								   output_lines)
+		if blocks is None or [block[:2] for block in blocks] != [block[:2] for block in reference_blocks]:
+			print(f"[!!!] {test.display_name}.{trace.display_name} streamed in {chunk_size} byte chunks does not match")
+			matches = False
+
+		suspend_counts = [int(count) for line in output_lines if "Stream suspended" in line
+						  for count in re.findall(r"= (\d+)", line)]
+		if chunk_size == 1 and (len(suspend_counts) != 2 or 0 in suspend_counts):
+			print(f"[!!!] {test.display_name}.{trace.display_name} streamed in single bytes did not suspend at both a "
+				  f"branch and an indirect jump")
+			matches = False
+	trace.block_stream_results.append(("streamed", matches))
+	return matches
+
+def compare_parallel_block_stream(test, trace, name, hive_arguments, reference_blocks):
+	"""
+	Decodes the trace on several threads and on one, both with a segment per PSB and with the default segment size,
+	and checks that every decode reports the same blocks. The single threaded decode must report the blocks of the
+	plain decode, although it may first report blocks from the IP of the first PSB (see ha_parallel_decode).
+	Returns true on success.
+	"""
+	success = True
+	for segment_name, segment_arguments in PARALLEL_DECODE_SEGMENTS:
+		print(f"[***] Comparing {name} parallel decode of {test.display_name}.{trace.display_name} with {segment_name}")
+		single_blocks = dump_block_stream(test, trace, hive_arguments, ["-j", "1"] + segment_arguments)
+		parallel_blocks = dump_block_stream(test, trace, hive_arguments,
+											 ["-j", str(PARALLEL_DECODE_THREAD_COUNT)] + segment_arguments)
+		plain_blocks = single_blocks[max(0, len(single_blocks) - len(reference_blocks)):] \
+					   if single_blocks is not None else None
+		success &= compare_block_stream(test, trace, f"{name} single threaded {segment_name}", plain_blocks,
+										reference_blocks)
+		success &= compare_block_stream(test, trace, f"{name} parallel {segment_name}", parallel_blocks,
+										single_blocks)
+	return success
 
 # These are the actual tests being run
 
@@ -136,10 +649,53 @@ for test in tests:
 	if not generate_test_hive(test):
 		print(f"[!!!] Skipping all traces for test {test.display_name} because it failed to generate a hive")
 		continue
+
+	compare_full_decode_hive(test)
+	compare_cached_hive(test)
+	compare_batch_hives(test)
+	#Parallel disassembly must not change the hive
+	compare_generated_hive(test, "parallel", HIVE_TEMP_PATH, ["-j", "4"])
+	compare_incremental_hives(test)
+	#Recursive descent must find the same blocks however it decodes instructions and however many threads it is given
+	if generate_hive(test, "hybrid", HYBRID_HIVE_TEMP_PATH, ["-r"]):
+		compare_generated_hive(test, "full decode hybrid", HYBRID_HIVE_TEMP_PATH, ["-r", "-f"])
+		compare_generated_hive(test, "parallel hybrid", HYBRID_HIVE_TEMP_PATH, ["-r", "-j", "4"])
+	#Program header based hives don't need the section headers at all
+	if generate_hive(test, "segment", SEGMENT_HIVE_TEMP_PATH, ["-v"]):
+		compare_generated_hive(test, "parallel segment", SEGMENT_HIVE_TEMP_PATH, ["-v", "-j", "4"])
+		if write_stripped_binary(test.binary_path, STRIPPED_BINARY_TEMP_PATH):
+			compare_generated_hive(test, "stripped segment", SEGMENT_HIVE_TEMP_PATH, ["-v"], STRIPPED_BINARY_TEMP_PATH)
+		else:
+			test.hive_check_results.append(("Stripped binary written", False))
+	hive_variants = generate_hive_variants(test)
+	profile_guided_hive = generate_profile_guided_hive(test)
+	if profile_guided_hive:
+		hive_variants.append(profile_guided_hive)
 		
 	for trace in test.traces:
 		perform_libipt_audit(test, trace)
 
+		#Every other decode of the trace must report exactly the same blocks as the plain decode
+		print(f"[***] Decoding {test.display_name}.{trace.display_name}")
+		reference_blocks = dump_block_stream(test, trace, get_hive_arguments(trace, HIVE_TEMP_PATH))
+		if reference_blocks is None:
+			trace.block_stream_results.append(("reference", False))
+			continue
+
+		compare_bundle_block_stream(test, trace, reference_blocks)
+		compare_window_block_stream(test, trace, reference_blocks)
+		compare_wrapped_block_stream(test, trace, reference_blocks)
+		compare_stream_block_stream(test, trace, reference_blocks)
+		compare_parallel_block_stream(test, trace, "hive", get_hive_arguments(trace, HIVE_TEMP_PATH), reference_blocks)
+		compare_parallel_block_stream(test, trace, "bundle", write_bundle_manifest(trace), reference_blocks)
+
+		for name, hive_path, arguments in hive_variants:
+			print(f"[***] Comparing {name} hive decode of {test.display_name}.{trace.display_name}")
+			blocks = dump_block_stream(test, trace, get_hive_arguments(trace, hive_path))
+			compare_block_stream(test, trace, f"{name} hive", blocks, reference_blocks)
+			if "-s" in arguments:
+				compare_chain_skip_block_stream(test, trace, name, hive_path, blocks)
+
 print("-" * 60)
 success_count = 0
 print("TEST RESULTS:")